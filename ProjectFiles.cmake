@@ -7,6 +7,9 @@ set(SRC
   "${SRC_PATH}/ilist.c"
   "${SRC_PATH}/slab.c"
   "${SRC_PATH}/bmgr.c"
+  "${SRC_PATH}/tcache.c"
+  "${SRC_PATH}/purger.c"
+  "${SRC_PATH}/shmalloc.c"
 )
 
 # Set project main file.
@@ -18,4 +21,5 @@ set(TEST_SRC
   "${TEST_SRC_PATH}/testBase.cpp"
   "${TEST_SRC_PATH}/testSlabAlloc.cpp"
   "${TEST_SRC_PATH}/testBuddyAlloc.cpp"
+  "${TEST_SRC_PATH}/testShmAlloc.cpp"
 )
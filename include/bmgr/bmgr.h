@@ -11,11 +11,223 @@ struct bmgr_t;
 
 typedef struct bmgr_t bmgr_t;
 
+/* Flags for bmgr_create_ext */
+#define BMGR_CONCURRENT		 0x01 /* Usable by multiple threads concurrently */
+#define BMGR_OUT_OF_BAND	 0x02 /* Track free blocks in bitmaps, never touch freed memory */
+#define BMGR_PURGE			 0x04 /* Track idle free memory, so that it can be returned to the OS */
+#define BMGR_SPANS			 0x08 /* Serve requests above max_alloc_size with contiguous chunks */
+#define BMGR_ADDRESS_ORDERED 0x10 /* Lowest address free blocks and chunks first, implies OUT_OF_BAND */
+#define BMGR_LAZY			 0x20 /* Defer coalescing of recently freed blocks */
+
 extern bmgr_t *bmgr_create(size_t min_alloc_size, size_t max_alloc_size, void *memory_region, size_t
 						   mem_size);
+extern bmgr_t *bmgr_create_concurrent(size_t min_alloc_size, size_t max_alloc_size, void
+									  *memory_region, size_t mem_size);
+extern bmgr_t *bmgr_create_ext(size_t min_alloc_size, size_t max_alloc_size, void *memory_region,
+							   size_t mem_size, int flags);
+extern bmgr_t *bmgr_attach(void *mapped_addr);
+
+/*
+ * Growing a buddy manager with more memory regions. Chunks are carved out of
+ * the region (along with their metadata) and become available to all allocations.
+ * Regions stay in use until the buddy manager is gone. Other processes, that
+ * attach the buddy manager, must map the region at the same offset from the
+ * start of the buddy manager. NUMA buddy managers can't be extended.
+ */
+#define BMGR_MAX_REGIONS 16
+
+extern size_t bmgr_extend(bmgr_t *bmgr, void *memory_region, size_t mem_size);
+
+/*
+ * Layout of chunks and their control blocks, which bmgr.hpp computes at
+ * compile time and checks against these macros. Chunks of a region are
+ * max_alloc_size bytes each, back to back from chunk_start. chunk_start is
+ * aligned to max_alloc_size in the process, that created the buddy manager,
+ * but not necessarily in another mapping of the region, so offsets within a
+ * chunk are counted from chunk_start. Control block of the i'th chunk of a
+ * region is at control_blocks + i * control_block_size: a lock, the bitmap of
+ * nodes in use, the free bitmap (BMGR_OUT_OF_BAND only) and the continuation
+ * bitmap. Bit BMGR_BITMAP_INDEX of the bitmap of nodes in use is set, while
+ * the node of size class 'szc' at 'chunk_offset' is allocated or split.
+ * Pointers of bmgr_get_region_layout are those of the calling process.
+ */
+#define BMGR_CONTROL_BLOCK_HEADER_SIZE 16
+
+#define BMGR_BITMAP_SIZE(min_alloc_size, max_alloc_size) \
+	((((max_alloc_size) / (min_alloc_size) * 2 + 7) / 8 + 15) / 16 * 16)
+#define BMGR_CONTINUATION_SIZE(min_alloc_size, max_alloc_size) \
+	((((max_alloc_size) / (min_alloc_size) + 7) / 8 + 15) / 16 * 16)
+#define BMGR_CONTROL_BLOCK_SIZE(min_alloc_size, max_alloc_size, out_of_band) \
+	(BMGR_CONTROL_BLOCK_HEADER_SIZE + ((out_of_band) ? 2 : 1) * \
+	 BMGR_BITMAP_SIZE(min_alloc_size, max_alloc_size) + \
+	 BMGR_CONTINUATION_SIZE(min_alloc_size, max_alloc_size))
+
+#define BMGR_LEVEL_START(num_size_classes, szc) \
+	((1ULL << ((num_size_classes) - ((szc) + 1))) - 1)
+#define BMGR_BITMAP_INDEX(num_size_classes, log2_min_alloc_size, szc, chunk_offset) \
+	(BMGR_LEVEL_START(num_size_classes, szc) + ((chunk_offset) >> ((log2_min_alloc_size) + (szc))))
+
+typedef struct
+{
+	char   *chunk_start;
+	char   *control_blocks;
+	size_t num_chunks;
+	size_t control_block_size;
+} bmgr_region_layout_t;
+
+extern int bmgr_get_region_layout(bmgr_t *bmgr, int region, bmgr_region_layout_t *layout);
+
+/* Pages backing the memory region of a buddy manager */
+typedef enum
+{
+	BMGR_PAGES_REGULAR,
+	BMGR_PAGES_TRANSPARENT_HUGE, /* madvise(MADV_HUGEPAGE) */
+	BMGR_PAGES_HUGETLB           /* MAP_HUGETLB */
+} bmgr_page_mode_t;
+
+extern bmgr_t			*bmgr_create_hugepage(size_t min_alloc_size, size_t max_alloc_size, size_t
+											  mem_size, int flags);
+extern void				bmgr_destroy(bmgr_t *bmgr);
+extern bmgr_page_mode_t bmgr_page_mode(bmgr_t *bmgr);
+
+/*
+ * NUMA aware buddy manager. Memory is split into a pool per node, bound to
+ * it's node with mbind, and an optional pool interleaved over all nodes.
+ * buddy_alloc and friends serve from the pool of the calling thread's node and
+ * fall back to pools of other nodes, only if it has no memory left. Interleaved
+ * pool is used only by buddy_alloc_interleaved, for read-mostly data shared by
+ * all nodes. Blocks of any pool are freed with buddy_free and friends.
+ *
+ * 'num_nodes' of 0 means a pool per online node. Pools of nodes, that are not
+ * online, are left unbound, so that any number of pools works on any machine.
+ */
+#define BMGR_MAX_NUMA_NODES 8
+
+extern bmgr_t *bmgr_create_numa(size_t min_alloc_size, size_t max_alloc_size, size_t
+								node_mem_size, size_t interleaved_mem_size, int num_nodes, int
+								flags);
+extern int	  bmgr_numa_nodes(bmgr_t *bmgr);
+extern int	  bmgr_numa_node(bmgr_t *bmgr, void *ptr);
+extern void	  *buddy_alloc_interleaved(bmgr_t *bmgr, size_t size);
+
 extern size_t buddy_total_alloc_memory(bmgr_t *bmgr);
+extern size_t buddy_min_alloc_size(bmgr_t *bmgr);
+extern size_t buddy_max_alloc_size(bmgr_t *bmgr);
 extern void	  *buddy_alloc(bmgr_t *bmgr, size_t size);
+extern void	  *buddy_alloc_aligned(bmgr_t *bmgr, size_t size, size_t alignment);
 extern void	  buddy_free(bmgr_t *bmgr, void *ptr, size_t size);
+extern void	  buddy_free_ptr(bmgr_t *bmgr, void *ptr);
+extern size_t buddy_usable_size(bmgr_t *bmgr, void *ptr);
+extern void	  *buddy_realloc(bmgr_t *bmgr, void *ptr, size_t old_size, size_t new_size);
+extern void	  *buddy_alloc_units(bmgr_t *bmgr, size_t units);
+extern void	  buddy_free_units(bmgr_t *bmgr, void *ptr, size_t units);
+extern size_t buddy_alloc_bulk(bmgr_t *bmgr, size_t size, size_t num_blocks, void **blocks);
+extern void	  buddy_free_bulk(bmgr_t *bmgr, void **blocks, const size_t *sizes, size_t num_blocks);
+
+/*
+ * Returning free memory to the OS (BMGR_PURGE).
+ *
+ * Purging is done either explicitly with bmgr_purge, or by a background
+ * purger thread, which needs a concurrent buddy manager.
+ */
+typedef struct bmgr_purger_t bmgr_purger_t;
+
+/* Purge advice, that works for both shared and private mappings (see bmgr_set_purge_policy) */
+#define BMGR_PURGE_ADVICE_DEFAULT (-1)
+
+extern void			 bmgr_set_purge_policy(bmgr_t *bmgr, size_t min_purge_size, unsigned
+										   decay_ms, int advice);
+extern size_t		 bmgr_purge(bmgr_t *bmgr);
+extern size_t		 bmgr_purged_bytes(bmgr_t *bmgr);
+extern bmgr_purger_t *bmgr_purger_start(bmgr_t *bmgr, unsigned interval_ms);
+extern void			 bmgr_purger_stop(bmgr_purger_t *purger);
+
+/*
+ * Guard page sampling, to catch memory corruption where it happens. About one
+ * in 'rate' allocated blocks (0, the default, samples none) gets a block of
+ * it's own, followed by an inaccessible page, so that writing past the usable
+ * size faults. A freed sampled block is made inaccessible and quarantined for
+ * a while, so that using it faults as well. Protection is set in mappings of
+ * the process, that allocated the block.
+ *
+ * Blocks of buddy_alloc, buddy_alloc_units, buddy_alloc_bulk and so of the
+ * per-thread cache, which is refilled in bulk, are sampled. Blocks of
+ * buddy_alloc_aligned are sampled, if the alignment is at most a page. Spans
+ * and blocks, that don't fit a chunk along with a page, aren't sampled. A
+ * sampled block freed to the per-thread cache is reused from there, it is
+ * quarantined once the cache gives it back.
+ *
+ * Only the usable size of a live sampled block is counted in allocated bytes
+ * of bmgr_get_stats, the guard page, padding and quarantined blocks are in
+ * guard_bytes.
+ */
+extern void		bmgr_set_guard_sample_rate(bmgr_t *bmgr, unsigned rate);
+extern unsigned bmgr_guard_sample_rate(bmgr_t *bmgr);
+
+/*
+ * Statistics. Counters are cheap enough to be always on; a snapshot taken
+ * while other threads allocate is not atomic as a whole.
+ */
+#define BMGR_MAX_SIZE_CLASSES 64
+
+typedef struct
+{
+	size_t block_size;
+	size_t allocated_bytes;  /* Bytes of blocks, whose size rounds up to this size class */
+	size_t allocated_blocks;
+	size_t free_bytes;       /* Bytes in free blocks of this size class */
+	size_t free_blocks;
+	size_t deferred_blocks;  /* Free blocks kept uncoalesced (BMGR_LAZY), part of free_blocks */
+	size_t splits;           /* # of free blocks of this size class split off a larger block */
+	size_t merges;           /* # of free blocks of this size class merged with their buddy */
+
+	/* Lock of this size class (BMGR_CONCURRENT), includes lock taken by bmgr_get_stats */
+	size_t lock_acquisitions;
+	size_t lock_contentions; /* Acquisitions, that found the lock held */
+} bmgr_size_class_stats_t;
+
+typedef struct
+{
+	bmgr_page_mode_t page_mode;
+	size_t			 total_memory;      /* Same as buddy_total_alloc_memory */
+	size_t			 allocated_bytes;   /* In blocks and spans, rounded up to min_alloc_size */
+	size_t			 free_bytes;        /* In free blocks and free chunks */
+	size_t			 span_bytes;        /* In spans (BMGR_SPANS) */
+	size_t			 spans;
+	size_t			 chunks_in_use;
+	size_t			 max_chunks_in_use; /* High water mark of chunks_in_use */
+	size_t			 purged_bytes;      /* Same as bmgr_purged_bytes */
+	size_t			 guarded_blocks;    /* Sampled blocks, live or quarantined */
+	size_t			 guard_bytes;       /* Taken by sampled blocks, beyond usable sizes of live ones */
+
+	/* Fraction of free memory, that is in blocks smaller than a chunk (0 if none is free) */
+	double fragmentation;
+
+	int						num_size_classes;
+	bmgr_size_class_stats_t size_classes[BMGR_MAX_SIZE_CLASSES];
+} bmgr_stats_t;
+
+extern void bmgr_get_stats(bmgr_t *bmgr, bmgr_stats_t *stats);
+
+/*
+ * Per-thread cache in front of buddy_alloc/buddy_free.
+ *
+ * Every thread keeps a small stack of blocks per size class, which is refilled
+ * from and drained to the buddy manager in batches. Blocks allocated with
+ * buddy_cached_alloc must be freed with buddy_cached_free. A thread caches
+ * blocks of up to 4 buddy managers at a time, blocks of the least recently
+ * used one are flushed, when it starts using one more. Cache of a thread is
+ * flushed, when it exits. Threads must flush their caches, before a buddy
+ * manager they used is destroyed. Buddy manager must be a concurrent one, if
+ * it is used by more than one thread.
+ */
+#define BUDDY_CACHE_DEFAULT_LIMIT (1024 * 1024)
+
+extern void *buddy_cached_alloc(bmgr_t *bmgr, size_t size);
+extern void buddy_cached_free(bmgr_t *bmgr, void *ptr, size_t size);
+extern void buddy_cache_flush(void);
+extern void buddy_cache_set_limit(size_t max_cached_bytes);
+extern size_t buddy_cache_size(void);
 
 #ifdef __cplusplus
 }
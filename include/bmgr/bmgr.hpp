@@ -0,0 +1,333 @@
+#ifndef BMGR_HPP
+#define BMGR_HPP
+
+#include "bmgr/bmgr.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace shmem
+{
+
+namespace detail
+{
+
+constexpr int
+log_2(std::size_t n)
+{
+	int log = -1;
+
+	for (; n != 0; n >>= 1)
+	{
+		log++;
+	}
+
+	return log;
+}
+
+
+constexpr bool
+is_power_of_two(std::size_t n)
+{
+	return n != 0 && (n & (n - 1)) == 0;
+}
+
+
+/* MAXALIGN of utils/ilist.h */
+constexpr std::size_t
+maxalign(std::size_t len)
+{
+	return (len + 15) & ~std::size_t(15);
+}
+
+
+/* Smallest size class, that can hold 'units' units (rounds up) */
+constexpr int
+units_size_class(std::size_t units)
+{
+	return units == 1 ? 0 : log_2(units - 1) + 1;
+}
+
+} /* namespace detail */
+
+/*
+ * Buddy manager with geometry fixed at compile time.
+ *
+ * All state lives in a C bmgr_t region and every change to it goes through
+ * the C functions, so a region created by buddy<MinSize, MaxSize> can be
+ * attached with bmgr_attach and vice versa. What the template adds is, that
+ * size classes, unit counts and chunk layout are constexpr: a request of a
+ * constant size is rounded to units at compile time and handed to
+ * buddy_alloc_units/buddy_free_units, and chunk index, chunk offset and
+ * bitmap index of an address fold into shifts and masks.
+ *
+ * Layout is computed by the template itself and checked against the macros of
+ * bmgr.h, that src/bmgr.c uses, at compile time. Geometry and control block
+ * size of an attached region are checked at run time.
+ */
+template <std::size_t MinSize, std::size_t MaxSize>
+class buddy
+{
+	static_assert(MinSize >= 16, "min_alloc_size must be at least 16 bytes");
+	static_assert(detail::is_power_of_two(MinSize) && detail::is_power_of_two(MaxSize),
+				  "Allocation sizes must be powers of two");
+	static_assert(MaxSize > MinSize, "max_alloc_size must be larger than min_alloc_size");
+
+public:
+	static constexpr std::size_t min_alloc_size	  = MinSize;
+	static constexpr std::size_t max_alloc_size	  = MaxSize;
+	static constexpr int		 log2_min_alloc_size = detail::log_2(MinSize);
+	static constexpr int		 log2_max_alloc_size = detail::log_2(MaxSize);
+	static constexpr int		 num_size_classes	   = log2_max_alloc_size - log2_min_alloc_size + 1;
+
+	static constexpr std::size_t units_per_chunk	   = MaxSize / MinSize;
+
+	static_assert(num_size_classes <= BMGR_MAX_SIZE_CLASSES, "Too many size classes");
+
+	/* Chunks are max_alloc_size bytes, back to back from the chunk_start of their region */
+	static constexpr int		 chunk_shift = log2_max_alloc_size;
+	static constexpr std::size_t chunk_mask	 = MaxSize - 1;
+
+	/* Control block of a chunk: lock, bitmap of nodes in use, [free bitmap], continuation bitmap */
+	static constexpr std::size_t control_block_header_size = BMGR_CONTROL_BLOCK_HEADER_SIZE;
+	static constexpr std::size_t bitmap_size			   = detail::maxalign((units_per_chunk * 2 + 7) / 8);
+	static constexpr std::size_t continuation_size		   = detail::maxalign((units_per_chunk + 7) / 8);
+
+	static constexpr std::size_t
+	control_block_size(bool out_of_band)
+	{
+		return control_block_header_size + (out_of_band ? 2 * bitmap_size : bitmap_size) +
+			   continuation_size;
+	}
+
+
+	/* Bitmap index of the first node of size class 'szc' (larger nodes come first) */
+	static constexpr std::size_t
+	level_start(int szc)
+	{
+		return (std::size_t(1) << (num_size_classes - (szc + 1))) - 1;
+	}
+
+
+	/* Bitmap index of the node of size class 'szc' at 'chunk_offset' */
+	static constexpr std::size_t
+	bitmap_index(std::size_t chunk_offset, int szc)
+	{
+		return level_start(szc) + (chunk_offset >> (log2_min_alloc_size + szc));
+	}
+
+
+	static_assert(bitmap_size == BMGR_BITMAP_SIZE(MinSize, MaxSize) &&
+				  continuation_size == BMGR_CONTINUATION_SIZE(MinSize, MaxSize),
+				  "Bitmap sizes differ from the C layout");
+	static_assert(control_block_size(false) == BMGR_CONTROL_BLOCK_SIZE(MinSize, MaxSize, 0) &&
+				  control_block_size(true) == BMGR_CONTROL_BLOCK_SIZE(MinSize, MaxSize, 1),
+				  "Control block size differs from the C layout");
+	static_assert(bitmap_index(0, num_size_classes - 1) ==
+				  BMGR_BITMAP_INDEX(num_size_classes, log2_min_alloc_size, num_size_classes - 1, 0) &&
+				  bitmap_index(MaxSize - MinSize, 0) ==
+				  BMGR_BITMAP_INDEX(num_size_classes, log2_min_alloc_size, 0, MaxSize - MinSize) &&
+				  bitmap_index(MaxSize / 2, 1) ==
+				  BMGR_BITMAP_INDEX(num_size_classes, log2_min_alloc_size, 1, MaxSize / 2),
+				  "Bitmap index differs from the C layout");
+
+	/* Offset of an address within it's chunk, of a region starting at 'chunk_start' */
+	static constexpr std::size_t
+	chunk_offset(std::uintptr_t addr, std::uintptr_t chunk_start)
+	{
+		return (addr - chunk_start) & chunk_mask;
+	}
+
+
+	/* Index of the chunk holding an address, among chunks of a region starting at 'chunk_start' */
+	static constexpr std::size_t
+	chunk_index(std::uintptr_t addr, std::uintptr_t chunk_start)
+	{
+		return (addr - chunk_start) >> chunk_shift;
+	}
+
+
+	/*
+	 * Is the node of size class 'szc' at 'ptr' allocated or split? 'ptr' must be
+	 * in a chunk of the region of 'layout'. Chunk's bitmap lock is not taken, so
+	 * the answer is only stable, while no other thread changes the chunk.
+	 */
+	static bool
+	node_in_use(const bmgr_region_layout_t &layout, const void *ptr, int szc)
+	{
+		auto		  addr	= reinterpret_cast<std::uintptr_t>(ptr);
+		auto		  start = reinterpret_cast<std::uintptr_t>(layout.chunk_start);
+		auto		  index = bitmap_index(chunk_offset(addr, start), szc);
+		const uint8_t *bitmap = reinterpret_cast<const uint8_t *>(layout.control_blocks) +
+								chunk_index(addr, start) * layout.control_block_size +
+								control_block_header_size;
+
+		return (bitmap[index / 8] & (1 << (index % 8))) != 0;
+	}
+
+
+	/* # of min_alloc_size units needed to hold 'size' bytes */
+	static constexpr std::size_t
+	units(std::size_t size)
+	{
+		return (size + MinSize - 1) >> log2_min_alloc_size;
+	}
+
+
+	/* Smallest size class, that can hold 'size' bytes, -1 if none */
+	static constexpr int
+	size_class(std::size_t size)
+	{
+		return size == 0 || size > MaxSize ? -1 : detail::units_size_class(units(size));
+	}
+
+
+	/* Bytes taken by a block of 'size' bytes */
+	static constexpr std::size_t
+	rounded_size(std::size_t size)
+	{
+		return units(size) << log2_min_alloc_size;
+	}
+
+
+	buddy() = default;
+
+	static buddy
+	create(void *memory_region, std::size_t mem_size, int flags = 0)
+	{
+		return buddy(bmgr_create_ext(MinSize, MaxSize, memory_region, mem_size, flags));
+	}
+
+
+	/* Attach to a region, fails if it was created with a different geometry */
+	static buddy
+	attach(void *mapped_addr)
+	{
+		bmgr_t *bmgr = bmgr_attach(mapped_addr);
+
+		bmgr_region_layout_t layout;
+
+		if (bmgr == nullptr || buddy_min_alloc_size(bmgr) != MinSize ||
+			buddy_max_alloc_size(bmgr) != MaxSize)
+		{
+			return buddy();
+		}
+
+		/* NUMA buddy managers have no chunks of their own */
+		if (bmgr_get_region_layout(bmgr, 0, &layout) == 0 &&
+			layout.control_block_size != control_block_size(false) &&
+			layout.control_block_size != control_block_size(true))
+		{
+			return buddy();
+		}
+
+		return buddy(bmgr);
+	}
+
+
+	explicit operator bool() const
+	{
+		return bmgr_ != nullptr;
+	}
+
+
+	bmgr_t *
+	handle() const
+	{
+		return bmgr_;
+	}
+
+
+	template <std::size_t Size>
+	void *
+	alloc()
+	{
+		static_assert(Size > 0 && Size <= MaxSize, "Size must be in (0, max_alloc_size]");
+
+		return buddy_alloc_units(bmgr_, units(Size));
+	}
+
+
+	void *
+	alloc(std::size_t size)
+	{
+		if (size == 0 || size > MaxSize)
+		{
+			return buddy_alloc(bmgr_, size);
+		}
+
+		return buddy_alloc_units(bmgr_, units(size));
+	}
+
+
+	void *
+	alloc_aligned(std::size_t size, std::size_t alignment)
+	{
+		return buddy_alloc_aligned(bmgr_, size, alignment);
+	}
+
+
+	template <std::size_t Size>
+	void
+	free(void *ptr)
+	{
+		static_assert(Size > 0 && Size <= MaxSize, "Size must be in (0, max_alloc_size]");
+
+		buddy_free_units(bmgr_, ptr, units(Size));
+	}
+
+
+	void
+	free(void *ptr, std::size_t size)
+	{
+		if (size == 0 || size > MaxSize)
+		{
+			buddy_free(bmgr_, ptr, size);
+			return;
+		}
+
+		buddy_free_units(bmgr_, ptr, units(size));
+	}
+
+
+	void
+	free(void *ptr)
+	{
+		buddy_free_ptr(bmgr_, ptr);
+	}
+
+
+	/* Layout of chunks of region 'region', false if there is no such region */
+	bool
+	region_layout(int region, bmgr_region_layout_t *layout) const
+	{
+		return bmgr_get_region_layout(bmgr_, region, layout) == 0;
+	}
+
+
+	std::size_t
+	usable_size(void *ptr) const
+	{
+		return buddy_usable_size(bmgr_, ptr);
+	}
+
+
+	void *
+	realloc(void *ptr, std::size_t old_size, std::size_t new_size)
+	{
+		return buddy_realloc(bmgr_, ptr, old_size, new_size);
+	}
+
+
+private:
+	explicit buddy(bmgr_t *bmgr) : bmgr_(bmgr)
+	{
+	}
+
+
+	bmgr_t *bmgr_ = nullptr;
+};
+
+} /* namespace shmem */
+
+#endif /* BMGR_HPP */
@@ -0,0 +1,52 @@
+#ifndef SHMALLOC_H
+#define SHMALLOC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include "bmgr/bmgr.h"
+
+#include <stddef.h>
+
+struct shm_heap_t;
+
+typedef struct shm_heap_t shm_heap_t;
+
+/*
+ * malloc like front end over a single memory region. Region is managed by a
+ * buddy manager, created with 'flags' (BMGR_* flags, BMGR_SPANS is implied).
+ *
+ * Small requests (up to SHM_SMALL_MAX bytes) are served by a slab cache per
+ * size class, whose pages and control blocks are blocks of the buddy manager.
+ * Size classes are 16 bytes apart up to 128 bytes and four per power of two
+ * above that, request size is mapped to it's class with a lookup table.
+ * Medium requests (up to SHM_MEDIUM_MAX) are buddy blocks, larger ones spans.
+ *
+ * With BMGR_CONCURRENT, every slab cache is guarded by a lock of it's own.
+ *
+ * Heap and everything it manages live in the region and hold offsets only.
+ * Another process, that maps the region at any address, gets the heap with
+ * shm_heap_attach and may allocate and free in it. With BMGR_CONCURRENT it
+ * may do so concurrently with the creator. shm_heap_get_bmgr is the buddy
+ * manager serving medium and large requests, that follows the heap in the
+ * region.
+ */
+#define SHM_SMALL_MAX  1024
+#define SHM_MEDIUM_MAX (1024 * 1024)
+
+extern shm_heap_t *shm_heap_create(void *memory_region, size_t mem_size, int flags);
+extern shm_heap_t *shm_heap_attach(void *memory_region);
+extern void		  shm_heap_destroy(shm_heap_t *heap);
+extern bmgr_t	  *shm_heap_get_bmgr(shm_heap_t *heap);
+
+extern void	  *shm_malloc(shm_heap_t *heap, size_t size);
+extern void	  shm_free(shm_heap_t *heap, void *ptr);
+extern size_t shm_usable_size(shm_heap_t *heap, void *ptr);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+
+#endif /* SHMALLOC_H */
@@ -5,25 +5,100 @@
 extern "C" {
 #endif /* __cplusplus */
 
+#include "bmgr/bmgr.h"
+
 #include <stddef.h>
+#include <stdint.h>
 
 struct slab_t;
 
 typedef struct slab_t slab_t;
 typedef void *(*aligned_alloc_t)(size_t size, size_t align, void *arg);
 typedef void (*free_t)(void *ptr, void *arg);
+typedef void (*sized_free_t)(void *ptr, size_t size, void *arg);
+
+/* Flags for slab_create_ext */
+#define SLAB_CONCURRENT 0x01 /* Blocks may be freed by threads other than the owner */
+#define SLAB_HEADERLESS 0x02 /* Pages are aligned, so that blocks need no header */
 
 extern int	  slab_control_block_size(void);
-extern int	  slab_get_header_size(void);
 extern slab_t *slab_create(int pagesize, int blocksize, aligned_alloc_t alloc, free_t free,
 						   void *arg_alloc);
+extern slab_t *slab_create_ext(int pagesize, int blocksize, aligned_alloc_t alloc, free_t free,
+							   void *arg_alloc, int flags);
 extern void slab_destroy(slab_t *slab);
 
+/*
+ * Headerless slab (SLAB_HEADERLESS). Every block of a regular slab starts with
+ * a pointer to it's page, that slab_free reads. Pages of a headerless slab are
+ * allocated aligned to pagesize (rounded up to a power of two), so slab_free
+ * finds the page by masking the block's address and blocks carry no header.
+ * First block of a page is cache line aligned. 'alloc' must honour 'align'.
+ * slab_get_header_size is the header of a regular slab, slab_block_header_size
+ * that of 'slab' (0 if it is headerless).
+ */
+extern int slab_get_header_size(void);
+extern int slab_block_header_size(slab_t *slab);
+
+/*
+ * Slab with pages of a buddy manager. slab_create_sized passes the size of a
+ * page (or of the control block) to 'free', as buddy_free needs it.
+ * slab_create_bmgr takes pages and the control block from 'bmgr' directly, so
+ * the whole slab lives in the buddy manager's region and nothing is malloced.
+ * 'pagesize' must not exceed max_alloc_size of the buddy manager. Such a slab
+ * holds offsets only, so any process, that maps the region and attached to
+ * the buddy manager, may use it at the address of the control block in it's
+ * own mapping. Slabs of slab_create_ext and slab_create_sized call back into
+ * the creating process and are usable there only.
+ *
+ * slab_create_bmgr_mapped also stores 'tag' (non-zero) in the byte of
+ * 'page_map', that stands for a page, while the page belongs to the slab and
+ * 0 once it is given back. Byte of a page is it's offset from chunk_start of
+ * region 0 (see bmgr_get_region_layout) divided by pagesize rounded up to a
+ * power of two. 'page_map' must lie in the region, it needs SLAB_HEADERLESS
+ * and a buddy manager with regions of it's own (not a NUMA one).
+ */
+extern slab_t *slab_create_sized(int pagesize, int blocksize, aligned_alloc_t alloc, sized_free_t
+								 free, void *arg_alloc, int flags);
+extern slab_t *slab_create_bmgr(bmgr_t *bmgr, int pagesize, int blocksize, int flags);
+extern slab_t *slab_create_bmgr_mapped(bmgr_t *bmgr, int pagesize, int blocksize, int flags,
+									   uint8_t *page_map, uint8_t tag);
+
 extern void	  *slab_alloc(slab_t *slab);
 extern void	  slab_free(slab_t *slab, void *ptr);
+extern size_t slab_alloc_bulk(slab_t *slab, size_t num_blocks, void **blocks);
+extern void	  slab_free_bulk(slab_t *slab, void **blocks, size_t num_blocks);
 extern size_t slab_get_size(slab_t *slab);
 extern int	  slab_get_page_size(slab_t *slab);
 
+/*
+ * Concurrent slab (SLAB_CONCURRENT). Thread that created the slab owns it:
+ * only the owner allocates, destroys the slab and takes stats. Any thread may
+ * free. Blocks freed by other threads are pushed onto a lock-free list of
+ * their page and reused, once the owner collects them, which it does when it's
+ * active page runs dry or on slab_collect. Until then they count as allocated.
+ * Threads are told apart by the kernel's thread id on Linux, so the threads
+ * of another process may free into a shared slab too.
+ */
+extern void slab_collect(slab_t *slab);
+
+typedef struct
+{
+	size_t block_size;
+	size_t page_size;
+	size_t pages;
+	size_t max_pages;        /* High water mark of pages */
+	size_t allocated_blocks;
+	size_t allocated_bytes;
+	size_t free_blocks;      /* Free blocks in allocated pages */
+	size_t free_bytes;
+
+	/* Fraction of blocks in allocated pages, that are free (0 if there are no pages) */
+	double fragmentation;
+} slab_stats_t;
+
+extern void slab_get_stats(slab_t *slab, slab_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -1,6 +1,7 @@
 #ifndef FREELIST_H
 #define FREELIST_H
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stdatomic.h>
 #include <stddef.h>
@@ -81,6 +82,8 @@ flist_push_head(flist_head *head, flist_node *node)
 	do {
 		flist_node *prev_head = flist_read_head(head);
 
+		node->next = prev_head;
+
 		if (swing_head(head, prev_head, node))
 		{
 			break;
@@ -89,4 +92,35 @@ flist_push_head(flist_head *head, flist_node *node)
 }
 
 
+/*
+ * Insert a chain of nodes, already linked from 'first' to 'last', at the
+ * beginning of the list in one swing of the head.
+ */
+static inline void
+flist_push_chain(flist_head *head, flist_node *first, flist_node *last)
+{
+	do {
+		flist_node *prev_head = flist_read_head(head);
+
+		last->next = prev_head;
+
+		if (swing_head(head, prev_head, first))
+		{
+			break;
+		}
+	} while (1);
+}
+
+
+/*
+ * Detach all nodes of the list in one exchange, returns the former head.
+ * Safe against concurrent pushes, as nodes are never popped one at a time.
+ */
+static inline flist_node *
+flist_pop_all(flist_head *head)
+{
+	return atomic_exchange(&CAST_TO_ATOMIC_NODE(&head->head)->next, NULL);
+}
+
+
 #endif /* FREELIST_H */
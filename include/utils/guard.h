@@ -0,0 +1,108 @@
+#ifndef GUARD_H
+#define GUARD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Freed sampled blocks stay inaccessible, until this many newer ones are freed */
+#define GUARD_QUARANTINE 16
+
+/*
+ * Sampling of allocations, that are placed against an inaccessible guard page.
+ *
+ * Every thread counts allocations down to the next sampled one. Distance
+ * between samples is drawn uniformly from [1, 2 * rate - 1], so that one in
+ * 'rate' allocations is sampled on average, but allocation patterns with a
+ * fixed period don't keep missing the samples.
+ */
+static _Thread_local uint32_t guard_countdown;
+static _Thread_local uint64_t guard_random_state;
+
+/* xorshift64*, seeded by the address of the thread's state */
+static inline uint64_t
+guard_random(void)
+{
+	uint64_t x = guard_random_state;
+
+	if (x == 0)
+	{
+		x = (uintptr_t) &guard_random_state | 1;
+	}
+
+	x				   ^= x >> 12;
+	x				   ^= x << 25;
+	x				   ^= x >> 27;
+	guard_random_state	= x;
+
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+/*
+ * Should the calling thread's next allocation be sampled? 'rate' of 0 never
+ * samples. Countdown drawn for a larger rate is drawn again, once the rate is
+ * lowered.
+ */
+static inline bool
+guard_sample(unsigned rate)
+{
+	if (rate == 0)
+	{
+		return false;
+	}
+
+	if (guard_countdown == 0 || guard_countdown >= 2 * (uint64_t) rate)
+	{
+		guard_countdown = 1 + guard_random() % (2 * (uint64_t) rate - 1);
+	}
+
+	return --guard_countdown == 0;
+}
+
+
+/*
+ * # of the calling thread's next allocations, up to 'count', that come before
+ * the next sampled one. They are counted off, so that guard_sample returns
+ * true right after a run shorter than 'count'.
+ */
+static inline size_t
+guard_unsampled_run(unsigned rate, size_t count)
+{
+	size_t run;
+
+	if (rate == 0)
+	{
+		return count;
+	}
+
+	if (guard_countdown == 0 || guard_countdown >= 2 * (uint64_t) rate)
+	{
+		guard_countdown = 1 + guard_random() % (2 * (uint64_t) rate - 1);
+	}
+
+	run				 = guard_countdown - 1 < count ? guard_countdown - 1 : count;
+	guard_countdown -= run;
+
+	return run;
+}
+
+
+static inline size_t
+guard_page_size(void)
+{
+	return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+
+/* Make whole pages in [addr, addr + len) accessible or not, returns false on failure */
+static inline bool
+guard_protect(void *addr, size_t len, bool accessible)
+{
+	return mprotect(addr, len, accessible ? PROT_READ | PROT_WRITE : PROT_NONE) == 0;
+}
+
+
+#endif /* GUARD_H */
@@ -0,0 +1,104 @@
+#ifndef OLIST_H
+#define OLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Position independent doubly linked lists.
+ *
+ * Links are stored as offsets from a base address instead of pointers, so a
+ * list living in shared memory stays valid in every process, irrespective of
+ * the address at which the memory is mapped. Every operation takes the base
+ * address of the mapping, all nodes and heads must be located after it.
+ *
+ * Lists are circular, an empty list points to itself.
+ */
+typedef struct olist_node olist_node;
+struct olist_node
+{
+	size_t prev;
+	size_t next;
+};
+
+typedef struct olist_head
+{
+	olist_node head;
+} olist_head;
+
+static inline olist_node *
+olist_node_at(void *base, size_t offset)
+{
+	return (olist_node *) ((char *) base + offset);
+}
+
+
+static inline size_t
+olist_offset_of(void *base, olist_node *node)
+{
+	return (size_t) ((char *) node - (char *) base);
+}
+
+
+/*
+ * Initialize a doubly linked list.
+ * Previous state will be thrown away without any cleanup.
+ */
+static inline void
+olist_init(void *base, olist_head *head)
+{
+	head->head.next = head->head.prev = olist_offset_of(base, &head->head);
+}
+
+
+/*
+ * Is the list empty?
+ */
+static inline bool
+olist_is_empty(void *base, olist_head *head)
+{
+	return head->head.next == olist_offset_of(base, &head->head);
+}
+
+
+/*
+ * Insert a node at the beginning of the list.
+ */
+static inline void
+olist_push_head(void *base, olist_head *head, olist_node *node)
+{
+	size_t node_offset = olist_offset_of(base, node);
+
+	node->next = head->head.next;
+	node->prev = olist_offset_of(base, &head->head);
+
+	olist_node_at(base, head->head.next)->prev = node_offset;
+	head->head.next							   = node_offset;
+}
+
+
+/*
+ * Delete 'node' from it's list (it must be in one).
+ */
+static inline void
+olist_delete(void *base, olist_node *node)
+{
+	olist_node_at(base, node->prev)->next = node->next;
+	olist_node_at(base, node->next)->prev = node->prev;
+}
+
+
+/*
+ * Remove and return the first node from a list (there must be one).
+ */
+static inline olist_node *
+olist_pop_head_node(void *base, olist_head *head)
+{
+	olist_node *node = olist_node_at(base, head->head.next);
+
+	olist_delete(base, node);
+	return node;
+}
+
+
+#endif /* OLIST_H */
@@ -1,23 +1,41 @@
+#define _GNU_SOURCE
+
 #include "bmgr/bmgr.h"
 #include "utils/ilist.h"
+#include "utils/guard.h"
+#include "utils/olist.h"
+#include "utils/slock.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif /* __linux__ */
 
-#ifdef __LINUX__
-#define leading_zeroes(x) __builtin_clzl(x)
-#endif /* __LINUX__ */
+#ifdef __linux__
+#define leading_zeroes(x)  __builtin_clzl(x)
+#define trailing_zeroes(x) __builtin_ctzl(x)
+#endif /* __linux__ */
 
 #ifdef __APPLE__
-#define leading_zeroes(x) __builtin_clzl(x)
+#define leading_zeroes(x)  __builtin_clzl(x)
+#define trailing_zeroes(x) __builtin_ctzl(x)
 #endif /* __APPLE__ */
 
 #ifdef _WIN32
 #include <intrin.h>
-#define leading_zeroes(x) __lzcnt64(x)
+#define leading_zeroes(x)  __lzcnt64(x)
+#define trailing_zeroes(x) _tzcnt_u64(x)
 #endif /* _WIN32 */
 
 typedef void *control_block_t;
@@ -25,364 +43,4666 @@ typedef void *control_block_t;
 #define BITS_PER_BYTE	 8
 #define BYTES_PER_QWORD	 8
 #define MAX_SIZE_CLASSES (BYTES_PER_QWORD * BITS_PER_BYTE)
+#define BITS_PER_WORD	 (BYTES_PER_QWORD * BITS_PER_BYTE)
 
-#define PTR_TO_NODE(ptr)  ((dlist_node *) ptr)
+#define PTR_TO_NODE(ptr)  ((olist_node *) ptr)
 #define NODE_TO_PTR(node) ((void *) node)
 
+/* Identifies a memory region initialized by bmgr_create */
+#define BMGR_MAGIC 0x424d475233ULL
+
+#undef Min
 #define Min(a, b) ((uintptr_t) (a) < (uintptr_t) (b) ? (a) : (b))
 
-/* Core struct that contains information about buddy manager */
+/* Every control block starts with the lock protecting it's bitmap */
+#define CONTROL_BLOCK_HEADER_SIZE BMGR_CONTROL_BLOCK_HEADER_SIZE
+
+static_assert(MAXALIGN(sizeof(slock_t)) <= CONTROL_BLOCK_HEADER_SIZE,
+			  "Lock of a control block must fit it's header");
+
+/* Huge pages are assumed to be of the x86-64/arm64 default size */
+#define HUGE_PAGE_SIZE ((size_t) 2 * 1024 * 1024)
+
+/* Defaults of purge policy */
+#define DEFAULT_PURGE_DECAY_MS 10000
+
+/* Releases pages of shared mappings, BMGR_PURGE_ADVICE_DEFAULT falls back to MADV_DONTNEED */
+#ifdef MADV_REMOVE
+#define DEFAULT_PURGE_ADVICE MADV_REMOVE
+#else
+#define DEFAULT_PURGE_ADVICE MADV_DONTNEED
+#endif /* MADV_REMOVE */
+
+/* Free ranges of a chunk madvise'd per bitmap lock hold */
+#define PURGE_BATCH 64
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define PURGE_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define PURGE_CLOCK CLOCK_MONOTONIC
+#endif /* CLOCK_MONOTONIC_COARSE */
+
+/* # of bins of free chunk runs, a bin per power of two of run length */
+#define MAX_RUN_BINS 64
+
+/* Calling thread's NUMA node is looked up again after this many lookups, as threads migrate */
+#define NUMA_NODE_REFRESH 64
+
+/* Marks a missing chunk index */
+#define NO_CHUNK SIZE_MAX
+
+/*
+ * Chunk ids carry the index of their region in the high bits, so that
+ * metadata of a chunk is found in constant time. Chunks of a region have
+ * consecutive ids.
+ */
+#define REGION_SHIFT		48
+#define CHUNK_REGION(id)	((int) ((id) >> REGION_SHIFT))
+#define CHUNK_INDEX(id)		((id) & (((size_t) 1 << REGION_SHIFT) - 1))
+#define CHUNK_ID(region, i) (((size_t) (region) << REGION_SHIFT) | (i))
+
+/*
+ * Per chunk state, kept out of the chunks.
+ *
+ * Run fields are protected by chunk_lock. Purge fields are protected by bitmap
+ * lock of the chunk, a chunk is dirty, if blocks have been freed in it since
+ * it was last purged. guarded_blocks is changed under guard_lock.
+ */
+typedef struct
+{
+	size_t run_length;   /* Length of a free run (first and last chunk) or span (first chunk) */
+	size_t prev_run;     /* Links of a free run in it's bin, chunk id + 1, 0 if none */
+	size_t next_run;
+	bool   run_boundary; /* First or last chunk of a free run? */
+
+	uint64_t		 idle_since_ms; /* Time of the last free in the chunk */
+	bool			 dirty;
+	_Atomic unsigned purging;       /* # of purge batches of the chunk being madvise'd */
+
+	_Atomic unsigned guarded_blocks; /* # of sampled blocks in the chunk */
+} chunk_meta_t;
+
+/*
+ * A memory region holding chunks: the one starting with bmgr_t, or one added
+ * by bmgr_extend. Metadata of it's chunks (control blocks, summary bitmaps and
+ * chunk_meta_t array) precedes or follows the chunks (see init_region).
+ * Offsets are relative to bmgr_t and may be negative.
+ */
+typedef struct
+{
+	ptrdiff_t chunk_start_offset;
+	ptrdiff_t control_block_offset;
+	ptrdiff_t summary_offset;    /* Out of band mode only */
+	ptrdiff_t chunk_meta_offset;
+	size_t	  summary_words;     /* # of words in a summary bitmap of the region */
+	size_t	  num_chunks;
+	size_t	  next_chunk_index;  /* Chunks from here on were never allocated (chunk_lock) */
+} region_t;
+
+/* Cap on blocks of a size class kept uncoalesced by BMGR_LAZY */
+#define MAX_DEFERRED_BLOCKS 32
+
+/*
+ * Lock of a size class and state it protects, padded to avoid false sharing
+ * between size classes.
+ */
+typedef struct
+{
+	slock_t	  lock;
+	size_t	  free_blocks;                  /* # of free blocks of the size class */
+	size_t	  splits;                       /* # of free blocks split off a larger block */
+	size_t	  merges;                       /* # of free blocks merged with their buddy */
+	size_t	  num_deferred;                 /* # of blocks in deferred (BMGR_LAZY) */
+	size_t	  acquisitions;                 /* # of times lock was taken (concurrent mode) */
+	size_t	  contentions;                  /* # of those, that found it held by another thread */
+	ptrdiff_t deferred[MAX_DEFERRED_BLOCKS]; /* Offsets from bmgr_t, oldest first */
+} __attribute__((aligned(CACHE_LINE_SIZE))) size_class_t;
+
+/* # of stripes of allocation counters, threads pick a stripe round robin */
+#define STAT_STRIPES 8
+
+/* Allocation counter of spans, after those of size classes */
+#define SPAN_COUNTER(bmgr) ((bmgr)->num_size_classes)
+
+/* Allocated blocks and their bytes, of a size class */
+typedef struct
+{
+	_Atomic size_t bytes;
+	_Atomic size_t blocks;
+} block_counter_t;
+
+/* # of sampled blocks (live or quarantined) a buddy manager keeps track of */
+#define GUARD_SLOTS 64
+
+typedef enum
+{
+	GUARD_SLOT_FREE,
+	GUARD_SLOT_LIVE,
+	GUARD_SLOT_QUARANTINED
+} guard_slot_state_t;
+
+/* Sampled block: data pages and the guard page, user data ends at the guard page */
+typedef struct
+{
+	guard_slot_state_t state;
+	pid_t			   owner;        /* Process, whose mappings are protected */
+	ptrdiff_t		   block_offset; /* Offsets from bmgr_t */
+	ptrdiff_t		   ptr_offset;
+	size_t			   block_size;
+	size_t			   usable_size;  /* Requested size rounded up to min_alloc_size */
+	uint64_t		   freed_seq;    /* Order of quarantined blocks */
+} guard_slot_t;
+
+/*
+ * Core struct that contains information about buddy manager.
+ *
+ * It lives at the start of the managed memory region and contains no
+ * pointers: everything in the region is addressed by it's offset from the
+ * start of bmgr_t, so the region can be mapped at different addresses in
+ * different processes.
+ */
 struct bmgr_t
 {
-	/* Description of user provided memory region */
-	void   *memory_region;
+	/*
+	 * Fields read by every allocation and free are packed in the first cache
+	 * line, followed by free lists of size classes (smallest first).
+	 */
+	_Atomic uint64_t nonempty_mask;       /* Size classes having free blocks */
+	bool			 concurrent;          /* Created with BMGR_CONCURRENT? */
+	bool			 out_of_band;         /* Created with BMGR_OUT_OF_BAND? */
+	bool			 lazy;                /* Created with BMGR_LAZY? */
+	_Atomic bool	 guarded;             /* Guard page sampling on or sampled blocks around? */
+	int				 num_size_classes;    /* Max size classes */
+	int				 log2_min_alloc_size;
+	int				 log2_max_alloc_size;
+	size_t			 min_alloc_size;
+	size_t			 max_alloc_size;
+	size_t			 control_block_size;
+	_Atomic int		 num_regions;         /* Regions are never removed */
+	int				 numa_nodes;          /* # of node pools, 0 if not NUMA */
+	_Atomic uint64_t deferred_mask;       /* Size classes having deferred blocks */
+
+	olist_head chunk_free_lists[MAX_SIZE_CLASSES] __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	uint64_t magic;
+
+	/* Size of user provided memory region, which starts with bmgr_t */
 	size_t total_memory_managed;
 
-	/* Start of buddy control blocks */
-	control_block_t control_block;
-	size_t			control_block_size;
+	/* Set if memory region was mapped by bmgr_create_hugepage */
+	bmgr_page_mode_t page_mode;
+	size_t			 mapping_size; /* 0, if memory region is caller provided */
+
+	/*
+	 * Regions of chunks, the first one is in the memory region starting with
+	 * bmgr_t. Regions are added under chunk_lock, num_regions is published
+	 * after the region is set up, so regions are looked up without locks.
+	 */
+	region_t regions[BMGR_MAX_REGIONS];
+
+	_Atomic size_t num_usable_chunks; /* max chunks that can be allocated */
+	size_t		   num_chunks_used;   /* # of chunks that are currently allocated */
+
+	/*
+	 * Free chunks of a region before it's next_chunk_index form runs of
+	 * contiguous chunks, binned by floor(log2(length)). First and last chunk of
+	 * a free run carry it's length in their chunk_meta_t, so that a freed run
+	 * is merged with it's free neighbours in the region, and a run reaching
+	 * next_chunk_index is given back to the never allocated chunks.
+	 */
+	bool	 spans;                  /* Created with BMGR_SPANS? */
+	bool	 address_ordered;        /* Created with BMGR_ADDRESS_ORDERED? */
+	uint64_t run_bin_mask;           /* Bins having free runs */
+	size_t	 run_bins[MAX_RUN_BINS]; /* First free run of a bin, chunk id + 1, 0 if none */
+
+	/*
+	 * Out of band free block tracking (BMGR_OUT_OF_BAND).
+	 *
+	 * Instead of linking free blocks into chunk_free_lists, every control block
+	 * has a second bitmap, where bit of a node is set, if the node is a free
+	 * block. For every size class, a summary bitmap of every region (with a
+	 * bit per chunk) tells which chunks have free blocks of that size class.
+	 * Both are searched from the lowest address, which BMGR_ADDRESS_ORDERED
+	 * relies on.
+	 */
+
+	/*
+	 * Lazy coalescing (BMGR_LAZY). A freed block is kept in the deferred
+	 * buffer of it's size class, marked in use, so that it's neither merged
+	 * nor split, and is handed out to the next allocation of the size class.
+	 * A buffer holds at most a chunk worth of blocks. Once it's full, it's
+	 * older half is coalesced, and all buffers are coalesced, when a request
+	 * can't be served from free lists, or memory is purged.
+	 */
+
+	/*
+	 * Purge mode (BMGR_PURGE): free chunks and free blocks of at least
+	 * min_purge_size bytes are returned to the OS via madvise, once their chunk
+	 * has seen no frees for purge_decay_ms.
+	 */
+	bool			purge;
+	size_t			min_purge_size;
+	uint64_t		purge_decay_ms;
+	_Atomic int		purge_advice;      /* MADV_* passed to madvise */
+	bool			purge_advice_auto; /* Fall back to MADV_DONTNEED, if MADV_REMOVE fails? */
+	_Atomic size_t	purged_bytes;      /* Total bytes passed to madvise */
+
+	/*
+	 * Synchronization for concurrent mode. Lock order is size class lock, then
+	 * the bitmap lock of a chunk (stored in it's control block). chunk_lock
+	 * protects the chunk allocator and is never held with any other lock.
+	 * Size classes, allocation counters and guard slots are kept with the
+	 * metadata of the first region, sized by the actual # of size classes
+	 * (see get_state_size).
+	 */
+	slock_t	  chunk_lock;
+	ptrdiff_t size_classes_offset;
+
+	/*
+	 * Statistics (bmgr_get_stats). Allocated blocks are counted by size class
+	 * of the request, in stripes summed by the reader, so that threads don't
+	 * contend on the counters. Free blocks, splits and merges are counted in
+	 * size_classes. High water mark of num_chunks_used is protected by
+	 * chunk_lock. A stripe is a block_counter_t per size class and one for
+	 * spans, stripes follow the size classes.
+	 */
+	size_t	  max_chunks_used;
+	ptrdiff_t stat_stripes_offset;
+	size_t	  stat_stripe_size;
+
+	/*
+	 * NUMA mode (bmgr_create_numa). Such a bmgr_t has no chunks of it's own,
+	 * it's followed by a buddy manager per node, each at the start of a pool of
+	 * numa_pool_size bytes bound to the node, and by the interleaved pool.
+	 * Public functions pass the call on to the pool of the calling thread's
+	 * node, or to the pool holding the block.
+	 */
+	ptrdiff_t numa_pools_offset;
+	size_t	  numa_pool_size;
+	size_t	  interleaved_pool_size; /* 0 if there is no interleaved pool */
+
+	/*
+	 * Guard page sampling (bmgr_set_guard_sample_rate). Every chunk counts
+	 * sampled blocks in it, so that frees look for a sampled block only in
+	 * such chunks. Protection of a sampled block is set in mappings of the
+	 * process, that allocated it, and only that process changes it: a block
+	 * freed by another process is quarantined unprotected and given back by
+	 * the owner. Slots (GUARD_SLOTS guard_slot_t, after the stripes) and
+	 * guarded are changed under guard_lock.
+	 */
+	_Atomic unsigned guard_sample_rate;
+	slock_t			 guard_lock;
+	uint64_t		 guard_free_seq;
+	ptrdiff_t		 guard_slots_offset;
+};
+
+static_assert(offsetof(bmgr_t, chunk_free_lists) == CACHE_LINE_SIZE,
+			  "Hot fields of bmgr_t don't fit in a cache line");
+
+/* Information needed to manipulate buddy control block for a given pointer */
+typedef struct
+{
+	size_t chunk_id;     /* Id of chunk containing the pointer */
+	size_t chunk_offset; /* Offset of pointer within the chunk */
+	bmgr_t *bmgr;        /* Buddy manger containing the pointer */
+	int	   szc;          /* sizeclass of this pointer */
+} buddy_ptr_t;
+
+/*
+ * Page aligned parts of free blocks of a chunk, that are purged together.
+ * Blocks before 'resume' (a chunk offset) were collected by earlier batches.
+ */
+typedef struct
+{
+	size_t resume;
+	int	   num_ranges;
+
+	struct
+	{
+		char   *start;
+		size_t size;
+	} ranges[PURGE_BATCH];
+} purge_batch_t;
+
+/* Block passed to buddy_free_bulk, blocks are sorted in batches of BULK_FREE_BATCH */
+#define BULK_FREE_BATCH 256
+
+typedef struct
+{
+	void   *ptr;
+	size_t size;
+} bulk_entry_t;
+
+/* Start of a node, that may be overwritten by a free list node */
+typedef struct
+{
+	olist_node *at;
+	olist_node contents;
+} saved_node_t;
+
+/* NUMA node of this thread and # of lookups since it was refreshed */
+static _Thread_local int	  numa_node;
+static _Thread_local unsigned numa_node_lookups;
+
+/* Stripe of allocation counters used by this thread, -1 until the first use */
+static _Thread_local int stat_stripe = -1;
+static _Atomic int		 next_stat_stripe;
+
+static int	  log_2(size_t n);
+static int	  get_num_size_classes(size_t min_alloc_size, size_t max_alloc_size);
+static size_t get_state_size(int num_size_classes);
+static size_t get_stat_stripe_size(int num_size_classes);
+static size_t get_control_block_size(size_t min_alloc_size, size_t max_alloc_size, bool
+									 out_of_band);
+static size_t get_bitmap_size(size_t min_alloc_size, size_t max_alloc_size);
+
+static bool	  init_region(bmgr_t *bmgr, region_t *region, char *memory, size_t size, size_t
+							  chunk_alignment, size_t state_size, ptrdiff_t *state_offset);
+static size_t get_metadata_size(bmgr_t *bmgr, size_t state_size, size_t num_chunks);
+static bmgr_t *bmgr_init(size_t min_alloc_size, size_t max_alloc_size, void *memory_region, size_t
+						 mem_size, int flags, size_t chunk_alignment);
+static void	  *map_region(size_t size, bmgr_page_mode_t *page_mode);
+static bool	  shmem_thp_enabled(void);
+
+static int		numa_num_pools(bmgr_t *bmgr);
+static bmgr_t	*get_numa_pool(bmgr_t *bmgr, int pool);
+static bmgr_t	*get_preferred_pool(bmgr_t *bmgr, int attempt);
+static bmgr_t	*get_owner(bmgr_t *bmgr, const void *ptr);
+static void		numa_get_stats(bmgr_t *bmgr, bmgr_stats_t *stats);
+static int		current_numa_node(void);
+static uint64_t numa_online_nodes(void);
+static void		numa_bind(void *addr, size_t len, uint64_t nodes, bool interleave);
+
+static void *chunk_alloc(bmgr_t *bmgr);
+static void chunk_free(bmgr_t *bmgr, void *ptr);
+static void *span_alloc(bmgr_t *bmgr, size_t num_chunks);
+static void span_free(bmgr_t *bmgr, void *ptr);
+static void *buddy_alloc_span(bmgr_t *bmgr, size_t size);
+static void buddy_free_span(bmgr_t *bmgr, void *ptr, size_t size);
+static size_t run_take(bmgr_t *bmgr, size_t num_chunks);
+static size_t run_find_fit(bmgr_t *bmgr, size_t num_chunks);
+static size_t run_find_lowest(bmgr_t *bmgr, size_t num_chunks);
+static void run_free(bmgr_t *bmgr, size_t start, size_t length);
+static void run_insert(bmgr_t *bmgr, size_t start, size_t length);
+static void run_remove(bmgr_t *bmgr, size_t start);
+static size_t get_span_chunks(bmgr_t *bmgr, size_t size);
+
+static bool	  guard_sampled(bmgr_t *bmgr);
+static void	  *guard_alloc(bmgr_t *bmgr, size_t size);
+static bool	  guard_free(bmgr_t *bmgr, void *ptr);
+static size_t guard_usable_size(bmgr_t *bmgr, void *ptr);
+static bool	  may_be_guarded(bmgr_t *bmgr, void *ptr);
+static int	  find_guard_slot(bmgr_t *bmgr, const void *ptr);
+static void	  release_quarantine(bmgr_t *bmgr, int keep);
+static void	  unprotect_guarded(bmgr_t *bmgr);
+static void	  get_guard_stats(bmgr_t *bmgr, bmgr_stats_t *stats);
+static void	  update_guarded(bmgr_t *bmgr);
+static void	  lock_guards(bmgr_t *bmgr);
+static void	  unlock_guards(bmgr_t *bmgr);
+
+static void *buddy_alloc_internal(bmgr_t *bmgr, size_t units);
+static void *alloc_aligned_internal(bmgr_t *bmgr, size_t size, size_t alignment);
+static void *get_donor_block(bmgr_t *bmgr, int szc, int *donor_szc);
+static void *pop_free_block(bmgr_t *bmgr, int szc, int *donor_szc);
+static void carve_block(bmgr_t *bmgr, char *ptr, int szc, size_t units, bool continuation);
+static size_t buddy_alloc_run(bmgr_t *bmgr, int szc, size_t num_blocks, void **blocks);
+static void split_into_leaves(bmgr_t *bmgr, char *ptr, int szc, int leaf_szc);
+static int	compare_bulk_entries(const void *a, const void *b);
+static bool bulk_free_groupable(bmgr_t *bmgr, const bulk_entry_t *entry);
+static void free_chunk_group(bmgr_t *bmgr, const bulk_entry_t *entries, size_t count);
+static bool merge_group_node(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t node,
+							 buddy_ptr_t *pending, int *num_pending);
+static void buddy_free_internal(bmgr_t *bmgr, void *ptr, int szc);
+static void coalesce_block(bmgr_t *bmgr, void *ptr, int szc);
+static void defer_block(bmgr_t *bmgr, void *ptr, int szc);
+static void *pop_deferred(bmgr_t *bmgr, int szc);
+static size_t flush_deferred(bmgr_t *bmgr);
+static size_t get_deferred_capacity(bmgr_t *bmgr, int szc);
+static void adjust_control_block(bmgr_t *bmgr, void *ptr, int szc, bool split);
+static void mark_continuation(bmgr_t *bmgr, void *ptr, bool continuation);
+static void clear_continuations(bmgr_t *bmgr, void *ptr, size_t units);
+
+static bool resize_in_place(bmgr_t *bmgr, void *ptr, size_t old_units, size_t new_units);
+static int	save_node_starts(bmgr_t *bmgr, char *ptr, size_t units, size_t kept, saved_node_t
+							 *saved, int num_saved);
+static bool range_is_free(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr, size_t
+						  units);
+static uint64_t get_resize_size_classes(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t
+										bptr, size_t old_units, size_t new_units);
+static void release_node(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr);
+static void claim_node(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr);
+static int	get_allocated_size_class(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t
+									 bptr);
+
+static void *freelist_pop(bmgr_t *bmgr, int szc);
+static void freelist_push(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr);
+static void freelist_remove(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr);
+static void *oob_freelist_pop(bmgr_t *bmgr, int szc);
+static void oob_freelist_push(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr);
+static void oob_freelist_remove(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr);
+
+static void		 mark_chunk_dirty(bmgr_t *bmgr, buddy_ptr_t bptr);
+static size_t		 purge_chunk(bmgr_t *bmgr, size_t chunk_id, uint64_t now_ms, size_t page_size);
+static bool			 collect_purge_ranges(bmgr_t *bmgr, buddy_ptr_t bptr, size_t page_size,
+										  purge_batch_t *batch);
+static void			 add_purge_range(bmgr_t *bmgr, buddy_ptr_t bptr, size_t page_size,
+									 purge_batch_t *batch);
+static size_t		 purge_range(bmgr_t *bmgr, char *start, size_t size);
+static void			 wait_for_purge(bmgr_t *bmgr, buddy_ptr_t bptr);
+static chunk_meta_t *get_chunk_meta(bmgr_t *bmgr, size_t chunk_id);
+static size_class_t	 *get_size_class_state(bmgr_t *bmgr, int szc);
+static block_counter_t *get_block_counters(bmgr_t *bmgr, int stripe);
+static guard_slot_t	 *get_guard_slot(bmgr_t *bmgr, int i);
+static uint64_t		 current_time_ms(void);
+
+static void count_units(bmgr_t *bmgr, size_t units, size_t count, bool allocated);
+static void count_blocks(bmgr_t *bmgr, int counter, size_t bytes, size_t count, bool allocated);
+static int	get_stat_stripe(void);
+
+static void set_nonempty(bmgr_t *bmgr, int szc);
+static void clear_nonempty(bmgr_t *bmgr, int szc);
+
+static void lock_size_class(bmgr_t *bmgr, int szc);
+static void unlock_size_class(bmgr_t *bmgr, int szc);
+static void lock_control_block(bmgr_t *bmgr, control_block_t control_block);
+static void unlock_control_block(bmgr_t *bmgr, control_block_t control_block);
+static void lock_size_classes(bmgr_t *bmgr, uint64_t mask);
+static void unlock_size_classes(bmgr_t *bmgr, uint64_t mask);
+
+static char		*get_chunk_start(bmgr_t *bmgr, const region_t *region);
+static int		find_region(bmgr_t *bmgr, const void *ptr);
+static region_t *get_region(bmgr_t *bmgr, size_t chunk_id);
+static char		*get_chunk_address(bmgr_t *bmgr, size_t chunk_id);
+
+static buddy_ptr_t get_buddy_ptr(bmgr_t *bmgr, void *ptr, int szc);
+static void		   *get_real_ptr(bmgr_t *bmgr, buddy_ptr_t bptr);
+
+static size_t get_units(bmgr_t *bmgr, size_t size);
+static int	  get_size_class(size_t units);
+static size_t get_size(bmgr_t *bmgr, int szc);
+
+static control_block_t get_control_block(buddy_ptr_t bptr);
+static uint8_t		   *get_bitmap(control_block_t control_block);
+static uint64_t		   *get_free_bitmap(bmgr_t *bmgr, control_block_t control_block);
+static uint64_t		   *get_continuation_bitmap(bmgr_t *bmgr, control_block_t control_block);
+static uint64_t		   *get_summary(bmgr_t *bmgr, const region_t *region, int szc);
+static size_t		   get_level_start(bmgr_t *bmgr, int szc);
+static size_t		   get_bitmap_index(buddy_ptr_t bptr);
+static void			   mark_as_in_use(control_block_t control_block, buddy_ptr_t bptr);
+static void			   mark_as_free(control_block_t control_block, buddy_ptr_t bptr);
+static bool			   block_is_free(control_block_t control_block, buddy_ptr_t bptr);
+static bool			   both_free(control_block_t control_block, buddy_ptr_t bptr);
+static buddy_ptr_t	   get_buddy(control_block_t control_block, buddy_ptr_t bptr);
+
+static void	  bitmap_set(uint64_t *bitmap, size_t bit);
+static bool	  bitmap_test(const uint64_t *bitmap, size_t bit);
+static void	  bitmap_clear(uint64_t *bitmap, size_t bit);
+static size_t bitmap_find_first(const uint64_t *bitmap, size_t start, size_t end);
+
+#define TOGGLE_BIT(val, bit) (val ^ (1 << bit))
+
+bmgr_t *
+bmgr_create(size_t min_alloc_size, size_t max_alloc_size, void *memory_region, size_t mem_size)
+{
+	return bmgr_create_ext(min_alloc_size, max_alloc_size, memory_region, mem_size, 0);
+}
+
+
+/*
+ * Create a buddy manager, that can be used by multiple threads concurrently.
+ *
+ * Each size class has it's own lock and bitmap of every chunk is protected by
+ * a lock in it's control block, so allocations of different sizes (and frees
+ * in different chunks) proceed in parallel.
+ */
+bmgr_t *
+bmgr_create_concurrent(size_t min_alloc_size, size_t max_alloc_size, void *memory_region, size_t
+					   mem_size)
+{
+	return bmgr_create_ext(min_alloc_size, max_alloc_size, memory_region, mem_size,
+						   BMGR_CONCURRENT);
+}
+
+
+/* Create a buddy manager with the given BMGR_* flags */
+bmgr_t *
+bmgr_create_ext(size_t min_alloc_size, size_t max_alloc_size, void *memory_region, size_t mem_size,
+				int flags)
+{
+	return bmgr_init(min_alloc_size, max_alloc_size, memory_region, mem_size, flags,
+					 max_alloc_size);
+}
+
+
+/*
+ * Create a buddy manager in a shared anonymous mapping of 'mem_size' bytes
+ * (rounded up to huge page size), that is backed by huge pages if possible.
+ *
+ * Tries MAP_HUGETLB first (needs reserved pages in vm.nr_hugepages), then
+ * transparent huge pages via madvise(MADV_HUGEPAGE) (needs shmem_enabled to be
+ * "advise" or "always"), and falls back to regular pages. Either way chunks
+ * start at a huge page boundary. bmgr_page_mode tells which mode is in effect,
+ * the mapping is released with bmgr_destroy.
+ */
+bmgr_t *
+bmgr_create_hugepage(size_t min_alloc_size, size_t max_alloc_size, size_t mem_size, int flags)
+{
+	bmgr_page_mode_t page_mode;
+	bmgr_t			 *bmgr;
+	size_t			 chunk_alignment = max_alloc_size > HUGE_PAGE_SIZE ? max_alloc_size :
+									   HUGE_PAGE_SIZE;
+	void			 *region;
+
+	mem_size = TYPEALIGN64(HUGE_PAGE_SIZE, mem_size);
+	region	 = map_region(mem_size, &page_mode);
+
+	if (region == NULL)
+	{
+		return NULL;
+	}
+
+	bmgr = bmgr_init(min_alloc_size, max_alloc_size, region, mem_size, flags, chunk_alignment);
+
+	if (bmgr == NULL)
+	{
+		munmap(region, mem_size);
+		return NULL;
+	}
+
+	bmgr->page_mode	   = page_mode;
+	bmgr->mapping_size = mem_size;
+
+	return bmgr;
+}
+
+
+/*
+ * Release memory region of a buddy manager, if it was mapped by
+ * bmgr_create_hugepage. Sampled blocks of the calling process are made
+ * accessible again.
+ */
+void
+bmgr_destroy(bmgr_t *bmgr)
+{
+	if (bmgr == NULL)
+	{
+		return;
+	}
+
+	/* Caller provided memory is usable again, as a whole */
+	unprotect_guarded(bmgr);
+
+	if (bmgr->mapping_size != 0)
+	{
+		bmgr->magic = 0;
+		munmap(bmgr, bmgr->mapping_size);
+	}
+}
+
+
+/* Kind of pages backing the memory region */
+bmgr_page_mode_t
+bmgr_page_mode(bmgr_t *bmgr)
+{
+	return bmgr->page_mode;
+}
+
+
+/*
+ * Create a NUMA buddy manager in a shared anonymous mapping: bmgr_t, then a
+ * pool of 'node_mem_size' bytes per node and a pool of 'interleaved_mem_size'
+ * bytes (none if 0). Every pool is a buddy manager created with 'flags'.
+ * Memory policy of a pool is set before it's pages are touched, failing to set
+ * it leaves the pool unbound. The mapping is released with bmgr_destroy.
+ */
+bmgr_t *
+bmgr_create_numa(size_t min_alloc_size, size_t max_alloc_size, size_t node_mem_size, size_t
+				 interleaved_mem_size, int num_nodes, int flags)
+{
+	size_t	 page_size	 = sysconf(_SC_PAGESIZE);
+	size_t	 header_size = TYPEALIGN64(page_size, sizeof(bmgr_t));
+	uint64_t online		 = numa_online_nodes();
+	size_t	 pool_size;
+	size_t	 interleaved_size;
+	size_t	 mapping_size;
+	bmgr_t	 *bmgr;
+	bmgr_t	 *pool;
+	char	 *pools;
+
+	if (num_nodes <= 0)
+	{
+		num_nodes = log_2(online) + 1;
+	}
+
+	if (num_nodes > BMGR_MAX_NUMA_NODES)
+	{
+		num_nodes = BMGR_MAX_NUMA_NODES;
+	}
+
+	pool_size		 = TYPEALIGN64(page_size, node_mem_size);
+	interleaved_size = TYPEALIGN64(page_size, interleaved_mem_size);
+	mapping_size	 = header_size + num_nodes * pool_size + interleaved_size;
+
+	bmgr = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (bmgr == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	pools = (char *) bmgr + header_size;
+
+	for (int node = 0; node < num_nodes; node++)
+	{
+		char *pool_start = pools + node * pool_size;
+
+		if (online & ((uint64_t) 1 << node))
+		{
+			numa_bind(pool_start, pool_size, (uint64_t) 1 << node, false);
+		}
+
+		if (bmgr_init(min_alloc_size, max_alloc_size, pool_start, pool_size, flags,
+					  max_alloc_size) == NULL)
+		{
+			munmap(bmgr, mapping_size);
+			return NULL;
+		}
+	}
+
+	if (interleaved_size > 0)
+	{
+		char *pool_start = pools + num_nodes * pool_size;
+
+		numa_bind(pool_start, interleaved_size, online, true);
+
+		if (bmgr_init(min_alloc_size, max_alloc_size, pool_start, interleaved_size, flags,
+					  max_alloc_size) == NULL)
+		{
+			munmap(bmgr, mapping_size);
+			return NULL;
+		}
+	}
+
+	/* Geometry and flags are those of the pools, chunks are all in the pools */
+	pool					  = (bmgr_t *) pools;
+	bmgr->min_alloc_size	  = pool->min_alloc_size;
+	bmgr->max_alloc_size	  = pool->max_alloc_size;
+	bmgr->log2_min_alloc_size = pool->log2_min_alloc_size;
+	bmgr->log2_max_alloc_size = pool->log2_max_alloc_size;
+	bmgr->num_size_classes	  = pool->num_size_classes;
+	bmgr->concurrent		  = pool->concurrent;
+	bmgr->out_of_band		  = pool->out_of_band;
+	bmgr->spans				  = pool->spans;
+	bmgr->address_ordered	  = pool->address_ordered;
+	bmgr->purge				  = pool->purge;
+	atomic_init(&bmgr->num_regions, 0);
+	atomic_init(&bmgr->num_usable_chunks, 0);
+
+	bmgr->total_memory_managed	= mapping_size;
+	bmgr->page_mode				= BMGR_PAGES_REGULAR;
+	bmgr->mapping_size			= mapping_size;
+	bmgr->numa_nodes			= num_nodes;
+	bmgr->numa_pools_offset		= header_size;
+	bmgr->numa_pool_size		= pool_size;
+	bmgr->interleaved_pool_size = interleaved_size;
+	bmgr->magic					= BMGR_MAGIC;
+
+	return bmgr;
+}
+
+
+/* # of node pools of a NUMA buddy manager, 0 if it's not one */
+int
+bmgr_numa_nodes(bmgr_t *bmgr)
+{
+	return bmgr->numa_nodes;
+}
+
+
+/* Node of the pool holding a block, -1 if it's in the interleaved pool or not NUMA */
+int
+bmgr_numa_node(bmgr_t *bmgr, void *ptr)
+{
+	bmgr_t *owner = get_owner(bmgr, ptr);
+
+	if (owner == bmgr)
+	{
+		return -1;
+	}
+
+	for (int node = 0; node < bmgr->numa_nodes; node++)
+	{
+		if (get_numa_pool(bmgr, node) == owner)
+		{
+			return node;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * Allocate from the interleaved pool, returns NULL once it is full. Same as
+ * buddy_alloc, if there is no interleaved pool.
+ */
+void *
+buddy_alloc_interleaved(bmgr_t *bmgr, size_t size)
+{
+	if (bmgr->interleaved_pool_size == 0)
+	{
+		return buddy_alloc(bmgr, size);
+	}
+
+	return buddy_alloc(get_numa_pool(bmgr, bmgr->numa_nodes), size);
+}
+
+
+/*
+ * Initialize a buddy manager at the start of 'memory_region', with chunks
+ * starting at an address aligned to 'chunk_alignment' (a multiple of
+ * max_alloc_size).
+ */
+static bmgr_t *
+bmgr_init(size_t min_alloc_size, size_t max_alloc_size, void *memory_region, size_t mem_size,
+		  int flags, size_t chunk_alignment)
+{
+	bmgr_t	  *bmgr = memory_region;
+	ptrdiff_t state_offset;
+
+	assert(bmgr != NULL);
+
+	if (mem_size <= sizeof(bmgr_t))
+	{
+		return NULL;
+	}
+
+	bmgr->magic					= 0;
+	bmgr->total_memory_managed	= mem_size;
+	bmgr->page_mode				= BMGR_PAGES_REGULAR;
+	bmgr->mapping_size			= 0;
+	atomic_init(&bmgr->nonempty_mask, 0);
+	bmgr->min_alloc_size		= min_alloc_size;
+	bmgr->max_alloc_size		= max_alloc_size;
+	bmgr->log2_min_alloc_size	= log_2(min_alloc_size);
+	bmgr->log2_max_alloc_size	= log_2(max_alloc_size);
+	bmgr->num_chunks_used		= 0;
+	bmgr->num_size_classes		= get_num_size_classes(min_alloc_size, max_alloc_size);
+	bmgr->out_of_band			= (flags & (BMGR_OUT_OF_BAND | BMGR_ADDRESS_ORDERED)) != 0;
+	bmgr->control_block_size	= get_control_block_size(min_alloc_size, max_alloc_size,
+														 bmgr->out_of_band);
+	bmgr->concurrent			= (flags & BMGR_CONCURRENT) != 0;
+	bmgr->lazy					= (flags & BMGR_LAZY) != 0;
+	atomic_init(&bmgr->deferred_mask, 0);
+	atomic_init(&bmgr->guarded, false);
+
+	bmgr->purge				= (flags & BMGR_PURGE) != 0;
+	bmgr->min_purge_size	= max_alloc_size;
+	bmgr->purge_decay_ms	= DEFAULT_PURGE_DECAY_MS;
+	bmgr->purge_advice_auto = true;
+	atomic_init(&bmgr->purge_advice, DEFAULT_PURGE_ADVICE);
+	atomic_init(&bmgr->purged_bytes, 0);
+
+	bmgr->spans			  = (flags & BMGR_SPANS) != 0;
+	bmgr->address_ordered = (flags & BMGR_ADDRESS_ORDERED) != 0;
+	bmgr->run_bin_mask = 0;
+	memset(bmgr->run_bins, 0, sizeof(bmgr->run_bins));
+
+	/* First region follows bmgr_t, state of size classes is kept with it's metadata */
+	if (bmgr->control_block_size == 0 ||
+		!init_region(bmgr, &bmgr->regions[0], (char *) bmgr + sizeof(bmgr_t), mem_size -
+					 sizeof(bmgr_t), chunk_alignment, get_state_size(bmgr->num_size_classes),
+					 &state_offset))
+	{
+		return NULL;
+	}
+
+	bmgr->stat_stripe_size	  = get_stat_stripe_size(bmgr->num_size_classes);
+	bmgr->size_classes_offset = state_offset;
+	bmgr->stat_stripes_offset = bmgr->size_classes_offset + bmgr->num_size_classes *
+								sizeof(size_class_t);
+	bmgr->guard_slots_offset  = bmgr->stat_stripes_offset + STAT_STRIPES *
+								bmgr->stat_stripe_size;
+
+	atomic_init(&bmgr->num_regions, 1);
+	atomic_init(&bmgr->num_usable_chunks, bmgr->regions[0].num_chunks);
+
+	for (int i = 0; i < bmgr->num_size_classes; i++)
+	{
+		size_class_t *size_class = get_size_class_state(bmgr, i);
+
+		olist_init(bmgr, &bmgr->chunk_free_lists[i]);
+		slock_init(&size_class->lock);
+		size_class->free_blocks	 = 0;
+		size_class->splits		 = 0;
+		size_class->merges		 = 0;
+		size_class->num_deferred = 0;
+		size_class->acquisitions = 0;
+		size_class->contentions	 = 0;
+	}
+
+	bmgr->max_chunks_used = 0;
+	memset(get_block_counters(bmgr, 0), 0, STAT_STRIPES * bmgr->stat_stripe_size);
+
+	bmgr->numa_nodes			= 0;
+	bmgr->numa_pools_offset		= 0;
+	bmgr->numa_pool_size		= 0;
+	bmgr->interleaved_pool_size = 0;
+
+	atomic_init(&bmgr->guard_sample_rate, 0);
+	slock_init(&bmgr->guard_lock);
+	bmgr->guard_free_seq = 0;
+	memset(get_guard_slot(bmgr, 0), 0, GUARD_SLOTS * sizeof(guard_slot_t));
+
+	slock_init(&bmgr->chunk_lock);
+
+	bmgr->magic = BMGR_MAGIC;
+
+	return bmgr;
+}
+
+
+/*
+ * Lay out a region of chunks in 'size' bytes at 'memory': metadata, starting
+ * with 'state_size' bytes of buddy manager state (at '*state_offset'), and
+ * the chunks, starting at an address aligned to 'chunk_alignment'. Metadata
+ * goes first, unless placing it after the last chunk leaves room for more
+ * chunks, as the start of the region isn't aligned. Returns false, if the
+ * metadata doesn't fit.
+ */
+static bool
+init_region(bmgr_t *bmgr, region_t *region, char *memory, size_t size, size_t chunk_alignment,
+			size_t state_size, ptrdiff_t *state_offset)
+{
+	size_t	  max_chunks	= size / bmgr->max_alloc_size;
+	size_t	  metadata_size = get_metadata_size(bmgr, state_size, max_chunks);
+	char	  *end			= memory + size;
+	char	  *aligned		= (char *) TYPEALIGN64(chunk_alignment, (uintptr_t) memory);
+	char	  *metadata		= memory;
+	char	  *chunk_start	= (char *) TYPEALIGN64(chunk_alignment, (uintptr_t) memory +
+												   metadata_size);
+	size_t	  num_chunks	= 0;
+	bool	  fits			= metadata_size < size;
+	ptrdiff_t offset;
+
+	if (fits && chunk_start < end)
+	{
+		num_chunks = (size_t) (end - chunk_start) >> bmgr->log2_max_alloc_size;
+	}
+
+	for (size_t n = max_chunks; n > num_chunks && aligned < end; n--)
+	{
+		size_t chunks_size = n << bmgr->log2_max_alloc_size;
+
+		if (chunks_size < (size_t) (end - aligned) &&
+			get_metadata_size(bmgr, state_size, n) <= (size_t) (end - aligned) - chunks_size)
+		{
+			chunk_start = aligned;
+			metadata	= aligned + chunks_size;
+			num_chunks	= n;
+			fits		= true;
+			break;
+		}
+	}
+
+	if (!fits)
+	{
+		return false;
+	}
+
+	offset = CACHEALIGN(metadata - (char *) bmgr);
+
+	if (state_offset != NULL)
+	{
+		*state_offset = offset;
+	}
+
+	offset						 += state_size;
+	region->control_block_offset  = offset;
+	offset						 += bmgr->control_block_size * num_chunks;
+	region->summary_offset		  = offset;
+	region->summary_words		  = 0;
+
+	if (bmgr->out_of_band)
+	{
+		region->summary_words  = (num_chunks + BITS_PER_WORD - 1) / BITS_PER_WORD;
+		offset				  += bmgr->num_size_classes * region->summary_words * sizeof(uint64_t);
+	}
+
+	region->chunk_meta_offset  = MAXALIGN(offset);
+	region->chunk_start_offset = chunk_start - (char *) bmgr;
+	region->num_chunks		   = num_chunks;
+	region->next_chunk_index   = 0;
+
+	memset((char *) bmgr + region->control_block_offset, 0, region->num_chunks *
+		   bmgr->control_block_size);
+	memset((char *) bmgr + region->summary_offset, 0, bmgr->num_size_classes *
+		   region->summary_words * sizeof(uint64_t));
+	memset((char *) bmgr + region->chunk_meta_offset, 0, region->num_chunks *
+		   sizeof(chunk_meta_t));
+
+	return true;
+}
+
+
+/* Bytes of metadata of a region of 'num_chunks' chunks, including alignment */
+static size_t
+get_metadata_size(bmgr_t *bmgr, size_t state_size, size_t num_chunks)
+{
+	size_t summary_words = bmgr->out_of_band ? (num_chunks + BITS_PER_WORD - 1) / BITS_PER_WORD : 0;
+
+	return CACHE_LINE_SIZE + state_size + bmgr->control_block_size * num_chunks +
+		   bmgr->num_size_classes * summary_words * sizeof(uint64_t) + MAXIMUM_ALIGNOF +
+		   num_chunks * sizeof(chunk_meta_t);
+}
+
+
+/*
+ * Map 'size' bytes of shared anonymous memory aligned to HUGE_PAGE_SIZE,
+ * preferring huge pages, returns NULL on failure.
+ */
+static void *
+map_region(size_t size, bmgr_page_mode_t *page_mode)
+{
+	char *region;
+	char *aligned;
+	int	  mmap_flags = MAP_SHARED | MAP_ANONYMOUS;
+
+#ifdef MAP_HUGETLB
+	region = mmap(NULL, size, PROT_READ | PROT_WRITE, mmap_flags | MAP_HUGETLB, -1, 0);
+
+	if (region != MAP_FAILED)
+	{
+		*page_mode = BMGR_PAGES_HUGETLB;
+		return region;
+	}
+#endif /* MAP_HUGETLB */
+
+	/* Over-allocate, so that the mapping can be trimmed to huge page alignment */
+	region = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, mmap_flags, -1, 0);
+
+	if (region == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	aligned = (char *) TYPEALIGN64(HUGE_PAGE_SIZE, region);
+
+	if (aligned != region)
+	{
+		munmap(region, aligned - region);
+	}
+
+	munmap(aligned + size, region + HUGE_PAGE_SIZE - aligned);
+
+	*page_mode = BMGR_PAGES_REGULAR;
+
+#ifdef MADV_HUGEPAGE
+	if (madvise(aligned, size, MADV_HUGEPAGE) == 0 && shmem_thp_enabled())
+	{
+		*page_mode = BMGR_PAGES_TRANSPARENT_HUGE;
+	}
+#endif /* MADV_HUGEPAGE */
+
+	return aligned;
+}
+
+
+/*
+ * madvise(MADV_HUGEPAGE) succeeds even if transparent huge pages are disabled
+ * for shared memory, so check the sysfs setting.
+ */
+static bool
+shmem_thp_enabled(void)
+{
+	FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+	char  setting[128];
+	bool  enabled;
+
+	if (file == NULL)
+	{
+		return false;
+	}
+
+	enabled = fgets(setting, sizeof(setting), file) != NULL &&
+			  strstr(setting, "[never]") == NULL && strstr(setting, "[deny]") == NULL;
+
+	fclose(file);
+
+	return enabled;
+}
+
+
+/* # of pools of a NUMA buddy manager, node pools first, then the interleaved one */
+static int
+numa_num_pools(bmgr_t *bmgr)
+{
+	return bmgr->numa_nodes + (bmgr->interleaved_pool_size > 0);
+}
+
+
+static bmgr_t *
+get_numa_pool(bmgr_t *bmgr, int pool)
+{
+	return (bmgr_t *) ((char *) bmgr + bmgr->numa_pools_offset + pool * bmgr->numa_pool_size);
+}
+
+
+/*
+ * Node pool to allocate from at the 'attempt'th try: the calling thread's node
+ * first, then the others round robin. NULL once all were tried.
+ */
+static bmgr_t *
+get_preferred_pool(bmgr_t *bmgr, int attempt)
+{
+	if (attempt >= bmgr->numa_nodes)
+	{
+		return NULL;
+	}
+
+	return get_numa_pool(bmgr, (current_numa_node() + attempt) % bmgr->numa_nodes);
+}
+
+
+/*
+ * Buddy manager holding 'ptr': the pool containing it, if 'bmgr' is NUMA,
+ * 'bmgr' itself otherwise or if no pool contains it.
+ */
+static bmgr_t *
+get_owner(bmgr_t *bmgr, const void *ptr)
+{
+	uintptr_t start	 = (uintptr_t) get_numa_pool(bmgr, 0);
+	size_t	  offset = (uintptr_t) ptr - start;
+
+	if (bmgr->numa_nodes == 0 || (uintptr_t) ptr < start ||
+		offset >= bmgr->numa_nodes * bmgr->numa_pool_size + bmgr->interleaved_pool_size)
+	{
+		return bmgr;
+	}
+
+	/* Interleaved pool may be smaller or larger than a node pool */
+	if (offset >= bmgr->numa_nodes * bmgr->numa_pool_size)
+	{
+		return get_numa_pool(bmgr, bmgr->numa_nodes);
+	}
+
+	return get_numa_pool(bmgr, offset / bmgr->numa_pool_size);
+}
+
+
+/* Sum of statistics of the pools, high water mark of chunks is the sum of those of the pools */
+static void
+numa_get_stats(bmgr_t *bmgr, bmgr_stats_t *stats)
+{
+	bmgr_stats_t pool_stats;
+	size_t		 free_chunk_bytes;
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->page_mode		= bmgr->page_mode;
+	stats->num_size_classes = bmgr->num_size_classes;
+
+	for (int pool = 0; pool < numa_num_pools(bmgr); pool++)
+	{
+		bmgr_get_stats(get_numa_pool(bmgr, pool), &pool_stats);
+
+		stats->total_memory		 += pool_stats.total_memory;
+		stats->allocated_bytes	 += pool_stats.allocated_bytes;
+		stats->free_bytes		 += pool_stats.free_bytes;
+		stats->span_bytes		 += pool_stats.span_bytes;
+		stats->spans			 += pool_stats.spans;
+		stats->chunks_in_use	 += pool_stats.chunks_in_use;
+		stats->max_chunks_in_use += pool_stats.max_chunks_in_use;
+		stats->purged_bytes		 += pool_stats.purged_bytes;
+		stats->guarded_blocks	 += pool_stats.guarded_blocks;
+		stats->guard_bytes		 += pool_stats.guard_bytes;
+
+		for (int szc = 0; szc < bmgr->num_size_classes; szc++)
+		{
+			bmgr_size_class_stats_t *szc_stats		= &stats->size_classes[szc];
+			bmgr_size_class_stats_t *pool_szc_stats = &pool_stats.size_classes[szc];
+
+			szc_stats->block_size		 = pool_szc_stats->block_size;
+			szc_stats->allocated_bytes	+= pool_szc_stats->allocated_bytes;
+			szc_stats->allocated_blocks += pool_szc_stats->allocated_blocks;
+			szc_stats->free_bytes		+= pool_szc_stats->free_bytes;
+			szc_stats->free_blocks		+= pool_szc_stats->free_blocks;
+			szc_stats->deferred_blocks	+= pool_szc_stats->deferred_blocks;
+			szc_stats->splits			+= pool_szc_stats->splits;
+			szc_stats->merges			+= pool_szc_stats->merges;
+			szc_stats->lock_acquisitions += pool_szc_stats->lock_acquisitions;
+			szc_stats->lock_contentions	 += pool_szc_stats->lock_contentions;
+		}
+	}
+
+	free_chunk_bytes = stats->total_memory - stats->chunks_in_use * bmgr->max_alloc_size;
+
+	if (stats->free_bytes > 0)
+	{
+		stats->fragmentation = (double) (stats->free_bytes - free_chunk_bytes) /
+							   stats->free_bytes;
+	}
+}
+
+
+/* NUMA node the calling thread runs on, 0 if unknown */
+static int
+current_numa_node(void)
+{
+	if (numa_node_lookups++ % NUMA_NODE_REFRESH == 0)
+	{
+		unsigned cpu;
+		unsigned node = 0;
+
+#ifdef SYS_getcpu
+		if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+		{
+			node = 0;
+		}
+#else
+		(void) cpu;
+#endif /* SYS_getcpu */
+
+		numa_node = node;
+	}
+
+	return numa_node;
+}
+
+
+/* Mask of online NUMA nodes (as listed in sysfs, e.g. "0-1,3"), node 0 if unknown */
+static uint64_t
+numa_online_nodes(void)
+{
+	FILE	 *file	= fopen("/sys/devices/system/node/online", "r");
+	uint64_t nodes	= 0;
+	char	 list[256];
+	char	 *pos	= list;
+
+	if (file == NULL)
+	{
+		return 1;
+	}
+
+	if (fgets(list, sizeof(list), file) == NULL)
+	{
+		list[0] = '\0';
+	}
+
+	fclose(file);
+
+	while (*pos >= '0' && *pos <= '9')
+	{
+		unsigned long first = strtoul(pos, &pos, 10);
+		unsigned long last	= first;
+
+		if (*pos == '-')
+		{
+			last = strtoul(pos + 1, &pos, 10);
+		}
+
+		for (; first <= last && first < BITS_PER_WORD; first++)
+		{
+			nodes |= (uint64_t) 1 << first;
+		}
+
+		if (*pos == ',')
+		{
+			pos++;
+		}
+	}
+
+	return nodes != 0 ? nodes : 1;
+}
+
+
+/* Bind memory to 'nodes' or interleave it over them, failures are ignored */
+static void
+numa_bind(void *addr, size_t len, uint64_t nodes, bool interleave)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	(void) syscall(SYS_mbind, addr, len, interleave ? MPOL_INTERLEAVE : MPOL_BIND, &nodes,
+				   BITS_PER_WORD + 1, 0);
+#else
+	(void) addr;
+	(void) len;
+	(void) nodes;
+	(void) interleave;
+#endif /* __linux__ && SYS_mbind */
+}
+
+
+/*
+ * Attach to a buddy manager created (by any process) in a memory region, that
+ * is mapped at 'mapped_addr' in the calling process. The address need not be
+ * the same as the one used by other processes.
+ */
+bmgr_t *
+bmgr_attach(void *mapped_addr)
+{
+	bmgr_t *bmgr = mapped_addr;
+
+	if (bmgr == NULL || bmgr->magic != BMGR_MAGIC)
+	{
+		return NULL;
+	}
+
+	return bmgr;
+}
+
+
+/*
+ * Add chunks in 'memory_region' to the buddy manager. Returns # of bytes in
+ * the added chunks, 0 if BMGR_MAX_REGIONS regions are in use already or the
+ * region is too small to hold a chunk.
+ */
+size_t
+bmgr_extend(bmgr_t *bmgr, void *memory_region, size_t mem_size)
+{
+	size_t added = 0;
+	int	   num_regions;
+
+	if (bmgr->numa_nodes > 0)
+	{
+		return 0;
+	}
+
+	if (bmgr->concurrent)
+	{
+		slock_lock(&bmgr->chunk_lock);
+	}
+
+	num_regions = atomic_load_explicit(&bmgr->num_regions, memory_order_relaxed);
+
+	if (num_regions < BMGR_MAX_REGIONS &&
+		init_region(bmgr, &bmgr->regions[num_regions], memory_region, mem_size,
+					bmgr->max_alloc_size, 0, NULL) && bmgr->regions[num_regions].num_chunks > 0)
+	{
+		added = bmgr->regions[num_regions].num_chunks;
+
+		atomic_fetch_add(&bmgr->num_usable_chunks, added);
+
+		/* Lock free lookups see the region only after it is set up */
+		atomic_store_explicit(&bmgr->num_regions, num_regions + 1, memory_order_release);
+	}
+
+	if (bmgr->concurrent)
+	{
+		slock_unlock(&bmgr->chunk_lock);
+	}
+
+	return added * bmgr->max_alloc_size;
+}
+
+
+/* Layout of chunks of region 'region' (see bmgr.h), returns -1 if there is no such region */
+int
+bmgr_get_region_layout(bmgr_t *bmgr, int region, bmgr_region_layout_t *layout)
+{
+	const region_t *r;
+
+	if (region < 0 || region >= atomic_load_explicit(&bmgr->num_regions, memory_order_acquire))
+	{
+		return -1;
+	}
+
+	r = &bmgr->regions[region];
+
+	layout->chunk_start		   = get_chunk_start(bmgr, r);
+	layout->control_blocks	   = (char *) bmgr + r->control_block_offset;
+	layout->num_chunks		   = r->num_chunks;
+	layout->control_block_size = bmgr->control_block_size;
+
+	return 0;
+}
+
+
+size_t
+buddy_total_alloc_memory(bmgr_t *bmgr)
+{
+	size_t total = atomic_load(&bmgr->num_usable_chunks) * bmgr->max_alloc_size;
+
+	for (int pool = 0; pool < numa_num_pools(bmgr); pool++)
+	{
+		total += buddy_total_alloc_memory(get_numa_pool(bmgr, pool));
+	}
+
+	return total;
+}
+
+
+size_t
+buddy_min_alloc_size(bmgr_t *bmgr)
+{
+	return bmgr->min_alloc_size;
+}
+
+
+size_t
+buddy_max_alloc_size(bmgr_t *bmgr)
+{
+	return bmgr->max_alloc_size;
+}
+
+
+/* Allocate memory region of size 'size' */
+void *
+buddy_alloc(bmgr_t *bmgr, size_t size)
+{
+	if (size == 0)
+	{
+		return NULL;
+	}
+
+	if (bmgr->numa_nodes > 0)
+	{
+		void   *ptr = NULL;
+		bmgr_t *pool;
+
+		for (int i = 0; ptr == NULL && (pool = get_preferred_pool(bmgr, i)) != NULL; i++)
+		{
+			ptr = buddy_alloc(pool, size);
+		}
+
+		return ptr;
+	}
+
+	if (size > bmgr->max_alloc_size)
+	{
+		return bmgr->spans ? buddy_alloc_span(bmgr, size) : NULL;
+	}
+
+	if (guard_sampled(bmgr))
+	{
+		void *ptr = guard_alloc(bmgr, size);
+
+		if (ptr != NULL)
+		{
+			return ptr;
+		}
+	}
+
+	return buddy_alloc_internal(bmgr, get_units(bmgr, size));
+}
+
+
+/*
+ * Allocate a block of 'units' min_alloc_size units, for callers that have
+ * already rounded the size (see bmgr/bmgr.hpp). Spans are not served.
+ */
+void *
+buddy_alloc_units(bmgr_t *bmgr, size_t units)
+{
+	if (units == 0 || units > bmgr->max_alloc_size >> bmgr->log2_min_alloc_size)
+	{
+		return NULL;
+	}
+
+	if (bmgr->numa_nodes > 0)
+	{
+		void   *ptr = NULL;
+		bmgr_t *pool;
+
+		for (int i = 0; ptr == NULL && (pool = get_preferred_pool(bmgr, i)) != NULL; i++)
+		{
+			ptr = buddy_alloc_units(pool, units);
+		}
+
+		return ptr;
+	}
+
+	if (guard_sampled(bmgr))
+	{
+		void *ptr = guard_alloc(bmgr, units << bmgr->log2_min_alloc_size);
+
+		if (ptr != NULL)
+		{
+			return ptr;
+		}
+	}
+
+	return buddy_alloc_internal(bmgr, units);
+}
+
+
+/*
+ * Allocate a block of 'size' bytes, aligned to 'alignment' (a power of two not
+ * larger than max_alloc_size).
+ *
+ * Nodes are aligned to their size, as chunks are aligned to max_alloc_size.
+ * So the block is carved out of the start of a node of at least 'alignment'
+ * bytes and the rest of the node goes back to free lists.
+ */
+void *
+buddy_alloc_aligned(bmgr_t *bmgr, size_t size, size_t alignment)
+{
+	void *ptr = NULL;
+
+	if (size == 0 || alignment > bmgr->max_alloc_size || (alignment & (alignment - 1)) != 0)
+	{
+		return NULL;
+	}
+
+	/* Spans start at a chunk */
+	if (size > bmgr->max_alloc_size)
+	{
+		return buddy_alloc(bmgr, size);
+	}
+
+	if (bmgr->numa_nodes > 0)
+	{
+		bmgr_t *pool;
+
+		for (int i = 0; ptr == NULL && (pool = get_preferred_pool(bmgr, i)) != NULL; i++)
+		{
+			ptr = buddy_alloc_aligned(pool, size, alignment);
+		}
+
+		return ptr;
+	}
+
+	/* Sampled block ends at a page boundary, so it starts aligned, as it's size is rounded up */
+	if (alignment <= guard_page_size() && guard_sampled(bmgr))
+	{
+		ptr = guard_alloc(bmgr, TYPEALIGN64(alignment, size));
+
+		if (ptr != NULL)
+		{
+			return ptr;
+		}
+	}
+
+	return alloc_aligned_internal(bmgr, size, alignment);
+}
+
+
+/* Aligned block of 'size' bytes (at most max_alloc_size), never sampled */
+static void *
+alloc_aligned_internal(bmgr_t *bmgr, size_t size, size_t alignment)
+{
+	size_t units = get_units(bmgr, size);
+	int	   szc	 = get_size_class(units);
+	int	   donor_szc;
+	void   *ptr;
+
+	if (alignment > get_size(bmgr, szc))
+	{
+		szc = log_2(alignment) - bmgr->log2_min_alloc_size;
+	}
+
+	ptr = get_donor_block(bmgr, szc, &donor_szc);
+
+	if (ptr != NULL)
+	{
+		carve_block(bmgr, ptr, donor_szc, units, true);
+		count_units(bmgr, units, 1, true);
+	}
+
+	return ptr;
+}
+
+
+/* Free memory region pointed by ptr of size 'size' */
+void
+buddy_free(bmgr_t *bmgr, void *ptr, size_t size)
+{
+	if (bmgr->numa_nodes > 0)
+	{
+		bmgr = get_owner(bmgr, ptr);
+	}
+
+	if (find_region(bmgr, ptr) < 0)
+	{
+		fprintf(stderr, "bmgr: Freeing invalid pointer");
+		abort();
+	}
+
+	if (guard_free(bmgr, ptr))
+	{
+		return;
+	}
+
+	if (size == 0 || (size > bmgr->max_alloc_size && !bmgr->spans))
+	{
+		return;
+	}
+
+	/* Chunks start at addresses aligned to max_alloc_size */
+	assert((uintptr_t) ptr % bmgr->min_alloc_size == 0);
+
+	if (size > bmgr->max_alloc_size)
+	{
+		buddy_free_span(bmgr, ptr, size);
+		return;
+	}
+
+	buddy_free_units(bmgr, ptr, get_units(bmgr, size));
+}
+
+
+/* Free a block allocated by buddy_alloc_units */
+void
+buddy_free_units(bmgr_t *bmgr, void *ptr, size_t units)
+{
+	int szc;
+
+	if (bmgr->numa_nodes > 0)
+	{
+		bmgr = get_owner(bmgr, ptr);
+	}
+
+	if (find_region(bmgr, ptr) < 0)
+	{
+		fprintf(stderr, "bmgr: Freeing invalid pointer");
+		abort();
+	}
+
+	if (guard_free(bmgr, ptr))
+	{
+		return;
+	}
+
+	if (units == 0 || units > bmgr->max_alloc_size >> bmgr->log2_min_alloc_size)
+	{
+		return;
+	}
+
+	szc = get_size_class(units);
+	count_units(bmgr, units, 1, false);
+
+	/*
+	 * A freed piece may be allocated again and freed by buddy_free_ptr right
+	 * away, which must not find it continued by pieces of this block. So the
+	 * pieces stop being continuations, before any of them is freed.
+	 */
+	if (units != (size_t) 1 << szc)
+	{
+		clear_continuations(bmgr, ptr, units);
+	}
+
+	/*
+	 * Walk the pieces, the block was carved into by buddy_alloc_internal, and
+	 * free them one by one. Last piece merges with the tail and with the pieces
+	 * freed before it.
+	 */
+	while (units != (size_t) 1 << szc)
+	{
+		size_t half = (size_t) 1 << --szc;
+
+		if (units > half)
+		{
+			buddy_free_internal(bmgr, ptr, szc);
+			ptr	   = (char *) ptr + get_size(bmgr, szc);
+			units -= half;
+		}
+	}
+
+	buddy_free_internal(bmgr, ptr, szc);
+}
+
+
+/*
+ * Free a block allocated by buddy_alloc, without knowing it's size. Size is
+ * recovered from the chunk's control block.
+ */
+void
+buddy_free_ptr(bmgr_t *bmgr, void *ptr)
+{
+	if (ptr == NULL)
+	{
+		return;
+	}
+
+	buddy_free(bmgr, ptr, buddy_usable_size(bmgr, ptr));
+}
+
+
+/*
+ * Usable size of a block allocated by buddy_alloc, i.e. the requested size
+ * rounded up to a multiple of min_alloc_size.
+ *
+ * A block is made of allocated nodes of decreasing size (see
+ * buddy_alloc_internal). Size class of the node starting at an address is the
+ * lowest level, having the bit of the node starting at the address set, and
+ * all but the first node are marked in the continuation bitmap of the chunk.
+ */
+size_t
+buddy_usable_size(bmgr_t *bmgr, void *ptr)
+{
+	buddy_ptr_t		bptr;
+	control_block_t control_block;
+	size_t			size = 0;
+	int				szc;
+
+	if (bmgr->numa_nodes > 0)
+	{
+		bmgr = get_owner(bmgr, ptr);
+	}
+
+	if (find_region(bmgr, ptr) < 0)
+	{
+		fprintf(stderr, "bmgr: Size of invalid pointer");
+		abort();
+	}
+
+	if ((size = guard_usable_size(bmgr, ptr)) > 0)
+	{
+		return size;
+	}
+
+	bptr		  = get_buddy_ptr(bmgr, ptr, 0);
+	control_block = get_control_block(bptr);
+
+	lock_control_block(bmgr, control_block);
+
+	do
+	{
+		szc = get_allocated_size_class(bmgr, control_block, bptr);
+
+		if (szc < 0)
+		{
+			fprintf(stderr, "bmgr: Size of invalid pointer");
+			abort();
+		}
+
+		/* Whole chunk may be the first one of a span */
+		if (szc == bmgr->num_size_classes - 1)
+		{
+			size += get_chunk_meta(bmgr, bptr.chunk_id)->run_length * bmgr->max_alloc_size;
+			break;
+		}
+
+		size			  += get_size(bmgr, szc);
+		bptr.chunk_offset += get_size(bmgr, szc);
+	} while (bptr.chunk_offset < bmgr->max_alloc_size &&
+			 bitmap_test(get_continuation_bitmap(bmgr, control_block), bptr.chunk_offset >>
+						 bmgr->log2_min_alloc_size));
+
+	unlock_control_block(bmgr, control_block);
+
+	return size;
+}
+
+
+/*
+ * Resize a block allocated by buddy_alloc.
+ *
+ * Block is shrunk in place, by giving it's tail back to free lists, and grown
+ * in place, if the memory after it is free and it's start is aligned enough
+ * for the new size. Otherwise contents are copied to a newly allocated block.
+ * Returns NULL and leaves the block alone, if there is no memory.
+ */
+void *
+buddy_realloc(bmgr_t *bmgr, void *ptr, size_t old_size, size_t new_size)
+{
+	size_t old_units;
+	size_t new_units;
+	void   *new_ptr;
+
+	if (ptr == NULL)
+	{
+		return buddy_alloc(bmgr, new_size);
+	}
+
+	if (new_size == 0)
+	{
+		buddy_free(bmgr, ptr, old_size);
+		return NULL;
+	}
+
+	if (new_size > bmgr->max_alloc_size && !bmgr->spans)
+	{
+		return NULL;
+	}
+
+	old_units = get_units(bmgr, old_size);
+	new_units = get_units(bmgr, new_size);
+
+	/* Spans are only resized in place, if # of chunks stays the same */
+	if (old_size > bmgr->max_alloc_size || new_size > bmgr->max_alloc_size)
+	{
+		if (old_size > bmgr->max_alloc_size && new_size > bmgr->max_alloc_size &&
+			get_span_chunks(bmgr, old_size) == get_span_chunks(bmgr, new_size))
+		{
+			return ptr;
+		}
+	}
+	else if (old_units == new_units ||
+			 (guard_usable_size(get_owner(bmgr, ptr), ptr) == 0 &&
+			  resize_in_place(get_owner(bmgr, ptr), ptr, old_units, new_units)))
+	{
+		return ptr;
+	}
+
+	new_ptr = buddy_alloc(bmgr, new_size);
+
+	if (new_ptr == NULL)
+	{
+		return NULL;
+	}
+
+	memcpy(new_ptr, ptr, Min(old_size, new_size));
+	buddy_free(bmgr, ptr, old_size);
+
+	return new_ptr;
+}
+
+
+/*
+ * Allocate up to 'num_blocks' blocks of 'size' bytes into 'blocks', returns
+ * # of blocks allocated (less than asked only if memory ran out).
+ *
+ * If size rounds up to a power of two of min_alloc_size units, many blocks are
+ * carved out of every free block split, instead of splitting per block.
+ */
+size_t
+buddy_alloc_bulk(bmgr_t *bmgr, size_t size, size_t num_blocks, void **blocks)
+{
+	size_t units;
+	size_t count = 0;
+
+	if (size == 0 || (size > bmgr->max_alloc_size && !bmgr->spans))
+	{
+		return 0;
+	}
+
+	if (bmgr->numa_nodes > 0)
+	{
+		bmgr_t *pool;
+
+		for (int i = 0; count < num_blocks && (pool = get_preferred_pool(bmgr, i)) != NULL; i++)
+		{
+			count += buddy_alloc_bulk(pool, size, num_blocks - count, blocks + count);
+		}
+
+		return count;
+	}
+
+	units = get_units(bmgr, size);
+
+	if (size > bmgr->max_alloc_size || (units & (units - 1)) != 0)
+	{
+		while (count < num_blocks && (blocks[count] = buddy_alloc(bmgr, size)) != NULL)
+		{
+			count++;
+		}
+
+		return count;
+	}
+
+	while (count < num_blocks)
+	{
+		size_t run = num_blocks - count;
+		size_t allocated;
+
+		/* A run ends before a sampled block, which gets a block of it's own */
+		if (atomic_load_explicit(&bmgr->guarded, memory_order_relaxed))
+		{
+			unsigned rate = atomic_load_explicit(&bmgr->guard_sample_rate, memory_order_relaxed);
+
+			if ((run = guard_unsampled_run(rate, run)) == 0)
+			{
+				guard_sample(rate);
+
+				if ((blocks[count] = guard_alloc(bmgr, size)) != NULL)
+				{
+					count++;
+					continue;
+				}
+
+				run = 1;
+			}
+		}
+
+		allocated = buddy_alloc_run(bmgr, get_size_class(units), run, blocks + count);
+
+		if (allocated == 0)
+		{
+			break;
+		}
+
+		count_units(bmgr, units, allocated, true);
+		count += allocated;
+	}
+
+	return count;
+}
+
+
+/*
+ * Free 'num_blocks' blocks, block i being of 'sizes[i]' bytes.
+ *
+ * Blocks are freed in address order, so that blocks of a chunk are freed one
+ * after the other and buddies are merged while the chunk's control block is
+ * hot. Control block of the next chunk is prefetched.
+ */
+void
+buddy_free_bulk(bmgr_t *bmgr, void **blocks, const size_t *sizes, size_t num_blocks)
+{
+	bulk_entry_t entries[BULK_FREE_BATCH];
+
+	for (size_t start = 0; start < num_blocks; start += BULK_FREE_BATCH)
+	{
+		size_t count = Min(num_blocks - start, BULK_FREE_BATCH);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			entries[i].ptr	= blocks[start + i];
+			entries[i].size = sizes[start + i];
+		}
+
+		qsort(entries, count, sizeof(bulk_entry_t), compare_bulk_entries);
+
+		for (size_t i = 0, end; i < count; i = end)
+		{
+			bmgr_t *owner;
+			size_t	chunk_id;
+
+			end = i + 1;
+
+			if (entries[i].ptr == NULL)
+			{
+				continue;
+			}
+
+			owner = get_owner(bmgr, entries[i].ptr);
+
+			if (!bulk_free_groupable(owner, &entries[i]))
+			{
+				buddy_free(bmgr, entries[i].ptr, entries[i].size);
+				continue;
+			}
+
+			/* Blocks of a chunk are next to each other, once sorted */
+			chunk_id = get_buddy_ptr(owner, entries[i].ptr, 0).chunk_id;
+
+			while (end < count && get_owner(bmgr, entries[end].ptr) == owner &&
+				   bulk_free_groupable(owner, &entries[end]) &&
+				   get_buddy_ptr(owner, entries[end].ptr, 0).chunk_id == chunk_id)
+			{
+				end++;
+			}
+
+			/* Next entry may be an invalid pointer, left for buddy_free to reject */
+			if (end < count)
+			{
+				bmgr_t *next_owner = get_owner(bmgr, entries[end].ptr);
+
+				if (bulk_free_groupable(next_owner, &entries[end]))
+				{
+					buddy_ptr_t next = get_buddy_ptr(next_owner, entries[end].ptr, 0);
+
+					__builtin_prefetch(get_control_block(next), 1);
+				}
+			}
+
+			free_chunk_group(owner, &entries[i], end - i);
+		}
+	}
+}
+
+
+/*
+ * Set purge policy of a buddy manager created with BMGR_PURGE: free blocks of
+ * at least 'min_purge_size' bytes (and free chunks) are purged with madvise
+ * 'advice', once their chunk has seen no frees for 'decay_ms' milliseconds.
+ *
+ * MADV_DONTNEED and MADV_FREE release private anonymous memory, memory of
+ * shared mappings needs MADV_REMOVE. BMGR_PURGE_ADVICE_DEFAULT uses MADV_REMOVE
+ * and switches to MADV_DONTNEED, once madvise reports a private mapping.
+ */
+void
+bmgr_set_purge_policy(bmgr_t *bmgr, size_t min_purge_size, unsigned decay_ms, int advice)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	for (int pool = 0; pool < numa_num_pools(bmgr); pool++)
+	{
+		bmgr_set_purge_policy(get_numa_pool(bmgr, pool), min_purge_size, decay_ms, advice);
+	}
+
+	bmgr->min_purge_size = min_purge_size < page_size ? page_size : min_purge_size;
+	bmgr->purge_decay_ms	= decay_ms;
+	bmgr->purge_advice_auto = advice == BMGR_PURGE_ADVICE_DEFAULT;
+	atomic_store_explicit(&bmgr->purge_advice, bmgr->purge_advice_auto ? DEFAULT_PURGE_ADVICE :
+						  advice, memory_order_relaxed);
+}
+
+
+/*
+ * Return idle free memory to the OS, returns # of bytes purged.
+ *
+ * Without BMGR_OUT_OF_BAND, first page of every free block holds it's free list
+ * node, so it is never purged.
+ */
+size_t
+bmgr_purge(bmgr_t *bmgr)
+{
+	size_t	 page_size = bmgr->page_mode == BMGR_PAGES_HUGETLB ? HUGE_PAGE_SIZE :
+						 (size_t) sysconf(_SC_PAGESIZE);
+	uint64_t now_ms	   = current_time_ms();
+	size_t	 purged	   = 0;
+
+	for (int pool = 0; pool < numa_num_pools(bmgr); pool++)
+	{
+		purged += bmgr_purge(get_numa_pool(bmgr, pool));
+	}
+
+	/* Pools of a NUMA buddy manager are purged above */
+	if (!bmgr->purge || bmgr->numa_nodes > 0)
+	{
+		return purged;
+	}
+
+	/* Deferred blocks look allocated, so they'd never be purged */
+	if (bmgr->lazy)
+	{
+		flush_deferred(bmgr);
+	}
+
+	/* Freed chunks may be after next_chunk_index, clean chunks are skipped cheaply */
+	for (int region = 0; region < atomic_load(&bmgr->num_regions); region++)
+	{
+		for (size_t i = 0; i < bmgr->regions[region].num_chunks; i++)
+		{
+			purged += purge_chunk(bmgr, CHUNK_ID(region, i), now_ms, page_size);
+		}
+	}
+
+	atomic_fetch_add_explicit(&bmgr->purged_bytes, purged, memory_order_relaxed);
+
+	return purged;
+}
+
+
+size_t
+bmgr_purged_bytes(bmgr_t *bmgr)
+{
+	size_t purged = atomic_load_explicit(&bmgr->purged_bytes, memory_order_relaxed);
+
+	for (int pool = 0; pool < numa_num_pools(bmgr); pool++)
+	{
+		purged += bmgr_purged_bytes(get_numa_pool(bmgr, pool));
+	}
+
+	return purged;
+}
+
+
+/*
+ * Place about one in 'rate' allocations against a guard page, 0 turns
+ * sampling off and gives quarantined blocks of the calling process back.
+ */
+void
+bmgr_set_guard_sample_rate(bmgr_t *bmgr, unsigned rate)
+{
+	for (int pool = 0; pool < numa_num_pools(bmgr); pool++)
+	{
+		bmgr_set_guard_sample_rate(get_numa_pool(bmgr, pool), rate);
+	}
+
+	atomic_store(&bmgr->guard_sample_rate, rate);
+
+	if (bmgr->numa_nodes > 0)
+	{
+		return;
+	}
+
+	if (rate == 0)
+	{
+		release_quarantine(bmgr, 0);
+		return;
+	}
+
+	lock_guards(bmgr);
+	update_guarded(bmgr);
+	unlock_guards(bmgr);
+}
+
+
+unsigned
+bmgr_guard_sample_rate(bmgr_t *bmgr)
+{
+	return atomic_load(&bmgr->guard_sample_rate);
+}
+
+
+/*
+ * Take a snapshot of statistics. Counters of a size class are read under it's
+ * lock and allocation counters are summed over stripes, so the snapshot is
+ * consistent only if nobody allocates meanwhile.
+ */
+void
+bmgr_get_stats(bmgr_t *bmgr, bmgr_stats_t *stats)
+{
+	size_t free_chunk_bytes;
+
+	if (bmgr->numa_nodes > 0)
+	{
+		numa_get_stats(bmgr, stats);
+		return;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->page_mode		= bmgr->page_mode;
+	stats->total_memory		= buddy_total_alloc_memory(bmgr);
+	stats->purged_bytes		= bmgr_purged_bytes(bmgr);
+	stats->num_size_classes = bmgr->num_size_classes;
+
+	for (int szc = 0; szc < bmgr->num_size_classes; szc++)
+	{
+		bmgr_size_class_stats_t *szc_stats = &stats->size_classes[szc];
+
+		size_class_t			*size_class = get_size_class_state(bmgr, szc);
+
+		szc_stats->block_size = get_size(bmgr, szc);
+
+		lock_size_class(bmgr, szc);
+		szc_stats->free_blocks		 = size_class->free_blocks + size_class->num_deferred;
+		szc_stats->deferred_blocks	 = size_class->num_deferred;
+		szc_stats->splits			 = size_class->splits;
+		szc_stats->merges			 = size_class->merges;
+		szc_stats->lock_acquisitions = size_class->acquisitions;
+		szc_stats->lock_contentions	 = size_class->contentions;
+		unlock_size_class(bmgr, szc);
+
+		for (int i = 0; i < STAT_STRIPES; i++)
+		{
+			block_counter_t *allocated = &get_block_counters(bmgr, i)[szc];
+
+			szc_stats->allocated_bytes	+= atomic_load_explicit(&allocated->bytes,
+																memory_order_relaxed);
+			szc_stats->allocated_blocks += atomic_load_explicit(&allocated->blocks,
+																memory_order_relaxed);
+		}
+
+		szc_stats->free_bytes	= szc_stats->free_blocks * szc_stats->block_size;
+		stats->allocated_bytes += szc_stats->allocated_bytes;
+		stats->free_bytes	   += szc_stats->free_bytes;
+	}
+
+	for (int i = 0; i < STAT_STRIPES; i++)
+	{
+		block_counter_t *allocated = &get_block_counters(bmgr, i)[SPAN_COUNTER(bmgr)];
+
+		stats->span_bytes += atomic_load_explicit(&allocated->bytes, memory_order_relaxed);
+		stats->spans	  += atomic_load_explicit(&allocated->blocks, memory_order_relaxed);
+	}
+
+	stats->allocated_bytes += stats->span_bytes;
+
+	get_guard_stats(bmgr, stats);
+
+	if (bmgr->concurrent)
+	{
+		slock_lock(&bmgr->chunk_lock);
+	}
+
+	stats->chunks_in_use	 = bmgr->num_chunks_used;
+	stats->max_chunks_in_use = bmgr->max_chunks_used;
+	free_chunk_bytes		 = (atomic_load(&bmgr->num_usable_chunks) - stats->chunks_in_use) *
+							   bmgr->max_alloc_size;
+
+	if (bmgr->concurrent)
+	{
+		slock_unlock(&bmgr->chunk_lock);
+	}
+
+	stats->free_bytes += free_chunk_bytes;
+
+	if (stats->free_bytes > 0)
+	{
+		stats->fragmentation = (double) (stats->free_bytes - free_chunk_bytes) /
+							   stats->free_bytes;
+	}
+}
+
+
+/*
+ * Core buddy alloc algorithm:
+ *  Find the smallest size class, that can hold 'units' min_alloc_size units
+ *  and has a free block, using the mask of non empty size classes.
+ *  If there is no such size class, allocate a full chunk.
+ *  Carve the block down to 'units' units (see carve_block).
+ */
+static void *
+buddy_alloc_internal(bmgr_t *bmgr, size_t units)
+{
+	int	 donor_szc;
+	void *ptr;
+
+	assert(units > 0);
+
+	ptr = get_donor_block(bmgr, get_size_class(units), &donor_szc);
+
+	if (ptr != NULL)
+	{
+		carve_block(bmgr, ptr, donor_szc, units, true);
+		count_units(bmgr, units, 1, true);
+	}
+
+	return ptr;
+}
+
+
+/*
+ * Allocate a free block of size class 'szc' or larger, returns NULL if there
+ * is none. The block is marked as allocated as a whole.
+ */
+static void *
+get_donor_block(bmgr_t *bmgr, int szc, int *donor_szc)
+{
+	void *ptr;
+
+	if (bmgr->lazy && (ptr = pop_deferred(bmgr, szc)) != NULL)
+	{
+		*donor_szc = szc;
+		return ptr;
+	}
+
+	ptr = pop_free_block(bmgr, szc, donor_szc);
+
+	/* Deferred blocks are coalesced only, when free lists run out */
+	if (ptr == NULL && bmgr->lazy && flush_deferred(bmgr) > 0)
+	{
+		ptr = pop_free_block(bmgr, szc, donor_szc);
+	}
+
+	if (ptr != NULL)
+	{
+		return ptr;
+	}
+
+	*donor_szc = bmgr->num_size_classes - 1;
+	ptr		   = chunk_alloc(bmgr);
+
+	if (ptr != NULL)
+	{
+		adjust_control_block(bmgr, ptr, *donor_szc, false);
+	}
+
+	return ptr;
+}
+
+
+/* Pop a block off the free list of the smallest non empty size class from 'szc' on */
+static void *
+pop_free_block(bmgr_t *bmgr, int szc, int *donor_szc)
+{
+	uint64_t candidates;
+	void	 *ptr;
+
+	candidates = atomic_load_explicit(&bmgr->nonempty_mask, memory_order_relaxed) &
+				 (~((uint64_t) 0) << szc);
+
+	/* Mask is only a hint without size class lock, so try next one, if it was a stale bit */
+	while (candidates)
+	{
+		*donor_szc = trailing_zeroes(candidates);
+
+		lock_size_class(bmgr, *donor_szc);
+
+		ptr = freelist_pop(bmgr, *donor_szc);
+
+		if (ptr)
+		{
+			adjust_control_block(bmgr, ptr, *donor_szc, false);
+			unlock_size_class(bmgr, *donor_szc);
+			return ptr;
+		}
+
+		unlock_size_class(bmgr, *donor_szc);
+		candidates &= candidates - 1;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Carve 'units' units out of the start of an allocated block of size class
+ * 'szc'. Descend from the block, until the remaining units fill a whole node:
+ *		If the units fit in the lower half, split the node and move the upper
+ *		half to freelist of it's size class.
+ *		Else the lower half is allocated whole and the rest of the units are
+ *		carved out of the upper half.
+ *
+ * So the units are made of one allocated node per set bit of 'units' and the
+ * unused tail is left in free lists, wasting less than min_alloc_size. Nodes
+ * after the first are marked as continuations, if the units form one block.
+ */
+static void
+carve_block(bmgr_t *bmgr, char *ptr, int szc, size_t units, bool continuation)
+{
+	char *block = ptr;
+
+	while (units != (size_t) 1 << szc)
+	{
+		size_t half = (size_t) 1 << --szc;
+
+		if (units <= half)
+		{
+			lock_size_class(bmgr, szc);
+			adjust_control_block(bmgr, block, szc, true);
+			unlock_size_class(bmgr, szc);
+			continue;
+		}
+
+		/* Neither half goes to a free list, so no size class lock is needed */
+		adjust_control_block(bmgr, block, szc, false);
+
+		if (continuation && block != ptr)
+		{
+			mark_continuation(bmgr, block, true);
+		}
+
+		block += get_size(bmgr, szc);
+		units -= half;
+		adjust_control_block(bmgr, block, szc, false);
+	}
+
+	if (continuation && block != ptr)
+	{
+		mark_continuation(bmgr, block, true);
+	}
+}
+
+
+/*
+ * Allocate up to 'num_blocks' blocks of size class 'szc' out of one free
+ * block, returns # of blocks allocated.
+ *
+ * Free blocks of the size class itself are popped under a single lock hold.
+ * Otherwise a larger block is carved into a run of allocated nodes (see
+ * carve_block), which are split down to the size class.
+ */
+static size_t
+buddy_alloc_run(bmgr_t *bmgr, int szc, size_t num_blocks, void **blocks)
+{
+	size_t count = 0;
+	size_t run;
+	char   *block;
+	int	   donor_szc;
+
+	while (bmgr->lazy && count < num_blocks && (blocks[count] = pop_deferred(bmgr, szc)) != NULL)
+	{
+		count++;
+	}
+
+	if (count > 0)
+	{
+		return count;
+	}
+
+	if (atomic_load_explicit(&bmgr->nonempty_mask, memory_order_relaxed) & ((uint64_t) 1 << szc))
+	{
+		lock_size_class(bmgr, szc);
+
+		while (count < num_blocks && (blocks[count] = freelist_pop(bmgr, szc)) != NULL)
+		{
+			adjust_control_block(bmgr, blocks[count++], szc, false);
+		}
+
+		unlock_size_class(bmgr, szc);
+
+		if (count > 0)
+		{
+			return count;
+		}
+	}
+
+	block = get_donor_block(bmgr, szc, &donor_szc);
+
+	if (block == NULL)
+	{
+		return 0;
+	}
+
+	run = Min(num_blocks, (size_t) 1 << (donor_szc - szc));
+
+	carve_block(bmgr, block, donor_szc, run << szc, false);
+
+	for (int node_szc = donor_szc; node_szc >= szc; node_szc--)
+	{
+		if (run & ((size_t) 1 << (node_szc - szc)))
+		{
+			split_into_leaves(bmgr, block, node_szc, szc);
+
+			for (size_t i = 0; i < (size_t) 1 << (node_szc - szc); i++)
+			{
+				blocks[count++]	 = block;
+				block			+= get_size(bmgr, szc);
+			}
+		}
+	}
+
+	assert(count == run);
+
+	return count;
+}
+
+
+/*
+ * Turn an allocated node of size class 'szc' into allocated nodes of size
+ * class 'leaf_szc', by marking every node of the subtree down to leaf_szc in
+ * use. Nothing goes to free lists.
+ */
+static void
+split_into_leaves(bmgr_t *bmgr, char *ptr, int szc, int leaf_szc)
+{
+	buddy_ptr_t		bptr		  = get_buddy_ptr(bmgr, ptr, szc);
+	control_block_t control_block = get_control_block(bptr);
+	uint8_t			*bitmap		  = get_bitmap(control_block);
+
+	lock_control_block(bmgr, control_block);
+
+	while (bptr.szc-- > leaf_szc)
+	{
+		size_t first = get_bitmap_index(bptr);
+		size_t last	 = first + ((size_t) 1 << (szc - bptr.szc));
+
+		for (size_t index = first; index < last; index++)
+		{
+			bitmap[index / 8] |= 1 << (index % 8);
+		}
+	}
+
+	unlock_control_block(bmgr, control_block);
+}
+
+
+/* Orders bulk_entry_t by address */
+static int
+compare_bulk_entries(const void *a, const void *b)
+{
+	uintptr_t ptr_a = (uintptr_t) ((const bulk_entry_t *) a)->ptr;
+	uintptr_t ptr_b = (uintptr_t) ((const bulk_entry_t *) b)->ptr;
+
+	return (ptr_a > ptr_b) - (ptr_a < ptr_b);
+}
+
+
+/*
+ * Can a block passed to buddy_free_bulk be freed with other blocks of it's
+ * chunk? Spans, sampled blocks and blocks of lazy buddy managers take the
+ * path of buddy_free, as do invalid pointers, which it rejects.
+ */
+static bool
+bulk_free_groupable(bmgr_t *bmgr, const bulk_entry_t *entry)
+{
+	return entry->size > 0 && entry->size <= bmgr->max_alloc_size && !bmgr->lazy &&
+		   find_region(bmgr, entry->ptr) >= 0 && !may_be_guarded(bmgr, entry->ptr);
+}
+
+
+/*
+ * Free blocks of a chunk, sorted by address, in one pass under a single hold
+ * of the chunk's bitmap lock and of the locks of size classes, that their
+ * nodes may merge in.
+ *
+ * Nodes of the blocks are freed in address order. A freed node, that may still
+ * merge with a node freed later (it's a left buddy, and later nodes lie in
+ * it's buddy), is kept pending instead of being pushed to a free list, so
+ * that nodes freed together are merged without going through free lists.
+ */
+static void
+free_chunk_group(bmgr_t *bmgr, const bulk_entry_t *entries, size_t count)
+{
+	buddy_ptr_t		first		  = get_buddy_ptr(bmgr, entries[0].ptr, 0);
+	control_block_t control_block = get_control_block(first);
+	uint64_t		*continuation = get_continuation_bitmap(bmgr, control_block);
+	int				max_szc		  = bmgr->num_size_classes - 1;
+	buddy_ptr_t		pending[MAX_SIZE_CLASSES];
+	int				num_pending	  = 0;
+	int				lo			  = max_szc;
+	bool			chunk_freed	  = false;
+	uint64_t		locked;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t units = get_units(bmgr, entries[i].size);
+
+		if (trailing_zeroes(units) < lo)
+		{
+			lo = trailing_zeroes(units);
+		}
+	}
+
+	/* Chunks are in no free list */
+	locked = (~((uint64_t) 0) << lo) & (((uint64_t) 1 << max_szc) - 1);
+
+	lock_size_classes(bmgr, locked);
+	lock_control_block(bmgr, control_block);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t		units = get_units(bmgr, entries[i].size);
+		buddy_ptr_t node  = get_buddy_ptr(bmgr, entries[i].ptr, 0);
+		size_t		start = node.chunk_offset;
+
+		count_units(bmgr, units, 1, false);
+
+		/* Nodes the block was carved into, largest first (see carve_block) */
+		for (int szc = max_szc; szc >= 0; szc--)
+		{
+			if (units & ((size_t) 1 << szc))
+			{
+				if (node.chunk_offset != start)
+				{
+					bitmap_clear(continuation, node.chunk_offset >> bmgr->log2_min_alloc_size);
+				}
+
+				node.szc	 = szc;
+				chunk_freed |= merge_group_node(bmgr, control_block, node, pending,
+												&num_pending);
+				node.chunk_offset += get_size(bmgr, szc);
+			}
+		}
+	}
+
+	for (int i = 0; i < num_pending; i++)
+	{
+		freelist_push(bmgr, control_block, pending[i]);
+	}
+
+	mark_chunk_dirty(bmgr, first);
+
+	unlock_control_block(bmgr, control_block);
+	unlock_size_classes(bmgr, locked);
+
+	if (chunk_freed)
+	{
+		chunk_free(bmgr, get_real_ptr(bmgr, first) - first.chunk_offset);
+	}
+}
+
+
+/*
+ * Mark a node freed by free_chunk_group as free and merge it with free
+ * buddies, returns true if the whole chunk is free.
+ */
+static bool
+merge_group_node(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t node, buddy_ptr_t
+				 *pending, int *num_pending)
+{
+	int max_szc = bmgr->num_size_classes - 1;
+
+	mark_as_free(control_block, node);
+
+	while (node.szc < max_szc)
+	{
+		buddy_ptr_t buddy = get_buddy(control_block, node);
+
+		/* Left buddy pending is the last pending node, pending nodes aren't in free lists */
+		if (*num_pending > 0 && pending[*num_pending - 1].szc == node.szc &&
+			pending[*num_pending - 1].chunk_offset == buddy.chunk_offset)
+		{
+			(*num_pending)--;
+		}
+		else if (block_is_free(control_block, buddy))
+		{
+			freelist_remove(bmgr, control_block, buddy);
+		}
+		else
+		{
+			break;
+		}
+
+		get_size_class_state(bmgr, node.szc)->merges++;
+
+		node.chunk_offset = Min(node.chunk_offset, buddy.chunk_offset);
+		node.szc++;
+		mark_as_free(control_block, node);
+	}
+
+	if (node.szc == max_szc)
+	{
+		assert(*num_pending == 0);
+		return true;
+	}
+
+	/* Nodes freed later lie after this node, so pending nodes, whose buddy they miss, are done */
+	while (*num_pending > 0)
+	{
+		buddy_ptr_t last		 = pending[*num_pending - 1];
+		size_t		buddy_offset = last.chunk_offset + get_size(bmgr, last.szc);
+
+		if (node.chunk_offset >= buddy_offset &&
+			node.chunk_offset < buddy_offset + get_size(bmgr, last.szc))
+		{
+			break;
+		}
+
+		freelist_push(bmgr, control_block, last);
+		(*num_pending)--;
+	}
+
+	/* Right buddy merges only with nodes before it */
+	if (node.chunk_offset & get_size(bmgr, node.szc))
+	{
+		freelist_push(bmgr, control_block, node);
+	}
+	else
+	{
+		pending[(*num_pending)++] = node;
+	}
+
+	return false;
+}
+
+
+/* Free a node of size class 'szc', deferring coalescing in lazy mode */
+static void
+buddy_free_internal(bmgr_t *bmgr, void *ptr, int szc)
+{
+	if (bmgr->lazy && szc < bmgr->num_size_classes - 1)
+	{
+		defer_block(bmgr, ptr, szc);
+		return;
+	}
+
+	coalesce_block(bmgr, ptr, szc);
+}
+
+
+/*
+ * Core buddy free algorithm:
+ *	Until the size class is maximum size class
+ *		If the buddy of current free block is also free, then
+ *			Merge two blocks and continue with the merged block.
+ *		Else
+ *			Push the block into freelist of current sizeclass and stop.
+ *	Free the entire chunk (block) of maximum size class
+ */
+static void
+coalesce_block(bmgr_t *bmgr, void *ptr, int szc)
+{
+	buddy_ptr_t		bptr;
+	control_block_t control_block;
+
+	assert(szc >= 0);
+	assert(ptr != NULL);
+
+	for (; szc != bmgr->num_size_classes - 1; szc++)
+	{
+		buddy_ptr_t buddy_bptr;
+
+		bptr		  = get_buddy_ptr(bmgr, ptr, szc);
+		control_block = get_control_block(bptr);
+
+		lock_size_class(bmgr, szc);
+		lock_control_block(bmgr, control_block);
+
+		assert(!both_free(control_block, bptr));
+
+		mark_as_free(control_block, bptr);
+		mark_chunk_dirty(bmgr, bptr);
+
+		buddy_bptr = get_buddy(control_block, bptr);
+
+		if (!block_is_free(control_block, buddy_bptr))
+		{
+			freelist_push(bmgr, control_block, bptr);
+
+			unlock_control_block(bmgr, control_block);
+			unlock_size_class(bmgr, szc);
+			return;
+		}
+
+		freelist_remove(bmgr, control_block, buddy_bptr);
+		get_size_class_state(bmgr, szc)->merges++;
+
+		/*
+		 * Nobody else can reach either of the buddies now, so merged block
+		 * can be freed without holding locks of current size class.
+		 */
+		unlock_control_block(bmgr, control_block);
+		unlock_size_class(bmgr, szc);
+
+		ptr = Min(ptr, get_real_ptr(bmgr, buddy_bptr));
+	}
+
+	bptr		  = get_buddy_ptr(bmgr, ptr, szc);
+	control_block = get_control_block(bptr);
+
+	lock_control_block(bmgr, control_block);
+	mark_as_free(control_block, bptr);
+	mark_chunk_dirty(bmgr, bptr);
+	unlock_control_block(bmgr, control_block);
+
+	chunk_free(bmgr, ptr);
+}
+
+
+/*
+ * Keep a freed node in the deferred buffer of it's size class (BMGR_LAZY). If
+ * the buffer is full, it's older half is coalesced, outside of the size class
+ * lock.
+ */
+static void
+defer_block(bmgr_t *bmgr, void *ptr, int szc)
+{
+	size_class_t *size_class   = get_size_class_state(bmgr, szc);
+	size_t		 capacity	   = get_deferred_capacity(bmgr, szc);
+	size_t		 num_released = 0;
+	ptrdiff_t	 released[MAX_DEFERRED_BLOCKS];
+
+	lock_size_class(bmgr, szc);
+
+	if (size_class->num_deferred == capacity)
+	{
+		num_released = capacity / 2;
+		memcpy(released, size_class->deferred, num_released * sizeof(ptrdiff_t));
+		memmove(size_class->deferred, size_class->deferred + num_released,
+				(capacity - num_released) * sizeof(ptrdiff_t));
+		size_class->num_deferred -= num_released;
+	}
+
+	if (size_class->num_deferred == 0)
+	{
+		atomic_fetch_or_explicit(&bmgr->deferred_mask, (uint64_t) 1 << szc, memory_order_relaxed);
+	}
+
+	size_class->deferred[size_class->num_deferred++] = (char *) ptr - (char *) bmgr;
+
+	unlock_size_class(bmgr, szc);
+
+	for (size_t i = 0; i < num_released; i++)
+	{
+		coalesce_block(bmgr, (char *) bmgr + released[i], szc);
+	}
+}
+
+
+/* Most recently deferred node of size class 'szc', NULL if there is none */
+static void *
+pop_deferred(bmgr_t *bmgr, int szc)
+{
+	size_class_t *size_class = get_size_class_state(bmgr, szc);
+	uint64_t	 bit		 = (uint64_t) 1 << szc;
+	void		 *ptr		 = NULL;
+
+	/* Mask is only a hint without size class lock */
+	if ((atomic_load_explicit(&bmgr->deferred_mask, memory_order_relaxed) & bit) == 0)
+	{
+		return NULL;
+	}
+
+	lock_size_class(bmgr, szc);
+
+	if (size_class->num_deferred > 0)
+	{
+		ptr = (char *) bmgr + size_class->deferred[--size_class->num_deferred];
+
+		if (size_class->num_deferred == 0)
+		{
+			atomic_fetch_and_explicit(&bmgr->deferred_mask, ~bit, memory_order_relaxed);
+		}
+	}
+
+	unlock_size_class(bmgr, szc);
+
+	return ptr;
+}
+
+
+/* Coalesce all deferred nodes, returns # of nodes coalesced */
+static size_t
+flush_deferred(bmgr_t *bmgr)
+{
+	uint64_t classes = atomic_load_explicit(&bmgr->deferred_mask, memory_order_relaxed);
+	size_t	 flushed = 0;
+
+	for (; classes != 0; classes &= classes - 1)
+	{
+		int			 szc		= trailing_zeroes(classes);
+		size_class_t *size_class = get_size_class_state(bmgr, szc);
+		size_t		 num_released;
+		ptrdiff_t	 released[MAX_DEFERRED_BLOCKS];
+
+		lock_size_class(bmgr, szc);
+
+		num_released = size_class->num_deferred;
+		memcpy(released, size_class->deferred, num_released * sizeof(ptrdiff_t));
+		size_class->num_deferred = 0;
+		atomic_fetch_and_explicit(&bmgr->deferred_mask, ~((uint64_t) 1 << szc),
+								  memory_order_relaxed);
+
+		unlock_size_class(bmgr, szc);
+
+		for (size_t i = 0; i < num_released; i++)
+		{
+			coalesce_block(bmgr, (char *) bmgr + released[i], szc);
+		}
+
+		flushed += num_released;
+	}
+
+	return flushed;
+}
+
+
+/* Deferred blocks of a size class take at most a chunk */
+static size_t
+get_deferred_capacity(bmgr_t *bmgr, int szc)
+{
+	size_t blocks_per_chunk = (size_t) 1 << (bmgr->num_size_classes - 1 - szc);
+
+	return Min(blocks_per_chunk, MAX_DEFERRED_BLOCKS);
+}
+
+
+/*
+ * Adjust control block for the given pointer.
+ *
+ * Caller must hold the lock of size class 'szc', if the block is split.
+ */
+static void
+adjust_control_block(bmgr_t *bmgr, void *ptr, int szc, bool split)
+{
+	buddy_ptr_t		bptr		  = get_buddy_ptr(bmgr, ptr, szc);
+	control_block_t control_block = get_control_block(bptr);
+
+	lock_control_block(bmgr, control_block);
+
+	mark_as_in_use(control_block, bptr);
+
+	/* If the block needs to be split, then push it's buddy into freelist */
+	if (split)
+	{
+		buddy_ptr_t buddy_bptr = get_buddy(control_block, bptr);
+
+		assert(block_is_free(control_block, buddy_bptr));
+
+		freelist_push(bmgr, control_block, buddy_bptr);
+		get_size_class_state(bmgr, szc)->splits++;
+	}
+
+	unlock_control_block(bmgr, control_block);
+
+	wait_for_purge(bmgr, bptr);
+}
+
+
+/* Mark the node starting at 'ptr' as continuation of the node before it */
+static void
+mark_continuation(bmgr_t *bmgr, void *ptr, bool continuation)
+{
+	buddy_ptr_t		bptr		  = get_buddy_ptr(bmgr, ptr, 0);
+	control_block_t control_block = get_control_block(bptr);
+	uint64_t		*bitmap		  = get_continuation_bitmap(bmgr, control_block);
+	size_t			unit		  = bptr.chunk_offset >> bmgr->log2_min_alloc_size;
+
+	lock_control_block(bmgr, control_block);
+
+	if (continuation)
+	{
+		bitmap_set(bitmap, unit);
+	}
+	else
+	{
+		bitmap_clear(bitmap, unit);
+	}
+
+	unlock_control_block(bmgr, control_block);
+}
+
+
+/* Clear continuation bits of the nodes of a block of 'units' units at 'ptr' */
+static void
+clear_continuations(bmgr_t *bmgr, void *ptr, size_t units)
+{
+	buddy_ptr_t		bptr		  = get_buddy_ptr(bmgr, ptr, 0);
+	control_block_t control_block = get_control_block(bptr);
+	uint64_t		*bitmap		  = get_continuation_bitmap(bmgr, control_block);
+	size_t			unit		  = bptr.chunk_offset >> bmgr->log2_min_alloc_size;
+
+	lock_control_block(bmgr, control_block);
+
+	/* Nodes are the set bits of 'units', largest first (see carve_block) */
+	for (int szc = bmgr->num_size_classes - 1; szc >= 0; szc--)
+	{
+		if (units & ((size_t) 1 << szc))
+		{
+			if (unit != bptr.chunk_offset >> bmgr->log2_min_alloc_size)
+			{
+				bitmap_clear(bitmap, unit);
+			}
+
+			unit += (size_t) 1 << szc;
+		}
+	}
+
+	unlock_control_block(bmgr, control_block);
+}
+
+
+/*
+ * Turn a block of 'old_units' units into a block of 'new_units' units at the
+ * same address, returns false if that is not possible.
+ *
+ * Nodes of the old block are released (merging with their free buddies) and
+ * nodes of the new block are claimed out of the resulting free blocks, like
+ * buddy_alloc_internal would carve them. Only locks of the size classes, whose
+ * free lists may change, are held (see get_resize_size_classes). They are
+ * found with the bitmap lock held, but are taken before it, so they are looked
+ * up again after locking, until no more are needed.
+ *
+ * Free list nodes are written at the start of released and split blocks.
+ * Within the block, those are the starts of old and new nodes, so they are
+ * saved and restored.
+ */
+static bool
+resize_in_place(bmgr_t *bmgr, void *ptr, size_t old_units, size_t new_units)
+{
+	buddy_ptr_t		bptr		  = get_buddy_ptr(bmgr, ptr, 0);
+	control_block_t control_block = get_control_block(bptr);
+	size_t			start_unit	  = bptr.chunk_offset >> bmgr->log2_min_alloc_size;
+	size_t			chunk_units	  = (size_t) 1 << (bmgr->num_size_classes - 1);
+	saved_node_t	saved[2 * MAX_SIZE_CLASSES];
+	int				num_saved	  = 0;
+	uint64_t		needed, locked;
+	size_t			offset;
+
+	/* Largest node of the new block must start at ptr, and the block can't leave the chunk */
+	if (start_unit + new_units > chunk_units ||
+		(start_unit & (((size_t) 1 << log_2(new_units)) - 1)) != 0)
+	{
+		return false;
+	}
+
+	lock_control_block(bmgr, control_block);
+	needed = get_resize_size_classes(bmgr, control_block, bptr, old_units, new_units);
+	unlock_control_block(bmgr, control_block);
+
+	for (;;)
+	{
+		locked = needed;
+
+		lock_size_classes(bmgr, locked);
+		lock_control_block(bmgr, control_block);
+
+		needed = get_resize_size_classes(bmgr, control_block, bptr, old_units, new_units);
+
+		if ((needed & ~locked) == 0)
+		{
+			break;
+		}
+
+		unlock_control_block(bmgr, control_block);
+		unlock_size_classes(bmgr, locked);
+		needed |= locked;
+	}
+
+	if (new_units > old_units)
+	{
+		buddy_ptr_t tail = bptr;
+
+		tail.chunk_offset += old_units << bmgr->log2_min_alloc_size;
+
+		if (!range_is_free(bmgr, control_block, tail, new_units - old_units))
+		{
+			unlock_control_block(bmgr, control_block);
+			unlock_size_classes(bmgr, locked);
+			return false;
+		}
+
+		/* Free list nodes are written into the tail, purger needs no lock to finish */
+		wait_for_purge(bmgr, bptr);
+	}
+
+	if (!bmgr->out_of_band)
+	{
+		size_t kept = Min(old_units, new_units) << bmgr->log2_min_alloc_size;
+
+		num_saved = save_node_starts(bmgr, ptr, old_units, kept, saved, num_saved);
+		num_saved = save_node_starts(bmgr, ptr, new_units, kept, saved, num_saved);
+	}
+
+	/* Nodes of a block are the set bits of it's # of units, largest first */
+	offset = bptr.chunk_offset;
+
+	for (int szc = bmgr->num_size_classes - 1; szc >= 0; szc--)
+	{
+		if (old_units & ((size_t) 1 << szc))
+		{
+			buddy_ptr_t node = bptr;
+
+			node.chunk_offset = offset;
+			node.szc		  = szc;
+
+			bitmap_clear(get_continuation_bitmap(bmgr, control_block), offset >>
+						 bmgr->log2_min_alloc_size);
+			release_node(bmgr, control_block, node);
+			offset += get_size(bmgr, szc);
+		}
+	}
+
+	offset = bptr.chunk_offset;
+
+	for (int szc = bmgr->num_size_classes - 1; szc >= 0; szc--)
+	{
+		if (new_units & ((size_t) 1 << szc))
+		{
+			buddy_ptr_t node = bptr;
+
+			node.chunk_offset = offset;
+			node.szc		  = szc;
+
+			claim_node(bmgr, control_block, node);
+
+			if (offset != bptr.chunk_offset)
+			{
+				bitmap_set(get_continuation_bitmap(bmgr, control_block), offset >>
+						   bmgr->log2_min_alloc_size);
+			}
+
+			offset += get_size(bmgr, szc);
+		}
+	}
+
+	for (int i = 0; i < num_saved; i++)
+	{
+		*saved[i].at = saved[i].contents;
+	}
+
+	if (new_units < old_units)
+	{
+		mark_chunk_dirty(bmgr, bptr);
+	}
+
+	unlock_control_block(bmgr, control_block);
+	unlock_size_classes(bmgr, locked);
+
+	count_units(bmgr, old_units, 1, false);
+	count_units(bmgr, new_units, 1, true);
+
+	return true;
+}
+
+
+/*
+ * Save the first bytes of nodes of a block of 'units' units at 'ptr', which
+ * start within the first 'kept' bytes of the block. Returns new # of saved.
+ */
+static int
+save_node_starts(bmgr_t *bmgr, char *ptr, size_t units, size_t kept, saved_node_t *saved, int
+				 num_saved)
+{
+	size_t offset = 0;
+
+	for (int szc = bmgr->num_size_classes - 1; szc >= 0 && offset < kept; szc--)
+	{
+		if (units & ((size_t) 1 << szc))
+		{
+			saved[num_saved].at		  = (olist_node *) (ptr + offset);
+			saved[num_saved].contents = *saved[num_saved].at;
+			num_saved++;
+
+			offset += get_size(bmgr, szc);
+		}
+	}
+
+	return num_saved;
+}
+
+
+/* Are all 'units' units starting at 'bptr' (size class ignored) in free blocks? */
+static bool
+range_is_free(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr, size_t units)
+{
+	size_t end = bptr.chunk_offset + (units << bmgr->log2_min_alloc_size);
+	size_t offset;
+
+	for (offset = bptr.chunk_offset; offset < end;)
+	{
+		buddy_ptr_t node = bptr;
+
+		/* Descend from the root to the free block containing offset */
+		node.chunk_offset = 0;
+		node.szc		  = bmgr->num_size_classes - 1;
+
+		while (!block_is_free(control_block, node))
+		{
+			buddy_ptr_t left = node;
+			buddy_ptr_t right;
+
+			if (node.szc == 0)
+			{
+				return false;
+			}
+
+			left.szc			= node.szc - 1;
+			right				= get_buddy(control_block, left);
+
+			/* Allocated node */
+			if (block_is_free(control_block, left) && block_is_free(control_block, right))
+			{
+				return false;
+			}
+
+			node = offset < right.chunk_offset ? left : right;
+		}
+
+		offset = node.chunk_offset + get_size(bmgr, node.szc);
+	}
+
+	return true;
+}
+
+
+/*
+ * Size classes, whose free lists resize_in_place may change, as a mask.
+ * Caller holds the bitmap lock of the chunk.
+ *
+ * Released and claimed nodes lie in the smallest node covering both blocks,
+ * so merges and splits are confined to it and to the free blocks, it merges
+ * with once all of it is free: size classes from the smallest node of either
+ * block up to the largest such free block.
+ */
+static uint64_t
+get_resize_size_classes(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr, size_t
+						old_units, size_t new_units)
+{
+	size_t		units = old_units > new_units ? old_units : new_units;
+	size_t		end	  = bptr.chunk_offset + (units << bmgr->log2_min_alloc_size);
+	int			lo	  = trailing_zeroes(old_units | new_units);
+	buddy_ptr_t cover = bptr;
+
+	cover.szc		   = lo;
+	cover.chunk_offset = bptr.chunk_offset & ~(get_size(bmgr, lo) - 1);
+
+	while (cover.chunk_offset + get_size(bmgr, cover.szc) < end)
+	{
+		cover.szc++;
+		cover.chunk_offset &= ~(get_size(bmgr, cover.szc) - 1);
+	}
+
+	/* Ancestors of the cover are in use, so a buddy not in use is a free block */
+	while (cover.szc < bmgr->num_size_classes - 1 &&
+		   block_is_free(control_block, get_buddy(control_block, cover)))
+	{
+		cover.szc++;
+		cover.chunk_offset &= ~(get_size(bmgr, cover.szc) - 1);
+	}
+
+	return (~((uint64_t) 0) << lo) & (~((uint64_t) 0) >> (BITS_PER_WORD - 1 - cover.szc));
+}
+
+
+/*
+ * Free an allocated node, merging it with free buddies. Caller holds locks of
+ * the size classes it may merge in and the bitmap lock of the chunk.
+ *
+ * A chunk is never freed, the caller claims nodes in it right away.
+ */
+static void
+release_node(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr)
+{
+	for (;;)
+	{
+		buddy_ptr_t buddy_bptr;
+
+		mark_as_free(control_block, bptr);
+
+		if (bptr.szc == bmgr->num_size_classes - 1)
+		{
+			return;
+		}
+
+		buddy_bptr = get_buddy(control_block, bptr);
+
+		if (!block_is_free(control_block, buddy_bptr))
+		{
+			freelist_push(bmgr, control_block, bptr);
+			return;
+		}
+
+		freelist_remove(bmgr, control_block, buddy_bptr);
+		get_size_class_state(bmgr, bptr.szc)->merges++;
+
+		bptr.chunk_offset = Min(bptr.chunk_offset, buddy_bptr.chunk_offset);
+		bptr.szc++;
+	}
+}
+
+
+/*
+ * Allocate a node lying in a free block, by splitting the free block down to
+ * the node. Caller holds locks of the size classes it may split in and the
+ * bitmap lock of the chunk.
+ */
+static void
+claim_node(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr)
+{
+	buddy_ptr_t block = bptr;
+
+	assert(block_is_free(control_block, bptr));
+
+	/* Find the free block, it's the highest free ancestor */
+	while (block.szc < bmgr->num_size_classes - 1)
+	{
+		buddy_ptr_t parent = block;
+
+		parent.szc++;
+		parent.chunk_offset &= ~(get_size(bmgr, parent.szc) - 1);
+
+		if (!block_is_free(control_block, parent))
+		{
+			break;
+		}
+
+		block = parent;
+	}
+
+	/* Whole chunk is released only in the middle of resize_in_place and isn't in any list */
+	if (block.szc < bmgr->num_size_classes - 1)
+	{
+		freelist_remove(bmgr, control_block, block);
+	}
+
+	while (block.szc > bptr.szc)
+	{
+		buddy_ptr_t child = block;
+
+		mark_as_in_use(control_block, block);
+
+		child.szc--;
+
+		if (bptr.chunk_offset >= child.chunk_offset + get_size(bmgr, child.szc))
+		{
+			child.chunk_offset += get_size(bmgr, child.szc);
+		}
+
+		freelist_push(bmgr, control_block, get_buddy(control_block, child));
+		get_size_class_state(bmgr, child.szc)->splits++;
+		block = child;
+	}
+
+	mark_as_in_use(control_block, bptr);
+}
+
+
+/*
+ * Size class of the allocated node starting at 'bptr' (size class of bptr is
+ * ignored), -1 if there is no such node.
+ *
+ * All nodes below an allocated node are free, so it is the lowest node in use
+ * among the nodes starting at the address.
+ */
+static int
+get_allocated_size_class(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr)
+{
+	int max_szc = bmgr->num_size_classes - 1;
+
+	/* Size class of the largest node starting at the address */
+	if (bptr.chunk_offset != 0)
+	{
+		max_szc = Min(max_szc, trailing_zeroes(bptr.chunk_offset) - bmgr->log2_min_alloc_size);
+	}
+
+	for (bptr.szc = 0; bptr.szc <= max_szc; bptr.szc++)
+	{
+		if (!block_is_free(control_block, bptr))
+		{
+			return bptr.szc;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * Free lists of size classes.
+ *
+ * Push and remove are called with bitmap lock of the block's chunk held, all
+ * of them need the lock of the size class.
+ */
+static void *
+freelist_pop(bmgr_t *bmgr, int szc)
+{
+	olist_head *list = &bmgr->chunk_free_lists[szc];
+	void	   *ptr;
+
+	if (bmgr->out_of_band)
+	{
+		return oob_freelist_pop(bmgr, szc);
+	}
+
+	if (olist_is_empty(bmgr, list))
+	{
+		return NULL;
+	}
+
+	ptr = NODE_TO_PTR(olist_pop_head_node(bmgr, list));
+	get_size_class_state(bmgr, szc)->free_blocks--;
+
+	if (olist_is_empty(bmgr, list))
+	{
+		clear_nonempty(bmgr, szc);
+	}
+
+	return ptr;
+}
+
+
+static void
+freelist_push(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr)
+{
+	olist_head *list = &bmgr->chunk_free_lists[bptr.szc];
+
+	if (bmgr->out_of_band)
+	{
+		oob_freelist_push(bmgr, control_block, bptr);
+		return;
+	}
+
+	if (olist_is_empty(bmgr, list))
+	{
+		set_nonempty(bmgr, bptr.szc);
+	}
+
+	olist_push_head(bmgr, list, PTR_TO_NODE(get_real_ptr(bmgr, bptr)));
+	get_size_class_state(bmgr, bptr.szc)->free_blocks++;
+}
+
+
+static void
+freelist_remove(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr)
+{
+	olist_head *list = &bmgr->chunk_free_lists[bptr.szc];
+
+	if (bmgr->out_of_band)
+	{
+		oob_freelist_remove(bmgr, control_block, bptr);
+		return;
+	}
+
+	olist_delete(bmgr, PTR_TO_NODE(get_real_ptr(bmgr, bptr)));
+	get_size_class_state(bmgr, bptr.szc)->free_blocks--;
+
+	if (olist_is_empty(bmgr, list))
+	{
+		clear_nonempty(bmgr, bptr.szc);
+	}
+}
+
+
+/*
+ * Out of band free lists: find the first chunk having a free block of the size
+ * class in the summary bitmaps of the regions and the first free block of the
+ * size class in the chunk's free bitmap. With BMGR_ADDRESS_ORDERED, the chunk
+ * at the lowest address is taken, otherwise the first one of the earliest
+ * region.
+ */
+static void *
+oob_freelist_pop(bmgr_t *bmgr, int szc)
+{
+	int				num_regions = atomic_load_explicit(&bmgr->num_regions, memory_order_acquire);
+	uint64_t		*free_bitmap;
+	control_block_t control_block;
+	buddy_ptr_t		bptr;
+	size_t			level_start;
+	size_t			level_end;
+	size_t			index;
+
+	/* Free chunks are handed out by chunk_alloc */
+	if (get_size_class_state(bmgr, szc)->free_blocks == 0 || szc == bmgr->num_size_classes - 1)
+	{
+		return NULL;
+	}
+
+	bptr.bmgr	  = bmgr;
+	bptr.szc	  = szc;
+	bptr.chunk_id = NO_CHUNK;
+
+	for (int i = 0; i < num_regions; i++)
+	{
+		region_t *region = &bmgr->regions[i];
+		size_t	 index	 = bitmap_find_first(get_summary(bmgr, region, szc), 0,
+											 region->num_chunks);
+
+		if (index < region->num_chunks && (bptr.chunk_id == NO_CHUNK ||
+										   get_chunk_address(bmgr, CHUNK_ID(i, index)) <
+										   get_chunk_address(bmgr, bptr.chunk_id)))
+		{
+			bptr.chunk_id = CHUNK_ID(i, index);
+
+			if (!bmgr->address_ordered)
+			{
+				break;
+			}
+		}
+	}
+
+	assert(bptr.chunk_id != NO_CHUNK);
+
+	control_block = get_control_block(bptr);
+	free_bitmap	  = get_free_bitmap(bmgr, control_block);
+	level_start	  = get_level_start(bmgr, szc);
+	level_end	  = 2 * level_start + 1;
+
+	lock_control_block(bmgr, control_block);
+
+	index = bitmap_find_first(free_bitmap, level_start, level_end);
+	assert(index < level_end);
+
+	bptr.chunk_offset = (index - level_start) * get_size(bmgr, szc);
+	oob_freelist_remove(bmgr, control_block, bptr);
+
+	unlock_control_block(bmgr, control_block);
+
+	return get_real_ptr(bmgr, bptr);
+}
+
+
+static void
+oob_freelist_push(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr)
+{
+	bitmap_set(get_free_bitmap(bmgr, control_block), get_bitmap_index(bptr));
+	bitmap_set(get_summary(bmgr, get_region(bmgr, bptr.chunk_id), bptr.szc),
+			   CHUNK_INDEX(bptr.chunk_id));
+
+	if (get_size_class_state(bmgr, bptr.szc)->free_blocks++ == 0)
+	{
+		set_nonempty(bmgr, bptr.szc);
+	}
+}
+
+
+static void
+oob_freelist_remove(bmgr_t *bmgr, control_block_t control_block, buddy_ptr_t bptr)
+{
+	uint64_t *free_bitmap = get_free_bitmap(bmgr, control_block);
+	size_t	 level_start  = get_level_start(bmgr, bptr.szc);
+	size_t	 level_end	  = 2 * level_start + 1;
+
+	bitmap_clear(free_bitmap, get_bitmap_index(bptr));
+
+	if (--get_size_class_state(bmgr, bptr.szc)->free_blocks == 0)
+	{
+		clear_nonempty(bmgr, bptr.szc);
+	}
+
+	/* Was it the last free block of it's size class in the chunk? */
+	if (bitmap_find_first(free_bitmap, level_start, level_end) == level_end)
+	{
+		bitmap_clear(get_summary(bmgr, get_region(bmgr, bptr.chunk_id), bptr.szc),
+					 CHUNK_INDEX(bptr.chunk_id));
+	}
+}
+
+
+static int
+get_num_size_classes(size_t min_alloc_size, size_t max_alloc_size)
+{
+	if (min_alloc_size < 16 || max_alloc_size <= min_alloc_size)
+	{
+		return 0;
+	}
+
+	int log2_min = log_2(min_alloc_size);
+	int log2_max = log_2(max_alloc_size);
+
+	/* Check if max_alloc_size and min_alloc_size are power of two */
+	if (((1 << log2_max) != max_alloc_size) || ((1 << log2_min) != min_alloc_size))
+	{
+		return 0;
+	}
+
+	return log2_max - log2_min + 1;
+}
+
+
+/*
+ * Bytes of buddy manager state kept with metadata of the first region: a
+ * size_class_t per size class, STAT_STRIPES stripes of allocation counters,
+ * then the guard slots.
+ */
+static size_t
+get_state_size(int num_size_classes)
+{
+	return num_size_classes * sizeof(size_class_t) + STAT_STRIPES *
+		   get_stat_stripe_size(num_size_classes) + GUARD_SLOTS * sizeof(guard_slot_t);
+}
+
+
+/* Bytes of a stripe: a counter per size class and one for spans, padded to a cache line */
+static size_t
+get_stat_stripe_size(int num_size_classes)
+{
+	return CACHEALIGN((num_size_classes + 1) * sizeof(block_counter_t));
+}
+
+
+/*
+ * Control block of a chunk is made of it's lock, bitmap of nodes in use, free
+ * bitmap (out of band mode) and continuation bitmap, which has a bit per
+ * min_alloc_size unit of the chunk.
+ */
+static size_t
+get_control_block_size(size_t min_alloc_size, size_t max_alloc_size, bool out_of_band)
+{
+	/* Out of band free bitmap follows the bitmap of blocks in use */
+	return BMGR_CONTROL_BLOCK_SIZE(min_alloc_size, max_alloc_size, out_of_band);
+}
+
+
+/* Size of the bitmap of nodes in use (and of the free bitmap) */
+static size_t
+get_bitmap_size(size_t min_alloc_size, size_t max_alloc_size)
+{
+	return BMGR_BITMAP_SIZE(min_alloc_size, max_alloc_size);
+}
+
+
+/* Allocate a chunk from managed memory region */
+static void *
+chunk_alloc(bmgr_t *bmgr)
+{
+	void *chunk = span_alloc(bmgr, 1);
+
+#ifdef USE_ASSERT_CHECKING
+
+	if (chunk)
+	{
+		buddy_ptr_t		bptr		  = get_buddy_ptr(bmgr, chunk, bmgr->num_size_classes - 1);
+		uint8_t			*bitmap		  = get_bitmap(get_control_block(bptr));
+
+		for (size_t i = 0; i < bmgr->control_block_size - CONTROL_BLOCK_HEADER_SIZE; i++)
+		{
+			assert(bitmap[i] == 0);
+		}
+	}
+
+#endif /* USE_ASSERT_CHECKING */
+
+	return chunk;
+}
+
+
+static void
+chunk_free(bmgr_t *bmgr, void *ptr)
+{
+	assert(ptr != NULL);
+	assert(get_buddy_ptr(bmgr, ptr, 0).chunk_offset == 0);
+
+	span_free(bmgr, ptr);
+}
+
+
+/*
+ * Allocate a span of 'num_chunks' contiguous chunks, out of the free runs or
+ * the never allocated chunks of the first region having enough of them.
+ * Returns NULL if there is no such span.
+ */
+static void *
+span_alloc(bmgr_t *bmgr, size_t num_chunks)
+{
+	size_t start;
+
+	if (bmgr->concurrent)
+	{
+		slock_lock(&bmgr->chunk_lock);
+	}
+
+	start = run_take(bmgr, num_chunks);
+
+	for (int i = 0; start == NO_CHUNK && i < atomic_load(&bmgr->num_regions); i++)
+	{
+		region_t *region = &bmgr->regions[i];
+
+		if (num_chunks <= region->num_chunks - region->next_chunk_index)
+		{
+			start					  = CHUNK_ID(i, region->next_chunk_index);
+			region->next_chunk_index += num_chunks;
+		}
+	}
+
+	if (start != NO_CHUNK)
+	{
+		get_chunk_meta(bmgr, start)->run_length	 = num_chunks;
+		bmgr->num_chunks_used					+= num_chunks;
+
+		if (bmgr->num_chunks_used > bmgr->max_chunks_used)
+		{
+			bmgr->max_chunks_used = bmgr->num_chunks_used;
+		}
+	}
+
+	if (bmgr->concurrent)
+	{
+		slock_unlock(&bmgr->chunk_lock);
+	}
+
+	if (start == NO_CHUNK)
+	{
+		return NULL;
+	}
+
+	return get_chunk_address(bmgr, start);
+}
+
+
+/* Free a span allocated by span_alloc */
+static void
+span_free(bmgr_t *bmgr, void *ptr)
+{
+	size_t start = get_buddy_ptr(bmgr, ptr, 0).chunk_id;
+
+	if (bmgr->concurrent)
+	{
+		slock_lock(&bmgr->chunk_lock);
+	}
+
+	bmgr->num_chunks_used -= get_chunk_meta(bmgr, start)->run_length;
+	run_free(bmgr, start, get_chunk_meta(bmgr, start)->run_length);
+
+	if (bmgr->concurrent)
+	{
+		slock_unlock(&bmgr->chunk_lock);
+	}
+}
+
+
+/*
+ * Allocate a block larger than max_alloc_size (BMGR_SPANS). Every chunk of the
+ * span is marked as allocated as a whole, so purge and buddy_usable_size see
+ * them as in use.
+ */
+static void *
+buddy_alloc_span(bmgr_t *bmgr, size_t size)
+{
+	size_t num_chunks = get_span_chunks(bmgr, size);
+	char   *span	  = span_alloc(bmgr, num_chunks);
+
+	if (span == NULL)
+	{
+		return NULL;
+	}
+
+	for (size_t i = 0; i < num_chunks; i++)
+	{
+		adjust_control_block(bmgr, span + i * bmgr->max_alloc_size, bmgr->num_size_classes - 1,
+							 false);
+	}
+
+	count_blocks(bmgr, SPAN_COUNTER(bmgr), num_chunks * bmgr->max_alloc_size, 1, true);
+
+	return span;
+}
+
+
+static void
+buddy_free_span(bmgr_t *bmgr, void *ptr, size_t size)
+{
+	size_t num_chunks = get_span_chunks(bmgr, size);
+
+	assert(get_buddy_ptr(bmgr, ptr, 0).chunk_offset == 0);
+
+	for (size_t i = 0; i < num_chunks; i++)
+	{
+		buddy_ptr_t		bptr		  = get_buddy_ptr(bmgr, (char *) ptr + i *
+													  bmgr->max_alloc_size,
+													  bmgr->num_size_classes - 1);
+		control_block_t control_block = get_control_block(bptr);
+
+		lock_control_block(bmgr, control_block);
+		mark_as_free(control_block, bptr);
+		mark_chunk_dirty(bmgr, bptr);
+		unlock_control_block(bmgr, control_block);
+	}
+
+	assert(get_chunk_meta(bmgr, get_buddy_ptr(bmgr, ptr, 0).chunk_id)->run_length == num_chunks);
+
+	count_blocks(bmgr, SPAN_COUNTER(bmgr), num_chunks * bmgr->max_alloc_size, 1, false);
+	span_free(bmgr, ptr);
+}
+
+
+/*
+ * Take a run of 'num_chunks' chunks out of the free runs, returns index of
+ * it's first chunk or NO_CHUNK. Caller holds chunk_lock. Rest of the run goes
+ * back to the bins.
+ */
+static size_t
+run_take(bmgr_t *bmgr, size_t num_chunks)
+{
+	size_t start = bmgr->address_ordered ? run_find_lowest(bmgr, num_chunks) :
+				   run_find_fit(bmgr, num_chunks);
+	size_t length;
+
+	if (start == NO_CHUNK)
+	{
+		return NO_CHUNK;
+	}
+
+	length = get_chunk_meta(bmgr, start)->run_length;
+
+	run_remove(bmgr, start);
+
+	if (length > num_chunks)
+	{
+		run_insert(bmgr, start + num_chunks, length - num_chunks);
+	}
+
+	return start;
+}
+
+
+/*
+ * Free run of at least 'num_chunks' chunks, returns NO_CHUNK if there is none.
+ *
+ * Runs in the bin of num_chunks may be shorter, so the bin is searched for the
+ * first fit. Any run of a larger bin fits, so the smallest non empty one is
+ * used.
+ */
+static size_t
+run_find_fit(bmgr_t *bmgr, size_t num_chunks)
+{
+	int		 bin = log_2(num_chunks);
+	uint64_t larger_bins;
+
+	if (bmgr->run_bin_mask & ((uint64_t) 1 << bin))
+	{
+		for (size_t run = bmgr->run_bins[bin]; run != 0; run = get_chunk_meta(bmgr, run - 1)->next_run)
+		{
+			if (get_chunk_meta(bmgr, run - 1)->run_length >= num_chunks)
+			{
+				return run - 1;
+			}
+		}
+	}
+
+	larger_bins = bmgr->run_bin_mask & ~((((uint64_t) 2) << bin) - 1);
+
+	if (larger_bins != 0)
+	{
+		return bmgr->run_bins[trailing_zeroes(larger_bins)] - 1;
+	}
+
+	return NO_CHUNK;
+}
+
+
+/*
+ * Lowest free run of at least 'num_chunks' chunks (BMGR_ADDRESS_ORDERED),
+ * returns NO_CHUNK if there is none. Bins aren't ordered by address, so every
+ * run of the bins, that may hold a fitting run, is looked at.
+ */
+static size_t
+run_find_lowest(bmgr_t *bmgr, size_t num_chunks)
+{
+	uint64_t bins  = bmgr->run_bin_mask & ~((((uint64_t) 1) << log_2(num_chunks)) - 1);
+	size_t	 start = NO_CHUNK;
+
+	for (; bins != 0; bins &= bins - 1)
+	{
+		size_t run = bmgr->run_bins[trailing_zeroes(bins)];
+
+		for (; run != 0; run = get_chunk_meta(bmgr, run - 1)->next_run)
+		{
+			if (get_chunk_meta(bmgr, run - 1)->run_length < num_chunks)
+			{
+				continue;
+			}
+
+			/* Regions need not be in address order */
+			if (start == NO_CHUNK || get_chunk_address(bmgr, run - 1) < get_chunk_address(bmgr, start))
+			{
+				start = run - 1;
+			}
+		}
+	}
+
+	return start;
+}
+
+
+/*
+ * Give a run of chunks back, merging it with free runs before and after it in
+ * it's region. Caller holds chunk_lock.
+ */
+static void
+run_free(bmgr_t *bmgr, size_t start, size_t length)
+{
+	region_t *region = get_region(bmgr, start);
+
+	/* Chunk before a freed run is either in use, or the last chunk of a free run */
+	if (CHUNK_INDEX(start) > 0 && get_chunk_meta(bmgr, start - 1)->run_boundary)
+	{
+		size_t prev_length = get_chunk_meta(bmgr, start - 1)->run_length;
+
+		start  -= prev_length;
+		length += prev_length;
+		run_remove(bmgr, start);
+	}
+
+	if (CHUNK_INDEX(start) + length < region->next_chunk_index &&
+		get_chunk_meta(bmgr, start + length)->run_boundary)
+	{
+		size_t next_length = get_chunk_meta(bmgr, start + length)->run_length;
+
+		run_remove(bmgr, start + length);
+		length += next_length;
+	}
+
+	if (CHUNK_INDEX(start) + length == region->next_chunk_index)
+	{
+		region->next_chunk_index = CHUNK_INDEX(start);
+		return;
+	}
+
+	run_insert(bmgr, start, length);
+}
+
+
+static void
+run_insert(bmgr_t *bmgr, size_t start, size_t length)
+{
+	chunk_meta_t *first = get_chunk_meta(bmgr, start);
+	chunk_meta_t *last	= get_chunk_meta(bmgr, start + length - 1);
+	int			 bin	= log_2(length);
+
+	first->run_length	= last->run_length = length;
+	first->run_boundary = last->run_boundary = true;
+
+	first->prev_run = 0;
+	first->next_run = bmgr->run_bins[bin];
+
+	if (bmgr->run_bins[bin] != 0)
+	{
+		get_chunk_meta(bmgr, bmgr->run_bins[bin] - 1)->prev_run = start + 1;
+	}
+
+	bmgr->run_bins[bin]	 = start + 1;
+	bmgr->run_bin_mask	|= (uint64_t) 1 << bin;
+}
+
+
+static void
+run_remove(bmgr_t *bmgr, size_t start)
+{
+	chunk_meta_t *first	 = get_chunk_meta(bmgr, start);
+	size_t		 length	 = first->run_length;
+	chunk_meta_t *last	 = get_chunk_meta(bmgr, start + length - 1);
+	int			 bin	 = log_2(length);
+
+	if (first->prev_run != 0)
+	{
+		get_chunk_meta(bmgr, first->prev_run - 1)->next_run = first->next_run;
+	}
+	else
+	{
+		bmgr->run_bins[bin] = first->next_run;
+	}
+
+	if (first->next_run != 0)
+	{
+		get_chunk_meta(bmgr, first->next_run - 1)->prev_run = first->prev_run;
+	}
+
+	if (bmgr->run_bins[bin] == 0)
+	{
+		bmgr->run_bin_mask &= ~((uint64_t) 1 << bin);
+	}
+
+	first->run_boundary = last->run_boundary = false;
+}
+
+
+/* # of chunks of a span of 'size' bytes */
+static size_t
+get_span_chunks(bmgr_t *bmgr, size_t size)
+{
+	return (size + bmgr->max_alloc_size - 1) >> bmgr->log2_max_alloc_size;
+}
+
+
+/* Should this allocation be placed against a guard page? */
+static bool
+guard_sampled(bmgr_t *bmgr)
+{
+	return atomic_load_explicit(&bmgr->guarded, memory_order_relaxed) &&
+		   guard_sample(atomic_load_explicit(&bmgr->guard_sample_rate, memory_order_relaxed));
+}
+
+
+/*
+ * Allocate 'size' bytes in a block of their own, followed by an inaccessible
+ * guard page, so that the usable size ends right at the guard page. Returns
+ * NULL, if the block can't be set up, the caller allocates as usual then.
+ */
+static void *
+guard_alloc(bmgr_t *bmgr, size_t size)
+{
+	size_t		 page_size	 = guard_page_size();
+	size_t		 usable_size = get_units(bmgr, size) << bmgr->log2_min_alloc_size;
+	size_t		 data_size	 = TYPEALIGN64(page_size, usable_size);
+	size_t		 block_size	 = data_size + page_size;
+	guard_slot_t *slot		 = NULL;
+	char		 *block;
+
+	/* Part of a huge page can't be protected */
+	if (bmgr->page_mode == BMGR_PAGES_HUGETLB || block_size > bmgr->max_alloc_size)
+	{
+		return NULL;
+	}
+
+	block = alloc_aligned_internal(bmgr, block_size, page_size);
+
+	if (block == NULL)
+	{
+		return NULL;
+	}
+
+	if (!guard_protect(block + data_size, page_size, false))
+	{
+		buddy_free(bmgr, block, block_size);
+		return NULL;
+	}
+
+	lock_guards(bmgr);
+
+	for (int i = 0; i < GUARD_SLOTS && slot == NULL; i++)
+	{
+		if (get_guard_slot(bmgr, i)->state == GUARD_SLOT_FREE)
+		{
+			slot = get_guard_slot(bmgr, i);
+		}
+	}
+
+	if (slot == NULL)
+	{
+		unlock_guards(bmgr);
+		guard_protect(block + data_size, page_size, true);
+		buddy_free(bmgr, block, block_size);
+		return NULL;
+	}
+
+	slot->state		   = GUARD_SLOT_LIVE;
+	slot->owner		   = getpid();
+	slot->block_offset = block - (char *) bmgr;
+	slot->ptr_offset   = slot->block_offset + data_size - usable_size;
+	slot->block_size   = block_size;
+	slot->usable_size  = usable_size;
+
+	atomic_fetch_add(&get_chunk_meta(bmgr, get_buddy_ptr(bmgr, block, 0).chunk_id)->guarded_blocks,
+					 1);
+	atomic_store(&bmgr->guarded, true);
+
+	unlock_guards(bmgr);
+
+	return (char *) bmgr + slot->ptr_offset;
+}
+
+
+/*
+ * Free 'ptr', if it is a sampled block: make the whole block inaccessible and
+ * quarantine it. Returns false, if it is not a sampled block.
+ */
+static bool
+guard_free(bmgr_t *bmgr, void *ptr)
+{
+	guard_slot_t *slot;
+	int			 i;
+
+	if (!may_be_guarded(bmgr, ptr))
+	{
+		return false;
+	}
+
+	lock_guards(bmgr);
+
+	if ((i = find_guard_slot(bmgr, ptr)) < 0)
+	{
+		unlock_guards(bmgr);
+		return false;
+	}
+
+	slot = get_guard_slot(bmgr, i);
+
+	/* Double free or a pointer into the block */
+	if (slot->state != GUARD_SLOT_LIVE || (char *) ptr != (char *) bmgr + slot->ptr_offset)
+	{
+		fprintf(stderr, "bmgr: Freeing invalid pointer");
+		abort();
+	}
+
+	slot->state		= GUARD_SLOT_QUARANTINED;
+	slot->freed_seq = bmgr->guard_free_seq++;
+
+	if (slot->owner == getpid())
+	{
+		guard_protect((char *) bmgr + slot->block_offset, slot->block_size, false);
+	}
+
+	unlock_guards(bmgr);
+
+	release_quarantine(bmgr, GUARD_QUARANTINE);
+
+	return true;
+}
+
+
+/* Usable size of a sampled block, 0 if 'ptr' is not one */
+static size_t
+guard_usable_size(bmgr_t *bmgr, void *ptr)
+{
+	size_t size = 0;
+	int	   i;
+
+	if (!may_be_guarded(bmgr, ptr))
+	{
+		return 0;
+	}
+
+	lock_guards(bmgr);
+
+	if ((i = find_guard_slot(bmgr, ptr)) >= 0)
+	{
+		guard_slot_t *slot = get_guard_slot(bmgr, i);
+
+		if (slot->state != GUARD_SLOT_LIVE || (char *) ptr != (char *) bmgr + slot->ptr_offset)
+		{
+			fprintf(stderr, "bmgr: Size of invalid pointer");
+			abort();
+		}
+
+		size = slot->usable_size;
+	}
+
+	unlock_guards(bmgr);
+
+	return size;
+}
+
+
+/* Lock free check, that 'ptr' may be in a sampled block, so that others skip the slots */
+static bool
+may_be_guarded(bmgr_t *bmgr, void *ptr)
+{
+	chunk_meta_t *meta;
+
+	if (!atomic_load_explicit(&bmgr->guarded, memory_order_relaxed))
+	{
+		return false;
+	}
+
+	meta = get_chunk_meta(bmgr, get_buddy_ptr(bmgr, ptr, 0).chunk_id);
+
+	return atomic_load_explicit(&meta->guarded_blocks, memory_order_relaxed) > 0;
+}
+
+
+/* Slot of the sampled block containing 'ptr', -1 if none (guard_lock held) */
+static int
+find_guard_slot(bmgr_t *bmgr, const void *ptr)
+{
+	for (int i = 0; i < GUARD_SLOTS; i++)
+	{
+		guard_slot_t *slot	= get_guard_slot(bmgr, i);
+		char		 *block = (char *) bmgr + slot->block_offset;
+
+		if (slot->state != GUARD_SLOT_FREE && (const char *) ptr >= block &&
+			(const char *) ptr < block + slot->block_size)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * Give quarantined blocks of the calling process back to the buddy manager,
+ * all but the 'keep' most recently freed ones.
+ */
+static void
+release_quarantine(bmgr_t *bmgr, int keep)
+{
+	pid_t pid = getpid();
+
+	for (;;)
+	{
+		guard_slot_t *oldest	  = NULL;
+		int			 quarantined = 0;
+		char		 *block;
+		size_t		 block_size;
+
+		lock_guards(bmgr);
+
+		for (int i = 0; i < GUARD_SLOTS; i++)
+		{
+			guard_slot_t *slot = get_guard_slot(bmgr, i);
+
+			if (slot->state == GUARD_SLOT_QUARANTINED && slot->owner == pid)
+			{
+				quarantined++;
+
+				if (oldest == NULL || slot->freed_seq < oldest->freed_seq)
+				{
+					oldest = slot;
+				}
+			}
+		}
+
+		if (quarantined <= keep)
+		{
+			update_guarded(bmgr);
+			unlock_guards(bmgr);
+			return;
+		}
+
+		block		  = (char *) bmgr + oldest->block_offset;
+		block_size	  = oldest->block_size;
+		oldest->state = GUARD_SLOT_FREE;
+		atomic_fetch_sub(&get_chunk_meta(bmgr, get_buddy_ptr(bmgr, block, 0).chunk_id)->
+						 guarded_blocks, 1);
+
+		unlock_guards(bmgr);
+
+		/* Block is not in a slot any more, so it's freed as a regular one */
+		guard_protect(block, block_size, true);
+		buddy_free(bmgr, block, block_size);
+	}
+}
+
+
+/* Make sampled blocks of the calling process accessible, slots are left as they are */
+static void
+unprotect_guarded(bmgr_t *bmgr)
+{
+	pid_t pid = getpid();
+
+	for (int pool = 0; pool < numa_num_pools(bmgr); pool++)
+	{
+		unprotect_guarded(get_numa_pool(bmgr, pool));
+	}
+
+	if (bmgr->numa_nodes > 0)
+	{
+		return;
+	}
+
+	lock_guards(bmgr);
+
+	for (int i = 0; i < GUARD_SLOTS; i++)
+	{
+		guard_slot_t *slot = get_guard_slot(bmgr, i);
+
+		if (slot->state != GUARD_SLOT_FREE && slot->owner == pid)
+		{
+			guard_protect((char *) bmgr + slot->block_offset, slot->block_size, true);
+		}
+	}
+
+	unlock_guards(bmgr);
+}
+
+
+/*
+ * Count sampled blocks, live or quarantined, in 'stats'. Their blocks are
+ * allocated ones to the size classes, so only the usable size of a live block
+ * is left in allocated bytes, the rest is moved to guard_bytes.
+ */
+static void
+get_guard_stats(bmgr_t *bmgr, bmgr_stats_t *stats)
+{
+	lock_guards(bmgr);
+
+	for (int i = 0; i < GUARD_SLOTS; i++)
+	{
+		guard_slot_t			*slot = get_guard_slot(bmgr, i);
+		size_t					block_units;
+		bmgr_size_class_stats_t *szc_stats;
+
+		if (slot->state == GUARD_SLOT_FREE)
+		{
+			continue;
+		}
+
+		block_units = get_units(bmgr, slot->block_size);
+		szc_stats	= &stats->size_classes[get_size_class(block_units)];
+
+		szc_stats->allocated_bytes	-= block_units << bmgr->log2_min_alloc_size;
+		szc_stats->allocated_blocks -= 1;
+		stats->allocated_bytes		-= block_units << bmgr->log2_min_alloc_size;
+		stats->guard_bytes			+= block_units << bmgr->log2_min_alloc_size;
+		stats->guarded_blocks++;
+
+		if (slot->state == GUARD_SLOT_LIVE)
+		{
+			szc_stats = &stats->size_classes[get_size_class(get_units(bmgr, slot->usable_size))];
+
+			szc_stats->allocated_bytes	+= slot->usable_size;
+			szc_stats->allocated_blocks += 1;
+			stats->allocated_bytes		+= slot->usable_size;
+			stats->guard_bytes			-= slot->usable_size;
+		}
+	}
+
+	unlock_guards(bmgr);
+}
+
+
+/* Recompute guarded (guard_lock held) */
+static void
+update_guarded(bmgr_t *bmgr)
+{
+	bool guarded = atomic_load(&bmgr->guard_sample_rate) != 0;
+
+	for (int i = 0; i < GUARD_SLOTS && !guarded; i++)
+	{
+		guarded = get_guard_slot(bmgr, i)->state != GUARD_SLOT_FREE;
+	}
+
+	atomic_store(&bmgr->guarded, guarded);
+}
+
+
+static void
+lock_guards(bmgr_t *bmgr)
+{
+	if (bmgr->concurrent)
+	{
+		slock_lock(&bmgr->guard_lock);
+	}
+}
+
+
+static void
+unlock_guards(bmgr_t *bmgr)
+{
+	if (bmgr->concurrent)
+	{
+		slock_unlock(&bmgr->guard_lock);
+	}
+}
+
+
+/* Remember that a block was freed in the chunk, caller holds the chunk's bitmap lock */
+static void
+mark_chunk_dirty(bmgr_t *bmgr, buddy_ptr_t bptr)
+{
+	if (bmgr->purge)
+	{
+		chunk_meta_t *meta = get_chunk_meta(bmgr, bptr.chunk_id);
+
+		meta->idle_since_ms = current_time_ms();
+		meta->dirty			= true;
+	}
+}
+
+
+/*
+ * Purge free blocks of a dirty chunk, that has been idle long enough.
+ *
+ * Free ranges are collected under the bitmap lock of the chunk and madvise'd
+ * after releasing it, in batches of PURGE_BATCH ranges. Meanwhile, purging of
+ * the chunk is non zero, so that an allocator, that takes a block out of a
+ * range, waits for the range to be purged, before it touches the block (see
+ * wait_for_purge). Frees and other allocations of the chunk go on.
+ */
+static size_t
+purge_chunk(bmgr_t *bmgr, size_t chunk_id, uint64_t now_ms, size_t page_size)
+{
+	chunk_meta_t	*meta = get_chunk_meta(bmgr, chunk_id);
+	control_block_t control_block;
+	buddy_ptr_t		bptr;
+	purge_batch_t	batch;
+	size_t			purged = 0;
+	bool			done   = false;
+
+	bptr.bmgr		  = bmgr;
+	bptr.chunk_id	  = chunk_id;
+	bptr.chunk_offset = 0;
+	bptr.szc		  = bmgr->num_size_classes - 1;
+	control_block	  = get_control_block(bptr);
+
+	lock_control_block(bmgr, control_block);
+
+	if (!meta->dirty || now_ms - meta->idle_since_ms < bmgr->purge_decay_ms)
+	{
+		unlock_control_block(bmgr, control_block);
+		return 0;
+	}
+
+	meta->dirty	 = false;
+	batch.resume = 0;
+
+	while (!done)
+	{
+		batch.num_ranges = 0;
+		done			 = collect_purge_ranges(bmgr, bptr, page_size, &batch);
+
+		if (batch.num_ranges > 0)
+		{
+			atomic_fetch_add_explicit(&meta->purging, 1, memory_order_relaxed);
+		}
+
+		unlock_control_block(bmgr, control_block);
+
+		for (int i = 0; i < batch.num_ranges; i++)
+		{
+			purged += purge_range(bmgr, batch.ranges[i].start, batch.ranges[i].size);
+		}
+
+		if (batch.num_ranges > 0)
+		{
+			atomic_fetch_sub_explicit(&meta->purging, 1, memory_order_release);
+		}
+
+		if (!done)
+		{
+			lock_control_block(bmgr, control_block);
+		}
+	}
+
+	return purged;
+}
+
+
+/*
+ * Collect free blocks in the subtree of 'bptr' into 'batch', returns false if
+ * the batch is full, before the subtree is done.
+ *
+ * A node is a free block, if it isn't in use and it's parent is split. A node
+ * in use is split, if any of it's children are in use, otherwise it is an
+ * allocated block.
+ */
+static bool
+collect_purge_ranges(bmgr_t *bmgr, buddy_ptr_t bptr, size_t page_size, purge_batch_t *batch)
+{
+	control_block_t control_block = get_control_block(bptr);
+	buddy_ptr_t		left, right;
+
+	if (bptr.chunk_offset + get_size(bmgr, bptr.szc) <= batch->resume)
+	{
+		return true;
+	}
+
+	if (block_is_free(control_block, bptr))
+	{
+		/* Block merged with one collected by an earlier batch, it's chunk is dirty again */
+		if (bptr.chunk_offset < batch->resume)
+		{
+			return true;
+		}
+
+		if (batch->num_ranges == PURGE_BATCH)
+		{
+			batch->resume = bptr.chunk_offset;
+			return false;
+		}
+
+		add_purge_range(bmgr, bptr, page_size, batch);
+		return true;
+	}
+
+	if (bptr.szc == 0 || get_size(bmgr, bptr.szc - 1) < bmgr->min_purge_size)
+	{
+		return true;
+	}
+
+	left				= bptr;
+	left.szc			= bptr.szc - 1;
+	right				= left;
+	right.chunk_offset += get_size(bmgr, left.szc);
 
-	size_t min_alloc_size;
-	size_t max_alloc_size;
-	int	   log2_min_alloc_size;
-	int	   log2_max_alloc_size;
+	/* Allocated block */
+	if (block_is_free(control_block, left) && block_is_free(control_block, right))
+	{
+		return true;
+	}
 
-	void	   *chunk_start;      /* start of allocatable memory region */
-	size_t	   num_usable_chunks; /* max chunks that can be allocated */
-	size_t	   num_chunks_used;   /* # of chunks that are currently allocated */
-	size_t	   next_chunk_index;  /* Index of next free chunk in memory region */
-	dlist_head free_chunks;       /* Freelist chunks */
+	return collect_purge_ranges(bmgr, left, page_size, batch) &&
+		   collect_purge_ranges(bmgr, right, page_size, batch);
+}
 
-	int		   num_size_classes;                   /* Max size classes */
-	dlist_head chunk_free_lists[MAX_SIZE_CLASSES]; /* Freelist of blocks per size class */
-};
 
-/* Information needed to manipulate buddy control block for a given pointer */
-typedef struct
+/* Add the whole pages of a free block to 'batch', merging with the previous range */
+static void
+add_purge_range(bmgr_t *bmgr, buddy_ptr_t bptr, size_t page_size, purge_batch_t *batch)
 {
-	size_t chunk_id;     /* Id of chunk containing the pointer */
-	size_t chunk_offset; /* Offset of pointer within the chunk */
-	bmgr_t *bmgr;        /* Buddy manger containing the pointer */
-	int	   szc;          /* sizeclass of this pointer */
-} buddy_ptr_t;
-
-static int	  log_2(size_t n);
-static int	  get_num_size_classes(size_t min_alloc_size, size_t max_alloc_size);
-static size_t get_control_block_size(size_t min_alloc_size, size_t max_alloc_size);
+	char *block = get_real_ptr(bmgr, bptr);
+	char *start = block;
+	char *end	= block + get_size(bmgr, bptr.szc);
 
-static void *chunk_alloc(bmgr_t *bmgr);
-static void chunk_free(bmgr_t *bmgr, void *ptr);
+	/* Free list node lives in the first page of the block, free chunks are tracked out of band */
+	if (!bmgr->out_of_band && bptr.szc < bmgr->num_size_classes - 1)
+	{
+		start += sizeof(olist_node);
+	}
 
-static void *buddy_alloc_internal(bmgr_t *bmgr, int szc);
-static void buddy_free_internal(bmgr_t *bmgr, void *ptr, int szc);
-static void adjust_control_block(bmgr_t *bmgr, void *ptr, int szc, bool split);
+	start = (char *) TYPEALIGN64(page_size, start);
+	end	  = (char *) ((uintptr_t) end & ~((uintptr_t) page_size - 1));
 
-static buddy_ptr_t get_buddy_ptr(bmgr_t *bmgr, void *ptr, int szc);
-static void		   *get_real_ptr(bmgr_t *bmgr, buddy_ptr_t bptr);
+	if (start >= end)
+	{
+		return;
+	}
 
-static int	  get_size_class(bmgr_t *bmgr, size_t size);
-static size_t get_size(bmgr_t *bmgr, int szc);
+	if (batch->num_ranges > 0 &&
+		batch->ranges[batch->num_ranges - 1].start + batch->ranges[batch->num_ranges - 1].size ==
+		start)
+	{
+		batch->ranges[batch->num_ranges - 1].size += end - start;
+		return;
+	}
 
-static control_block_t get_control_block(buddy_ptr_t bptr);
-static size_t		   get_bitmap_index(buddy_ptr_t bptr);
-static void			   mark_as_in_use(control_block_t control_block, buddy_ptr_t bptr);
-static void			   mark_as_free(control_block_t control_block, buddy_ptr_t bptr);
-static bool			   block_is_free(control_block_t control_block, buddy_ptr_t bptr);
-static bool			   both_free(control_block_t control_block, buddy_ptr_t bptr);
-static buddy_ptr_t	   get_buddy(control_block_t control_block, buddy_ptr_t bptr);
+	batch->ranges[batch->num_ranges].start = start;
+	batch->ranges[batch->num_ranges].size  = end - start;
+	batch->num_ranges++;
+}
 
-#define TOGGLE_BIT(val, bit) (val ^ (1 << bit))
 
-bmgr_t *
-bmgr_create(size_t min_alloc_size, size_t max_alloc_size, void *memory_region, size_t mem_size)
+/* madvise a range with the purge advice, returns # of bytes purged */
+static size_t
+purge_range(bmgr_t *bmgr, char *start, size_t size)
 {
-	bmgr_t	  *bmgr = memory_region;
-	size_t	  max_usable_chunks;
-	ptrdiff_t usable_mem_size;
-	size_t	  mem_used;
-
-	assert(bmgr != NULL);
-
-	max_usable_chunks = mem_size / max_alloc_size;
-	mem_used		  = sizeof(bmgr_t);
+	int advice = atomic_load_explicit(&bmgr->purge_advice, memory_order_relaxed);
 
-	if (mem_size <= mem_used)
+	if (madvise(start, size, advice) == 0)
 	{
-		return NULL;
+		return size;
 	}
 
-	bmgr->memory_region		   = memory_region;
-	bmgr->total_memory_managed = mem_size;
-	bmgr->min_alloc_size	   = min_alloc_size;
-	bmgr->max_alloc_size	   = max_alloc_size;
-	bmgr->log2_min_alloc_size  = log_2(min_alloc_size);
-	bmgr->log2_max_alloc_size  = log_2(max_alloc_size);
-	bmgr->num_chunks_used	   = 0;
-	bmgr->next_chunk_index	   = 0;
-	bmgr->num_size_classes	   = get_num_size_classes(min_alloc_size, max_alloc_size);
-	bmgr->control_block_size   = get_control_block_size(min_alloc_size, max_alloc_size);
-	bmgr->control_block		   = (control_block_t) ((char *) memory_region + sizeof(bmgr_t));
-	mem_used				  += bmgr->control_block_size * max_usable_chunks;
-
-	if (bmgr->control_block_size == 0 || mem_size <= mem_used)
+	/* MADV_REMOVE fails for private mappings, which MADV_DONTNEED releases */
+	if (bmgr->purge_advice_auto && advice != MADV_DONTNEED && (errno == EINVAL || errno == EACCES))
 	{
-		return NULL;
+		atomic_store_explicit(&bmgr->purge_advice, MADV_DONTNEED, memory_order_relaxed);
+
+		return madvise(start, size, MADV_DONTNEED) == 0 ? size : 0;
 	}
 
-	/* Align chunk_start to max_alloc_size, so that start of chunk is efficiently computed via bit manipulations */
-	bmgr->chunk_start = (void *) TYPEALIGN64(max_alloc_size, (char *) bmgr->control_block +
-											 max_usable_chunks * bmgr->control_block_size);
+	return 0;
+}
 
-	for (int i = 0; i < bmgr->num_size_classes; i++)
+
+/*
+ * Wait until ranges of the chunk of 'bptr' collected by purge_chunk are
+ * purged. Called by allocators after taking a block out of the free blocks of
+ * the chunk, before the block is written.
+ */
+static void
+wait_for_purge(bmgr_t *bmgr, buddy_ptr_t bptr)
+{
+	chunk_meta_t *meta;
+
+	if (!bmgr->purge)
 	{
-		dlist_init(&bmgr->chunk_free_lists[i]);
+		return;
 	}
 
-	/* Size of alloca'ble memory region */
-	usable_mem_size = ((char *) memory_region + mem_size) - (char *) bmgr->chunk_start;
+	meta = get_chunk_meta(bmgr, bptr.chunk_id);
 
-	if (usable_mem_size > 0)
+	while (atomic_load_explicit(&meta->purging, memory_order_acquire) != 0)
 	{
-		bmgr->num_usable_chunks = usable_mem_size / max_alloc_size;
+		sched_yield();
 	}
+}
 
-	memset(bmgr->control_block, 0, bmgr->num_usable_chunks * bmgr->control_block_size);
-
-	dlist_init(&bmgr->free_chunks);
 
-	return bmgr;
+static size_class_t *
+get_size_class_state(bmgr_t *bmgr, int szc)
+{
+	return (size_class_t *) ((char *) bmgr + bmgr->size_classes_offset) + szc;
 }
 
 
-size_t
-buddy_total_alloc_memory(bmgr_t *bmgr)
+/* Allocation counters of stripe 'stripe' */
+static block_counter_t *
+get_block_counters(bmgr_t *bmgr, int stripe)
 {
-	return bmgr->num_usable_chunks * bmgr->max_alloc_size;
+	return (block_counter_t *) ((char *) bmgr + bmgr->stat_stripes_offset +
+								stripe * bmgr->stat_stripe_size);
 }
 
 
-/* Allocate memory region of size 'size' */
-void *
-buddy_alloc(bmgr_t *bmgr, size_t size)
+static guard_slot_t *
+get_guard_slot(bmgr_t *bmgr, int i)
 {
-	if (size < bmgr->min_alloc_size || size > bmgr->max_alloc_size)
-	{
-		return NULL;
-	}
+	return (guard_slot_t *) ((char *) bmgr + bmgr->guard_slots_offset) + i;
+}
 
-	return buddy_alloc_internal(bmgr, get_size_class(bmgr, size));
+
+static chunk_meta_t *
+get_chunk_meta(bmgr_t *bmgr, size_t chunk_id)
+{
+	return (chunk_meta_t *) ((char *) bmgr + get_region(bmgr, chunk_id)->chunk_meta_offset) +
+		   CHUNK_INDEX(chunk_id);
 }
 
 
-/* Free memory region pointed by ptr of size 'size' */
-void
-buddy_free(bmgr_t *bmgr, void *ptr, size_t size)
+static uint64_t
+current_time_ms(void)
 {
-	if (ptr < bmgr->chunk_start || ptr > bmgr->memory_region + bmgr->total_memory_managed)
-	{
-		fprintf(stderr, "bmgr: Freeing invalid pointer");
-		abort();
-	}
+	struct timespec ts;
 
-	if (size < bmgr->min_alloc_size || size > bmgr->max_alloc_size)
-	{
-		return;
-	}
+	clock_gettime(PURGE_CLOCK, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	assert(((uintptr_t) ptr) % bmgr->min_alloc_size == 0);
 
-	buddy_free_internal(bmgr, ptr, get_size_class(bmgr, size));
+/* Count 'count' blocks of 'units' units as allocated or freed */
+static void
+count_units(bmgr_t *bmgr, size_t units, size_t count, bool allocated)
+{
+	count_blocks(bmgr, get_size_class(units), (units << bmgr->log2_min_alloc_size) * count, count,
+				 allocated);
 }
 
 
 /*
- * Core buddy alloc algorithm:
- *  If there is a free block available for the target size class
- *      Retun the block.
- *  Else If the target size class is not maximum size class,
- *      Allocate a block from next size class and split that into two and
- *      return one block and move it's buddy to current sizeclass's freelist.
- * Else (For max size class)
- *      Allocate a full chunk and return it.
+ * Add blocks to allocation counter 'counter' (a size class or SPAN_COUNTER(bmgr)).
+ * Frees subtract, counters of a stripe may wrap around, only their sum is
+ * meaningful. Without BMGR_CONCURRENT there is a single thread, so stripe 0 is
+ * updated without atomic read-modify-write.
  */
-static void *
-buddy_alloc_internal(bmgr_t *bmgr, int szc)
+static void
+count_blocks(bmgr_t *bmgr, int counter, size_t bytes, size_t count, bool allocated)
 {
-	void *ptr;
-	bool split;
-
-	assert(szc >= 0);
+	block_counter_t *block_counter;
 
-	if (!dlist_is_empty(&bmgr->chunk_free_lists[szc]))
+	if (!allocated)
 	{
-		ptr	  = NODE_TO_PTR(dlist_pop_head_node(&bmgr->chunk_free_lists[szc]));
-		split = false;
+		bytes = -bytes;
+		count = -count;
 	}
-	else if (szc != bmgr->num_size_classes - 1)
-	{
-		ptr	  = buddy_alloc_internal(bmgr, szc + 1);
-		split = true;
-	}
-	else
+
+	if (!bmgr->concurrent)
 	{
-		ptr	  = chunk_alloc(bmgr);
-		split = false;
+		block_counter = &get_block_counters(bmgr, 0)[counter];
+
+		atomic_store_explicit(&block_counter->bytes, atomic_load_explicit(&block_counter->bytes,
+																		  memory_order_relaxed) +
+							  bytes, memory_order_relaxed);
+		atomic_store_explicit(&block_counter->blocks, atomic_load_explicit(&block_counter->blocks,
+																		   memory_order_relaxed) +
+							  count, memory_order_relaxed);
+		return;
 	}
 
-	if (ptr)
+	block_counter = &get_block_counters(bmgr, get_stat_stripe())[counter];
+
+	atomic_fetch_add_explicit(&block_counter->bytes, bytes, memory_order_relaxed);
+	atomic_fetch_add_explicit(&block_counter->blocks, count, memory_order_relaxed);
+}
+
+
+static int
+get_stat_stripe(void)
+{
+	if (stat_stripe < 0)
 	{
-		adjust_control_block(bmgr, ptr, szc, split);
+		stat_stripe = atomic_fetch_add_explicit(&next_stat_stripe, 1, memory_order_relaxed) %
+					  STAT_STRIPES;
 	}
 
-	return ptr;
+	return stat_stripe;
 }
 
 
 /*
- * Core buddy free algorithm:
- *	If size class is maximum size class, then
- *		Free the entire chunk (block)
- *  Else If the buddy of current free block is also free, then
- *      Merge two blocks and free the merged block.
- *	Else
- *		Push the block into freelist of current sizeclass
+ * Bits of the non empty mask are changed with the lock of their size class
+ * held, but a word is shared by all size classes.
  */
 static void
-buddy_free_internal(bmgr_t *bmgr, void *ptr, int szc)
+set_nonempty(bmgr_t *bmgr, int szc)
 {
-	assert(szc >= 0);
-	assert(ptr != NULL);
+	uint64_t bit = ((uint64_t) 1) << szc;
 
-	buddy_ptr_t		bptr		  = get_buddy_ptr(bmgr, ptr, szc);
-	control_block_t control_block = get_control_block(bptr);
+	if (bmgr->concurrent)
+	{
+		atomic_fetch_or_explicit(&bmgr->nonempty_mask, bit, memory_order_relaxed);
+	}
+	else
+	{
+		atomic_store_explicit(&bmgr->nonempty_mask, atomic_load_explicit(&bmgr->nonempty_mask,
+																		 memory_order_relaxed) |
+							  bit, memory_order_relaxed);
+	}
+}
 
-	assert(!both_free(control_block, bptr));
 
-	mark_as_free(control_block, bptr);
+static void
+clear_nonempty(bmgr_t *bmgr, int szc)
+{
+	uint64_t bit = ((uint64_t) 1) << szc;
 
-	if (szc != bmgr->num_size_classes - 1)
+	if (bmgr->concurrent)
 	{
-		buddy_ptr_t buddy_bptr = get_buddy(control_block, bptr);
-
-		if (block_is_free(control_block, buddy_bptr))
-		{
-			void *buddy = get_real_ptr(bmgr, buddy_bptr);
-
-			dlist_delete(PTR_TO_NODE(buddy));
-			buddy_free_internal(bmgr, Min(ptr, buddy), szc + 1);
-		}
-		else
-		{
-			dlist_push_head(&bmgr->chunk_free_lists[szc], PTR_TO_NODE(ptr));
-		}
+		atomic_fetch_and_explicit(&bmgr->nonempty_mask, ~bit, memory_order_relaxed);
 	}
 	else
 	{
-		chunk_free(bmgr, ptr);
+		atomic_store_explicit(&bmgr->nonempty_mask, atomic_load_explicit(&bmgr->nonempty_mask,
+																		 memory_order_relaxed) &
+							  ~bit, memory_order_relaxed);
 	}
 }
 
 
-/*
- * Adjust control block for the given pointer.
- */
+/* Lock counters are updated while holding the lock */
 static void
-adjust_control_block(bmgr_t *bmgr, void *ptr, int szc, bool split)
+lock_size_class(bmgr_t *bmgr, int szc)
 {
-	buddy_ptr_t		bptr		  = get_buddy_ptr(bmgr, ptr, szc);
-	control_block_t control_block = get_control_block(bptr);
-
-	mark_as_in_use(control_block, bptr);
-
-	/* If the block needs to be split, then push it's buddy into freelist */
-	if (split)
+	if (bmgr->concurrent)
 	{
-		buddy_ptr_t buddy_bptr = get_buddy(control_block, bptr);
-		void		*buddy	   = get_real_ptr(bmgr, buddy_bptr);
+		size_class_t *size_class = get_size_class_state(bmgr, szc);
 
-		assert(block_is_free(control_block, buddy_bptr));
+		if (!slock_try_lock(&size_class->lock))
+		{
+			slock_lock(&size_class->lock);
+			size_class->contentions++;
+		}
 
-		dlist_push_head(&bmgr->chunk_free_lists[szc], PTR_TO_NODE(buddy));
+		size_class->acquisitions++;
 	}
 }
 
 
-static int
-get_num_size_classes(size_t min_alloc_size, size_t max_alloc_size)
+static void
+unlock_size_class(bmgr_t *bmgr, int szc)
 {
-	if (min_alloc_size < 16 || max_alloc_size <= min_alloc_size)
+	if (bmgr->concurrent)
 	{
-		return 0;
+		slock_unlock(&get_size_class_state(bmgr, szc)->lock);
 	}
+}
 
-	int log2_min = log_2(min_alloc_size);
-	int log2_max = log_2(max_alloc_size);
 
-	/* Check if max_alloc_size and min_alloc_size are power of two */
-	if (((1 << log2_max) != max_alloc_size) || ((1 << log2_min) != min_alloc_size))
+static void
+lock_control_block(bmgr_t *bmgr, control_block_t control_block)
+{
+	if (bmgr->concurrent)
 	{
-		return 0;
+		slock_lock((slock_t *) control_block);
 	}
-
-	return log2_max - log2_min + 1;
 }
 
 
-static size_t
-get_control_block_size(size_t min_alloc_size, size_t max_alloc_size)
+static void
+unlock_control_block(bmgr_t *bmgr, control_block_t control_block)
 {
-	return MAXALIGN((max_alloc_size / min_alloc_size * 2) / 8);
+	if (bmgr->concurrent)
+	{
+		slock_unlock((slock_t *) control_block);
+	}
 }
 
 
-/* Allocate a chunk from managed memory region */
-static void *
-chunk_alloc(bmgr_t *bmgr)
+/* Size class locks are taken in ascending order by operations needing more than one of them */
+static void
+lock_size_classes(bmgr_t *bmgr, uint64_t mask)
 {
-	void *chunk = NULL;
-
-	/* check if there is free chunk available */
-	if (!dlist_is_empty(&bmgr->free_chunks))
+	for (; mask != 0; mask &= mask - 1)
 	{
-		bmgr->num_chunks_used++;
-		chunk = NODE_TO_PTR(dlist_pop_head_node(&bmgr->free_chunks));
+		lock_size_class(bmgr, trailing_zeroes(mask));
 	}
-	else if (bmgr->next_chunk_index < bmgr->num_usable_chunks)
-	{
-		/* Allocate next chunk, from the memory region, If all chunks are not in use */
-		chunk = (char *) bmgr->chunk_start + bmgr->next_chunk_index * bmgr->max_alloc_size;
+}
+
 
-		bmgr->next_chunk_index++;
-		bmgr->num_chunks_used++;
+static void
+unlock_size_classes(bmgr_t *bmgr, uint64_t mask)
+{
+	for (; mask != 0; mask &= ~((uint64_t) 1 << (BITS_PER_WORD - 1 - leading_zeroes(mask))))
+	{
+		unlock_size_class(bmgr, BITS_PER_WORD - 1 - leading_zeroes(mask));
 	}
+}
 
-#ifdef USE_ASSERT_CHECKING
 
-	if (chunk)
+static char *
+get_chunk_start(bmgr_t *bmgr, const region_t *region)
+{
+	return (char *) bmgr + region->chunk_start_offset;
+}
+
+
+/*
+ * Index of the region, whose chunks contain 'ptr', -1 if none. Most pointers
+ * are in the first region, so it is checked first, others take a scan over at
+ * most BMGR_MAX_REGIONS regions.
+ */
+static int
+find_region(bmgr_t *bmgr, const void *ptr)
+{
+	int num_regions = atomic_load_explicit(&bmgr->num_regions, memory_order_acquire);
+
+	for (int i = 0; i < num_regions; i++)
 	{
-		buddy_ptr_t		bptr		  = get_buddy_ptr(bmgr, chunk, bmgr->num_size_classes - 1);
-		control_block_t control_block = get_control_block(bptr);
+		const region_t *region = &bmgr->regions[i];
+		uintptr_t		start  = (uintptr_t) get_chunk_start(bmgr, region);
 
-		for (size_t i = 0; i < bmgr->control_block_size; i++)
+		if ((uintptr_t) ptr >= start && (uintptr_t) ptr - start < region->num_chunks <<
+			bmgr->log2_max_alloc_size)
 		{
-			assert(((uint8_t *) control_block)[i] == 0);
+			return i;
 		}
 	}
 
-#endif /* USE_ASSERT_CHECKING */
-
-	return chunk;
+	return -1;
 }
 
 
-static void
-chunk_free(bmgr_t *bmgr, void *ptr)
+static region_t *
+get_region(bmgr_t *bmgr, size_t chunk_id)
 {
-	assert(ptr != NULL);
-	assert(((uintptr_t) ptr) % bmgr->max_alloc_size == 0);
+	return &bmgr->regions[CHUNK_REGION(chunk_id)];
+}
 
-	bmgr->num_chunks_used--;
-	dlist_push_head(&bmgr->free_chunks, PTR_TO_NODE(ptr));
+
+static char *
+get_chunk_address(bmgr_t *bmgr, size_t chunk_id)
+{
+	return get_chunk_start(bmgr, get_region(bmgr, chunk_id)) + (CHUNK_INDEX(chunk_id) <<
+																bmgr->log2_max_alloc_size);
 }
 
 
@@ -390,13 +4710,16 @@ static buddy_ptr_t
 get_buddy_ptr(bmgr_t *bmgr, void *ptr, int szc)
 {
 	buddy_ptr_t bptr;
+	int			region_index	= find_region(bmgr, ptr);
 	uintptr_t	ptr_val			= (uintptr_t) ptr;
-	uintptr_t	chunk_start_val = (uintptr_t) bmgr->chunk_start;
+	uintptr_t	chunk_start_val;
 
-	assert(chunk_start_val <= ptr_val);
+	assert(region_index >= 0);
 
-	bptr.chunk_id	  = (ptr_val - chunk_start_val) / bmgr->max_alloc_size;
-	bptr.chunk_offset = (ptr_val - chunk_start_val) % bmgr->max_alloc_size;
+	chunk_start_val	  = (uintptr_t) get_chunk_start(bmgr, &bmgr->regions[region_index]);
+	bptr.chunk_id	  = CHUNK_ID(region_index, (ptr_val - chunk_start_val) >>
+								 bmgr->log2_max_alloc_size);
+	bptr.chunk_offset = (ptr_val - chunk_start_val) & (bmgr->max_alloc_size - 1);
 	bptr.szc		  = szc;
 	bptr.bmgr		  = bmgr;
 
@@ -407,22 +4730,30 @@ get_buddy_ptr(bmgr_t *bmgr, void *ptr, int szc)
 static void *
 get_real_ptr(bmgr_t *bmgr, buddy_ptr_t bptr)
 {
-	return (void *) (bptr.chunk_id * bmgr->max_alloc_size + (uintptr_t) bmgr->chunk_start +
-					 bptr.chunk_offset);
+	return get_chunk_address(bmgr, bptr.chunk_id) + bptr.chunk_offset;
 }
 
 
+/* # of min_alloc_size units needed to hold 'size' bytes */
+static size_t
+get_units(bmgr_t *bmgr, size_t size)
+{
+	return (size + bmgr->min_alloc_size - 1) >> bmgr->log2_min_alloc_size;
+}
+
+
+/* Smallest size class, that can hold 'units' units (rounds up) */
 static int
-get_size_class(bmgr_t *bmgr, size_t size)
+get_size_class(size_t units)
 {
-	return log_2(size) - bmgr->log2_min_alloc_size;
+	return units == 1 ? 0 : log_2(units - 1) + 1;
 }
 
 
 static size_t
 get_size(bmgr_t *bmgr, int szc)
 {
-	return bmgr->min_alloc_size * (((size_t) 1) << szc);
+	return bmgr->min_alloc_size << szc;
 }
 
 
@@ -431,8 +4762,52 @@ get_control_block(buddy_ptr_t bptr)
 {
 	bmgr_t *bmgr = bptr.bmgr;
 
-	return (control_block_t) ((char *) bmgr->control_block + bptr.chunk_id *
-							  bmgr->control_block_size);
+	return (control_block_t) ((char *) bmgr + get_region(bmgr, bptr.chunk_id)->control_block_offset +
+							  CHUNK_INDEX(bptr.chunk_id) * bmgr->control_block_size);
+}
+
+
+static uint8_t *
+get_bitmap(control_block_t control_block)
+{
+	return (uint8_t *) control_block + CONTROL_BLOCK_HEADER_SIZE;
+}
+
+
+/* Free bitmap of out of band mode starts right after the bitmap of blocks in use */
+static uint64_t *
+get_free_bitmap(bmgr_t *bmgr, control_block_t control_block)
+{
+	size_t bitmap_size = get_bitmap_size(bmgr->min_alloc_size, bmgr->max_alloc_size);
+
+	return (uint64_t *) (get_bitmap(control_block) + bitmap_size);
+}
+
+
+/* Continuation bitmap is the last one in the control block */
+static uint64_t *
+get_continuation_bitmap(bmgr_t *bmgr, control_block_t control_block)
+{
+	size_t bitmap_size = get_bitmap_size(bmgr->min_alloc_size, bmgr->max_alloc_size);
+
+	return (uint64_t *) (get_bitmap(control_block) + (bmgr->out_of_band ? 2 * bitmap_size :
+													  bitmap_size));
+}
+
+
+/* Summary bitmap of chunks of a region having free blocks of size class 'szc' */
+static uint64_t *
+get_summary(bmgr_t *bmgr, const region_t *region, int szc)
+{
+	return (uint64_t *) ((char *) bmgr + region->summary_offset) + szc * region->summary_words;
+}
+
+
+/* Bitmap index of the first node of size class 'szc' */
+static size_t
+get_level_start(bmgr_t *bmgr, int szc)
+{
+	return BMGR_LEVEL_START(bmgr->num_size_classes, szc);
 }
 
 
@@ -441,15 +4816,15 @@ get_bitmap_index(buddy_ptr_t bptr)
 {
 	bmgr_t *bmgr = bptr.bmgr;
 
-	return (1 << (bmgr->num_size_classes - (bptr.szc + 1))) - 1 + bptr.chunk_offset /
-		   get_size(bmgr, bptr.szc);
+	return BMGR_BITMAP_INDEX(bmgr->num_size_classes, bmgr->log2_min_alloc_size, bptr.szc,
+							 bptr.chunk_offset);
 }
 
 
 static void
 mark_as_in_use(control_block_t control_block, buddy_ptr_t bptr)
 {
-	uint8_t *bitmap		 = control_block;
+	uint8_t *bitmap		 = get_bitmap(control_block);
 	size_t	bitmap_index = get_bitmap_index(bptr);
 	size_t	bitmap_byte	 = bitmap_index / 8;
 	size_t	bitmap_bit	 = bitmap_index % 8;
@@ -463,7 +4838,7 @@ mark_as_in_use(control_block_t control_block, buddy_ptr_t bptr)
 static void
 mark_as_free(control_block_t control_block, buddy_ptr_t bptr)
 {
-	uint8_t *bitmap		 = control_block;
+	uint8_t *bitmap		 = get_bitmap(control_block);
 	size_t	bitmap_index = get_bitmap_index(bptr);
 	size_t	bitmap_byte	 = bitmap_index / 8;
 	size_t	bitmap_bit	 = bitmap_index % 8;
@@ -477,7 +4852,7 @@ mark_as_free(control_block_t control_block, buddy_ptr_t bptr)
 static bool
 block_is_free(control_block_t control_block, buddy_ptr_t bptr)
 {
-	uint8_t *bitmap		 = control_block;
+	uint8_t *bitmap		 = get_bitmap(control_block);
 	size_t	bitmap_index = get_bitmap_index(bptr);
 	size_t	bitmap_byte	 = bitmap_index / 8;
 	size_t	bitmap_bit	 = bitmap_index % 8;
@@ -497,16 +4872,58 @@ both_free(control_block_t control_block, buddy_ptr_t bptr)
 static buddy_ptr_t
 get_buddy(control_block_t control_block, buddy_ptr_t bptr)
 {
-	size_t size		 = get_size(bptr.bmgr, bptr.szc);
-	int	   log2_size = log_2(size);
-	size_t n_ptr	 = bptr.chunk_offset >> log2_size;
+	(void) control_block;
 
-	bptr.chunk_offset = (n_ptr ^ 0x1) << log2_size;
+	bptr.chunk_offset ^= get_size(bptr.bmgr, bptr.szc);
 
 	return bptr;
 }
 
 
+static void
+bitmap_set(uint64_t *bitmap, size_t bit)
+{
+	bitmap[bit / BITS_PER_WORD] |= ((uint64_t) 1) << (bit % BITS_PER_WORD);
+}
+
+
+static bool
+bitmap_test(const uint64_t *bitmap, size_t bit)
+{
+	return (bitmap[bit / BITS_PER_WORD] & (((uint64_t) 1) << (bit % BITS_PER_WORD))) != 0;
+}
+
+
+static void
+bitmap_clear(uint64_t *bitmap, size_t bit)
+{
+	bitmap[bit / BITS_PER_WORD] &= ~(((uint64_t) 1) << (bit % BITS_PER_WORD));
+}
+
+
+/* Find first set bit in [start, end) of the bitmap, returns 'end' if there is none */
+static size_t
+bitmap_find_first(const uint64_t *bitmap, size_t start, size_t end)
+{
+	size_t	 word = start / BITS_PER_WORD;
+	uint64_t bits = bitmap[word] & (~((uint64_t) 0) << (start % BITS_PER_WORD));
+
+	while (bits == 0)
+	{
+		if (++word * BITS_PER_WORD >= end)
+		{
+			return end;
+		}
+
+		bits = bitmap[word];
+	}
+
+	start = word * BITS_PER_WORD + trailing_zeroes(bits);
+
+	return start < end ? start : end;
+}
+
+
 static int
 log_2(size_t n)
 {
@@ -0,0 +1,130 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "bmgr/bmgr.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Background thread, that periodically purges idle free memory of a buddy manager */
+struct bmgr_purger_t
+{
+	bmgr_t		   *bmgr;
+	unsigned		interval_ms;
+	bool			stop;   /* Protected by mutex */
+	pthread_t		thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t	cond;   /* Signalled on stop */
+};
+
+static void *purger_main(void *arg);
+static void	 purger_deadline(struct timespec *deadline, unsigned interval_ms);
+
+
+/*
+ * Start a purger thread, that calls bmgr_purge every 'interval_ms' milliseconds.
+ * The buddy manager must be concurrent, returns NULL on failure.
+ */
+bmgr_purger_t *
+bmgr_purger_start(bmgr_t *bmgr, unsigned interval_ms)
+{
+	bmgr_purger_t	  *purger = malloc(sizeof(bmgr_purger_t));
+	pthread_condattr_t attr;
+
+	if (purger == NULL)
+	{
+		return NULL;
+	}
+
+	purger->bmgr		= bmgr;
+	purger->interval_ms = interval_ms;
+	purger->stop		= false;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&purger->mutex, NULL);
+	pthread_cond_init(&purger->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&purger->thread, NULL, purger_main, purger) != 0)
+	{
+		pthread_cond_destroy(&purger->cond);
+		pthread_mutex_destroy(&purger->mutex);
+		free(purger);
+		return NULL;
+	}
+
+	return purger;
+}
+
+
+/* Stop the purger thread and wait for it to exit */
+void
+bmgr_purger_stop(bmgr_purger_t *purger)
+{
+	if (purger == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&purger->mutex);
+	purger->stop = true;
+	pthread_cond_signal(&purger->cond);
+	pthread_mutex_unlock(&purger->mutex);
+
+	pthread_join(purger->thread, NULL);
+
+	pthread_cond_destroy(&purger->cond);
+	pthread_mutex_destroy(&purger->mutex);
+	free(purger);
+}
+
+
+static void *
+purger_main(void *arg)
+{
+	bmgr_purger_t  *purger = arg;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&purger->mutex);
+
+	while (!purger->stop)
+	{
+		purger_deadline(&deadline, purger->interval_ms);
+
+		while (!purger->stop &&
+			   pthread_cond_timedwait(&purger->cond, &purger->mutex, &deadline) != ETIMEDOUT)
+			;
+
+		if (purger->stop)
+		{
+			break;
+		}
+
+		pthread_mutex_unlock(&purger->mutex);
+		bmgr_purge(purger->bmgr);
+		pthread_mutex_lock(&purger->mutex);
+	}
+
+	pthread_mutex_unlock(&purger->mutex);
+
+	return NULL;
+}
+
+
+static void
+purger_deadline(struct timespec *deadline, unsigned interval_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+
+	deadline->tv_sec  += interval_ms / 1000;
+	deadline->tv_nsec += (long) (interval_ms % 1000) * 1000000;
+
+	if (deadline->tv_nsec >= 1000000000)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
@@ -0,0 +1,318 @@
+#include "shmalloc/shmalloc.h"
+#include "bmgr/bmgr.h"
+#include "slab/slab.h"
+#include "utils/ilist.h"
+#include "utils/slock.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Slab pages are buddy blocks aligned to their size within a chunk, found by their offset */
+#define SHM_SLAB_PAGE_SHIFT 16
+#define SHM_SLAB_PAGE_SIZE	((size_t) 1 << SHM_SLAB_PAGE_SHIFT)
+
+/* Smallest buddy block, medium requests are rounded up to a multiple of it */
+#define SHM_MIN_ALLOC_SIZE 1024
+
+/* Small request sizes are looked up in steps of SHM_QUANTUM */
+#define SHM_QUANTUM		16
+#define SHM_NUM_CLASSES 20
+
+/* Tells a region, that holds a heap, from one that doesn't ("SHMHEAP") */
+#define SHM_HEAP_MAGIC 0x53484d48454150ULL
+
+static_assert(SHM_SLAB_PAGE_SIZE <= SHM_MEDIUM_MAX, "Slab pages must be buddy blocks");
+
+static const int shm_class_sizes[SHM_NUM_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256,
+	320, 384, 448, 512,
+	640, 768, 896, SHM_SMALL_MAX
+};
+
+/* Slab cache of a size class, offset of the slab is relative to the heap */
+typedef struct
+{
+	ptrdiff_t slab_offset;
+	slock_t	  lock;
+	int		  index;
+} shm_class_t;
+
+/*
+ * Heap lives at the start of it's region, the buddy manager follows it and
+ * page_class. Heap holds offsets only (from the heap), so it works at the
+ * address, that any process maps the region at. page_class tells, which size
+ * class a slab page of region 0 of the buddy manager belongs to (index + 1, 0
+ * if it is not a slab page), counted from the region's chunk_start. It is
+ * written by the slab of the class under the lock of the class, when the slab
+ * allocates or frees the page, and read by frees of blocks in live pages.
+ */
+struct shm_heap_t
+{
+	uint64_t  magic;
+	ptrdiff_t bmgr_offset;
+	bool	  concurrent;
+
+	uint8_t		class_index[SHM_SMALL_MAX / SHM_QUANTUM + 1];
+	shm_class_t classes[SHM_NUM_CLASSES];
+
+	ptrdiff_t		page_base_offset; /* chunk_start of region 0 */
+	size_t			num_pages;
+	_Atomic uint8_t page_class[];
+};
+
+static bmgr_t	   *get_bmgr(shm_heap_t *heap);
+static slab_t	   *get_slab(shm_heap_t *heap, shm_class_t *cls);
+static shm_class_t *get_page_class(shm_heap_t *heap, void *ptr);
+static void		   lock_class(shm_heap_t *heap, shm_class_t *cls);
+static void		   unlock_class(shm_heap_t *heap, shm_class_t *cls);
+static void		   destroy_classes(shm_heap_t *heap, int num_classes);
+
+
+/* Create a heap in 'memory_region', returns NULL if region is too small */
+shm_heap_t *
+shm_heap_create(void *memory_region, size_t mem_size, int flags)
+{
+	shm_heap_t			 *heap		= memory_region;
+	size_t				 max_pages	= mem_size >> SHM_SLAB_PAGE_SHIFT;
+	size_t				 heap_size	= CACHEALIGN(sizeof(shm_heap_t) + max_pages);
+	bmgr_region_layout_t layout;
+	bmgr_t				 *bmgr;
+
+	if (mem_size <= heap_size)
+	{
+		return NULL;
+	}
+
+	heap->magic = 0;
+
+	bmgr = bmgr_create_ext(SHM_MIN_ALLOC_SIZE, SHM_MEDIUM_MAX, (char *) heap + heap_size,
+						   mem_size - heap_size, flags | BMGR_SPANS);
+
+	if (bmgr == NULL)
+	{
+		return NULL;
+	}
+
+	if (bmgr_get_region_layout(bmgr, 0, &layout) != 0)
+	{
+		bmgr_destroy(bmgr);
+		return NULL;
+	}
+
+	heap->bmgr_offset	   = (char *) bmgr - (char *) heap;
+	heap->concurrent	   = (flags & BMGR_CONCURRENT) != 0;
+	heap->page_base_offset = layout.chunk_start - (char *) heap;
+	heap->num_pages		   = layout.num_chunks * (SHM_MEDIUM_MAX / SHM_SLAB_PAGE_SIZE);
+
+	assert(heap->num_pages <= max_pages);
+
+	for (size_t page = 0; page < heap->num_pages; page++)
+	{
+		atomic_init(&heap->page_class[page], 0);
+	}
+
+	/* Smallest class, that fits every size of a step */
+	for (int step = 0, cls = 0; step <= SHM_SMALL_MAX / SHM_QUANTUM; step++)
+	{
+		while (shm_class_sizes[cls] < step * SHM_QUANTUM)
+		{
+			cls++;
+		}
+
+		heap->class_index[step] = cls;
+	}
+
+	for (int cls = 0; cls < SHM_NUM_CLASSES; cls++)
+	{
+		shm_class_t *cache = &heap->classes[cls];
+		slab_t		*slab  = slab_create_bmgr_mapped(bmgr, SHM_SLAB_PAGE_SIZE, shm_class_sizes[cls],
+													 SLAB_HEADERLESS,
+													 (uint8_t *) heap->page_class, cls + 1);
+
+		if (slab == NULL)
+		{
+			destroy_classes(heap, cls);
+			bmgr_destroy(bmgr);
+			return NULL;
+		}
+
+		cache->slab_offset = (char *) slab - (char *) heap;
+		cache->index	   = cls;
+		slock_init(&cache->lock);
+	}
+
+	heap->magic = SHM_HEAP_MAGIC;
+
+	return heap;
+}
+
+
+/*
+ * Heap created in 'memory_region' by shm_heap_create, which may have been
+ * called by another process, that mapped the region at another address.
+ * Returns NULL if there is no heap.
+ */
+shm_heap_t *
+shm_heap_attach(void *memory_region)
+{
+	shm_heap_t *heap = memory_region;
+
+	if (heap == NULL || heap->magic != SHM_HEAP_MAGIC ||
+		bmgr_attach((char *) heap + heap->bmgr_offset) == NULL)
+	{
+		return NULL;
+	}
+
+	return heap;
+}
+
+
+/* Give slab pages back to the buddy manager, caller provided region is usable again */
+void
+shm_heap_destroy(shm_heap_t *heap)
+{
+	heap->magic = 0;
+
+	destroy_classes(heap, SHM_NUM_CLASSES);
+	bmgr_destroy(get_bmgr(heap));
+}
+
+
+/* Buddy manager of the heap, it serves medium and large requests */
+bmgr_t *
+shm_heap_get_bmgr(shm_heap_t *heap)
+{
+	return get_bmgr(heap);
+}
+
+
+void *
+shm_malloc(shm_heap_t *heap, size_t size)
+{
+	shm_class_t *cls;
+	void		*ptr;
+
+	if (size == 0)
+	{
+		return NULL;
+	}
+
+	if (size > SHM_SMALL_MAX)
+	{
+		return buddy_alloc(get_bmgr(heap), size);
+	}
+
+	cls = &heap->classes[heap->class_index[(size + SHM_QUANTUM - 1) / SHM_QUANTUM]];
+
+	lock_class(heap, cls);
+	ptr = slab_alloc(get_slab(heap, cls));
+	unlock_class(heap, cls);
+
+	return ptr;
+}
+
+
+void
+shm_free(shm_heap_t *heap, void *ptr)
+{
+	shm_class_t *cls;
+
+	if (ptr == NULL)
+	{
+		return;
+	}
+
+	cls = get_page_class(heap, ptr);
+
+	if (cls == NULL)
+	{
+		buddy_free_ptr(get_bmgr(heap), ptr);
+		return;
+	}
+
+	lock_class(heap, cls);
+	slab_free(get_slab(heap, cls), ptr);
+	unlock_class(heap, cls);
+}
+
+
+/* Size of the class of a small block, usable size of the buddy block otherwise */
+size_t
+shm_usable_size(shm_heap_t *heap, void *ptr)
+{
+	shm_class_t *cls = get_page_class(heap, ptr);
+
+	if (cls == NULL)
+	{
+		return buddy_usable_size(get_bmgr(heap), ptr);
+	}
+
+	return shm_class_sizes[cls->index];
+}
+
+
+static bmgr_t *
+get_bmgr(shm_heap_t *heap)
+{
+	return (bmgr_t *) ((char *) heap + heap->bmgr_offset);
+}
+
+
+static slab_t *
+get_slab(shm_heap_t *heap, shm_class_t *cls)
+{
+	return (slab_t *) ((char *) heap + cls->slab_offset);
+}
+
+
+/* Size class of the slab page containing 'ptr', NULL if it's not in a slab page */
+static shm_class_t *
+get_page_class(shm_heap_t *heap, void *ptr)
+{
+	size_t page = ((char *) ptr - ((char *) heap + heap->page_base_offset)) >>
+				  SHM_SLAB_PAGE_SHIFT;
+	int	   cls;
+
+	if (page >= heap->num_pages)
+	{
+		return NULL;
+	}
+
+	cls = atomic_load_explicit(&heap->page_class[page], memory_order_relaxed);
+
+	return cls == 0 ? NULL : &heap->classes[cls - 1];
+}
+
+
+static void
+lock_class(shm_heap_t *heap, shm_class_t *cls)
+{
+	if (heap->concurrent)
+	{
+		slock_lock(&cls->lock);
+	}
+}
+
+
+static void
+unlock_class(shm_heap_t *heap, shm_class_t *cls)
+{
+	if (heap->concurrent)
+	{
+		slock_unlock(&cls->lock);
+	}
+}
+
+
+/* Destroy slab caches of the first 'num_classes' size classes, last one first */
+static void
+destroy_classes(shm_heap_t *heap, int num_classes)
+{
+	for (int cls = num_classes - 1; cls >= 0; cls--)
+	{
+		slab_destroy(get_slab(heap, &heap->classes[cls]));
+	}
+}
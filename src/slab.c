@@ -1,9 +1,20 @@
+#define _GNU_SOURCE
+
 #include "slab/slab.h"
 #include "utils/ilist.h"
+#include "utils/olist.h"
 
 #include <assert.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif /* __linux__ */
 
 
 typedef struct
@@ -11,57 +22,145 @@ typedef struct
 	int pagesize;
 	int blocksize;
 	int block_count;
+	int first_block_offset; /* Offset of the first block from the page */
+	int header_size;        /* 0 with SLAB_HEADERLESS */
+
+	size_t page_align;      /* Alignment of pages, a power of two */
+	int	   page_shift;      /* log2 of page_align */
 } slab_info_t;
 
-#define FLEXIBLE_ARRAY_MEMBER
+/*
+ * Page of a slab. Links are offsets, so that a slab in shared memory works at
+ * whatever address a process maps it: free lists hold offsets of blocks from
+ * the page (0 ends a list) and list_node is relative to the slab. freelist
+ * and counts are touched only by the owner of the slab, remote_freelist holds
+ * blocks freed by other threads, until the owner collects them.
+ */
 typedef struct
 {
-	int		   alloc_block_count;
-	int		   next_free_index;
-	slist_head freelist;
-	slab_t	   *slab;
-	dlist_node list_node;
+	int			   alloc_block_count;
+	int			   next_free_index;
+	size_t		   freelist;
+	olist_node	   list_node;
+	_Atomic size_t remote_freelist;
 } __attribute__((aligned(MAXIMUM_ALIGNOF))) slab_page_t;
 
 static_assert(sizeof(slab_page_t) <= CACHE_LINE_SIZE,
 			  "Slab Page header size greater than CACHE_LINE_SIZE bytes");
 
+/* Free block, on the free list or the remote free list of it's page */
 typedef struct
 {
-	slist_node next;
+	size_t next; /* Offset of the next block from the page, 0 if none */
 } free_block_t;
 
+/* Block passed to slab_free_bulk, blocks are grouped by page in batches of SLAB_BULK_FREE_BATCH */
+#define SLAB_BULK_FREE_BATCH 256
+
+typedef struct
+{
+	slab_page_t *page;
+	void		*block;
+} bulk_entry_t;
+
+/* Where pages and the control block of a slab come from */
+typedef enum
+{
+	SLAB_BACKEND_CALLBACKS, /* alloc and free (or sized_free) of the creating process */
+	SLAB_BACKEND_BMGR       /* Buddy manager at bmgr_offset */
+} slab_backend_t;
+
 struct slab_t
 {
 	slab_info_t slab_info;
-	slab_page_t *active_page;
+	size_t		active_page; /* Offset from the slab, 0 if none */
 
-	dlist_head partially_full_pages;
-	dlist_head full_pages;
+	/* Relative to the slab */
+	olist_head partially_full_pages;
+	olist_head full_pages;
 
+	slab_backend_t	backend;
 	aligned_alloc_t alloc;
 	free_t			free;
+	sized_free_t	sized_free; /* Used instead of free, if set */
 	void			*arg_alloc;
 
+	/*
+	 * SLAB_BACKEND_BMGR. Offsets are relative to the slab. Buddy blocks are
+	 * aligned relative to the chunks of the buddy manager, so headerless pages
+	 * are found by masking relative to them (absolutely, if page_base_set is
+	 * false). Page map, if any, has a byte per page_align bytes from there.
+	 */
+	ptrdiff_t bmgr_offset;
+	bool	  page_base_set;
+	ptrdiff_t page_base_offset;
+	ptrdiff_t page_map_offset; /* 0 if there is no page map */
+	uint8_t	  page_tag;
+
 	unsigned page_count;
+	unsigned max_page_count;   /* High water mark of page_count */
+	size_t	 allocated_blocks;
+
+	/* Created with SLAB_CONCURRENT? Then frees of other threads than owner are remote */
+	bool	 concurrent;
+	uint64_t owner; /* See current_thread_id */
+
+	/* Written by remote frees, so it is kept off the owner's cache line */
+	_Atomic size_t remote_frees __attribute__((aligned(CACHE_LINE_SIZE))); /* # not collected yet */
 } __attribute__((aligned(CACHE_LINE_SIZE)));
 
-static void		   slab_page_init(slab_page_t *slab_page, slab_t *slab);
-static void		   *slab_page_alloc(slab_page_t *page);
+/* Cached id of the calling thread, forgotten by a forked child */
+static _Thread_local uint64_t thread_id;
+static pthread_once_t		  thread_id_once = PTHREAD_ONCE_INIT;
+
+static void		   slab_init(slab_t *slab, int pagesize, int blocksize, int flags);
+static void		   slab_page_init(slab_page_t *slab_page);
+static void		   *slab_page_alloc(slab_t *slab, slab_page_t *page);
 static void		   slab_page_free(slab_page_t *page, void *ptr);
 static bool		   slab_page_is_empty(slab_page_t *page);
-static bool		   slab_page_is_full(slab_page_t *slab_page);
+static bool		   slab_page_is_full(slab_t *slab, slab_page_t *slab_page);
 static slab_page_t *slab_alloc_page(slab_t *slab);
 static void		   slab_free_page(slab_page_t *slab_page, slab_t *slab);
-static void		   *get_user_pointer(void *ptr, slab_page_t *slab_page);
-static void		   *get_block_start(void *ptr);
-static slab_page_t *get_slab_page(void *ptr);
+static void		   *get_user_pointer(slab_t *slab, void *ptr, slab_page_t *slab_page);
+static void		   *get_block_start(slab_t *slab, void *ptr);
+static slab_page_t *get_slab_page(slab_t *slab, void *ptr);
+static slab_page_t *get_active_page(slab_t *slab);
+static void		   set_active_page(slab_t *slab, slab_page_t *slab_page);
+static slab_page_t *get_list_page(slab_t *slab, size_t node_offset);
 static void		   *slab_alloc_from_active_page(slab_t *slab);
+static bool		   slab_next_active_page(slab_t *slab);
+static size_t	   slab_page_alloc_bulk(slab_t *slab, slab_page_t *slab_page, size_t num_blocks,
+										void **blocks);
+static void		   slab_free_local(slab_t *slab, slab_page_t *slab_page, void *block);
+static void		   slab_free_page_group(slab_t *slab, bulk_entry_t *entries, size_t count);
+static void		   slab_update_page_lists(slab_t *slab, slab_page_t *slab_page, bool page_was_full);
+static int		   compare_bulk_entries(const void *a, const void *b);
+static void		   slab_collect_list(slab_t *slab, olist_head *list);
+static void		   slab_collect_page(slab_t *slab, slab_page_t *slab_page);
+static void		   remote_push_chain(slab_page_t *slab_page, free_block_t *first, free_block_t
+									 *last);
+static void		   *slab_acquire(slab_t *slab, size_t size, size_t align);
+static void		   slab_release(slab_t *slab, void *ptr, size_t size);
+static bmgr_t	   *get_bmgr(slab_t *slab);
+static uintptr_t   get_page_base(slab_t *slab);
+static void		   map_page(slab_t *slab, slab_page_t *slab_page, uint8_t tag);
+static bool		   is_owner(slab_t *slab);
+static uint64_t	   current_thread_id(void);
+static void		   forget_thread_id(void);
+static void		   register_fork_handler(void);
 
 int
 slab_get_header_size(void)
 {
-	return sizeof(slab_page_t * *);
+	return sizeof(size_t);
+}
+
+
+/* Bytes of a block of 'slab', that are not usable */
+int
+slab_block_header_size(slab_t *slab)
+{
+	return slab->slab_info.header_size;
 }
 
 
@@ -74,23 +173,92 @@ slab_control_block_size(void)
 
 slab_t *
 slab_create(int pagesize, int blocksize, aligned_alloc_t alloc, free_t free, void *arg_alloc)
+{
+	return slab_create_ext(pagesize, blocksize, alloc, free, arg_alloc, 0);
+}
+
+
+slab_t *
+slab_create_ext(int pagesize, int blocksize, aligned_alloc_t alloc, free_t free, void *arg_alloc,
+				int flags)
 {
 	slab_t *slab = alloc(sizeof(slab_t), CACHE_LINE_SIZE, arg_alloc);
 
-	blocksize = MAXALIGN(blocksize);
-	pagesize  = MAXALIGN(pagesize);
+	if (slab == NULL)
+	{
+		return NULL;
+	}
 
-	slab->active_page			= NULL;
-	slab->slab_info.blocksize	= blocksize;
-	slab->slab_info.pagesize	= pagesize;
-	slab->slab_info.block_count = (pagesize - sizeof(slab_page_t)) / blocksize;
-	slab->arg_alloc				= arg_alloc;
-	slab->alloc					= alloc;
-	slab->free					= free;
-	slab->page_count			= 0;
+	slab_init(slab, pagesize, blocksize, flags);
+
+	slab->backend	 = SLAB_BACKEND_CALLBACKS;
+	slab->arg_alloc	 = arg_alloc;
+	slab->alloc		 = alloc;
+	slab->free		 = free;
+	slab->sized_free = NULL;
+
+	return slab;
+}
+
+
+/* Create a slab, whose 'free' is told the size of what it frees */
+slab_t *
+slab_create_sized(int pagesize, int blocksize, aligned_alloc_t alloc, sized_free_t free,
+				  void *arg_alloc, int flags)
+{
+	slab_t *slab = slab_create_ext(pagesize, blocksize, alloc, NULL, arg_alloc, flags);
 
-	dlist_init(&slab->full_pages);
-	dlist_init(&slab->partially_full_pages);
+	if (slab != NULL)
+	{
+		slab->sized_free = free;
+	}
+
+	return slab;
+}
+
+
+/* Create a slab in the region of 'bmgr', pages are buddy blocks */
+slab_t *
+slab_create_bmgr(bmgr_t *bmgr, int pagesize, int blocksize, int flags)
+{
+	return slab_create_bmgr_mapped(bmgr, pagesize, blocksize, flags, NULL, 0);
+}
+
+
+/* Create a slab in the region of 'bmgr', that marks it's pages with 'tag' in 'page_map' */
+slab_t *
+slab_create_bmgr_mapped(bmgr_t *bmgr, int pagesize, int blocksize, int flags, uint8_t *page_map,
+						uint8_t tag)
+{
+	bmgr_region_layout_t layout;
+	bool				 has_layout = bmgr_get_region_layout(bmgr, 0, &layout) == 0;
+	slab_t				 *slab;
+
+	if ((size_t) MAXALIGN(pagesize) > buddy_max_alloc_size(bmgr) ||
+		(page_map != NULL && ((flags & SLAB_HEADERLESS) == 0 || !has_layout || tag == 0)))
+	{
+		return NULL;
+	}
+
+	slab = buddy_alloc_aligned(bmgr, sizeof(slab_t), CACHE_LINE_SIZE);
+
+	if (slab == NULL)
+	{
+		return NULL;
+	}
+
+	slab_init(slab, pagesize, blocksize, flags);
+
+	slab->backend		   = SLAB_BACKEND_BMGR;
+	slab->arg_alloc		   = NULL;
+	slab->alloc			   = NULL;
+	slab->free			   = NULL;
+	slab->sized_free	   = NULL;
+	slab->bmgr_offset	   = (char *) bmgr - (char *) slab;
+	slab->page_base_set	   = has_layout;
+	slab->page_base_offset = has_layout ? layout.chunk_start - (char *) slab : 0;
+	slab->page_map_offset  = page_map != NULL ? (char *) page_map - (char *) slab : 0;
+	slab->page_tag		   = tag;
 
 	return slab;
 }
@@ -99,30 +267,28 @@ slab_create(int pagesize, int blocksize, aligned_alloc_t alloc, free_t free, voi
 void
 slab_destroy(slab_t *slab)
 {
-	dlist_mutable_iter iter;
+	slab_page_t *active_page = get_active_page(slab);
 
-	if (slab->active_page)
+	if (active_page)
 	{
-		slab_free_page(slab->active_page, slab);
+		slab_free_page(active_page, slab);
 	}
 
-	dlist_foreach_modify(iter, &slab->partially_full_pages)
+	while (!olist_is_empty(slab, &slab->partially_full_pages))
 	{
-		slab_page_t *slab_page = dlist_container(slab_page_t, list_node, iter.cur);
+		olist_node *node = olist_pop_head_node(slab, &slab->partially_full_pages);
 
-		dlist_delete(iter.cur);
-		slab_free_page(slab_page, slab);
+		slab_free_page(get_list_page(slab, olist_offset_of(slab, node)), slab);
 	}
 
-	dlist_foreach_modify(iter, &slab->full_pages)
+	while (!olist_is_empty(slab, &slab->full_pages))
 	{
-		slab_page_t *slab_page = dlist_container(slab_page_t, list_node, iter.cur);
+		olist_node *node = olist_pop_head_node(slab, &slab->full_pages);
 
-		dlist_delete(iter.cur);
-		slab_free_page(slab_page, slab);
+		slab_free_page(get_list_page(slab, olist_offset_of(slab, node)), slab);
 	}
 
-	slab->free(slab, slab->arg_alloc);
+	slab_release(slab, slab, sizeof(slab_t));
 }
 
 
@@ -136,32 +302,45 @@ slab_alloc(slab_t *slab)
 		return mem;
 	}
 
-	if (slab->active_page)
+	if (!slab_next_active_page(slab))
 	{
-		assert(slab_page_is_full(slab->active_page));
-		dlist_push_head(&slab->full_pages, &slab->active_page->list_node);
+		return NULL;
 	}
 
-	slab->active_page = NULL;
+	return slab_alloc_from_active_page(slab);
+}
 
-	if (!dlist_is_empty(&slab->partially_full_pages))
-	{
-		slab->active_page = dlist_head_element(slab_page_t, list_node, &slab->partially_full_pages);
-		dlist_pop_head_node(&slab->partially_full_pages);
 
-		assert(!slab_page_is_empty(slab->active_page));
+/*
+ * Allocate 'num_blocks' blocks into 'blocks', returns # of blocks allocated
+ * (less than asked only if pages can't be allocated). Free list of a page is
+ * drained and never used blocks are carved in one pass, so page lists are
+ * maintained once per page.
+ */
+size_t
+slab_alloc_bulk(slab_t *slab, size_t num_blocks, void **blocks)
+{
+	size_t count = 0;
 
-		return slab_alloc_from_active_page(slab);
-	}
+	while (count < num_blocks)
+	{
+		size_t allocated;
 
-	slab->active_page = slab_alloc_page(slab);
+		if (get_active_page(slab) == NULL || slab_page_is_full(slab, get_active_page(slab)))
+		{
+			if (!slab_next_active_page(slab))
+			{
+				break;
+			}
+		}
 
-	if (slab->active_page)
-	{
-		return slab_alloc_from_active_page(slab);
+		allocated				= slab_page_alloc_bulk(slab, get_active_page(slab),
+													   num_blocks - count, blocks + count);
+		slab->allocated_blocks += allocated;
+		count				   += allocated;
 	}
 
-	return NULL;
+	return count;
 }
 
 
@@ -170,30 +349,78 @@ slab_free(slab_t *slab, void *ptr)
 {
 	assert(slab != NULL);
 
-	slab_page_t *slab_page	  = get_slab_page(ptr);
-	bool		page_was_full = slab_page_is_full(slab_page);
+	slab_page_t *slab_page = get_slab_page(slab, ptr);
 
-	slab_page_free(slab_page, get_block_start(ptr));
+	if (slab->concurrent && !is_owner(slab))
+	{
+		free_block_t *block = get_block_start(slab, ptr);
 
-	if (slab_page != slab->active_page)
+		/* Page can't go away before the push, as the block is still allocated */
+		remote_push_chain(slab_page, block, block);
+		atomic_fetch_add(&slab->remote_frees, 1);
+		return;
+	}
+
+	slab_free_local(slab, slab_page, get_block_start(slab, ptr));
+}
+
+
+/*
+ * Free 'num_blocks' blocks. Blocks are grouped by page in batches, so that a
+ * page is looked at and moved between page lists once per batch. Blocks of a
+ * page freed by another thread than the owner are pushed in one chain.
+ */
+void
+slab_free_bulk(slab_t *slab, void **blocks, size_t num_blocks)
+{
+	bulk_entry_t entries[SLAB_BULK_FREE_BATCH];
+
+	for (size_t start = 0; start < num_blocks; start += SLAB_BULK_FREE_BATCH)
 	{
-		if (slab_page_is_empty(slab_page))
+		size_t count = num_blocks - start < SLAB_BULK_FREE_BATCH ? num_blocks - start :
+					   SLAB_BULK_FREE_BATCH;
+
+		for (size_t i = 0; i < count; i++)
 		{
-			dlist_delete(&slab_page->list_node);
-			slab_free_page(slab_page, slab);
+			entries[i].page	 = get_slab_page(slab, blocks[start + i]);
+			entries[i].block = get_block_start(slab, blocks[start + i]);
 		}
-		else
+
+		qsort(entries, count, sizeof(bulk_entry_t), compare_bulk_entries);
+
+		for (size_t i = 0, group; i < count; i += group)
 		{
-			if (page_was_full)
-			{
-				dlist_delete(&slab_page->list_node);
-				dlist_push_head(&slab->partially_full_pages, &slab_page->list_node);
-			}
+			for (group = 1; i + group < count && entries[i + group].page == entries[i].page; group++)
+			{ }
+
+			slab_free_page_group(slab, entries + i, group);
 		}
 	}
 }
 
 
+/*
+ * Reuse blocks freed by other threads. Remote free list of every page is taken
+ * in one exchange, blocks pushed after that are collected next time.
+ */
+void
+slab_collect(slab_t *slab)
+{
+	if (!slab->concurrent || atomic_exchange(&slab->remote_frees, 0) == 0)
+	{
+		return;
+	}
+
+	if (get_active_page(slab))
+	{
+		slab_collect_page(slab, get_active_page(slab));
+	}
+
+	slab_collect_list(slab, &slab->full_pages);
+	slab_collect_list(slab, &slab->partially_full_pages);
+}
+
+
 size_t
 slab_get_size(slab_t *slab)
 {
@@ -208,16 +435,84 @@ slab_get_page_size(slab_t *slab)
 }
 
 
+void
+slab_get_stats(slab_t *slab, slab_stats_t *stats)
+{
+	size_t total_blocks = (size_t) slab->page_count * slab->slab_info.block_count;
+
+	stats->block_size		= slab->slab_info.blocksize;
+	stats->page_size		= slab->slab_info.pagesize;
+	stats->pages			= slab->page_count;
+	stats->max_pages		= slab->max_page_count;
+	stats->allocated_blocks = slab->allocated_blocks;
+	stats->allocated_bytes	= slab->allocated_blocks * slab->slab_info.blocksize;
+	stats->free_blocks		= total_blocks - slab->allocated_blocks;
+	stats->free_bytes		= stats->free_blocks * slab->slab_info.blocksize;
+	stats->fragmentation	= total_blocks > 0 ? (double) stats->free_blocks / total_blocks : 0;
+}
+
+
+/* Set up an empty slab, that isn't bound to a backend yet */
+static void
+slab_init(slab_t *slab, int pagesize, int blocksize, int flags)
+{
+	bool   headerless = (flags & SLAB_HEADERLESS) != 0;
+	size_t page_align = CACHE_LINE_SIZE;
+	int	   page_shift = 6;
+
+	blocksize = MAXALIGN(blocksize);
+	pagesize  = MAXALIGN(pagesize);
+
+	if (headerless)
+	{
+		while (page_align < (size_t) pagesize)
+		{
+			page_align <<= 1;
+			page_shift++;
+		}
+	}
+
+	static_assert(CACHE_LINE_SIZE == 1 << 6, "page_shift starts at log2 of CACHE_LINE_SIZE");
+
+	slab->active_page				   = 0;
+	slab->slab_info.blocksize		   = blocksize;
+	slab->slab_info.pagesize		   = pagesize;
+	slab->slab_info.page_align		   = page_align;
+	slab->slab_info.page_shift		   = page_shift;
+	slab->slab_info.header_size		   = headerless ? 0 : slab_get_header_size();
+	slab->slab_info.first_block_offset = headerless ? CACHEALIGN(sizeof(slab_page_t)) :
+										 sizeof(slab_page_t);
+	slab->slab_info.block_count = (pagesize - slab->slab_info.first_block_offset) / blocksize;
+	slab->bmgr_offset			= 0;
+	slab->page_base_set			= false;
+	slab->page_base_offset		= 0;
+	slab->page_map_offset		= 0;
+	slab->page_tag				= 0;
+	slab->page_count			= 0;
+	slab->max_page_count		= 0;
+	slab->allocated_blocks		= 0;
+	slab->concurrent			= (flags & SLAB_CONCURRENT) != 0;
+	slab->owner					= current_thread_id();
+	atomic_init(&slab->remote_frees, 0);
+
+	olist_init(slab, &slab->full_pages);
+	olist_init(slab, &slab->partially_full_pages);
+}
+
+
 static void *
 slab_alloc_from_active_page(slab_t *slab)
 {
-	if (slab->active_page)
+	slab_page_t *active_page = get_active_page(slab);
+
+	if (active_page)
 	{
-		void *mem = slab_page_alloc(slab->active_page);
+		void *mem = slab_page_alloc(slab, active_page);
 
 		if (mem)
 		{
-			return get_user_pointer(mem, slab->active_page);
+			slab->allocated_blocks++;
+			return get_user_pointer(slab, mem, active_page);
 		}
 	}
 
@@ -225,38 +520,357 @@ slab_alloc_from_active_page(slab_t *slab)
 }
 
 
+/*
+ * Make an active page, that has free blocks, out of a partially full page or a
+ * new one. Full active page is moved to full pages. Returns false, if a new
+ * page can't be allocated.
+ */
+static bool
+slab_next_active_page(slab_t *slab)
+{
+	slab_page_t *active_page = get_active_page(slab);
+
+	if (active_page)
+	{
+		assert(slab_page_is_full(slab, active_page));
+		olist_push_head(slab, &slab->full_pages, &active_page->list_node);
+	}
+
+	set_active_page(slab, NULL);
+
+	/* Blocks freed by other threads may make a new page unnecessary */
+	if (slab->concurrent && atomic_load_explicit(&slab->remote_frees, memory_order_relaxed) > 0)
+	{
+		slab_collect(slab);
+	}
+
+	if (!olist_is_empty(slab, &slab->partially_full_pages))
+	{
+		olist_node *node = olist_pop_head_node(slab, &slab->partially_full_pages);
+
+		active_page = get_list_page(slab, olist_offset_of(slab, node));
+		set_active_page(slab, active_page);
+
+		assert(!slab_page_is_empty(active_page));
+
+		return true;
+	}
+
+	set_active_page(slab, slab_alloc_page(slab));
+
+	return get_active_page(slab) != NULL;
+}
+
+
+/* Allocate up to 'num_blocks' blocks of a page: free list first, then never used blocks */
+static size_t
+slab_page_alloc_bulk(slab_t *slab, slab_page_t *slab_page, size_t num_blocks, void **blocks)
+{
+	slab_info_t *sinfo = &slab->slab_info;
+	size_t		count  = 0;
+	size_t		carve;
+	char		*mem;
+
+	while (count < num_blocks && slab_page->freelist != 0)
+	{
+		free_block_t *block = (free_block_t *) ((char *) slab_page + slab_page->freelist);
+
+		slab_page->freelist = block->next;
+		blocks[count++]		= get_user_pointer(slab, block, slab_page);
+	}
+
+	carve = sinfo->block_count - slab_page->next_free_index;
+	carve = num_blocks - count < carve ? num_blocks - count : carve;
+	mem	  = (char *) slab_page + sinfo->first_block_offset + sinfo->blocksize *
+			slab_page->next_free_index;
+
+	for (size_t i = 0; i < carve; i++, mem += sinfo->blocksize)
+	{
+		blocks[count++] = get_user_pointer(slab, mem, slab_page);
+	}
+
+	slab_page->next_free_index	 += carve;
+	slab_page->alloc_block_count += count;
+
+	return count;
+}
+
+
+/* Free a block of the slab's owner, page is given back once it's empty */
+static void
+slab_free_local(slab_t *slab, slab_page_t *slab_page, void *block)
+{
+	bool page_was_full = slab_page_is_full(slab, slab_page);
+
+	slab_page_free(slab_page, block);
+	slab->allocated_blocks--;
+
+	slab_update_page_lists(slab, slab_page, page_was_full);
+}
+
+
+/* Free 'count' blocks of one page, pushed as a chain, if the caller isn't the owner */
+static void
+slab_free_page_group(slab_t *slab, bulk_entry_t *entries, size_t count)
+{
+	slab_page_t *slab_page = entries[0].page;
+	bool		page_was_full;
+
+	if (slab->concurrent && !is_owner(slab))
+	{
+		for (size_t i = 0; i + 1 < count; i++)
+		{
+			((free_block_t *) entries[i].block)->next = (char *) entries[i + 1].block -
+														(char *) slab_page;
+		}
+
+		remote_push_chain(slab_page, entries[0].block, entries[count - 1].block);
+		atomic_fetch_add(&slab->remote_frees, count);
+		return;
+	}
+
+	page_was_full = slab_page_is_full(slab, slab_page);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		slab_page_free(slab_page, entries[i].block);
+	}
+
+	slab->allocated_blocks -= count;
+
+	slab_update_page_lists(slab, slab_page, page_was_full);
+}
+
+
+/* Move a page, that blocks were freed in, between page lists or give it back, if it's empty */
+static void
+slab_update_page_lists(slab_t *slab, slab_page_t *slab_page, bool page_was_full)
+{
+	if (slab_page != get_active_page(slab))
+	{
+		if (slab_page_is_empty(slab_page))
+		{
+			olist_delete(slab, &slab_page->list_node);
+			slab_free_page(slab_page, slab);
+		}
+		else
+		{
+			if (page_was_full)
+			{
+				olist_delete(slab, &slab_page->list_node);
+				olist_push_head(slab, &slab->partially_full_pages, &slab_page->list_node);
+			}
+		}
+	}
+}
+
+
+/* Memory for a page or the control block, from the slab's backend */
 static void *
-get_user_pointer(void *ptr, slab_page_t *slab_page)
+slab_acquire(slab_t *slab, size_t size, size_t align)
 {
-	*((slab_page_t **) ptr) = slab_page;
-	return (void *) ((char *) ptr + slab_get_header_size());
+	if (slab->backend == SLAB_BACKEND_BMGR)
+	{
+		return buddy_alloc_aligned(get_bmgr(slab), size, align);
+	}
+
+	return slab->alloc(size, align, slab->arg_alloc);
+}
+
+
+/* Give memory, that was taken with slab_acquire, back */
+static void
+slab_release(slab_t *slab, void *ptr, size_t size)
+{
+	if (slab->backend == SLAB_BACKEND_BMGR)
+	{
+		buddy_free(get_bmgr(slab), ptr, size);
+	}
+	else if (slab->sized_free != NULL)
+	{
+		slab->sized_free(ptr, size, slab->arg_alloc);
+	}
+	else
+	{
+		slab->free(ptr, slab->arg_alloc);
+	}
+}
+
+
+static bmgr_t *
+get_bmgr(slab_t *slab)
+{
+	return (bmgr_t *) ((char *) slab + slab->bmgr_offset);
+}
+
+
+/* Address, that headerless pages are aligned relative to */
+static uintptr_t
+get_page_base(slab_t *slab)
+{
+	return slab->page_base_set ? (uintptr_t) slab + slab->page_base_offset : 0;
+}
+
+
+/* Mark a page of the slab in it's page map, if it has one */
+static void
+map_page(slab_t *slab, slab_page_t *slab_page, uint8_t tag)
+{
+	_Atomic uint8_t *page_map;
+	size_t			index;
+
+	if (slab->page_map_offset == 0)
+	{
+		return;
+	}
+
+	page_map = (_Atomic uint8_t *) ((char *) slab + slab->page_map_offset);
+	index	 = ((uintptr_t) slab_page - get_page_base(slab)) >> slab->slab_info.page_shift;
+
+	atomic_store_explicit(&page_map[index], tag, memory_order_relaxed);
+}
+
+
+/* Orders bulk_entry_t by page */
+static int
+compare_bulk_entries(const void *a, const void *b)
+{
+	uintptr_t page_a = (uintptr_t) ((const bulk_entry_t *) a)->page;
+	uintptr_t page_b = (uintptr_t) ((const bulk_entry_t *) b)->page;
+
+	return (page_a > page_b) - (page_a < page_b);
+}
+
+
+/* Collect remote frees of the pages of a page list, pages may leave the list */
+static void
+slab_collect_list(slab_t *slab, olist_head *list)
+{
+	size_t end = olist_offset_of(slab, &list->head);
+
+	for (size_t cur = list->head.next, next; cur != end; cur = next)
+	{
+		next = olist_node_at(slab, cur)->next;
+		slab_collect_page(slab, get_list_page(slab, cur));
+	}
+}
+
+
+/* Free blocks on the remote free list of a page, it may be given back */
+static void
+slab_collect_page(slab_t *slab, slab_page_t *slab_page)
+{
+	size_t offset = atomic_exchange_explicit(&slab_page->remote_freelist, 0,
+											 memory_order_acquire);
+
+	while (offset != 0)
+	{
+		free_block_t *block = (free_block_t *) ((char *) slab_page + offset);
+
+		offset = block->next;
+		slab_free_local(slab, slab_page, block);
+	}
+}
+
+
+/* Push blocks of a page, linked from 'first' to 'last', onto it's remote free list */
+static void
+remote_push_chain(slab_page_t *slab_page, free_block_t *first, free_block_t *last)
+{
+	size_t head = atomic_load_explicit(&slab_page->remote_freelist, memory_order_relaxed);
+
+	do
+	{
+		last->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&slab_page->remote_freelist, &head,
+													(char *) first - (char *) slab_page,
+													memory_order_release, memory_order_relaxed));
+}
+
+
+static void *
+get_user_pointer(slab_t *slab, void *ptr, slab_page_t *slab_page)
+{
+	if (slab->slab_info.header_size == 0)
+	{
+		return ptr;
+	}
+
+	*((size_t *) ptr) = (char *) ptr - (char *) slab_page;
+	return (void *) ((char *) ptr + slab->slab_info.header_size);
 }
 
 
 static void *
-get_block_start(void *ptr)
+get_block_start(slab_t *slab, void *ptr)
+{
+	return (char *) ptr - slab->slab_info.header_size;
+}
+
+
+/*
+ * Page of a block, found by masking a headerless block's address, or by the
+ * offset of the page from the block, that it's header holds.
+ */
+static slab_page_t *
+get_slab_page(slab_t *slab, void *ptr)
+{
+	if (slab->slab_info.header_size == 0)
+	{
+		uintptr_t base = get_page_base(slab);
+
+		return (slab_page_t *) (base + (((uintptr_t) ptr - base) &
+										~(slab->slab_info.page_align - 1)));
+	}
+
+	ptr = get_block_start(slab, ptr);
+
+	return (slab_page_t *) ((char *) ptr - *(size_t *) ptr);
+}
+
+
+static slab_page_t *
+get_active_page(slab_t *slab)
+{
+	return slab->active_page == 0 ? NULL : (slab_page_t *) ((char *) slab + slab->active_page);
+}
+
+
+static void
+set_active_page(slab_t *slab, slab_page_t *slab_page)
 {
-	return (char *) ptr - slab_get_header_size();
+	slab->active_page = slab_page == NULL ? 0 : (size_t) ((char *) slab_page - (char *) slab);
 }
 
 
+/* Page, whose list_node is at 'node_offset' from the slab */
 static slab_page_t *
-get_slab_page(void *ptr)
+get_list_page(slab_t *slab, size_t node_offset)
 {
-	return *(slab_page_t **) ((char *) ptr - slab_get_header_size());
+	return (slab_page_t *) ((char *) olist_node_at(slab, node_offset) -
+							offsetof(slab_page_t, list_node));
 }
 
 
 static slab_page_t *
 slab_alloc_page(slab_t *slab)
 {
-	slab_page_t *slab_page = slab->alloc(slab->slab_info.pagesize, CACHE_LINE_SIZE,
-										 slab->arg_alloc);
+	slab_page_t *slab_page = slab_acquire(slab, slab->slab_info.pagesize,
+										  slab->slab_info.page_align);
 
 	if (slab_page)
 	{
+		assert(((uintptr_t) slab_page - get_page_base(slab)) % slab->slab_info.page_align == 0 ||
+			   slab->slab_info.header_size != 0);
+
 		slab->page_count++;
-		slab_page_init(slab_page, slab);
+		slab_page_init(slab_page);
+		map_page(slab, slab_page, slab->page_tag);
+
+		if (slab->page_count > slab->max_page_count)
+		{
+			slab->max_page_count = slab->page_count;
+		}
 	}
 
 	return slab_page;
@@ -267,38 +881,36 @@ static void
 slab_free_page(slab_page_t *slab_page, slab_t *slab)
 {
 	slab->page_count--;
-	slab->free(slab_page, slab->arg_alloc);
+	map_page(slab, slab_page, 0);
+	slab_release(slab, slab_page, slab->slab_info.pagesize);
 }
 
 
 static void
-slab_page_init(slab_page_t *slab_page, slab_t *slab)
+slab_page_init(slab_page_t *slab_page)
 {
 	assert(slab_page != NULL);
 
 	slab_page->next_free_index	 = 0;
 	slab_page->alloc_block_count = 0;
-	slab_page->slab				 = slab;
+	slab_page->freelist			 = 0;
 
-	slist_init(&slab_page->freelist);
+	atomic_init(&slab_page->remote_freelist, 0);
 }
 
 
 static void *
-slab_page_alloc(slab_page_t *slab_page)
+slab_page_alloc(slab_t *slab, slab_page_t *slab_page)
 {
-	void		*mem;
-	slab_info_t *sinfo;
+	slab_info_t *sinfo = &slab->slab_info;
 
 	assert(slab_page != NULL);
 
-	sinfo = &slab_page->slab->slab_info;
-
-	if (!slist_is_empty(&slab_page->freelist))
+	if (slab_page->freelist != 0)
 	{
-		free_block_t *free_block = slist_head_element(free_block_t, next, &slab_page->freelist);
+		free_block_t *free_block = (free_block_t *) ((char *) slab_page + slab_page->freelist);
 
-		slist_pop_head_node(&slab_page->freelist);
+		slab_page->freelist = free_block->next;
 
 		slab_page->alloc_block_count++;
 		return (void *) free_block;
@@ -308,7 +920,7 @@ slab_page_alloc(slab_page_t *slab_page)
 	{
 		char *mem;
 
-		mem = (char *) slab_page + sizeof(slab_page_t) + sinfo->blocksize *
+		mem = (char *) slab_page + sinfo->first_block_offset + sinfo->blocksize *
 			  (slab_page->next_free_index);
 
 		slab_page->next_free_index++;
@@ -326,7 +938,8 @@ slab_page_free(slab_page_t *slab_page, void *ptr)
 	assert(slab_page != NULL);
 
 	slab_page->alloc_block_count--;
-	slist_push_head(&slab_page->freelist, &((free_block_t *) ptr)->next);
+	((free_block_t *) ptr)->next = slab_page->freelist;
+	slab_page->freelist			 = (char *) ptr - (char *) slab_page;
 }
 
 
@@ -340,9 +953,56 @@ slab_page_is_empty(slab_page_t *slab_page)
 
 
 static bool
-slab_page_is_full(slab_page_t *slab_page)
+slab_page_is_full(slab_t *slab, slab_page_t *slab_page)
 {
 	assert(slab_page != NULL);
 
-	return slab_page->alloc_block_count == slab_page->slab->slab_info.block_count;
+	return slab_page->alloc_block_count == slab->slab_info.block_count;
+}
+
+
+/* Is the calling thread the owner of a concurrent slab? */
+static bool
+is_owner(slab_t *slab)
+{
+	return current_thread_id() == slab->owner;
+}
+
+
+/*
+ * Id of the calling thread. Owner of a slab in shared memory is compared with
+ * threads of other processes, so on Linux it is the kernel's thread id, which
+ * is unique across processes. Elsewhere it's pthread_self, which is unique
+ * only within a process.
+ */
+static uint64_t
+current_thread_id(void)
+{
+	if (thread_id == 0)
+	{
+		pthread_once(&thread_id_once, register_fork_handler);
+
+#ifdef __linux__
+		thread_id = (uint64_t) syscall(SYS_gettid);
+#else
+		thread_id = (uint64_t) (uintptr_t) pthread_self();
+#endif /* __linux__ */
+	}
+
+	return thread_id;
+}
+
+
+/* Forked child runs in a copy of the forking thread, which has an id of it's own */
+static void
+forget_thread_id(void)
+{
+	thread_id = 0;
+}
+
+
+static void
+register_fork_handler(void)
+{
+	pthread_atfork(NULL, NULL, forget_thread_id);
 }
@@ -0,0 +1,379 @@
+#include "bmgr/bmgr.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Only small size classes are cached, larger blocks go directly to buddy manager */
+#define CACHE_SIZE_CLASSES 16
+#define MAGAZINE_SIZE	   32
+#define MAGAZINE_BATCH	   (MAGAZINE_SIZE / 2)
+
+/* # of buddy managers, a thread caches blocks of at the same time */
+#define CACHE_BINDINGS 4
+
+/* Stack of ready to use blocks of a size class */
+typedef struct
+{
+	int	 count;
+	void *blocks[MAGAZINE_SIZE];
+} magazine_t;
+
+/* Cached blocks of a buddy manager */
+typedef struct
+{
+	bmgr_t	 *bmgr;            /* Buddy manager, the cached blocks belong to, NULL if unused */
+	size_t	 min_alloc_size;
+	int		 log2_min_alloc_size;
+	int		 num_size_classes; /* # of size classes that are cached */
+	uint64_t last_used;        /* Value of tcache.clock, when the binding was last looked up */
+
+	magazine_t magazines[CACHE_SIZE_CLASSES];
+} tcache_binding_t;
+
+/*
+ * Cache of a thread keeps blocks of up to CACHE_BINDINGS buddy managers, so
+ * that threads switching between a few heaps don't flush their cache on
+ * every switch. Least recently used binding is flushed, when a thread starts
+ * using one more buddy manager.
+ */
+typedef struct
+{
+	size_t	 cached_bytes;      /* Total size of all cached blocks */
+	size_t	 max_cached_bytes;  /* Cap on cached_bytes */
+	bool	 registered;        /* Is thread exit callback registered? */
+	uint64_t clock;             /* Counts binding lookups */
+
+	tcache_binding_t *last;     /* Binding found by the previous lookup */
+	tcache_binding_t bindings[CACHE_BINDINGS];
+} tcache_t;
+
+static _Thread_local tcache_t tcache = { .max_cached_bytes = BUDDY_CACHE_DEFAULT_LIMIT };
+
+static pthread_key_t  tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static tcache_binding_t *tcache_get(bmgr_t *bmgr);
+static void				tcache_bind(tcache_binding_t *cache, bmgr_t *bmgr);
+static void				tcache_unbind(tcache_binding_t *cache);
+static void				tcache_create_key(void);
+static void				tcache_thread_exit(void *arg);
+static int				tcache_size_class(tcache_binding_t *cache, size_t size);
+static size_t			tcache_get_size(tcache_binding_t *cache, int szc);
+static void				*magazine_refill(tcache_binding_t *cache, int szc);
+static void				magazine_drain(tcache_binding_t *cache, int szc, int count);
+static int		log_2(size_t n);
+
+
+void *
+buddy_cached_alloc(bmgr_t *bmgr, size_t size)
+{
+	tcache_binding_t *cache = tcache_get(bmgr);
+	int				 szc   = tcache_size_class(cache, size);
+	magazine_t		 *mag;
+
+	if (szc < 0)
+	{
+		return buddy_alloc(bmgr, size);
+	}
+
+	mag = &cache->magazines[szc];
+
+	if (mag->count == 0)
+	{
+		return magazine_refill(cache, szc);
+	}
+
+	tcache.cached_bytes -= tcache_get_size(cache, szc);
+
+	return mag->blocks[--mag->count];
+}
+
+
+void
+buddy_cached_free(bmgr_t *bmgr, void *ptr, size_t size)
+{
+	tcache_binding_t *cache;
+	int				 szc;
+	size_t			 block_size;
+	magazine_t		 *mag;
+
+	if (ptr == NULL)
+	{
+		return;
+	}
+
+	cache = tcache_get(bmgr);
+	szc	  = tcache_size_class(cache, size);
+
+	if (szc < 0)
+	{
+		buddy_free(bmgr, ptr, size);
+		return;
+	}
+
+	mag		   = &cache->magazines[szc];
+	block_size = tcache_get_size(cache, szc);
+
+	if (mag->count == MAGAZINE_SIZE || tcache.cached_bytes + block_size > tcache.max_cached_bytes)
+	{
+		magazine_drain(cache, szc, MAGAZINE_BATCH);
+	}
+
+	/* Even an empty magazine can't hold this block, without exceeding the cap */
+	if (tcache.cached_bytes + block_size > tcache.max_cached_bytes)
+	{
+		buddy_free(bmgr, ptr, block_size);
+		return;
+	}
+
+	tcache.cached_bytes		   += block_size;
+	mag->blocks[mag->count++]	= ptr;
+}
+
+
+/* Return all blocks cached by the calling thread to their buddy managers */
+void
+buddy_cache_flush(void)
+{
+	for (int i = 0; i < CACHE_BINDINGS; i++)
+	{
+		tcache_unbind(&tcache.bindings[i]);
+	}
+
+	assert(tcache.cached_bytes == 0);
+}
+
+
+/* Set cap on bytes cached by the calling thread */
+void
+buddy_cache_set_limit(size_t max_cached_bytes)
+{
+	tcache.max_cached_bytes = max_cached_bytes;
+
+	for (int i = 0; i < CACHE_BINDINGS && tcache.cached_bytes > max_cached_bytes; i++)
+	{
+		tcache_binding_t *cache = &tcache.bindings[i];
+
+		for (int szc = cache->num_size_classes - 1;
+			 szc >= 0 && tcache.cached_bytes > max_cached_bytes; szc--)
+		{
+			magazine_drain(cache, szc, cache->magazines[szc].count);
+		}
+	}
+}
+
+
+/* Bytes currently cached by the calling thread */
+size_t
+buddy_cache_size(void)
+{
+	return tcache.cached_bytes;
+}
+
+
+static tcache_binding_t *
+tcache_get(bmgr_t *bmgr)
+{
+	tcache_binding_t *victim;
+
+	tcache.clock++;
+
+	if (tcache.last != NULL && tcache.last->bmgr == bmgr)
+	{
+		tcache.last->last_used = tcache.clock;
+		return tcache.last;
+	}
+
+	victim = &tcache.bindings[0];
+
+	for (int i = 0; i < CACHE_BINDINGS; i++)
+	{
+		tcache_binding_t *cache = &tcache.bindings[i];
+
+		if (cache->bmgr == bmgr)
+		{
+			victim = cache;
+			break;
+		}
+
+		if (cache->last_used < victim->last_used)
+		{
+			victim = cache;
+		}
+	}
+
+	if (victim->bmgr != bmgr)
+	{
+		tcache_unbind(victim);
+		tcache_bind(victim, bmgr);
+	}
+
+	victim->last_used = tcache.clock;
+	tcache.last		  = victim;
+
+	return victim;
+}
+
+
+static void
+tcache_bind(tcache_binding_t *cache, bmgr_t *bmgr)
+{
+	size_t min_alloc_size = buddy_min_alloc_size(bmgr);
+	size_t max_alloc_size = buddy_max_alloc_size(bmgr);
+	int	   num_size_classes;
+
+	num_size_classes = log_2(max_alloc_size) - log_2(min_alloc_size) + 1;
+
+	cache->bmgr				   = bmgr;
+	cache->min_alloc_size	   = min_alloc_size;
+	cache->log2_min_alloc_size = log_2(min_alloc_size);
+	cache->num_size_classes	   = num_size_classes < CACHE_SIZE_CLASSES ? num_size_classes :
+								 CACHE_SIZE_CLASSES;
+
+	if (!tcache.registered)
+	{
+		pthread_once(&tcache_key_once, tcache_create_key);
+		pthread_setspecific(tcache_key, &tcache);
+		tcache.registered = true;
+	}
+}
+
+
+/* Give cached blocks of the binding back to it's buddy manager */
+static void
+tcache_unbind(tcache_binding_t *cache)
+{
+	if (cache->bmgr == NULL)
+	{
+		return;
+	}
+
+	for (int szc = 0; szc < cache->num_size_classes; szc++)
+	{
+		magazine_drain(cache, szc, cache->magazines[szc].count);
+	}
+
+	cache->bmgr		  = NULL;
+	cache->last_used = 0;
+
+	if (tcache.last == cache)
+	{
+		tcache.last = NULL;
+	}
+}
+
+
+static void
+tcache_create_key(void)
+{
+	pthread_key_create(&tcache_key, tcache_thread_exit);
+}
+
+
+/* Give all cached blocks back, when the thread exits */
+static void
+tcache_thread_exit(void *arg)
+{
+	(void) arg;
+
+	buddy_cache_flush();
+}
+
+
+/*
+ * Returns -1, if blocks of given size are not cached. Only sizes, that round
+ * up to a whole power of two of min_alloc_size units are cached, others are
+ * trimmed to size by buddy_alloc.
+ */
+static int
+tcache_size_class(tcache_binding_t *cache, size_t size)
+{
+	size_t units = (size + cache->min_alloc_size - 1) >> cache->log2_min_alloc_size;
+	int	   szc;
+
+	if (units == 0 || (units & (units - 1)) != 0)
+	{
+		return -1;
+	}
+
+	szc = log_2(units);
+
+	return szc < cache->num_size_classes ? szc : -1;
+}
+
+
+static size_t
+tcache_get_size(tcache_binding_t *cache, int szc)
+{
+	return cache->min_alloc_size << szc;
+}
+
+
+/* Fill half of the magazine from buddy manager and return one more block to the caller */
+static void *
+magazine_refill(tcache_binding_t *cache, int szc)
+{
+	magazine_t *mag		   = &cache->magazines[szc];
+	size_t	   block_size  = tcache_get_size(cache, szc);
+	size_t	   space	   = tcache.max_cached_bytes > tcache.cached_bytes ?
+							 tcache.max_cached_bytes - tcache.cached_bytes : 0;
+	int		   batch	   = space / block_size < MAGAZINE_BATCH ? space / block_size :
+							 MAGAZINE_BATCH;
+	size_t	   allocated;
+
+	assert(mag->count == 0);
+
+	/* Block for the caller is the last one */
+	allocated = buddy_alloc_bulk(cache->bmgr, block_size, batch + 1, mag->blocks);
+
+	if (allocated == 0)
+	{
+		return NULL;
+	}
+
+	mag->count			 = allocated - 1;
+	tcache.cached_bytes += mag->count * block_size;
+
+	return mag->blocks[mag->count];
+}
+
+
+/* Return 'count' least recently freed blocks of the magazine to buddy manager */
+static void
+magazine_drain(tcache_binding_t *cache, int szc, int count)
+{
+	magazine_t *mag		   = &cache->magazines[szc];
+	size_t	   block_size  = tcache_get_size(cache, szc);
+	size_t	   sizes[MAGAZINE_SIZE];
+
+	if (count > mag->count)
+	{
+		count = mag->count;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		sizes[i] = block_size;
+	}
+
+	buddy_free_bulk(cache->bmgr, mag->blocks, sizes, count);
+
+	for (int i = count; i < mag->count; i++)
+	{
+		mag->blocks[i - count] = mag->blocks[i];
+	}
+
+	mag->count			-= count;
+	tcache.cached_bytes -= count * block_size;
+}
+
+
+static int
+log_2(size_t n)
+{
+	assert(n > 0);
+
+	return sizeof(n) * 8 - __builtin_clzl(n) - 1;
+}
@@ -1,3 +1,4 @@
+#define CATCH_CONFIG_NO_POSIX_SIGNALS /* Catch's alternate signal stack does not build against newer glibc */
 #define CATCH_CONFIG_MAIN /* This tells Catch to provide a main() - only do this in one cpp file */
 #include "test/catch.hpp"
 
@@ -1,13 +1,25 @@
 #include "test/catch.hpp"
 #include "test/testBase.h"
 #include "bmgr/bmgr.h"
+#include "bmgr/bmgr.hpp"
 
 #include <memory>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include <random>
 #include <unordered_map>
 #include <list>
 #include <iostream>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <csetjmp>
+#include <csignal>
+
+#include <sys/mman.h>
+#include <unistd.h>
 
 using random_gen = std::ranlux24_base;
 
@@ -23,6 +35,65 @@ randomize_mem(random_gen &rand, void *ptr, size_t size)
 }
 
 
+/* Anonymous mapping to create a buddy manager in, unmapped when it goes out of scope */
+class mapped_region
+{
+public:
+	explicit mapped_region(size_t size, int map_flags = MAP_PRIVATE)
+		: size_(size),
+		  mem_(mmap(nullptr, size, PROT_READ | PROT_WRITE, map_flags | MAP_ANONYMOUS, -1, 0))
+	{
+		REQUIRE(mem_ != MAP_FAILED);
+	}
+
+
+	~mapped_region()
+	{
+		munmap(mem_, size_);
+	}
+
+
+	mapped_region(const mapped_region &)			 = delete;
+	mapped_region &operator=(const mapped_region &) = delete;
+
+	char *
+	get() const
+	{
+		return static_cast<char *>(mem_);
+	}
+
+
+private:
+	size_t size_;
+	void   *mem_;
+};
+
+
+/* Ways of tracking free blocks, most tests are run with each of them */
+static const struct
+{
+	const char *name;
+	int		   flags;
+} free_block_trackings[] = {
+	{ "Free lists", 0 },
+	{ "Out of band free bitmaps", BMGR_OUT_OF_BAND },
+};
+
+/* Run 'test' in a section per free block tracking, passing it 'flags' of the tracking added */
+template <typename Test>
+static void
+with_free_block_trackings(int flags, Test test)
+{
+	for (const auto &tracking : free_block_trackings)
+	{
+		SECTION(tracking.name)
+		{
+			test(flags | tracking.flags);
+		}
+	}
+}
+
+
 TEST_CASE("BuddyManager Test", "[allocator]")
 {
 	using namespace std;
@@ -123,3 +194,2975 @@ TEST_CASE("BuddyManager Test", "[allocator]")
 	alloc_size_vector.push_back(BuddyPageSize / 4);
 	do_alloc(alloc_size_vector);
 }
+
+
+static void
+test_concurrent(int flags)
+{
+	using namespace std;
+
+	constexpr auto BuddyPageSize		  = 1024 * 1024;
+	constexpr auto BuddyMinAllocSize	  = 4 * 1024;
+	constexpr auto BuddyManagerAllocLimit = 64 * 1024 * 1024;
+	constexpr auto NumSizeClasses		  = 5;
+	constexpr auto MaxLiveAllocations	  = 32;
+	constexpr auto OpsPerThread			  = 64 * 1024;
+
+	unique_ptr<char[]> buddy_mem(new char[BuddyManagerAllocLimit]);
+	bmgr_t			   *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize,
+														buddy_mem.get(), BuddyManagerAllocLimit,
+														flags);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	/* Every thread stamps it's allocations and verifies the stamp before freeing them */
+	auto worker = [buddy_manager](size_t thread_id, atomic<bool> &failed)
+				  {
+					  random_gen				 rand_op(thread_id + 1);
+					  vector<pair<void *, size_t> > live{ };
+
+					  for (int i = 0; i < OpsPerThread; i++)
+					  {
+						  if (live.size() < MaxLiveAllocations && (live.empty() || rand_op() % 2))
+						  {
+							  size_t size = BuddyMinAllocSize << (rand_op() % NumSizeClasses);
+							  auto	 mem  = static_cast<size_t *>(buddy_alloc(buddy_manager, size));
+
+							  if (mem == nullptr)
+							  {
+								  failed = true;
+								  return;
+							  }
+
+							  mem[0]							  = thread_id;
+							  mem[size / sizeof(size_t) - 1] = thread_id;
+							  live.push_back({ mem, size });
+						  }
+						  else
+						  {
+							  auto idx		= rand_op() % live.size();
+							  auto ptr_size = live[idx];
+							  auto mem		= static_cast<size_t *>(ptr_size.first);
+
+							  if (mem[0] != thread_id ||
+								  mem[ptr_size.second / sizeof(size_t) - 1] != thread_id)
+							  {
+								  failed = true;
+							  }
+
+							  buddy_free(buddy_manager, ptr_size.first, ptr_size.second);
+							  live[idx] = live.back();
+							  live.pop_back();
+						  }
+					  }
+
+					  for (auto &ptr_size : live)
+					  {
+						  buddy_free(buddy_manager, ptr_size.first, ptr_size.second);
+					  }
+				  };
+
+	size_t max_threads = max(4u, thread::hardware_concurrency());
+
+	for (size_t num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+	{
+		atomic<bool>	failed{ false };
+		vector<thread> threads{ };
+		bmgr_stats_t   before, after;
+
+		bmgr_get_stats(buddy_manager, &before);
+
+		auto start = chrono::steady_clock::now();
+
+		for (size_t t = 0; t < num_threads; t++)
+		{
+			threads.emplace_back(worker, t, ref(failed));
+		}
+
+		for (auto &t : threads)
+		{
+			t.join();
+		}
+
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+		cout << "bmgr concurrent" << (flags & BMGR_OUT_OF_BAND ? " (out of band)" : "")
+			 << (flags & BMGR_LAZY ? " (lazy): " : ": ")
+			 << num_threads << " threads, "
+			 << static_cast<size_t>(num_threads * OpsPerThread / elapsed.count()) << " ops/sec"
+			 << endl;
+
+		REQUIRE(!failed);
+
+		/*
+		 * Every request and free takes the lock of it's size class, requests of
+		 * different sizes take different locks, and a single thread never finds
+		 * a lock held.
+		 */
+		size_t acquisitions = 0, contentions = 0;
+
+		bmgr_get_stats(buddy_manager, &after);
+
+		for (int szc = 0; szc < after.num_size_classes; szc++)
+		{
+			size_t szc_acquisitions = after.size_classes[szc].lock_acquisitions -
+									  before.size_classes[szc].lock_acquisitions;
+
+			if (szc < NumSizeClasses)
+			{
+				REQUIRE(szc_acquisitions > 0);
+			}
+
+			acquisitions += szc_acquisitions;
+			contentions	 += after.size_classes[szc].lock_contentions -
+							before.size_classes[szc].lock_contentions;
+		}
+
+		cout << "  size class locks: " << acquisitions << " acquisitions, " << contentions
+			 << " contended" << endl;
+
+		REQUIRE(acquisitions >= num_threads * OpsPerThread);
+
+		if (num_threads == 1)
+		{
+			REQUIRE(contentions == 0);
+		}
+	}
+
+	/* All memory must be back in the manager, so every chunk can be allocated again */
+	size_t num_chunks = buddy_total_alloc_memory(buddy_manager) / BuddyPageSize;
+
+	for (size_t i = 0; i < num_chunks; i++)
+	{
+		REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) != nullptr);
+	}
+
+	REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) == nullptr);
+}
+
+
+TEST_CASE("BuddyManager Concurrent Test", "[allocator][concurrent]")
+{
+	with_free_block_trackings(BMGR_CONCURRENT, test_concurrent);
+
+	SECTION("Lazy coalescing")
+	{
+		test_concurrent(BMGR_CONCURRENT | BMGR_LAZY);
+	}
+}
+
+
+TEST_CASE("BuddyManager Thread Cache Test", "[allocator][concurrent]")
+{
+	using namespace std;
+
+	constexpr auto BuddyPageSize		  = 1024 * 1024;
+	constexpr auto BuddyMinAllocSize	  = 4 * 1024;
+	constexpr auto BuddyManagerAllocLimit = 32 * 1024 * 1024;
+	constexpr auto NumThreads			  = 4;
+	constexpr auto AllocsPerThread		  = 256;
+
+	unique_ptr<char[]> buddy_mem(new char[BuddyManagerAllocLimit]);
+	bmgr_t			   *buddy_manager = bmgr_create_concurrent(BuddyMinAllocSize, BuddyPageSize,
+															   buddy_mem.get(),
+															   BuddyManagerAllocLimit);
+
+	auto all_chunks_free = [buddy_manager]()
+						   {
+							   size_t		  num_chunks = buddy_total_alloc_memory(buddy_manager) /
+														   BuddyPageSize;
+							   vector<void *> chunks{ };
+
+							   for (size_t i = 0; i < num_chunks; i++)
+							   {
+								   void *chunk = buddy_alloc(buddy_manager, BuddyPageSize);
+
+								   if (chunk == nullptr)
+								   {
+									   break;
+								   }
+
+								   chunks.push_back(chunk);
+							   }
+
+							   for (auto chunk : chunks)
+							   {
+								   buddy_free(buddy_manager, chunk, BuddyPageSize);
+							   }
+
+							   return chunks.size() == num_chunks;
+						   };
+
+	SECTION("Cached blocks are reused and bounded")
+	{
+		constexpr auto CacheLimit = 8 * BuddyMinAllocSize;
+
+		buddy_cache_set_limit(CacheLimit);
+
+		void *mem = buddy_cached_alloc(buddy_manager, BuddyMinAllocSize);
+
+		REQUIRE(mem != nullptr);
+		REQUIRE(buddy_cache_size() <= CacheLimit);
+
+		buddy_cached_free(buddy_manager, mem, BuddyMinAllocSize);
+		REQUIRE(buddy_cached_alloc(buddy_manager, BuddyMinAllocSize) == mem);
+		buddy_cached_free(buddy_manager, mem, BuddyMinAllocSize);
+
+		vector<void *> ptrs{ };
+
+		for (int i = 0; i < 64; i++)
+		{
+			ptrs.push_back(buddy_cached_alloc(buddy_manager, BuddyMinAllocSize * 2));
+			REQUIRE(ptrs.back() != nullptr);
+		}
+
+		for (auto ptr : ptrs)
+		{
+			buddy_cached_free(buddy_manager, ptr, BuddyMinAllocSize * 2);
+			REQUIRE(buddy_cache_size() <= CacheLimit);
+		}
+
+		/* Blocks beyond the cached size classes go straight to buddy manager */
+		mem = buddy_cached_alloc(buddy_manager, BuddyPageSize);
+		REQUIRE(mem != nullptr);
+		buddy_cached_free(buddy_manager, mem, BuddyPageSize);
+
+		REQUIRE(buddy_cache_size() > 0);
+		buddy_cache_flush();
+		REQUIRE(buddy_cache_size() == 0);
+		REQUIRE(all_chunks_free());
+
+		buddy_cache_set_limit(BUDDY_CACHE_DEFAULT_LIMIT);
+	}
+
+	SECTION("Blocks of alternating buddy managers stay cached")
+	{
+		unique_ptr<char[]> other_mem(new char[BuddyManagerAllocLimit]);
+		bmgr_t			   *other_manager = bmgr_create_concurrent(BuddyMinAllocSize,
+																   BuddyPageSize,
+																   other_mem.get(),
+																   BuddyManagerAllocLimit);
+
+		REQUIRE(other_manager != nullptr);
+
+		/* Freeing NULL is a no-op, that doesn't bind the cache */
+		buddy_cached_free(other_manager, nullptr, BuddyMinAllocSize);
+		REQUIRE(buddy_cache_size() == 0);
+
+		void *mem		= buddy_cached_alloc(buddy_manager, BuddyMinAllocSize);
+		void *other_ptr = buddy_cached_alloc(other_manager, BuddyMinAllocSize);
+
+		REQUIRE(mem != nullptr);
+		REQUIRE(other_ptr != nullptr);
+
+		for (int i = 0; i < 16; i++)
+		{
+			buddy_cached_free(buddy_manager, mem, BuddyMinAllocSize);
+			buddy_cached_free(other_manager, other_ptr, BuddyMinAllocSize);
+
+			REQUIRE(buddy_cached_alloc(buddy_manager, BuddyMinAllocSize) == mem);
+			REQUIRE(buddy_cached_alloc(other_manager, BuddyMinAllocSize) == other_ptr);
+		}
+
+		buddy_cached_free(buddy_manager, mem, BuddyMinAllocSize);
+		buddy_cached_free(other_manager, other_ptr, BuddyMinAllocSize);
+
+		buddy_cache_flush();
+		REQUIRE(buddy_cache_size() == 0);
+		REQUIRE(all_chunks_free());
+	}
+
+	SECTION("Caches are flushed on thread exit")
+	{
+		atomic<bool> failed{ false };
+
+		auto worker = [buddy_manager, &failed]()
+					  {
+						  vector<void *> ptrs{ };
+
+						  for (int round = 0; round < 16; round++)
+						  {
+							  for (int i = 0; i < AllocsPerThread; i++)
+							  {
+								  auto mem = buddy_cached_alloc(buddy_manager,
+																BuddyMinAllocSize << (i % 4));
+
+								  if (mem == nullptr)
+								  {
+									  failed = true;
+									  return;
+								  }
+
+								  ptrs.push_back(mem);
+							  }
+
+							  for (size_t i = 0; i < ptrs.size(); i++)
+							  {
+								  buddy_cached_free(buddy_manager, ptrs[i],
+													BuddyMinAllocSize << (i % 4));
+							  }
+
+							  ptrs.clear();
+						  }
+					  };
+
+		vector<thread> threads{ };
+
+		for (size_t t = 0; t < NumThreads; t++)
+		{
+			threads.emplace_back(worker);
+		}
+
+		for (auto &t : threads)
+		{
+			t.join();
+		}
+
+		REQUIRE(!failed);
+		REQUIRE(all_chunks_free());
+	}
+}
+
+
+TEST_CASE("BuddyManager Attach Test", "[allocator]")
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 1024 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 4 * 1024;
+	constexpr size_t BuddyManagerAllocLimit = 16 * 1024 * 1024;
+
+	/* Map the same segment twice, so that it is visible at two different addresses */
+	int fd = memfd_create("bmgr_attach_test", 0);
+
+	REQUIRE(fd >= 0);
+	REQUIRE(ftruncate(fd, BuddyManagerAllocLimit) == 0);
+
+	auto map_segment = [fd]()
+					   {
+						   return static_cast<char *>(mmap(nullptr, BuddyManagerAllocLimit,
+														   PROT_READ | PROT_WRITE, MAP_SHARED,
+														   fd, 0));
+					   };
+
+	char *creator_addr	= map_segment();
+	char *attacher_addr = map_segment();
+
+	REQUIRE(creator_addr != MAP_FAILED);
+	REQUIRE(attacher_addr != MAP_FAILED);
+	REQUIRE(creator_addr != attacher_addr);
+
+	REQUIRE(bmgr_attach(attacher_addr) == nullptr);
+
+	bmgr_t *creator = bmgr_create(BuddyMinAllocSize, BuddyPageSize, creator_addr,
+								  BuddyManagerAllocLimit);
+	bmgr_t *attacher = bmgr_attach(attacher_addr);
+
+	REQUIRE(creator != nullptr);
+	REQUIRE(attacher == reinterpret_cast<bmgr_t *>(attacher_addr));
+
+	/* Allocations made through one mapping are visible and freeable through the other */
+	vector<size_t> offsets{ };
+
+	for (size_t size = BuddyMinAllocSize; size <= BuddyPageSize; size *= 2)
+	{
+		auto mem = static_cast<char *>(buddy_alloc(creator, size));
+
+		REQUIRE(mem != nullptr);
+		memset(mem, 0x5A, size);
+		offsets.push_back(mem - creator_addr);
+	}
+
+	size_t size = BuddyMinAllocSize;
+
+	for (auto offset : offsets)
+	{
+		REQUIRE(attacher_addr[offset] == 0x5A);
+		buddy_free(attacher, attacher_addr + offset, size);
+		size *= 2;
+	}
+
+	/* Memory freed via the attacher is reused by the creator */
+	auto mem = static_cast<char *>(buddy_alloc(creator, BuddyPageSize));
+
+	REQUIRE(mem != nullptr);
+	REQUIRE(find(offsets.begin(), offsets.end(), static_cast<size_t>(mem - creator_addr)) !=
+			offsets.end());
+
+	munmap(creator_addr, BuddyManagerAllocLimit);
+	munmap(attacher_addr, BuddyManagerAllocLimit);
+	close(fd);
+}
+
+
+TEST_CASE("BuddyManager Out Of Band Test", "[allocator]")
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 1024 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 4 * 1024;
+	constexpr size_t BuddyManagerAllocLimit = 16 * 1024 * 1024;
+	constexpr int	 NumSizeClasses			= 6;
+
+	random_gen rand_op(42);
+
+	mapped_region region(BuddyManagerAllocLimit);
+	auto		  buddy_mem = region.get();
+
+	bmgr_t *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, buddy_mem,
+											BuddyManagerAllocLimit, BMGR_OUT_OF_BAND);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	/*
+	 * Freed blocks are made inaccessible, so the test crashes if buddy manager
+	 * ever reads or writes memory, that is not allocated.
+	 */
+	unordered_map<void *, size_t> ptr_set;
+
+	auto do_alloc = [&](size_t size)
+					{
+						auto mem = buddy_alloc(buddy_manager, size);
+
+						REQUIRE(mem != nullptr);
+						REQUIRE(ptr_set.count(mem) == 0);
+						REQUIRE(mprotect(mem, size, PROT_READ | PROT_WRITE) == 0);
+
+						memset(mem, 0x7F, size);
+						ptr_set.insert({ mem, size });
+					};
+
+	auto do_free = [&](void *mem)
+				   {
+					   size_t size = ptr_set[mem];
+
+					   REQUIRE(mprotect(mem, size, PROT_NONE) == 0);
+					   buddy_free(buddy_manager, mem, size);
+					   ptr_set.erase(mem);
+				   };
+
+	size_t num_chunks = buddy_total_alloc_memory(buddy_manager) / BuddyPageSize;
+
+	/* Cycle every chunk through allocation once, so that all of them are protected */
+	for (size_t i = 0; i < num_chunks; i++)
+	{
+		do_alloc(BuddyPageSize);
+	}
+
+	while (!ptr_set.empty())
+	{
+		do_free(ptr_set.begin()->first);
+	}
+
+	for (int i = 0; i < 16 * 1024; i++)
+	{
+		if (ptr_set.size() < 256 && (ptr_set.empty() || rand_op() % 3))
+		{
+			do_alloc(BuddyMinAllocSize << (rand_op() % NumSizeClasses));
+		}
+		else
+		{
+			auto iter = ptr_set.begin();
+
+			advance(iter, rand_op() % ptr_set.size());
+			do_free(iter->first);
+		}
+	}
+
+	while (!ptr_set.empty())
+	{
+		do_free(ptr_set.begin()->first);
+	}
+
+	/* Everything coalesced back to chunks */
+	for (size_t i = 0; i < num_chunks; i++)
+	{
+		do_alloc(BuddyPageSize);
+	}
+
+	REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) == nullptr);
+}
+
+
+static size_t
+resident_bytes(void *ptr, size_t size)
+{
+	size_t				   page_size = sysconf(_SC_PAGESIZE);
+	std::vector<unsigned char> pages((size + page_size - 1) / page_size);
+	size_t				   resident	 = 0;
+
+	REQUIRE(mincore(ptr, size, pages.data()) == 0);
+
+	for (auto page : pages)
+	{
+		resident += (page & 1) * page_size;
+	}
+
+	return resident;
+}
+
+
+static void
+test_purge(int flags, int map_flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 1024 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 4 * 1024;
+	constexpr size_t BuddyManagerAllocLimit = 16 * 1024 * 1024;
+
+	mapped_region region(BuddyManagerAllocLimit, map_flags);
+	auto		  buddy_mem = region.get();
+
+	bmgr_t *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, buddy_mem,
+											BuddyManagerAllocLimit, flags | BMGR_CONCURRENT);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	vector<char *> blocks;
+
+	for (char *mem; (mem = static_cast<char *>(buddy_alloc(buddy_manager, BuddyPageSize / 4)));)
+	{
+		memset(mem, 0x7F, BuddyPageSize / 4);
+		blocks.push_back(mem);
+	}
+
+	REQUIRE(blocks.size() >= 4);
+
+	/* Decay not reached, nothing is purged */
+	bmgr_set_purge_policy(buddy_manager, 64 * 1024, 60 * 1000, BMGR_PURGE_ADVICE_DEFAULT);
+	buddy_free(buddy_manager, blocks.back(), BuddyPageSize / 4);
+	blocks.pop_back();
+
+	REQUIRE(bmgr_purge(buddy_manager) == 0);
+
+	/*
+	 * Free sub-blocks and whole chunks are purged. Pages of a shared mapping
+	 * stay resident after MADV_DONTNEED, so default advice must remove them.
+	 */
+	bmgr_set_purge_policy(buddy_manager, 64 * 1024, 0, BMGR_PURGE_ADVICE_DEFAULT);
+
+	SECTION("Explicit purge")
+	{
+		char *sub_block = blocks[0];
+		char *chunk		= blocks[4];
+
+		buddy_free(buddy_manager, sub_block, BuddyPageSize / 4);
+
+		for (int i = 4; i < 8; i++)
+		{
+			buddy_free(buddy_manager, blocks[i], BuddyPageSize / 4);
+		}
+
+		size_t purged = bmgr_purge(buddy_manager);
+
+		REQUIRE(purged >= BuddyPageSize);
+		REQUIRE(bmgr_purged_bytes(buddy_manager) == purged);
+		REQUIRE(resident_bytes(sub_block + BuddyMinAllocSize, BuddyPageSize / 4 -
+							   BuddyMinAllocSize) == 0);
+		REQUIRE(resident_bytes(chunk + BuddyMinAllocSize, BuddyPageSize - BuddyMinAllocSize) == 0);
+
+		/* Allocated neighbours are left alone */
+		REQUIRE(resident_bytes(blocks[1], BuddyPageSize / 4) == BuddyPageSize / 4);
+
+		/* Clean chunks are not purged again */
+		REQUIRE(bmgr_purge(buddy_manager) == 0);
+	}
+
+	SECTION("Purger thread")
+	{
+		bmgr_purger_t *purger = bmgr_purger_start(buddy_manager, 10);
+
+		REQUIRE(purger != nullptr);
+
+		for (int i = 4; i < 8; i++)
+		{
+			buddy_free(buddy_manager, blocks[i], BuddyPageSize / 4);
+		}
+
+		for (int i = 0; i < 500 && bmgr_purged_bytes(buddy_manager) < BuddyPageSize; i++)
+		{
+			this_thread::sleep_for(chrono::milliseconds(10));
+		}
+
+		bmgr_purger_stop(purger);
+
+		REQUIRE(bmgr_purged_bytes(buddy_manager) >= BuddyPageSize);
+	}
+
+	SECTION("Blocks allocated while chunks are purged keep their contents")
+	{
+		constexpr int NumThreads = 4;
+		constexpr int Rounds	 = 2000;
+
+		atomic<bool>   failed{ false };
+		vector<thread> threads{ };
+		bmgr_purger_t  *purger = bmgr_purger_start(buddy_manager, 1);
+
+		REQUIRE(purger != nullptr);
+
+		for (int i = 4; i < 8; i++)
+		{
+			buddy_free(buddy_manager, blocks[i], BuddyPageSize / 4);
+		}
+
+		for (int t = 0; t < NumThreads; t++)
+		{
+			threads.emplace_back([&, t]()
+								 {
+									 random_gen rand_size(t + 1);
+
+									 for (int round = 0; round < Rounds; round++)
+									 {
+										 size_t size = 64 * 1024 << (rand_size() % 3);
+										 auto	mem	 = static_cast<char *>(buddy_alloc(buddy_manager,
+																					 size));
+
+										 if (mem == nullptr)
+										 {
+											 continue;
+										 }
+
+										 memset(mem, t + 1, size);
+
+										 if (count(mem, mem + size, static_cast<char>(t + 1)) !=
+											 static_cast<ptrdiff_t>(size))
+										 {
+											 failed = true;
+										 }
+
+										 buddy_free(buddy_manager, mem, size);
+									 }
+								 });
+		}
+
+		for (auto &t : threads)
+		{
+			t.join();
+		}
+
+		bmgr_purger_stop(purger);
+
+		REQUIRE(!failed);
+	}
+}
+
+
+TEST_CASE("BuddyManager Purge Test", "[allocator]")
+{
+	with_free_block_trackings(BMGR_PURGE, [](int flags) { test_purge(flags, MAP_PRIVATE); });
+
+	SECTION("Shared mapping")
+	{
+		test_purge(BMGR_PURGE, MAP_SHARED);
+	}
+}
+
+
+TEST_CASE("BuddyManager Huge Page Test", "[allocator]")
+{
+	using namespace std;
+
+	constexpr size_t BuddyMinAllocSize	= 4 * 1024;
+	constexpr size_t HugePageSize		= 2 * 1024 * 1024;
+	constexpr size_t BuddyManagerMemory = 64 * 1024 * 1024;
+
+	size_t max_alloc_size = 0;
+
+	SECTION("Chunks smaller than a huge page")
+	{
+		max_alloc_size = 1024 * 1024;
+	}
+	SECTION("Chunks larger than a huge page")
+	{
+		max_alloc_size = 4 * 1024 * 1024;
+	}
+
+	bmgr_t *buddy_manager = bmgr_create_hugepage(BuddyMinAllocSize, max_alloc_size,
+												 BuddyManagerMemory, BMGR_CONCURRENT);
+
+	REQUIRE(buddy_manager != nullptr);
+	REQUIRE((bmgr_page_mode(buddy_manager) == BMGR_PAGES_REGULAR ||
+			 bmgr_page_mode(buddy_manager) == BMGR_PAGES_TRANSPARENT_HUGE ||
+			 bmgr_page_mode(buddy_manager) == BMGR_PAGES_HUGETLB));
+	REQUIRE(reinterpret_cast<uintptr_t>(buddy_manager) % HugePageSize == 0);
+	REQUIRE(buddy_total_alloc_memory(buddy_manager) >= BuddyManagerMemory - 2 *
+			max(max_alloc_size, HugePageSize));
+
+	vector<char *> chunks;
+
+	for (char *mem; (mem = static_cast<char *>(buddy_alloc(buddy_manager, max_alloc_size)));)
+	{
+		REQUIRE(reinterpret_cast<uintptr_t>(mem) % max_alloc_size == 0);
+		memset(mem, 0x7F, max_alloc_size);
+		chunks.push_back(mem);
+	}
+
+	/* First chunk starts at a huge page boundary */
+	REQUIRE(reinterpret_cast<uintptr_t>(*min_element(chunks.begin(), chunks.end())) % HugePageSize ==
+			0);
+	REQUIRE(chunks.size() * max_alloc_size == buddy_total_alloc_memory(buddy_manager));
+
+	for (auto mem : chunks)
+	{
+		buddy_free(buddy_manager, mem, max_alloc_size);
+	}
+
+	bmgr_destroy(buddy_manager);
+}
+
+
+static void
+test_round_up(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 1024 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 4 * 1024;
+	constexpr size_t BuddyManagerAllocLimit = 16 * 1024 * 1024;
+	constexpr size_t UnitsPerChunk			= BuddyPageSize / BuddyMinAllocSize;
+
+	mapped_region region(BuddyManagerAllocLimit);
+	auto		  buddy_mem = region.get();
+
+	bmgr_t *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, buddy_mem,
+											BuddyManagerAllocLimit, flags);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	size_t num_chunks = buddy_total_alloc_memory(buddy_manager) / BuddyPageSize;
+
+	/* Every block is filled with it's index, so that overlapping blocks are detected */
+	vector<pair<char *, size_t> > blocks;
+
+	auto fill_until_full = [&](size_t size)
+						   {
+							   for (char *mem; (mem = static_cast<char *>(buddy_alloc(buddy_manager,
+																					  size)));)
+							   {
+								   memset(mem, blocks.size() & 0xFF, size);
+								   blocks.push_back({ mem, size });
+							   }
+						   };
+
+	auto check_and_free = [&]()
+						  {
+							  for (size_t i = 0; i < blocks.size(); i++)
+							  {
+								  auto [mem, size] = blocks[i];
+
+								  REQUIRE(count(mem, mem + size, static_cast<char>(i & 0xFF)) ==
+										  static_cast<ptrdiff_t>(size));
+							  }
+
+							  for (auto [mem, size] : blocks)
+							  {
+								  buddy_free(buddy_manager, mem, size);
+							  }
+
+							  blocks.clear();
+						  };
+
+	auto check_all_chunks_free = [&]()
+								 {
+									 fill_until_full(BuddyPageSize);
+									 REQUIRE(blocks.size() == num_chunks);
+									 check_and_free();
+								 };
+
+	SECTION("Sizes are rounded up")
+	{
+		fill_until_full(BuddyMinAllocSize + 1);
+		REQUIRE(blocks.size() == num_chunks * UnitsPerChunk / 2);
+		check_and_free();
+
+		fill_until_full(1);
+		REQUIRE(blocks.size() == num_chunks * UnitsPerChunk);
+		check_and_free();
+
+		check_all_chunks_free();
+	}
+
+	SECTION("Unused tails are reusable")
+	{
+		/* Every 3 unit block leaves it's 4th unit free */
+		fill_until_full(3 * BuddyMinAllocSize);
+		REQUIRE(blocks.size() == num_chunks * UnitsPerChunk / 4);
+
+		fill_until_full(BuddyMinAllocSize);
+		REQUIRE(blocks.size() == num_chunks * UnitsPerChunk / 2);
+		check_and_free();
+
+		check_all_chunks_free();
+	}
+
+	SECTION("Random sizes")
+	{
+		random_gen rand_op(7);
+
+		for (int i = 0; i < 4096; i++)
+		{
+			if (blocks.size() < 512 && (blocks.empty() || rand_op() % 3))
+			{
+				size_t size = 1 + rand_op() % (BuddyPageSize / 2);
+				auto   mem	= static_cast<char *>(buddy_alloc(buddy_manager, size));
+
+				if (mem)
+				{
+					memset(mem, blocks.size() & 0xFF, size);
+					blocks.push_back({ mem, size });
+				}
+			}
+			else
+			{
+				size_t victim = rand_op() % blocks.size();
+				auto [mem, size] = blocks[victim];
+
+				REQUIRE(count(mem, mem + size, static_cast<char>(victim & 0xFF)) ==
+						static_cast<ptrdiff_t>(size));
+				buddy_free(buddy_manager, mem, size);
+
+				/* Move last block into the hole and refill it with it's new index */
+				blocks[victim] = blocks.back();
+				blocks.pop_back();
+
+				if (victim < blocks.size())
+				{
+					memset(blocks[victim].first, victim & 0xFF, blocks[victim].second);
+				}
+			}
+		}
+
+		check_and_free();
+		check_all_chunks_free();
+	}
+}
+
+
+TEST_CASE("BuddyManager Round Up Test", "[allocator]")
+{
+	with_free_block_trackings(0, test_round_up);
+}
+
+
+static void
+test_usable_size(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 1024 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 4 * 1024;
+	constexpr size_t BuddyManagerAllocLimit = 16 * 1024 * 1024;
+
+	mapped_region region(BuddyManagerAllocLimit);
+	auto		  buddy_mem = region.get();
+
+	bmgr_t *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, buddy_mem,
+											BuddyManagerAllocLimit, flags);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	auto round_up = [](size_t size)
+					{
+						return (size + BuddyMinAllocSize - 1) / BuddyMinAllocSize * BuddyMinAllocSize;
+					};
+
+	/* Whole chunk carved into a 2 unit block, followed by a 1 unit block and a 3 unit block */
+	auto first	= static_cast<char *>(buddy_alloc(buddy_manager, BuddyPageSize - 4 * BuddyMinAllocSize));
+	auto two	= static_cast<char *>(buddy_alloc(buddy_manager, 2 * BuddyMinAllocSize));
+	auto one	= static_cast<char *>(buddy_alloc(buddy_manager, BuddyMinAllocSize));
+	auto three	= static_cast<char *>(buddy_alloc(buddy_manager, 3 * BuddyMinAllocSize));
+
+	REQUIRE(first != nullptr);
+	REQUIRE(two == first + BuddyPageSize - 4 * BuddyMinAllocSize);
+	REQUIRE(one == two + 2 * BuddyMinAllocSize);
+	REQUIRE(buddy_usable_size(buddy_manager, first) == BuddyPageSize - 4 * BuddyMinAllocSize);
+	REQUIRE(buddy_usable_size(buddy_manager, two) == 2 * BuddyMinAllocSize);
+	REQUIRE(buddy_usable_size(buddy_manager, one) == BuddyMinAllocSize);
+	REQUIRE(buddy_usable_size(buddy_manager, three) == 3 * BuddyMinAllocSize);
+
+	buddy_free_ptr(buddy_manager, two);
+	buddy_free_ptr(buddy_manager, one);
+	buddy_free_ptr(buddy_manager, three);
+	buddy_free_ptr(buddy_manager, first);
+
+	random_gen				  rand_op(11);
+	vector<pair<void *, size_t> > blocks;
+
+	for (int i = 0; i < 8192; i++)
+	{
+		if (blocks.size() < 256 && (blocks.empty() || rand_op() % 3))
+		{
+			size_t size = 1 + rand_op() % (rand_op() % 2 ? BuddyPageSize : 16 * BuddyMinAllocSize);
+			auto   mem	= buddy_alloc(buddy_manager, size);
+
+			if (mem)
+			{
+				REQUIRE(buddy_usable_size(buddy_manager, mem) == round_up(size));
+				blocks.push_back({ mem, size });
+			}
+		}
+		else
+		{
+			size_t victim = rand_op() % blocks.size();
+
+			REQUIRE(buddy_usable_size(buddy_manager, blocks[victim].first) ==
+					round_up(blocks[victim].second));
+			buddy_free_ptr(buddy_manager, blocks[victim].first);
+			blocks[victim] = blocks.back();
+			blocks.pop_back();
+		}
+	}
+
+	for (auto [mem, size] : blocks)
+	{
+		buddy_free_ptr(buddy_manager, mem);
+	}
+
+	/* Everything coalesced back to chunks */
+	size_t num_chunks = buddy_total_alloc_memory(buddy_manager) / BuddyPageSize;
+
+	for (size_t i = 0; i < num_chunks; i++)
+	{
+		REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) != nullptr);
+	}
+}
+
+
+TEST_CASE("BuddyManager Usable Size Test", "[allocator]")
+{
+	with_free_block_trackings(BMGR_CONCURRENT, test_usable_size);
+}
+
+
+static void
+test_concurrent_free_ptr(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 64 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 1024;
+	constexpr size_t BuddyManagerAllocLimit = 4 * 1024 * 1024;
+	constexpr size_t MaxUnits				= 16;
+	constexpr auto	 MaxLiveAllocations		= 8;
+	constexpr auto	 OpsPerThread			= 64 * 1024;
+
+	mapped_region region(BuddyManagerAllocLimit);
+
+	bmgr_t *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, region.get(),
+											BuddyManagerAllocLimit, flags);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	/*
+	 * Blocks are carved into several nodes and freed by size or by pointer at
+	 * random. Nodes freed by size are reallocated and freed by pointer by other
+	 * threads right away, which must not take later nodes of the block along.
+	 * Every unit of a block is stamped and verified before it is freed.
+	 */
+	auto worker = [buddy_manager](size_t thread_id, atomic<bool> &failed)
+				  {
+					  random_gen				 rand_op(thread_id + 1);
+					  vector<pair<void *, size_t> > live{ };
+
+					  for (int i = 0; i < OpsPerThread && !failed; i++)
+					  {
+						  if (live.size() < MaxLiveAllocations && (live.empty() || rand_op() % 2))
+						  {
+							  size_t size = (1 + rand_op() % MaxUnits) * BuddyMinAllocSize;
+							  auto	 mem  = static_cast<char *>(buddy_alloc(buddy_manager, size));
+
+							  if (mem == nullptr)
+							  {
+								  continue;
+							  }
+
+							  for (size_t off = 0; off < size; off += BuddyMinAllocSize)
+							  {
+								  *reinterpret_cast<size_t *>(mem + off) = thread_id;
+							  }
+
+							  live.push_back({ mem, size });
+						  }
+						  else
+						  {
+							  auto idx		= rand_op() % live.size();
+							  auto [mem, size] = live[idx];
+
+							  for (size_t off = 0; off < size; off += BuddyMinAllocSize)
+							  {
+								  failed = failed ||
+										   *reinterpret_cast<size_t *>(static_cast<char *>(mem) + off) !=
+										   thread_id;
+							  }
+
+							  if (rand_op() % 2)
+							  {
+								  buddy_free(buddy_manager, mem, size);
+							  }
+							  else
+							  {
+								  failed = failed || buddy_usable_size(buddy_manager, mem) != size;
+								  buddy_free_ptr(buddy_manager, mem);
+							  }
+
+							  live[idx] = live.back();
+							  live.pop_back();
+						  }
+					  }
+
+					  for (auto [mem, size] : live)
+					  {
+						  buddy_free(buddy_manager, mem, size);
+					  }
+				  };
+
+	atomic<bool>	failed{ false };
+	vector<thread> threads{ };
+
+	for (size_t t = 0; t < max(4u, thread::hardware_concurrency()); t++)
+	{
+		threads.emplace_back(worker, t, ref(failed));
+	}
+
+	for (auto &t : threads)
+	{
+		t.join();
+	}
+
+	REQUIRE(!failed);
+
+	/* Everything coalesced back to chunks */
+	size_t num_chunks = buddy_total_alloc_memory(buddy_manager) / BuddyPageSize;
+
+	for (size_t i = 0; i < num_chunks; i++)
+	{
+		REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) != nullptr);
+	}
+
+	REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) == nullptr);
+}
+
+
+TEST_CASE("BuddyManager Concurrent Free Ptr Test", "[allocator][concurrent]")
+{
+	with_free_block_trackings(BMGR_CONCURRENT, test_concurrent_free_ptr);
+}
+
+
+static void
+test_realloc(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 1024 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 4 * 1024;
+	constexpr size_t BuddyManagerAllocLimit = 16 * 1024 * 1024;
+
+	mapped_region region(BuddyManagerAllocLimit);
+	auto		  buddy_mem = region.get();
+
+	bmgr_t *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, buddy_mem,
+											BuddyManagerAllocLimit, flags);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	auto fill = [](void *mem, size_t size, char value)
+				{
+					memset(mem, value, size);
+				};
+
+	auto is_filled = [](void *mem, size_t size, char value)
+					 {
+						 auto bytes = static_cast<char *>(mem);
+
+						 return count(bytes, bytes + size, value) == static_cast<ptrdiff_t>(size);
+					 };
+
+	/* Grows in place through every size up to a whole chunk, and shrinks back */
+	auto mem = buddy_alloc(buddy_manager, BuddyMinAllocSize);
+
+	size_t old_size = BuddyMinAllocSize;
+
+	fill(mem, BuddyMinAllocSize, 1);
+
+	for (size_t size = 2 * BuddyMinAllocSize; size <= BuddyPageSize; size += 3 * BuddyMinAllocSize)
+	{
+		REQUIRE(buddy_realloc(buddy_manager, mem, old_size, size) == mem);
+		old_size = size;
+	}
+
+	REQUIRE(buddy_realloc(buddy_manager, mem, old_size, BuddyPageSize) == mem);
+
+	REQUIRE(buddy_usable_size(buddy_manager, mem) == BuddyPageSize);
+	REQUIRE(is_filled(mem, BuddyMinAllocSize, 1));
+
+	fill(mem, BuddyPageSize, 2);
+
+	REQUIRE(buddy_realloc(buddy_manager, mem, BuddyPageSize, 5 * BuddyMinAllocSize) == mem);
+	REQUIRE(buddy_usable_size(buddy_manager, mem) == 5 * BuddyMinAllocSize);
+	REQUIRE(is_filled(mem, 5 * BuddyMinAllocSize, 2));
+
+	/* Tail went back to free lists */
+	auto next = buddy_alloc(buddy_manager, BuddyMinAllocSize);
+
+	REQUIRE(next == static_cast<char *>(mem) + 5 * BuddyMinAllocSize);
+
+	/* Blocked by the next block, so the block moves */
+	fill(next, BuddyMinAllocSize, 3);
+
+	auto moved = buddy_realloc(buddy_manager, mem, 5 * BuddyMinAllocSize, 6 * BuddyMinAllocSize);
+
+	REQUIRE(moved != nullptr);
+	REQUIRE(moved != mem);
+	REQUIRE(is_filled(moved, 5 * BuddyMinAllocSize, 2));
+	REQUIRE(is_filled(next, BuddyMinAllocSize, 3));
+
+	buddy_free_ptr(buddy_manager, moved);
+	buddy_free_ptr(buddy_manager, next);
+
+	/* Random resizes keep contents */
+	random_gen					rand_op(13);
+	vector<pair<void *, size_t> > blocks;
+
+	for (int i = 0; i < 8192; i++)
+	{
+		size_t size = 1 + rand_op() % (rand_op() % 2 ? BuddyPageSize / 4 : 8 * BuddyMinAllocSize);
+
+		if (blocks.size() < 128 && (blocks.empty() || rand_op() % 4 == 0))
+		{
+			auto block = buddy_alloc(buddy_manager, size);
+
+			if (block)
+			{
+				fill(block, size, blocks.size() & 0xFF);
+				blocks.push_back({ block, size });
+			}
+		}
+		else if (rand_op() % 4 == 0)
+		{
+			size_t victim = rand_op() % blocks.size();
+
+			buddy_free(buddy_manager, blocks[victim].first, blocks[victim].second);
+			blocks[victim] = blocks.back();
+			blocks.pop_back();
+
+			if (victim < blocks.size())
+			{
+				fill(blocks[victim].first, blocks[victim].second, victim & 0xFF);
+			}
+		}
+		else
+		{
+			size_t victim = rand_op() % blocks.size();
+			auto [block, old_size] = blocks[victim];
+			auto resized = buddy_realloc(buddy_manager, block, old_size, size);
+
+			if (resized)
+			{
+				REQUIRE(is_filled(resized, min(old_size, size), victim & 0xFF));
+				REQUIRE(buddy_usable_size(buddy_manager, resized) ==
+						(size + BuddyMinAllocSize - 1) / BuddyMinAllocSize * BuddyMinAllocSize);
+				fill(resized, size, victim & 0xFF);
+				blocks[victim] = { resized, size };
+			}
+		}
+	}
+
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		REQUIRE(is_filled(blocks[i].first, blocks[i].second, i & 0xFF));
+		buddy_free(buddy_manager, blocks[i].first, blocks[i].second);
+	}
+
+	/* Threads resizing small blocks in the same chunks lock only the size classes they need */
+	atomic<bool>   failed{ false };
+	vector<thread> threads{ };
+
+	for (int t = 0; t < 4; t++)
+	{
+		threads.emplace_back([&, t]()
+							 {
+								 random_gen					 rand_resize(t + 1);
+								 vector<pair<char *, size_t> > live{ };
+
+								 for (int i = 0; i < 8192; i++)
+								 {
+									 size_t size = (1 + rand_resize() % 8) * BuddyMinAllocSize;
+
+									 if (live.size() < 32 && (live.empty() || rand_resize() % 2))
+									 {
+										 auto block = static_cast<char *>(buddy_alloc(buddy_manager,
+																					  size));
+
+										 if (block)
+										 {
+											 fill(block, size, t + 1);
+											 live.push_back({ block, size });
+										 }
+
+										 continue;
+									 }
+
+									 size_t victim = rand_resize() % live.size();
+									 auto [block, old_size] = live[victim];
+
+									 if (!is_filled(block, old_size, t + 1))
+									 {
+										 failed = true;
+									 }
+
+									 if (rand_resize() % 2)
+									 {
+										 buddy_free(buddy_manager, block, old_size);
+										 live[victim] = live.back();
+										 live.pop_back();
+										 continue;
+									 }
+
+									 auto resized = static_cast<char *>(buddy_realloc(buddy_manager,
+																					  block,
+																					  old_size,
+																					  size));
+
+									 if (resized)
+									 {
+										 fill(resized, size, t + 1);
+										 live[victim] = { resized, size };
+									 }
+								 }
+
+								 for (auto [block, size] : live)
+								 {
+									 buddy_free(buddy_manager, block, size);
+								 }
+							 });
+	}
+
+	for (auto &t : threads)
+	{
+		t.join();
+	}
+
+	REQUIRE(!failed);
+
+	/* Everything coalesced back to chunks */
+	size_t num_chunks = buddy_total_alloc_memory(buddy_manager) / BuddyPageSize;
+
+	for (size_t i = 0; i < num_chunks; i++)
+	{
+		REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) != nullptr);
+	}
+}
+
+
+TEST_CASE("BuddyManager Realloc Test", "[allocator]")
+{
+	with_free_block_trackings(BMGR_CONCURRENT, test_realloc);
+}
+
+
+static void
+test_bulk(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 1024 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 4 * 1024;
+	constexpr size_t BuddyManagerAllocLimit = 16 * 1024 * 1024;
+
+	mapped_region region(BuddyManagerAllocLimit);
+	auto		  buddy_mem = region.get();
+
+	bmgr_t *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, buddy_mem,
+											BuddyManagerAllocLimit, flags);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	size_t	   num_chunks = buddy_total_alloc_memory(buddy_manager) / BuddyPageSize;
+	random_gen rand_op(17);
+
+	vector<void *> blocks;
+	vector<size_t> sizes;
+
+	auto alloc_bulk = [&](size_t size, size_t num_blocks)
+					  {
+						  size_t first = blocks.size();
+
+						  blocks.resize(first + num_blocks);
+
+						  size_t allocated = buddy_alloc_bulk(buddy_manager, size, num_blocks,
+															  blocks.data() + first);
+
+						  blocks.resize(first + allocated);
+						  sizes.resize(first + allocated, size);
+
+						  for (size_t i = first; i < blocks.size(); i++)
+						  {
+							  REQUIRE(buddy_usable_size(buddy_manager, blocks[i]) ==
+									  (size + BuddyMinAllocSize - 1) / BuddyMinAllocSize *
+									  BuddyMinAllocSize);
+							  memset(blocks[i], i & 0xFF, size);
+						  }
+
+						  return allocated;
+					  };
+
+	auto free_all = [&]()
+					{
+						for (size_t i = 0; i < blocks.size(); i++)
+						{
+							auto bytes = static_cast<char *>(blocks[i]);
+
+							REQUIRE(count(bytes, bytes + sizes[i], static_cast<char>(i & 0xFF)) ==
+									static_cast<ptrdiff_t>(sizes[i]));
+						}
+
+						/* Freed out of order, buddy_free_bulk sorts them */
+						vector<size_t> order(blocks.size());
+
+						for (size_t i = 0; i < order.size(); i++)
+						{
+							order[i] = i;
+						}
+
+						shuffle(order.begin(), order.end(), rand_op);
+
+						vector<void *> shuffled_blocks;
+						vector<size_t> shuffled_sizes;
+
+						for (auto i : order)
+						{
+							shuffled_blocks.push_back(blocks[i]);
+							shuffled_sizes.push_back(sizes[i]);
+						}
+
+						buddy_free_bulk(buddy_manager, shuffled_blocks.data(), shuffled_sizes.data(),
+										shuffled_blocks.size());
+						blocks.clear();
+						sizes.clear();
+					};
+
+	auto check_all_chunks_free = [&]()
+								 {
+									 REQUIRE(alloc_bulk(BuddyPageSize, num_chunks + 1) == num_chunks);
+									 free_all();
+								 };
+
+	SECTION("Runs of blocks out of one split")
+	{
+		REQUIRE(alloc_bulk(BuddyMinAllocSize, 100) == 100);
+		REQUIRE(alloc_bulk(2 * BuddyMinAllocSize, 1000) == 1000);
+		REQUIRE(alloc_bulk(BuddyPageSize / 2, 3) == 3);
+
+		/* Whole chunks carved into runs, even across chunks */
+		REQUIRE(alloc_bulk(BuddyMinAllocSize, 3 * BuddyPageSize / BuddyMinAllocSize) ==
+				3 * BuddyPageSize / BuddyMinAllocSize);
+		free_all();
+		check_all_chunks_free();
+	}
+
+	SECTION("Blocks of a chunk are freed under one hold of each lock")
+	{
+		bmgr_stats_t before, after;
+
+		/* Out of one chunk */
+		REQUIRE(alloc_bulk(BuddyMinAllocSize, 100) == 100);
+
+		bmgr_get_stats(buddy_manager, &before);
+		free_all();
+		bmgr_get_stats(buddy_manager, &after);
+
+		/* Second bmgr_get_stats takes every lock once as well */
+		for (int szc = 0; szc < after.num_size_classes; szc++)
+		{
+			REQUIRE(after.size_classes[szc].lock_acquisitions -
+					before.size_classes[szc].lock_acquisitions <= 2);
+		}
+
+		check_all_chunks_free();
+	}
+
+	SECTION("Running out of memory")
+	{
+		size_t max_blocks = num_chunks * BuddyPageSize / (8 * BuddyMinAllocSize);
+
+		REQUIRE(alloc_bulk(8 * BuddyMinAllocSize, max_blocks + 10) == max_blocks);
+		REQUIRE(buddy_alloc(buddy_manager, BuddyMinAllocSize) == nullptr);
+		free_all();
+		check_all_chunks_free();
+	}
+
+	SECTION("Mixed with single allocations")
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			size_t size = 1 + rand_op() % (16 * BuddyMinAllocSize);
+
+			if (rand_op() % 2)
+			{
+				alloc_bulk(size, 1 + rand_op() % 64);
+			}
+			else if (void *mem = buddy_alloc(buddy_manager, size))
+			{
+				memset(mem, blocks.size() & 0xFF, size);
+				blocks.push_back(mem);
+				sizes.push_back(size);
+			}
+		}
+
+		free_all();
+		check_all_chunks_free();
+	}
+}
+
+
+TEST_CASE("BuddyManager Bulk Test", "[allocator]")
+{
+	with_free_block_trackings(BMGR_CONCURRENT, test_bulk);
+}
+
+
+TEST_CASE("BuddyManager Aligned Alloc Test", "[allocator]")
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 1024 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 4 * 1024;
+	constexpr size_t BuddyManagerAllocLimit = 16 * 1024 * 1024;
+
+	/* Region is not aligned to chunk size, chunks are */
+	mapped_region region(BuddyManagerAllocLimit);
+	auto		  buddy_mem = region.get();
+
+	bmgr_t *buddy_manager = bmgr_create(BuddyMinAllocSize, BuddyPageSize, buddy_mem +
+										BuddyMinAllocSize, BuddyManagerAllocLimit -
+										BuddyMinAllocSize);
+
+	REQUIRE(buddy_manager != nullptr);
+	REQUIRE(buddy_alloc_aligned(buddy_manager, 64, 3 * BuddyMinAllocSize) == nullptr);
+	REQUIRE(buddy_alloc_aligned(buddy_manager, 64, 2 * BuddyPageSize) == nullptr);
+
+	size_t num_chunks = buddy_total_alloc_memory(buddy_manager) / BuddyPageSize;
+
+	SECTION("Small blocks don't take whole aligned nodes")
+	{
+		vector<void *> blocks;
+
+		for (size_t i = 0; i < num_chunks; i++)
+		{
+			auto mem = buddy_alloc_aligned(buddy_manager, 64, BuddyPageSize);
+
+			REQUIRE(mem != nullptr);
+			REQUIRE(reinterpret_cast<uintptr_t>(mem) % BuddyPageSize == 0);
+			REQUIRE(buddy_usable_size(buddy_manager, mem) == BuddyMinAllocSize);
+			blocks.push_back(mem);
+		}
+
+		/* Rest of every chunk is free */
+		for (size_t i = 0; i < num_chunks; i++)
+		{
+			REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize / 2) != nullptr);
+		}
+	}
+
+	SECTION("Random alignments")
+	{
+		random_gen					 rand_op(19);
+		vector<pair<void *, size_t> > blocks;
+
+		for (int i = 0; i < 4096; i++)
+		{
+			if (blocks.size() < 64 && (blocks.empty() || rand_op() % 2))
+			{
+				size_t size		 = 1 + rand_op() % (8 * BuddyMinAllocSize);
+				size_t alignment = size_t{ 1 } << (rand_op() % 21);
+				auto   mem		 = buddy_alloc_aligned(buddy_manager, size, alignment);
+
+				REQUIRE(mem != nullptr);
+				REQUIRE(reinterpret_cast<uintptr_t>(mem) % alignment == 0);
+				memset(mem, 0x7F, size);
+				blocks.push_back({ mem, size });
+			}
+			else
+			{
+				size_t victim = rand_op() % blocks.size();
+
+				buddy_free(buddy_manager, blocks[victim].first, blocks[victim].second);
+				blocks[victim] = blocks.back();
+				blocks.pop_back();
+			}
+		}
+
+		for (auto &block : blocks)
+		{
+			buddy_free(buddy_manager, block.first, block.second);
+		}
+
+		for (size_t i = 0; i < num_chunks; i++)
+		{
+			REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) != nullptr);
+		}
+	}
+}
+
+
+static void
+test_spans(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 1024 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 4 * 1024;
+	constexpr size_t BuddyManagerAllocLimit = 32 * 1024 * 1024;
+
+	mapped_region region(BuddyManagerAllocLimit);
+	auto		  buddy_mem = region.get();
+
+	bmgr_t *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, buddy_mem,
+											BuddyManagerAllocLimit, flags);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	size_t num_chunks = buddy_total_alloc_memory(buddy_manager) / BuddyPageSize;
+
+	auto is_filled = [](void *mem, size_t size, char value)
+					 {
+						 auto bytes = static_cast<char *>(mem);
+
+						 return count(bytes, bytes + size, value) == static_cast<ptrdiff_t>(size);
+					 };
+
+	auto check_all_chunks_free = [&]()
+								 {
+									 auto all = buddy_alloc(buddy_manager, num_chunks * BuddyPageSize);
+
+									 REQUIRE(all != nullptr);
+									 buddy_free_ptr(buddy_manager, all);
+								 };
+
+	SECTION("Spans are contiguous chunks")
+	{
+		auto span = buddy_alloc(buddy_manager, 3 * BuddyPageSize + 1);
+
+		REQUIRE(span != nullptr);
+		REQUIRE(reinterpret_cast<uintptr_t>(span) % BuddyPageSize == 0);
+		REQUIRE(buddy_usable_size(buddy_manager, span) == 4 * BuddyPageSize);
+
+		memset(span, 0x5A, 4 * BuddyPageSize);
+
+		/* Spans are never purged */
+		auto small = buddy_alloc(buddy_manager, BuddyMinAllocSize);
+
+		bmgr_set_purge_policy(buddy_manager, BuddyMinAllocSize, 0, MADV_DONTNEED);
+		buddy_free(buddy_manager, small, BuddyMinAllocSize);
+		bmgr_purge(buddy_manager);
+
+		REQUIRE(is_filled(span, 4 * BuddyPageSize, 0x5A));
+
+		REQUIRE(buddy_realloc(buddy_manager, span, 4 * BuddyPageSize, 3 * BuddyPageSize + 7) == span);
+
+		auto larger = buddy_realloc(buddy_manager, span, 4 * BuddyPageSize, 6 * BuddyPageSize);
+
+		REQUIRE(larger != nullptr);
+		REQUIRE(is_filled(larger, 4 * BuddyPageSize, 0x5A));
+
+		buddy_free(buddy_manager, larger, 6 * BuddyPageSize);
+		check_all_chunks_free();
+	}
+
+	SECTION("Free runs are merged")
+	{
+		vector<void *> chunks;
+
+		for (size_t i = 0; i < num_chunks; i++)
+		{
+			chunks.push_back(buddy_alloc(buddy_manager, BuddyPageSize));
+			REQUIRE(chunks.back() != nullptr);
+		}
+
+		for (size_t i = 0; i < num_chunks; i += 2)
+		{
+			buddy_free(buddy_manager, chunks[i], BuddyPageSize);
+		}
+
+		REQUIRE(buddy_alloc(buddy_manager, 2 * BuddyPageSize) == nullptr);
+
+		/* Single chunks are reused */
+		auto chunk = buddy_alloc(buddy_manager, BuddyPageSize);
+
+		REQUIRE(chunk != nullptr);
+		buddy_free(buddy_manager, chunk, BuddyPageSize);
+
+		for (size_t i = 1; i < num_chunks; i += 2)
+		{
+			buddy_free(buddy_manager, chunks[i], BuddyPageSize);
+		}
+
+		check_all_chunks_free();
+	}
+
+	SECTION("Random spans and blocks")
+	{
+		random_gen					 rand_op(23);
+		vector<pair<void *, size_t> > blocks;
+
+		for (int i = 0; i < 4096; i++)
+		{
+			if (blocks.size() < 32 && (blocks.empty() || rand_op() % 2))
+			{
+				size_t size = rand_op() % 2 ? 1 + rand_op() % (4 * BuddyPageSize) :
+							  1 + rand_op() % (16 * BuddyMinAllocSize);
+				auto   mem	= buddy_alloc(buddy_manager, size);
+
+				if (mem)
+				{
+					memset(mem, blocks.size() & 0xFF, size);
+					blocks.push_back({ mem, size });
+				}
+			}
+			else
+			{
+				size_t victim = rand_op() % blocks.size();
+
+				REQUIRE(is_filled(blocks[victim].first, blocks[victim].second, victim & 0xFF));
+				buddy_free(buddy_manager, blocks[victim].first, blocks[victim].second);
+				blocks[victim] = blocks.back();
+				blocks.pop_back();
+
+				if (victim < blocks.size())
+				{
+					memset(blocks[victim].first, victim & 0xFF, blocks[victim].second);
+				}
+			}
+		}
+
+		for (auto &block : blocks)
+		{
+			buddy_free_ptr(buddy_manager, block.first);
+		}
+
+		check_all_chunks_free();
+	}
+}
+
+
+TEST_CASE("BuddyManager Span Test", "[allocator]")
+{
+	with_free_block_trackings(BMGR_SPANS | BMGR_PURGE | BMGR_CONCURRENT, test_spans);
+}
+
+
+static void
+test_template(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 64 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 64;
+	constexpr size_t BuddyManagerAllocLimit = 8 * 1024 * 1024;
+
+	using buddy_t = shmem::buddy<BuddyMinAllocSize, BuddyPageSize>;
+
+	static_assert(buddy_t::num_size_classes == 11);
+	static_assert(buddy_t::size_class(1) == 0 && buddy_t::size_class(BuddyMinAllocSize) == 0);
+	static_assert(buddy_t::size_class(BuddyMinAllocSize + 1) == 1);
+	static_assert(buddy_t::size_class(3 * BuddyMinAllocSize) == 2);
+	static_assert(buddy_t::size_class(BuddyPageSize) == 10);
+	static_assert(buddy_t::size_class(BuddyPageSize + 1) == -1);
+	static_assert(buddy_t::units(3 * BuddyMinAllocSize - 1) == 3);
+	static_assert(buddy_t::rounded_size(3 * BuddyMinAllocSize - 1) == 3 * BuddyMinAllocSize);
+	static_assert(buddy_t::chunk_offset(3 * BuddyPageSize + 5 * BuddyMinAllocSize, 0) ==
+				  5 * BuddyMinAllocSize);
+	static_assert(buddy_t::chunk_offset(3 * BuddyPageSize + 4096 + 5 * BuddyMinAllocSize, 4096) ==
+				  5 * BuddyMinAllocSize);
+	static_assert(buddy_t::chunk_index(7 * BuddyPageSize + 1, 4 * BuddyPageSize) == 3);
+	static_assert(buddy_t::bitmap_index(0, 10) == 0 && buddy_t::bitmap_index(BuddyPageSize / 2, 9) == 2);
+
+	mapped_region region(BuddyManagerAllocLimit);
+	auto		  buddy_mem = region.get();
+
+	auto buddy = buddy_t::create(buddy_mem, BuddyManagerAllocLimit, flags);
+
+	REQUIRE(buddy);
+
+	SECTION("Region is shared with the C API")
+	{
+		REQUIRE(bmgr_attach(buddy_mem) == buddy.handle());
+		REQUIRE(buddy_t::attach(buddy_mem).handle() == buddy.handle());
+		REQUIRE_FALSE(shmem::buddy<2 * BuddyMinAllocSize, BuddyPageSize>::attach(buddy_mem));
+
+		/* Blocks allocated on one side are freed on the other */
+		auto block = buddy.alloc<3 * BuddyMinAllocSize>();
+
+		REQUIRE(block != nullptr);
+		REQUIRE(buddy_usable_size(buddy.handle(), block) == 3 * BuddyMinAllocSize);
+		buddy_free(buddy.handle(), block, 3 * BuddyMinAllocSize);
+
+		block = buddy_alloc(buddy.handle(), 5 * BuddyMinAllocSize - 7);
+		REQUIRE(buddy.usable_size(block) == buddy_t::rounded_size(5 * BuddyMinAllocSize - 7));
+		buddy.free(block, 5 * BuddyMinAllocSize - 7);
+	}
+
+	SECTION("Chunk layout is that of the C side")
+	{
+		bmgr_region_layout_t layout;
+
+		REQUIRE(buddy.region_layout(0, &layout));
+		REQUIRE_FALSE(buddy.region_layout(1, &layout));
+		REQUIRE(layout.control_block_size ==
+				buddy_t::control_block_size((flags & BMGR_OUT_OF_BAND) != 0));
+
+		/* Chunk is split down to 2 units, upper halves of the way are left free */
+		auto block = static_cast<char *>(buddy.alloc<2 * BuddyMinAllocSize>());
+
+		REQUIRE(block != nullptr);
+		REQUIRE(buddy_t::chunk_index(reinterpret_cast<uintptr_t>(block),
+									 reinterpret_cast<uintptr_t>(layout.chunk_start)) <
+				layout.num_chunks);
+		REQUIRE(buddy_t::node_in_use(layout, block, 1));
+		REQUIRE(buddy_t::node_in_use(layout, block, 2));
+		REQUIRE_FALSE(buddy_t::node_in_use(layout, block + 2 * BuddyMinAllocSize, 1));
+
+		buddy.free<2 * BuddyMinAllocSize>(block);
+		REQUIRE_FALSE(buddy_t::node_in_use(layout, block, 1));
+	}
+
+	SECTION("Compile time and run time sizes")
+	{
+		random_gen					 rand_op(29);
+		vector<pair<void *, size_t> > blocks;
+
+		for (int i = 0; i < 512; i++)
+		{
+			blocks.push_back({ buddy.alloc<BuddyMinAllocSize>(), BuddyMinAllocSize });
+			blocks.push_back({ buddy.alloc<BuddyPageSize / 4 + 1>(), BuddyPageSize / 4 + 1 });
+
+			size_t size = 1 + rand_op() % BuddyPageSize;
+
+			blocks.push_back({ buddy.alloc(size), size });
+		}
+
+		for (auto &block : blocks)
+		{
+			if (block.first != nullptr)
+			{
+				memset(block.first, 0xAB, block.second);
+			}
+		}
+
+		for (auto &block : blocks)
+		{
+			if (block.first == nullptr)
+			{
+				continue;
+			}
+
+			if (block.second == BuddyMinAllocSize)
+			{
+				buddy.free<BuddyMinAllocSize>(block.first);
+			}
+			else if (rand_op() % 2)
+			{
+				buddy.free(block.first, block.second);
+			}
+			else
+			{
+				buddy.free(block.first);
+			}
+		}
+
+		/* Everything is free again */
+		vector<void *> chunks;
+
+		while (auto chunk = buddy.alloc<BuddyPageSize>())
+		{
+			chunks.push_back(chunk);
+		}
+
+		REQUIRE(chunks.size() * BuddyPageSize == buddy_total_alloc_memory(buddy.handle()));
+
+		for (auto chunk : chunks)
+		{
+			buddy.free<BuddyPageSize>(chunk);
+		}
+	}
+}
+
+
+TEST_CASE("BuddyManager Template Test", "[allocator]")
+{
+	with_free_block_trackings(0, test_template);
+}
+
+
+static void
+test_stats(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 64 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 64;
+	constexpr size_t BuddyManagerAllocLimit = 8 * 1024 * 1024;
+
+	mapped_region region(BuddyManagerAllocLimit);
+	auto		  buddy_mem = region.get();
+
+	bmgr_t *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, buddy_mem,
+											BuddyManagerAllocLimit, flags);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	bmgr_stats_t stats;
+
+	auto check_totals = [&]()
+						{
+							bmgr_get_stats(buddy_manager, &stats);
+
+							REQUIRE(stats.allocated_bytes + stats.free_bytes == stats.total_memory);
+						};
+
+	check_totals();
+	REQUIRE(stats.num_size_classes == 11);
+	REQUIRE(stats.size_classes[10].block_size == BuddyPageSize);
+	REQUIRE(stats.allocated_bytes == 0);
+	REQUIRE(stats.chunks_in_use == 0);
+	REQUIRE(stats.fragmentation == 0);
+	REQUIRE(stats.page_mode == BMGR_PAGES_REGULAR);
+
+	SECTION("Blocks are counted by size class")
+	{
+		auto block = buddy_alloc(buddy_manager, 3 * BuddyMinAllocSize - 1);
+
+		check_totals();
+		REQUIRE(stats.size_classes[2].allocated_bytes == 3 * BuddyMinAllocSize);
+		REQUIRE(stats.size_classes[2].allocated_blocks == 1);
+		REQUIRE(stats.chunks_in_use == 1);
+		REQUIRE(stats.fragmentation > 0);
+
+		/* Chunk was split down to size class 2, and the unused unit is free */
+		for (int szc = 2; szc < 10; szc++)
+		{
+			REQUIRE(stats.size_classes[szc].splits == 1);
+			REQUIRE(stats.size_classes[szc].free_blocks == 1);
+		}
+
+		REQUIRE(stats.size_classes[0].free_blocks == 1);
+
+		buddy_free(buddy_manager, block, 3 * BuddyMinAllocSize - 1);
+
+		check_totals();
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(stats.chunks_in_use == 0);
+		REQUIRE(stats.max_chunks_in_use == 1);
+		REQUIRE(stats.fragmentation == 0);
+		REQUIRE(stats.size_classes[9].merges == 1);
+
+		auto span = buddy_alloc(buddy_manager, 2 * BuddyPageSize + 1);
+
+		check_totals();
+		REQUIRE(stats.spans == 1);
+		REQUIRE(stats.span_bytes == 3 * BuddyPageSize);
+		REQUIRE(stats.chunks_in_use == 3);
+
+		buddy_free(buddy_manager, span, 2 * BuddyPageSize + 1);
+	}
+
+	SECTION("Every allocation path is counted")
+	{
+		random_gen					 rand_op(31);
+		vector<pair<void *, size_t> > blocks;
+		size_t						 usable = 0;
+
+		for (int i = 0; i < 2048; i++)
+		{
+			int op = rand_op() % 4;
+
+			if (op == 0 || blocks.empty())
+			{
+				size_t size = 1 + rand_op() % (BuddyPageSize / 4);
+				void   *mem = rand_op() % 2 ? buddy_alloc(buddy_manager, size) :
+								buddy_alloc_aligned(buddy_manager, size, BuddyMinAllocSize << rand_op() % 4);
+
+				if (mem)
+				{
+					blocks.push_back({ mem, size });
+				}
+			}
+			else if (op == 1)
+			{
+				void   *bulk[8];
+				size_t size	 = BuddyMinAllocSize << rand_op() % 4;
+				size_t count = buddy_alloc_bulk(buddy_manager, size, 8, bulk);
+
+				for (size_t j = 0; j < count; j++)
+				{
+					blocks.push_back({ bulk[j], size });
+				}
+			}
+			else if (op == 2)
+			{
+				size_t victim	= rand_op() % blocks.size();
+				size_t new_size = 1 + rand_op() % (BuddyPageSize / 2);
+				void   *mem		= buddy_realloc(buddy_manager, blocks[victim].first,
+												blocks[victim].second, new_size);
+
+				if (mem)
+				{
+					blocks[victim] = { mem, new_size };
+				}
+			}
+			else
+			{
+				size_t victim = rand_op() % blocks.size();
+
+				buddy_free(buddy_manager, blocks[victim].first, blocks[victim].second);
+				blocks[victim] = blocks.back();
+				blocks.pop_back();
+			}
+		}
+
+		for (auto &block : blocks)
+		{
+			usable += buddy_usable_size(buddy_manager, block.first);
+		}
+
+		check_totals();
+		REQUIRE(stats.allocated_bytes == usable);
+
+		for (auto &block : blocks)
+		{
+			buddy_free(buddy_manager, block.first, block.second);
+		}
+
+		check_totals();
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(stats.chunks_in_use == 0);
+	}
+
+	SECTION("Counters of concurrent threads are summed")
+	{
+		constexpr int NumThreads = 4;
+		atomic<bool>  done(false);
+		thread		  reader([&]()
+							 {
+								 bmgr_stats_t snapshot;
+
+								 while (!done)
+								 {
+									 bmgr_get_stats(buddy_manager, &snapshot);
+								 }
+							 });
+		vector<thread> threads;
+
+		for (int t = 0; t < NumThreads; t++)
+		{
+			threads.emplace_back([&, t]()
+								 {
+									 random_gen		rand_op(t);
+									 vector<void *> mine;
+
+									 for (int i = 0; i < 4096; i++)
+									 {
+										 void *mem = buddy_alloc(buddy_manager, BuddyMinAllocSize <<
+																 rand_op() % 3);
+
+										 if (mem)
+										 {
+											 mine.push_back(mem);
+										 }
+
+										 if (mine.size() > 64)
+										 {
+											 buddy_free_ptr(buddy_manager, mine.back());
+											 mine.pop_back();
+											 buddy_free_ptr(buddy_manager, mine.front());
+											 mine.erase(mine.begin());
+										 }
+									 }
+
+									 for (auto mem : mine)
+									 {
+										 buddy_free_ptr(buddy_manager, mem);
+									 }
+								 });
+		}
+
+		for (auto &t : threads)
+		{
+			t.join();
+		}
+
+		done = true;
+		reader.join();
+
+		check_totals();
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(stats.max_chunks_in_use > 0);
+	}
+}
+
+
+TEST_CASE("BuddyManager Stats Test", "[allocator][concurrent]")
+{
+	with_free_block_trackings(BMGR_SPANS | BMGR_CONCURRENT, test_stats);
+}
+
+
+/* Address ordered placement, by a single thread or with locking */
+static void
+test_address_ordered(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 64 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 64;
+	constexpr size_t BuddyManagerAllocLimit = 8 * 1024 * 1024;
+
+	mapped_region region(BuddyManagerAllocLimit);
+	auto		  buddy_mem = region.get();
+
+	bmgr_t *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, buddy_mem,
+											BuddyManagerAllocLimit, flags);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	SECTION("Lowest chunk first")
+	{
+		vector<char *> chunks;
+
+		for (int i = 0; i < 16; i++)
+		{
+			chunks.push_back(static_cast<char *>(buddy_alloc(buddy_manager, BuddyPageSize)));
+			REQUIRE(chunks.back() != nullptr);
+		}
+
+		/* Free runs [1, 3] and [6, 7]; the later one is at the head of their bin */
+		for (int i : { 1, 2, 3, 6, 7 })
+		{
+			buddy_free(buddy_manager, chunks[i], BuddyPageSize);
+		}
+
+		REQUIRE(buddy_alloc(buddy_manager, 2 * BuddyPageSize) == chunks[1]);
+		REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) == chunks[3]);
+		REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) == chunks[6]);
+		REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) == chunks[7]);
+	}
+
+	SECTION("Lowest block of a size class first")
+	{
+		random_gen	   rand_op(37);
+		vector<char *> blocks;
+
+		for (size_t i = 0; i < 4 * BuddyPageSize / BuddyMinAllocSize; i++)
+		{
+			blocks.push_back(static_cast<char *>(buddy_alloc(buddy_manager, BuddyMinAllocSize)));
+			REQUIRE(blocks.back() != nullptr);
+		}
+
+		/* Free every other block in random order, no buddies merge */
+		vector<char *> freed;
+
+		for (size_t i = 0; i < blocks.size(); i += 2)
+		{
+			freed.push_back(blocks[i]);
+		}
+
+		shuffle(freed.begin(), freed.end(), rand_op);
+
+		for (auto block : freed)
+		{
+			buddy_free(buddy_manager, block, BuddyMinAllocSize);
+		}
+
+		sort(freed.begin(), freed.end());
+
+		for (auto block : freed)
+		{
+			REQUIRE(buddy_alloc(buddy_manager, BuddyMinAllocSize) == block);
+		}
+	}
+}
+
+
+TEST_CASE("BuddyManager Address Ordered Test", "[allocator]")
+{
+	SECTION("Single threaded")
+	{
+		test_address_ordered(BMGR_ADDRESS_ORDERED | BMGR_SPANS);
+	}
+
+	SECTION("Concurrent")
+	{
+		test_address_ordered(BMGR_ADDRESS_ORDERED | BMGR_SPANS | BMGR_CONCURRENT);
+	}
+}
+
+
+static void
+test_extend(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize		   = 64 * 1024;
+	constexpr size_t BuddyMinAllocSize	   = 64;
+	constexpr size_t BuddyManagerAllocLimit = 512 * 1024;
+	constexpr size_t ExtensionSize		   = 1024 * 1024;
+
+	mapped_region region(BuddyManagerAllocLimit + BMGR_MAX_REGIONS * ExtensionSize);
+	auto		  buddy_mem = region.get();
+
+	char	*extensions	   = buddy_mem + BuddyManagerAllocLimit;
+	bmgr_t	*buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, buddy_mem,
+											 BuddyManagerAllocLimit, flags);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	size_t base_chunks = buddy_total_alloc_memory(buddy_manager) / BuddyPageSize;
+
+	REQUIRE(base_chunks > 0);
+
+	auto in_extension = [&](void *ptr, int i)
+						{
+							return static_cast<char *>(ptr) >= extensions + i * ExtensionSize &&
+								   static_cast<char *>(ptr) < extensions + (i + 1) * ExtensionSize;
+						};
+
+	SECTION("Chunks of extensions are used, once the first region is full")
+	{
+		vector<void *> blocks;
+
+		for (size_t i = 0; i < base_chunks; i++)
+		{
+			blocks.push_back(buddy_alloc(buddy_manager, BuddyPageSize));
+			REQUIRE(blocks.back() != nullptr);
+		}
+
+		REQUIRE(buddy_alloc(buddy_manager, BuddyMinAllocSize) == nullptr);
+
+		size_t added = bmgr_extend(buddy_manager, extensions, ExtensionSize);
+
+		REQUIRE(added > 0);
+		REQUIRE(added % BuddyPageSize == 0);
+		REQUIRE(buddy_total_alloc_memory(buddy_manager) == (base_chunks * BuddyPageSize + added));
+
+		/* Blocks of every size class come out of the extension and are freed by pointer */
+		for (size_t size = BuddyMinAllocSize; size <= BuddyPageSize; size *= 2)
+		{
+			void *block = buddy_alloc(buddy_manager, size);
+
+			REQUIRE(in_extension(block, 0));
+			REQUIRE(buddy_usable_size(buddy_manager, block) == size);
+			memset(block, 0x5a, size);
+			blocks.push_back(block);
+		}
+
+		while (void *block = buddy_alloc(buddy_manager, BuddyMinAllocSize))
+		{
+			REQUIRE(in_extension(block, 0));
+			blocks.push_back(block);
+		}
+
+		for (auto block : blocks)
+		{
+			buddy_free_ptr(buddy_manager, block);
+		}
+
+		bmgr_stats_t stats;
+
+		bmgr_get_stats(buddy_manager, &stats);
+
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(stats.chunks_in_use == 0);
+		REQUIRE(stats.free_bytes == stats.total_memory);
+
+		/* Every chunk of both regions is free again */
+		size_t num_chunks = buddy_total_alloc_memory(buddy_manager) / BuddyPageSize;
+
+		for (size_t i = 0; i < num_chunks; i++)
+		{
+			REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) != nullptr);
+		}
+
+		REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) == nullptr);
+	}
+
+	SECTION("Spans don't cross regions")
+	{
+		size_t added = bmgr_extend(buddy_manager, extensions, ExtensionSize) / BuddyPageSize;
+
+		REQUIRE(added > base_chunks);
+
+		void *span = buddy_alloc(buddy_manager, added * BuddyPageSize);
+
+		REQUIRE(in_extension(span, 0));
+		REQUIRE(buddy_alloc(buddy_manager, (base_chunks + 1) * BuddyPageSize) == nullptr);
+
+		buddy_free(buddy_manager, span, added * BuddyPageSize);
+
+		span = buddy_alloc(buddy_manager, (base_chunks + 1) * BuddyPageSize);
+
+		REQUIRE(in_extension(span, 0));
+		buddy_free(buddy_manager, span, (base_chunks + 1) * BuddyPageSize);
+	}
+
+	SECTION("Number of regions is bounded")
+	{
+		REQUIRE(bmgr_extend(buddy_manager, extensions, BuddyPageSize / 2) == 0);
+
+		for (int i = 1; i < BMGR_MAX_REGIONS; i++)
+		{
+			REQUIRE(bmgr_extend(buddy_manager, extensions + i * ExtensionSize, ExtensionSize) > 0);
+		}
+
+		REQUIRE(bmgr_extend(buddy_manager, extensions, ExtensionSize) == 0);
+
+		/* A block of the last region is freed as well as one of the first */
+		vector<void *> chunks;
+
+		while (void *chunk = buddy_alloc(buddy_manager, BuddyPageSize))
+		{
+			chunks.push_back(chunk);
+		}
+
+		REQUIRE(chunks.size() == buddy_total_alloc_memory(buddy_manager) / BuddyPageSize);
+		REQUIRE(any_of(chunks.begin(), chunks.end(),
+					   [&](void *chunk) { return in_extension(chunk, BMGR_MAX_REGIONS - 1); }));
+
+		for (auto chunk : chunks)
+		{
+			buddy_free(buddy_manager, chunk, BuddyPageSize);
+		}
+
+		REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) != nullptr);
+	}
+
+	SECTION("Regions are added while other threads allocate")
+	{
+		atomic<bool>   failed{ false };
+		atomic<int>	   extended{ 0 };
+		vector<thread> threads;
+
+		for (int t = 0; t < 4; t++)
+		{
+			threads.emplace_back([&, t]()
+								 {
+									 random_gen			 rand_op(t + 1);
+									 vector<size_t *> live;
+
+									 /* Keep allocating until all regions are added and in use */
+									 while (extended < BMGR_MAX_REGIONS - 1 || live.size() < 64)
+									 {
+										 size_t size  = BuddyMinAllocSize << (rand_op() % 6);
+										 auto	mem	  = static_cast<size_t *>(buddy_alloc(buddy_manager,
+																						  size));
+
+										 if (mem == nullptr)
+										 {
+											 this_thread::yield();
+											 continue;
+										 }
+
+										 mem[0] = t;
+										 live.push_back(mem);
+									 }
+
+									 for (auto mem : live)
+									 {
+										 if (mem[0] != static_cast<size_t>(t))
+										 {
+											 failed = true;
+										 }
+
+										 buddy_free_ptr(buddy_manager, mem);
+									 }
+								 });
+		}
+
+		for (int i = 1; i < BMGR_MAX_REGIONS; i++)
+		{
+			REQUIRE(bmgr_extend(buddy_manager, extensions + i * ExtensionSize, ExtensionSize) > 0);
+			extended++;
+		}
+
+		for (auto &t : threads)
+		{
+			t.join();
+		}
+
+		REQUIRE(!failed);
+
+		bmgr_stats_t stats;
+
+		bmgr_get_stats(buddy_manager, &stats);
+
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(stats.free_bytes == stats.total_memory);
+	}
+}
+
+
+TEST_CASE("BuddyManager Extend Test", "[allocator][concurrent]")
+{
+	with_free_block_trackings(BMGR_CONCURRENT | BMGR_SPANS, test_extend);
+
+	SECTION("Address ordered")
+	{
+		test_extend(BMGR_CONCURRENT | BMGR_SPANS | BMGR_ADDRESS_ORDERED);
+	}
+}
+
+
+static void
+test_numa(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize		 = 64 * 1024;
+	constexpr size_t BuddyMinAllocSize	 = 64;
+	constexpr size_t NodeMemSize		 = 2 * 1024 * 1024;
+	constexpr size_t InterleavedMemSize	 = 1024 * 1024;
+
+	SECTION("Pool per online node")
+	{
+		bmgr_t *buddy_manager = bmgr_create_numa(BuddyMinAllocSize, BuddyPageSize, NodeMemSize,
+												 0, 0, flags);
+
+		REQUIRE(buddy_manager != nullptr);
+		REQUIRE(bmgr_numa_nodes(buddy_manager) >= 1);
+
+		void *block = buddy_alloc(buddy_manager, BuddyMinAllocSize);
+
+		REQUIRE(block != nullptr);
+		REQUIRE(bmgr_numa_node(buddy_manager, block) >= 0);
+		REQUIRE(bmgr_numa_node(buddy_manager, block) < bmgr_numa_nodes(buddy_manager));
+
+		/* Without an interleaved pool, interleaved blocks come from the node pools */
+		void *shared = buddy_alloc_interleaved(buddy_manager, BuddyMinAllocSize);
+
+		REQUIRE(bmgr_numa_node(buddy_manager, shared) >= 0);
+
+		buddy_free(buddy_manager, block, BuddyMinAllocSize);
+		buddy_free(buddy_manager, shared, BuddyMinAllocSize);
+
+		bmgr_destroy(buddy_manager);
+	}
+
+	/* More pools than nodes, so that falling back to remote pools is seen on any machine */
+	bmgr_t *buddy_manager = bmgr_create_numa(BuddyMinAllocSize, BuddyPageSize, NodeMemSize,
+											 InterleavedMemSize, 2, flags);
+
+	REQUIRE(buddy_manager != nullptr);
+	REQUIRE(bmgr_numa_nodes(buddy_manager) == 2);
+	REQUIRE(buddy_min_alloc_size(buddy_manager) == BuddyMinAllocSize);
+	REQUIRE(buddy_max_alloc_size(buddy_manager) == BuddyPageSize);
+	REQUIRE(bmgr_attach(buddy_manager) == buddy_manager);
+
+	size_t total = buddy_total_alloc_memory(buddy_manager);
+
+	SECTION("Local pool is used up before remote ones")
+	{
+		vector<void *> blocks;
+		vector<size_t> blocks_per_node(2);
+		int			   node_changes = 0;
+
+		while (void *block = buddy_alloc(buddy_manager, BuddyPageSize / 4))
+		{
+			int node = bmgr_numa_node(buddy_manager, block);
+
+			REQUIRE(node >= 0);
+			REQUIRE(node < 2);
+
+			if (!blocks.empty() && node != bmgr_numa_node(buddy_manager, blocks.back()))
+			{
+				node_changes++;
+			}
+
+			blocks_per_node[node]++;
+			blocks.push_back(block);
+		}
+
+		REQUIRE(blocks_per_node[0] > 0);
+		REQUIRE(blocks_per_node[1] > 0);
+
+		/* Thread may migrate between nodes of a multi node machine */
+		bmgr_t *detected = bmgr_create_numa(BuddyMinAllocSize, BuddyPageSize, NodeMemSize, 0, 0,
+											flags);
+
+		if (bmgr_numa_nodes(detected) == 1)
+		{
+			REQUIRE(node_changes == 1);
+		}
+
+		bmgr_destroy(detected);
+
+		/* Interleaved pool is left alone by buddy_alloc */
+		void *shared = buddy_alloc_interleaved(buddy_manager, BuddyPageSize);
+
+		REQUIRE(shared != nullptr);
+		REQUIRE(bmgr_numa_node(buddy_manager, shared) == -1);
+
+		bmgr_stats_t stats;
+
+		bmgr_get_stats(buddy_manager, &stats);
+
+		REQUIRE(stats.total_memory == total);
+		REQUIRE(stats.allocated_bytes == total - stats.free_bytes);
+
+		for (auto block : blocks)
+		{
+			buddy_free_ptr(buddy_manager, block);
+		}
+
+		buddy_free(buddy_manager, shared, BuddyPageSize);
+
+		bmgr_get_stats(buddy_manager, &stats);
+
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(stats.free_bytes == total);
+		REQUIRE(stats.chunks_in_use == 0);
+	}
+
+	SECTION("Interleaved pool doesn't fall back")
+	{
+		vector<void *> blocks;
+
+		while (void *block = buddy_alloc_interleaved(buddy_manager, BuddyPageSize))
+		{
+			REQUIRE(bmgr_numa_node(buddy_manager, block) == -1);
+			blocks.push_back(block);
+		}
+
+		REQUIRE(!blocks.empty());
+		REQUIRE(blocks.size() * BuddyPageSize < InterleavedMemSize);
+		REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) != nullptr);
+
+		/* Blocks of all pools are freed together */
+		blocks.push_back(buddy_alloc(buddy_manager, BuddyMinAllocSize));
+
+		vector<size_t> sizes(blocks.size(), BuddyPageSize);
+
+		sizes.back() = BuddyMinAllocSize;
+		buddy_free_bulk(buddy_manager, blocks.data(), sizes.data(), blocks.size());
+
+		REQUIRE(buddy_alloc_interleaved(buddy_manager, BuddyPageSize) != nullptr);
+	}
+
+	SECTION("Every entry point passes on to the pools")
+	{
+		void *aligned = buddy_alloc_aligned(buddy_manager, BuddyMinAllocSize, 4096);
+
+		REQUIRE(aligned != nullptr);
+		REQUIRE(reinterpret_cast<uintptr_t>(aligned) % 4096 == 0);
+
+		void *span = buddy_alloc(buddy_manager, 3 * BuddyPageSize);
+
+		REQUIRE(span != nullptr);
+		REQUIRE(buddy_usable_size(buddy_manager, span) == 3 * BuddyPageSize);
+
+		void *block = buddy_alloc_units(buddy_manager, 3);
+
+		REQUIRE(block != nullptr);
+
+		block = buddy_realloc(buddy_manager, block, 3 * BuddyMinAllocSize, 8 * BuddyMinAllocSize);
+
+		REQUIRE(block != nullptr);
+		REQUIRE(buddy_usable_size(buddy_manager, block) == 8 * BuddyMinAllocSize);
+
+		void  *bulk[16];
+		size_t bulk_sizes[16];
+
+		REQUIRE(buddy_alloc_bulk(buddy_manager, BuddyMinAllocSize, 16, bulk) == 16);
+		fill(begin(bulk_sizes), end(bulk_sizes), BuddyMinAllocSize);
+		buddy_free_bulk(buddy_manager, bulk, bulk_sizes, 16);
+
+		buddy_free(buddy_manager, aligned, BuddyMinAllocSize);
+		buddy_free(buddy_manager, span, 3 * BuddyPageSize);
+		buddy_free_units(buddy_manager, block, 8);
+
+		REQUIRE(bmgr_extend(buddy_manager, nullptr, NodeMemSize) == 0);
+
+		bmgr_stats_t stats;
+
+		bmgr_get_stats(buddy_manager, &stats);
+
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(stats.spans == 0);
+		REQUIRE(stats.free_bytes == total);
+	}
+
+	bmgr_destroy(buddy_manager);
+}
+
+
+TEST_CASE("BuddyManager NUMA Test", "[allocator]")
+{
+	with_free_block_trackings(BMGR_SPANS, test_numa);
+}
+
+
+static void
+test_lazy_coalescing(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 64 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 64;
+	constexpr size_t BuddyManagerAllocLimit = 4 * 1024 * 1024;
+	constexpr int	 NumSizeClasses			= 11;
+
+	unique_ptr<char[]> buddy_mem(new char[BuddyManagerAllocLimit]);
+	bmgr_t			   *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize,
+														buddy_mem.get(), BuddyManagerAllocLimit,
+														flags);
+
+	REQUIRE(buddy_manager != nullptr);
+
+	size_t		 num_chunks = buddy_total_alloc_memory(buddy_manager) / BuddyPageSize;
+	bmgr_stats_t stats;
+
+	auto churn = [](const bmgr_stats_t &stats)
+				 {
+					 size_t churn = 0;
+
+					 for (int szc = 0; szc < stats.num_size_classes; szc++)
+					 {
+						 churn += stats.size_classes[szc].splits + stats.size_classes[szc].merges;
+					 }
+
+					 return churn;
+				 };
+
+	SECTION("Freed blocks are reused without splits or merges")
+	{
+		void *block = buddy_alloc(buddy_manager, BuddyMinAllocSize);
+
+		buddy_free(buddy_manager, block, BuddyMinAllocSize);
+		bmgr_get_stats(buddy_manager, &stats);
+
+		size_t churn_before = churn(stats);
+
+		REQUIRE(stats.size_classes[0].deferred_blocks == 1);
+		REQUIRE(stats.size_classes[0].free_blocks == 2);
+
+		for (int i = 0; i < 1000; i++)
+		{
+			REQUIRE(buddy_alloc(buddy_manager, BuddyMinAllocSize) == block);
+			buddy_free(buddy_manager, block, BuddyMinAllocSize);
+		}
+
+		bmgr_get_stats(buddy_manager, &stats);
+
+		REQUIRE(churn(stats) == churn_before);
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(stats.free_bytes == stats.total_memory);
+	}
+
+	SECTION("Slack of a size class is bounded")
+	{
+		for (int szc = 0; szc < NumSizeClasses - 1; szc++)
+		{
+			size_t		   size = BuddyMinAllocSize << szc;
+			vector<void *> blocks;
+
+			for (size_t i = 0; i < 2 * BuddyPageSize / size; i++)
+			{
+				blocks.push_back(buddy_alloc(buddy_manager, size));
+				REQUIRE(blocks.back() != nullptr);
+			}
+
+			for (auto block : blocks)
+			{
+				buddy_free(buddy_manager, block, size);
+			}
+
+			bmgr_get_stats(buddy_manager, &stats);
+
+			REQUIRE(stats.size_classes[szc].deferred_blocks > 0);
+			REQUIRE(stats.size_classes[szc].deferred_blocks <= min<size_t>(32, BuddyPageSize /
+																			   size));
+		}
+
+		bmgr_get_stats(buddy_manager, &stats);
+
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(stats.free_bytes == stats.total_memory);
+		REQUIRE(stats.size_classes[NumSizeClasses - 1].deferred_blocks == 0);
+	}
+
+	SECTION("Deferred blocks are coalesced when memory runs out")
+	{
+		vector<void *> blocks;
+
+		while (void *block = buddy_alloc(buddy_manager, BuddyMinAllocSize << (blocks.size() % 4)))
+		{
+			blocks.push_back(block);
+		}
+
+		for (auto block : blocks)
+		{
+			buddy_free_ptr(buddy_manager, block);
+		}
+
+		for (size_t i = 0; i < num_chunks; i++)
+		{
+			REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) != nullptr);
+		}
+
+		REQUIRE(buddy_alloc(buddy_manager, BuddyMinAllocSize) == nullptr);
+	}
+
+	SECTION("Random sizes")
+	{
+		random_gen						rand_op(11);
+		vector<pair<size_t *, size_t> > live;
+
+		for (int i = 0; i < 100000; i++)
+		{
+			if (!live.empty() && (live.size() > 1000 || rand_op() % 2))
+			{
+				auto idx = rand_op() % live.size();
+
+				REQUIRE(live[idx].first[0] == live[idx].second);
+				buddy_free(buddy_manager, live[idx].first, live[idx].second);
+				live[idx] = live.back();
+				live.pop_back();
+				continue;
+			}
+
+			size_t size = BuddyMinAllocSize * (1 + rand_op() % 64);
+			auto   mem	= static_cast<size_t *>(buddy_alloc(buddy_manager, size));
+
+			REQUIRE(mem != nullptr);
+			mem[0] = size;
+			live.push_back({ mem, size });
+		}
+
+		for (auto &block : live)
+		{
+			buddy_free(buddy_manager, block.first, block.second);
+		}
+
+		bmgr_get_stats(buddy_manager, &stats);
+
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(stats.free_bytes == stats.total_memory);
+
+		for (size_t i = 0; i < num_chunks; i++)
+		{
+			REQUIRE(buddy_alloc(buddy_manager, BuddyPageSize) != nullptr);
+		}
+	}
+
+	/* Alloc/free of one small block in an otherwise empty chunk: eager mode splits and merges every time */
+	SECTION("Churn at a chunk boundary")
+	{
+		constexpr int Cycles = 1000 * 1000;
+
+		for (int mode_flags : { flags & ~BMGR_LAZY, flags })
+		{
+			unique_ptr<char[]> mem(new char[BuddyManagerAllocLimit]);
+			bmgr_t			   *bmgr = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, mem.get(),
+													   BuddyManagerAllocLimit, mode_flags);
+			auto			   start = chrono::steady_clock::now();
+
+			for (int i = 0; i < Cycles; i++)
+			{
+				buddy_free(bmgr, buddy_alloc(bmgr, BuddyMinAllocSize), BuddyMinAllocSize);
+			}
+
+			chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+			bmgr_get_stats(bmgr, &stats);
+
+			cout << "bmgr " << (mode_flags & BMGR_LAZY ? "lazy" : "eager") << " coalescing"
+				 << (flags & BMGR_OUT_OF_BAND ? " (out of band): " : ": ")
+				 << static_cast<size_t>(Cycles / elapsed.count()) << " alloc/free pairs/sec, "
+				 << churn(stats) << " splits and merges" << endl;
+
+			if (mode_flags & BMGR_LAZY)
+			{
+				REQUIRE(churn(stats) < NumSizeClasses);
+			}
+			else
+			{
+				REQUIRE(churn(stats) >= static_cast<size_t>(Cycles));
+			}
+		}
+	}
+}
+
+
+TEST_CASE("BuddyManager Lazy Coalescing Test", "[allocator]")
+{
+	with_free_block_trackings(BMGR_LAZY, test_lazy_coalescing);
+}
+
+
+static sigjmp_buf fault_jump;
+
+
+static void
+fault_handler(int)
+{
+	siglongjmp(fault_jump, 1);
+}
+
+
+/* Does writing at 'ptr' fault? Fault is caught, so that the test goes on */
+static bool
+write_faults(char *ptr)
+{
+	struct sigaction action = {};
+	struct sigaction old_segv;
+	struct sigaction old_bus;
+	bool			 faulted = false;
+
+	action.sa_handler = fault_handler;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, &old_segv);
+	sigaction(SIGBUS, &action, &old_bus);
+
+	if (sigsetjmp(fault_jump, 1) == 0)
+	{
+		*static_cast<volatile char *>(ptr) = 1;
+	}
+	else
+	{
+		faulted = true;
+	}
+
+	sigaction(SIGSEGV, &old_segv, nullptr);
+	sigaction(SIGBUS, &old_bus, nullptr);
+
+	return faulted;
+}
+
+
+static void
+test_guard_pages(int flags)
+{
+	using namespace std;
+
+	constexpr size_t BuddyPageSize			= 64 * 1024;
+	constexpr size_t BuddyMinAllocSize		= 64;
+	constexpr size_t BuddyManagerAllocLimit = 8 * 1024 * 1024;
+	constexpr int	 Quarantine				= 16;
+
+	size_t		  page_size = sysconf(_SC_PAGESIZE);
+	mapped_region region(BuddyManagerAllocLimit);
+	auto		  buddy_mem = region.get();
+
+	bmgr_t *buddy_manager = bmgr_create_ext(BuddyMinAllocSize, BuddyPageSize, buddy_mem,
+											BuddyManagerAllocLimit, flags);
+
+	REQUIRE(buddy_manager != nullptr);
+	REQUIRE(bmgr_guard_sample_rate(buddy_manager) == 0);
+
+	bmgr_stats_t stats;
+
+	SECTION("Nothing is sampled by default")
+	{
+		vector<void *> blocks;
+
+		for (int i = 0; i < 1000; i++)
+		{
+			blocks.push_back(buddy_alloc(buddy_manager, 100));
+			REQUIRE(blocks.back() != nullptr);
+		}
+
+		bmgr_get_stats(buddy_manager, &stats);
+		REQUIRE(stats.guarded_blocks == 0);
+
+		for (auto block : blocks)
+		{
+			REQUIRE(buddy_usable_size(buddy_manager, block) == 128);
+			buddy_free_ptr(buddy_manager, block);
+		}
+	}
+
+	SECTION("Sampled blocks end at a guard page")
+	{
+		bmgr_set_guard_sample_rate(buddy_manager, 1);
+		REQUIRE(bmgr_guard_sample_rate(buddy_manager) == 1);
+
+		auto block = static_cast<char *>(buddy_alloc(buddy_manager, 100));
+
+		REQUIRE(block != nullptr);
+		REQUIRE(buddy_usable_size(buddy_manager, block) == 128);
+		REQUIRE(reinterpret_cast<uintptr_t>(block + 128) % page_size == 0);
+
+		/* Guard page is not counted as allocated */
+		bmgr_get_stats(buddy_manager, &stats);
+		REQUIRE(stats.guarded_blocks == 1);
+		REQUIRE(stats.allocated_bytes == 128);
+		REQUIRE(stats.size_classes[1].allocated_blocks == 1);
+		REQUIRE(stats.guard_bytes == 2 * page_size - 128);
+
+		memset(block, 0, 128);
+		REQUIRE(!write_faults(block + 127));
+		REQUIRE(write_faults(block + 128));
+
+		/* Blocks of the unit, bulk and aligned APIs are sampled as well */
+		void *units_block = buddy_alloc_units(buddy_manager, 1);
+		void *bulk_block;
+		void *run_blocks[4];
+		auto aligned_block = static_cast<char *>(buddy_alloc_aligned(buddy_manager, 100, 256));
+
+		REQUIRE(buddy_alloc_bulk(buddy_manager, 3 * BuddyMinAllocSize, 1, &bulk_block) == 1);
+		REQUIRE(buddy_alloc_bulk(buddy_manager, BuddyMinAllocSize, 4, run_blocks) == 4);
+		REQUIRE(aligned_block != nullptr);
+		REQUIRE(reinterpret_cast<uintptr_t>(aligned_block) % 256 == 0);
+		REQUIRE(write_faults(aligned_block + 256));
+		bmgr_get_stats(buddy_manager, &stats);
+		REQUIRE(stats.guarded_blocks == 8);
+
+		for (auto run_block : run_blocks)
+		{
+			REQUIRE(write_faults(static_cast<char *>(run_block) + BuddyMinAllocSize));
+		}
+
+		buddy_free_bulk(buddy_manager, run_blocks, vector<size_t>(4, BuddyMinAllocSize).data(), 4);
+		buddy_free_units(buddy_manager, units_block, 1);
+		buddy_free_ptr(buddy_manager, bulk_block);
+		buddy_free_ptr(buddy_manager, aligned_block);
+		buddy_free(buddy_manager, block, 100);
+		bmgr_set_guard_sample_rate(buddy_manager, 0);
+
+		bmgr_get_stats(buddy_manager, &stats);
+		REQUIRE(stats.guarded_blocks == 0);
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(stats.free_bytes == stats.total_memory);
+	}
+
+	SECTION("Freed blocks are quarantined")
+	{
+		bmgr_set_guard_sample_rate(buddy_manager, 1);
+
+		vector<char *> blocks;
+
+		for (int i = 0; i < Quarantine + 1; i++)
+		{
+			blocks.push_back(static_cast<char *>(buddy_alloc(buddy_manager, BuddyMinAllocSize)));
+			REQUIRE(blocks.back() != nullptr);
+		}
+
+		buddy_free(buddy_manager, blocks[0], BuddyMinAllocSize);
+		REQUIRE(write_faults(blocks[0]));
+
+		/* Quarantine of the first block ends, once enough newer ones are freed */
+		for (int i = 1; i <= Quarantine; i++)
+		{
+			buddy_free(buddy_manager, blocks[i], BuddyMinAllocSize);
+		}
+
+		bmgr_get_stats(buddy_manager, &stats);
+		REQUIRE(stats.guarded_blocks == Quarantine);
+		REQUIRE(!write_faults(blocks[0]));
+		REQUIRE(write_faults(blocks[Quarantine]));
+
+		bmgr_set_guard_sample_rate(buddy_manager, 0);
+
+		bmgr_get_stats(buddy_manager, &stats);
+		REQUIRE(stats.guarded_blocks == 0);
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(!write_faults(blocks[Quarantine]));
+	}
+
+	SECTION("Blocks of the per-thread cache are sampled")
+	{
+		bmgr_set_guard_sample_rate(buddy_manager, 1);
+
+		auto block = static_cast<char *>(buddy_cached_alloc(buddy_manager, BuddyMinAllocSize));
+
+		REQUIRE(block != nullptr);
+		REQUIRE(!write_faults(block + BuddyMinAllocSize - 1));
+		REQUIRE(write_faults(block + BuddyMinAllocSize));
+
+		/* Cached blocks are quarantined, once the cache gives them back */
+		buddy_cached_free(buddy_manager, block, BuddyMinAllocSize);
+		buddy_cache_flush();
+		REQUIRE(write_faults(block));
+
+		bmgr_set_guard_sample_rate(buddy_manager, 0);
+
+		bmgr_get_stats(buddy_manager, &stats);
+		REQUIRE(stats.guarded_blocks == 0);
+		REQUIRE(stats.guard_bytes == 0);
+		REQUIRE(stats.allocated_bytes == 0);
+	}
+
+	SECTION("Sampled blocks are moved by realloc")
+	{
+		bmgr_set_guard_sample_rate(buddy_manager, 1);
+
+		auto block = static_cast<char *>(buddy_alloc(buddy_manager, BuddyMinAllocSize));
+
+		REQUIRE(block != nullptr);
+		memset(block, 'x', BuddyMinAllocSize);
+
+		bmgr_set_guard_sample_rate(buddy_manager, 0);
+
+		/* Growing in place would run into the guard page */
+		auto grown = static_cast<char *>(buddy_realloc(buddy_manager, block, BuddyMinAllocSize,
+													  4 * BuddyMinAllocSize));
+
+		REQUIRE(grown != nullptr);
+		REQUIRE(grown != block);
+		REQUIRE(grown[BuddyMinAllocSize - 1] == 'x');
+
+		buddy_free(buddy_manager, grown, 4 * BuddyMinAllocSize);
+
+		bmgr_get_stats(buddy_manager, &stats);
+		REQUIRE(stats.guarded_blocks == 1);
+
+		/* Quarantined blocks of a rate of 0 are given back by the next free */
+		buddy_free(buddy_manager, buddy_alloc(buddy_manager, BuddyMinAllocSize),
+				   BuddyMinAllocSize);
+		bmgr_set_guard_sample_rate(buddy_manager, 0);
+
+		bmgr_get_stats(buddy_manager, &stats);
+		REQUIRE(stats.guarded_blocks == 0);
+		REQUIRE(stats.allocated_bytes == 0);
+	}
+
+	SECTION("About one in rate allocations is sampled")
+	{
+		constexpr int Rate		= 16;
+		constexpr int NumBlocks = 512;
+
+		bmgr_set_guard_sample_rate(buddy_manager, Rate);
+
+		vector<void *> blocks;
+
+		for (int i = 0; i < NumBlocks; i++)
+		{
+			blocks.push_back(buddy_alloc(buddy_manager, BuddyMinAllocSize));
+			REQUIRE(blocks.back() != nullptr);
+		}
+
+		bmgr_get_stats(buddy_manager, &stats);
+		REQUIRE(stats.guarded_blocks >= NumBlocks / Rate / 2);
+		REQUIRE(stats.guarded_blocks <= NumBlocks / Rate * 2);
+
+		for (auto block : blocks)
+		{
+			buddy_free_ptr(buddy_manager, block);
+		}
+
+		bmgr_set_guard_sample_rate(buddy_manager, 0);
+
+		bmgr_get_stats(buddy_manager, &stats);
+		REQUIRE(stats.guarded_blocks == 0);
+		REQUIRE(stats.allocated_bytes == 0);
+		REQUIRE(stats.free_bytes == stats.total_memory);
+	}
+
+	bmgr_destroy(buddy_manager);
+}
+
+
+TEST_CASE("BuddyManager Guard Page Test", "[allocator]")
+{
+	with_free_block_trackings(BMGR_CONCURRENT, test_guard_pages);
+}
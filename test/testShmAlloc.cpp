@@ -0,0 +1,272 @@
+#include "test/catch.hpp"
+#include "test/testBase.h"
+#include "bmgr/bmgr.h"
+#include "shmalloc/shmalloc.h"
+
+#include <cstring>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using random_gen = std::ranlux24_base;
+
+
+/* Sections of the heap test, run single threaded and with locking */
+static void
+test_shm_heap(int flags)
+{
+	using namespace std;
+
+	constexpr size_t HeapSize = 64 * 1024 * 1024;
+
+	auto heap_mem = static_cast<char *>(mmap(nullptr, HeapSize, PROT_READ | PROT_WRITE,
+											 MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+
+	REQUIRE(heap_mem != MAP_FAILED);
+
+	shm_heap_t *heap = shm_heap_create(heap_mem, HeapSize, flags);
+
+	REQUIRE(heap != nullptr);
+
+	SECTION("Sizes are rounded up to their class")
+	{
+		REQUIRE(shm_malloc(heap, 0) == nullptr);
+
+		for (size_t size = 1; size <= SHM_SMALL_MAX; size++)
+		{
+			auto   ptr	 = static_cast<char *>(shm_malloc(heap, size));
+			size_t usable = shm_usable_size(heap, ptr);
+
+			REQUIRE(ptr != nullptr);
+			REQUIRE(usable >= size);
+
+			/* Classes are 16 bytes apart up to 128 and 4 per power of two above */
+			REQUIRE(usable - size < (size <= 128 ? 16 : size / 4 + 16));
+			REQUIRE(reinterpret_cast<uintptr_t>(ptr) % 16 == 0);
+
+			memset(ptr, 0x7F, usable);
+			shm_free(heap, ptr);
+		}
+
+		for (size_t size : { SHM_SMALL_MAX + 1, SHM_MEDIUM_MAX, 3 * SHM_MEDIUM_MAX })
+		{
+			auto ptr = static_cast<char *>(shm_malloc(heap, size));
+
+			REQUIRE(ptr != nullptr);
+			REQUIRE(shm_usable_size(heap, ptr) >= size);
+
+			memset(ptr, 0x7F, size);
+			shm_free(heap, ptr);
+		}
+
+		shm_free(heap, nullptr);
+	}
+
+	SECTION("Random sizes")
+	{
+		random_device r;
+		random_gen	  rand_size(r());
+
+		uniform_int_distribution<size_t> small(1, SHM_SMALL_MAX);
+		uniform_int_distribution<size_t> medium(SHM_SMALL_MAX + 1, 64 * 1024);
+		unordered_map<char *, size_t>	 blocks;
+
+		for (int i = 0; i < 100 * 1000; i++)
+		{
+			if (blocks.size() < 2000 && rand_size() % 3 != 0)
+			{
+				size_t size = rand_size() % 8 == 0 ? medium(rand_size) : small(rand_size);
+				auto   ptr	= static_cast<char *>(shm_malloc(heap, size));
+
+				REQUIRE(ptr != nullptr);
+				REQUIRE(blocks.count(ptr) == 0);
+
+				memset(ptr, static_cast<int>(size), size);
+				blocks[ptr] = size;
+			}
+			else if (!blocks.empty())
+			{
+				auto block = blocks.begin();
+
+				REQUIRE(block->first[block->second - 1] == static_cast<char>(block->second));
+
+				shm_free(heap, block->first);
+				blocks.erase(block);
+			}
+		}
+
+		for (auto &block : blocks)
+		{
+			shm_free(heap, block.first);
+		}
+	}
+
+	if ((flags & BMGR_CONCURRENT) != 0)
+	{
+		SECTION("Threads allocate and free each other's blocks")
+		{
+			constexpr int NumThreads = 4;
+			constexpr int Rounds	 = 5 * 1000;
+
+			vector<vector<void *> > handoff(NumThreads);
+			vector<thread>			threads;
+			atomic<bool>			failed{ false };
+
+			for (int t = 0; t < NumThreads; t++)
+			{
+				threads.emplace_back([&, t] {
+										 random_gen	   rand_size(t);
+										 vector<void *> mine;
+
+										 for (int i = 0; i < Rounds; i++)
+										 {
+											 size_t size = 1 + rand_size() % (2 * SHM_SMALL_MAX);
+											 auto	ptr	 = static_cast<char *>(shm_malloc(heap, size));
+
+											 if (ptr == nullptr)
+											 {
+												 failed = true;
+												 return;
+											 }
+
+											 memset(ptr, t, size);
+											 mine.push_back(ptr);
+										 }
+
+										 handoff[t] = move(mine);
+									 });
+			}
+
+			for (auto &thread : threads)
+			{
+				thread.join();
+			}
+
+			threads.clear();
+			REQUIRE(!failed);
+
+			/* Every thread frees the blocks of the next one */
+			for (int t = 0; t < NumThreads; t++)
+			{
+				threads.emplace_back([&, t] {
+										 for (auto ptr : handoff[(t + 1) % NumThreads])
+										 {
+											 shm_free(heap, ptr);
+										 }
+									 });
+			}
+
+			for (auto &thread : threads)
+			{
+				thread.join();
+			}
+		}
+	}
+
+	bmgr_t		 *bmgr = shm_heap_get_bmgr(heap);
+	bmgr_stats_t stats;
+
+	shm_heap_destroy(heap);
+
+	/* Every block went back to the buddy manager */
+
+	bmgr_get_stats(bmgr, &stats);
+	REQUIRE(stats.allocated_bytes == 0);
+
+	munmap(heap_mem, HeapSize);
+}
+
+
+TEST_CASE("SharedHeap Test", "[allocator]")
+{
+	SECTION("Single threaded")
+	{
+		test_shm_heap(0);
+	}
+
+	SECTION("Concurrent")
+	{
+		test_shm_heap(BMGR_CONCURRENT);
+	}
+}
+
+
+/* Heap created through one mapping of a memfd and attached through another, as by two processes */
+TEST_CASE("SharedHeap Attach Test", "[allocator]")
+{
+	using namespace std;
+
+	constexpr size_t HeapSize = 16 * 1024 * 1024;
+
+	int fd = memfd_create("shm_heap_attach_test", 0);
+
+	REQUIRE(fd >= 0);
+	REQUIRE(ftruncate(fd, HeapSize) == 0);
+
+	auto map_segment = [fd]()
+					   {
+						   return static_cast<char *>(mmap(nullptr, HeapSize, PROT_READ | PROT_WRITE,
+														   MAP_SHARED, fd, 0));
+					   };
+
+	char *creator_addr	= map_segment();
+	char *attacher_addr = map_segment();
+
+	REQUIRE(creator_addr != MAP_FAILED);
+	REQUIRE(attacher_addr != MAP_FAILED);
+
+	REQUIRE(shm_heap_attach(attacher_addr) == nullptr);
+
+	shm_heap_t *creator = shm_heap_create(creator_addr, HeapSize, BMGR_CONCURRENT);
+
+	REQUIRE(creator != nullptr);
+
+	shm_heap_t *attacher = shm_heap_attach(attacher_addr);
+
+	REQUIRE(attacher == reinterpret_cast<shm_heap_t *>(attacher_addr));
+
+	/* Blocks of every kind, allocated through one mapping and freed through the other */
+	vector<size_t> sizes{ 1, 100, SHM_SMALL_MAX, SHM_SMALL_MAX + 1, 64 * 1024, 2 * SHM_MEDIUM_MAX };
+
+	for (int round = 0; round < 2; round++)
+	{
+		shm_heap_t *alloc_heap = round == 0 ? creator : attacher;
+		shm_heap_t *free_heap  = round == 0 ? attacher : creator;
+		char	   *alloc_addr = round == 0 ? creator_addr : attacher_addr;
+		char	   *free_addr  = round == 0 ? attacher_addr : creator_addr;
+
+		for (size_t size : sizes)
+		{
+			auto ptr = static_cast<char *>(shm_malloc(alloc_heap, size));
+
+			REQUIRE(ptr != nullptr);
+			memset(ptr, 0x3C, size);
+
+			char *other = ptr - alloc_addr + free_addr;
+
+			REQUIRE(other[size - 1] == 0x3C);
+			REQUIRE(shm_usable_size(free_heap, other) == shm_usable_size(alloc_heap, ptr));
+
+			shm_free(free_heap, other);
+		}
+	}
+
+	bmgr_t		 *bmgr = shm_heap_get_bmgr(attacher);
+	bmgr_stats_t stats;
+
+	shm_heap_destroy(attacher);
+
+	REQUIRE(shm_heap_attach(creator_addr) == nullptr);
+
+	bmgr_get_stats(bmgr, &stats);
+	REQUIRE(stats.allocated_bytes == 0);
+
+	munmap(creator_addr, HeapSize);
+	munmap(attacher_addr, HeapSize);
+	close(fd);
+}
@@ -1,18 +1,30 @@
 #include "test/catch.hpp"
 #include "test/testBase.h"
 #include "slab/slab.h"
+#include "bmgr/bmgr.h"
 
 #include <cstdlib>
+#include <cstring>
 #include <random>
 #include <iostream>
 #include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <unistd.h>
 
 static void *
 slab_base_alloc(size_t size, size_t align, void *arg)
 {
-	(void) align;
+	void *ptr;
+
 	(void) arg;
-	return malloc(size);
+	return posix_memalign(&ptr, align, size) == 0 ? ptr : nullptr;
 }
 
 
@@ -131,3 +143,596 @@ TEST_CASE("SlabAllocatorTest", "[allocator]")
 	REQUIRE(slab_get_size(slab) == slab_get_page_size(slab));
 	slab_destroy(slab);
 }
+
+
+TEST_CASE("SlabAllocator Stats Test", "[allocator]")
+{
+	using namespace std;
+
+	constexpr int BlockSize = 64;
+	constexpr int PageSize	= 4 * 1024;
+
+	slab_t		 *slab = slab_create(PageSize, BlockSize, slab_base_alloc, slab_base_free, NULL);
+	slab_stats_t stats;
+
+	slab_get_stats(slab, &stats);
+	REQUIRE(stats.block_size == BlockSize);
+	REQUIRE(stats.page_size == PageSize);
+	REQUIRE(stats.pages == 0);
+	REQUIRE(stats.allocated_blocks == 0);
+	REQUIRE(stats.fragmentation == 0);
+
+	vector<void *> blocks;
+
+	for (int i = 0; i < 10 * PageSize / BlockSize; i++)
+	{
+		blocks.push_back(slab_alloc(slab));
+		REQUIRE(blocks.back() != nullptr);
+	}
+
+	slab_get_stats(slab, &stats);
+
+	size_t blocks_per_page = (stats.allocated_blocks + stats.free_blocks) / stats.pages;
+
+	REQUIRE(stats.allocated_blocks == blocks.size());
+	REQUIRE(stats.allocated_bytes == blocks.size() * BlockSize);
+	REQUIRE(stats.pages * PageSize == slab_get_size(slab));
+	REQUIRE(stats.max_pages == stats.pages);
+	REQUIRE(stats.free_blocks < blocks_per_page);
+
+	/* Every other block is freed, so half of the pages is free */
+	size_t pages = stats.pages;
+
+	for (size_t i = 0; i < blocks.size(); i += 2)
+	{
+		slab_free(slab, blocks[i]);
+	}
+
+	slab_get_stats(slab, &stats);
+	REQUIRE(stats.allocated_blocks == blocks.size() / 2);
+	REQUIRE(stats.pages == pages);
+	REQUIRE(stats.fragmentation > 0.45);
+	REQUIRE(stats.free_bytes == stats.free_blocks * BlockSize);
+
+	for (size_t i = 1; i < blocks.size(); i += 2)
+	{
+		slab_free(slab, blocks[i]);
+	}
+
+	slab_get_stats(slab, &stats);
+	REQUIRE(stats.allocated_blocks == 0);
+	REQUIRE(stats.pages == 1);
+	REQUIRE(stats.max_pages == pages);
+
+	slab_destroy(slab);
+}
+
+
+TEST_CASE("SlabAllocator Remote Free Test", "[allocator][concurrent]")
+{
+	using namespace std;
+
+	constexpr int BlockSize	  = 64;
+	constexpr int PageSize	  = 4 * 1024;
+	constexpr int NumBlocks	  = 200 * 1000;
+	constexpr int MaxInFlight = 1024;
+
+	int flags = SLAB_CONCURRENT;
+
+	SECTION("Block headers")
+	{ }
+
+	SECTION("Headerless blocks")
+	{
+		flags |= SLAB_HEADERLESS;
+	}
+
+	slab_t		 *slab = slab_create_ext(PageSize, BlockSize, slab_base_alloc, slab_base_free, NULL,
+										 flags);
+	slab_stats_t stats;
+
+	/* Owner produces blocks, consumer frees them on another thread */
+	mutex			   lock;
+	condition_variable cond;
+	deque<void *>	   queue;
+	bool			   done	  = false;
+	bool			   failed = false; /* Catch assertions are not thread safe */
+
+	thread consumer([&] {
+						for (;;)
+						{
+							unique_lock<mutex> guard(lock);
+
+							cond.wait(guard, [&] { return done || !queue.empty(); });
+
+							if (queue.empty())
+							{
+								break;
+							}
+
+							auto block = queue.front();
+
+							queue.pop_front();
+							guard.unlock();
+							cond.notify_all();
+
+							failed |= *static_cast<int *>(block) != 42;
+							slab_free(slab, block);
+						}
+					});
+
+	for (int i = 0; i < NumBlocks; i++)
+	{
+		auto block = slab_alloc(slab);
+
+		REQUIRE(block != nullptr);
+		*static_cast<int *>(block) = 42;
+
+		unique_lock<mutex> guard(lock);
+
+		cond.wait(guard, [&] { return queue.size() < MaxInFlight; });
+		queue.push_back(block);
+		cond.notify_all();
+	}
+
+	{
+		lock_guard<mutex> guard(lock);
+
+		done = true;
+	}
+
+	cond.notify_all();
+	consumer.join();
+	REQUIRE(!failed);
+
+	/* Remotely freed blocks were reused, so pages are bounded by blocks in flight */
+	slab_get_stats(slab, &stats);
+
+	size_t blocks_per_page = (stats.allocated_blocks + stats.free_blocks) / stats.pages;
+
+	REQUIRE(stats.max_pages <= 3 * MaxInFlight / blocks_per_page + 2);
+
+	slab_collect(slab);
+	slab_get_stats(slab, &stats);
+	REQUIRE(stats.allocated_blocks == 0);
+	REQUIRE(stats.pages == 1);
+
+	/* Frees of the owner stay local, remote ones wait for a collection */
+	void *local	 = slab_alloc(slab);
+	void *remote = slab_alloc(slab);
+
+	slab_free(slab, local);
+	thread([slab, remote] { slab_free(slab, remote); }).join();
+
+	slab_get_stats(slab, &stats);
+	REQUIRE(stats.allocated_blocks == 1);
+
+	slab_collect(slab);
+	slab_get_stats(slab, &stats);
+	REQUIRE(stats.allocated_blocks == 0);
+
+	slab_destroy(slab);
+}
+
+
+TEST_CASE("SlabAllocator Headerless Test", "[allocator]")
+{
+	using namespace std;
+
+	constexpr int BlockSize = 64;
+	constexpr int PageSize	= 4 * 1024;
+
+	slab_t		 *slab = slab_create_ext(PageSize, BlockSize, slab_base_alloc, slab_base_free, NULL,
+										 SLAB_HEADERLESS);
+	slab_stats_t stats;
+
+	REQUIRE(slab_block_header_size(slab) == 0);
+
+	vector<char *> blocks;
+
+	for (int i = 0; i < 10 * PageSize / BlockSize; i++)
+	{
+		blocks.push_back(static_cast<char *>(slab_alloc(slab)));
+		REQUIRE(blocks.back() != nullptr);
+
+		/* Whole block is usable and starts a cache line */
+		REQUIRE(reinterpret_cast<uintptr_t>(blocks.back()) % 64 == 0);
+		memset(blocks.back(), 0x7F, BlockSize);
+	}
+
+	slab_get_stats(slab, &stats);
+
+	/* Page header takes the first cache line */
+	REQUIRE((stats.allocated_blocks + stats.free_blocks) / stats.pages ==
+			(PageSize - 64) / BlockSize);
+
+	/* Pages are found by their address and given back, once they are empty */
+	for (auto block : blocks)
+	{
+		slab_free(slab, block);
+	}
+
+	slab_get_stats(slab, &stats);
+	REQUIRE(stats.allocated_blocks == 0);
+	REQUIRE(stats.pages == 1);
+
+	slab_destroy(slab);
+}
+
+
+/* Sections of the bulk test, run with and without block headers */
+static void
+test_slab_bulk(int flags)
+{
+	using namespace std;
+
+	constexpr int BlockSize = 64;
+	constexpr int PageSize	= 4 * 1024;
+	constexpr int NumBlocks = 1000;
+
+	slab_t		 *slab = slab_create_ext(PageSize, BlockSize, slab_base_alloc, slab_base_free, NULL,
+										 flags);
+	slab_stats_t stats;
+
+	vector<void *> blocks(NumBlocks);
+
+	REQUIRE(slab_alloc_bulk(slab, NumBlocks, blocks.data()) == NumBlocks);
+	REQUIRE(unordered_set<void *>(blocks.begin(), blocks.end()).size() == NumBlocks);
+
+	for (auto block : blocks)
+	{
+		memset(block, 0x7F, BlockSize - slab_block_header_size(slab));
+	}
+
+	slab_get_stats(slab, &stats);
+
+	size_t blocks_per_page = (stats.allocated_blocks + stats.free_blocks) / stats.pages;
+
+	REQUIRE(stats.allocated_blocks == NumBlocks);
+	REQUIRE(stats.pages == (NumBlocks + blocks_per_page - 1) / blocks_per_page);
+
+	SECTION("Freed blocks are reused before pages are added")
+	{
+		size_t pages = stats.pages;
+
+		/* Every other block of the first pages goes back to it's page's free list */
+		vector<void *> freed;
+
+		for (int i = 0; i < NumBlocks / 2; i += 2)
+		{
+			freed.push_back(blocks[i]);
+		}
+
+		slab_free_bulk(slab, freed.data(), freed.size());
+
+		vector<void *> again(freed.size());
+
+		REQUIRE(slab_alloc_bulk(slab, again.size(), again.data()) == again.size());
+
+		unordered_set<void *> live(blocks.begin(), blocks.end());
+
+		for (auto block : freed)
+		{
+			live.erase(block);
+		}
+
+		for (auto block : again)
+		{
+			REQUIRE(live.insert(block).second);
+		}
+
+		slab_get_stats(slab, &stats);
+		REQUIRE(stats.allocated_blocks == NumBlocks);
+		REQUIRE(stats.pages == pages);
+		REQUIRE(stats.max_pages == pages);
+	}
+
+	SECTION("Empty pages are given back")
+	{
+		random_device r;
+
+		shuffle(blocks.begin(), blocks.end(), random_gen(r()));
+		slab_free_bulk(slab, blocks.data(), blocks.size());
+
+		slab_get_stats(slab, &stats);
+		REQUIRE(stats.allocated_blocks == 0);
+		REQUIRE(stats.pages == 1);
+	}
+
+	SECTION("Single and bulk calls are mixed")
+	{
+		for (int i = 0; i < NumBlocks; i += 3)
+		{
+			slab_free(slab, blocks[i]);
+			blocks[i] = nullptr;
+		}
+
+		blocks.erase(remove(blocks.begin(), blocks.end(), nullptr), blocks.end());
+		slab_free_bulk(slab, blocks.data(), blocks.size());
+
+		slab_get_stats(slab, &stats);
+		REQUIRE(stats.allocated_blocks == 0);
+		REQUIRE(stats.pages == 1);
+	}
+
+	SECTION("Remote bulk frees are collected")
+	{
+		thread([slab, &blocks] { slab_free_bulk(slab, blocks.data(), blocks.size()); }).join();
+
+		slab_get_stats(slab, &stats);
+		REQUIRE(stats.allocated_blocks == NumBlocks);
+
+		slab_collect(slab);
+		slab_get_stats(slab, &stats);
+		REQUIRE(stats.allocated_blocks == 0);
+		REQUIRE(stats.pages == 1);
+	}
+
+	slab_destroy(slab);
+}
+
+
+TEST_CASE("SlabAllocator Bulk Test", "[allocator]")
+{
+	SECTION("Block headers")
+	{
+		test_slab_bulk(SLAB_CONCURRENT);
+	}
+
+	SECTION("Headerless blocks")
+	{
+		test_slab_bulk(SLAB_CONCURRENT | SLAB_HEADERLESS);
+	}
+}
+
+
+/* Sections of the buddy manager backed slab test, run with and without block headers */
+static void
+test_slab_bmgr(int flags)
+{
+	using namespace std;
+
+	constexpr int	 BlockSize	  = 64;
+	constexpr int	 PageSize	  = 16 * 1024;
+	constexpr size_t RegionSize	  = 8 * 1024 * 1024;
+	constexpr size_t MinAllocSize = 1024;
+	constexpr size_t MaxAllocSize = 64 * 1024;
+
+	auto region = static_cast<char *>(mmap(nullptr, RegionSize, PROT_READ | PROT_WRITE,
+										   MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+
+	REQUIRE(region != MAP_FAILED);
+
+	bmgr_t		 *bmgr = bmgr_create(MinAllocSize, MaxAllocSize, region, RegionSize);
+	bmgr_stats_t bmgr_stats;
+	slab_stats_t stats;
+
+	REQUIRE(bmgr != nullptr);
+	REQUIRE(slab_create_bmgr(bmgr, 2 * MaxAllocSize, BlockSize, flags) == nullptr);
+
+	slab_t *slab = slab_create_bmgr(bmgr, PageSize, BlockSize, flags);
+
+	REQUIRE(slab != nullptr);
+
+	/* Control block lives in the region */
+	REQUIRE(reinterpret_cast<char *>(slab) >= region);
+	REQUIRE(reinterpret_cast<char *>(slab) < region + RegionSize);
+
+	vector<void *> blocks(20 * PageSize / BlockSize);
+
+	REQUIRE(slab_alloc_bulk(slab, blocks.size(), blocks.data()) == blocks.size());
+
+	for (auto block : blocks)
+	{
+		REQUIRE(static_cast<char *>(block) >= region);
+		REQUIRE(static_cast<char *>(block) < region + RegionSize);
+		memset(block, 0x7F, BlockSize - slab_block_header_size(slab));
+	}
+
+	/* Pages are buddy blocks, so the buddy manager accounts for them */
+	slab_get_stats(slab, &stats);
+	bmgr_get_stats(bmgr, &bmgr_stats);
+	REQUIRE(bmgr_stats.allocated_bytes == stats.pages * PageSize + MinAllocSize);
+
+	for (auto block : blocks)
+	{
+		slab_free(slab, block);
+	}
+
+	bmgr_get_stats(bmgr, &bmgr_stats);
+	REQUIRE(bmgr_stats.allocated_bytes == PageSize + MinAllocSize);
+
+	slab_destroy(slab);
+
+	bmgr_get_stats(bmgr, &bmgr_stats);
+	REQUIRE(bmgr_stats.allocated_bytes == 0);
+
+	munmap(region, RegionSize);
+}
+
+
+TEST_CASE("SlabAllocator Buddy Manager Test", "[allocator]")
+{
+	SECTION("Block headers")
+	{
+		test_slab_bmgr(0);
+	}
+
+	SECTION("Headerless blocks")
+	{
+		test_slab_bmgr(SLAB_HEADERLESS);
+	}
+}
+
+
+/*
+ * Slab of a buddy manager used through two mappings of the region, as two
+ * processes would. Second mapping is put a few OS pages off the alignment of
+ * the first one, so that chunks are aligned differently in each.
+ */
+static void
+test_slab_bmgr_attach(int flags)
+{
+	using namespace std;
+
+	constexpr int	 BlockSize	  = 64;
+	constexpr int	 PageSize	  = 16 * 1024;
+	constexpr size_t RegionSize	  = 8 * 1024 * 1024;
+	constexpr size_t MinAllocSize = 1024;
+	constexpr size_t MaxAllocSize = 64 * 1024;
+
+	size_t os_page_size = sysconf(_SC_PAGESIZE);
+	int	   fd			= memfd_create("slab_attach_test", 0);
+
+	REQUIRE(fd >= 0);
+	REQUIRE(ftruncate(fd, RegionSize) == 0);
+
+	auto reserved = static_cast<char *>(mmap(nullptr, RegionSize + 2 * MaxAllocSize, PROT_NONE,
+											 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+	REQUIRE(reserved != MAP_FAILED);
+
+	char *creator_addr = static_cast<char *>(mmap(nullptr, RegionSize, PROT_READ | PROT_WRITE,
+												  MAP_SHARED, fd, 0));
+	char *misaligned = reserved + MaxAllocSize - reinterpret_cast<uintptr_t>(reserved) %
+					   MaxAllocSize + (reinterpret_cast<uintptr_t>(creator_addr) + os_page_size) %
+					   MaxAllocSize;
+	char *attacher_addr = static_cast<char *>(mmap(misaligned, RegionSize, PROT_READ | PROT_WRITE,
+												   MAP_SHARED | MAP_FIXED, fd, 0));
+
+	REQUIRE(creator_addr != MAP_FAILED);
+	REQUIRE(attacher_addr == misaligned);
+
+	bmgr_t *bmgr = bmgr_create(MinAllocSize, MaxAllocSize, creator_addr, RegionSize);
+
+	REQUIRE(bmgr != nullptr);
+
+	slab_t *slab = slab_create_bmgr(bmgr, PageSize, BlockSize, flags);
+
+	REQUIRE(slab != nullptr);
+	REQUIRE(bmgr_attach(attacher_addr) != nullptr);
+
+	auto attached_slab = reinterpret_cast<slab_t *>(attacher_addr + (reinterpret_cast<char *>(slab) -
+																	 creator_addr));
+	int			   usable = BlockSize - slab_block_header_size(slab);
+	vector<void *> blocks(4 * PageSize / BlockSize);
+	slab_stats_t   stats;
+	bmgr_stats_t   bmgr_stats;
+
+	/* Blocks allocated through one mapping are seen and freed through the other */
+	REQUIRE(slab_alloc_bulk(attached_slab, blocks.size() / 2, blocks.data()) == blocks.size() / 2);
+
+	for (size_t i = blocks.size() / 2; i < blocks.size(); i++)
+	{
+		blocks[i] = slab_alloc(slab);
+		REQUIRE(blocks[i] != nullptr);
+	}
+
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		memset(blocks[i], static_cast<int>(i & 0x7F), usable);
+	}
+
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		char *block = static_cast<char *>(blocks[i]);
+		char *other = i < blocks.size() / 2 ? block - attacher_addr + creator_addr :
+					  block - creator_addr + attacher_addr;
+
+		REQUIRE(other[usable - 1] == static_cast<char>(i & 0x7F));
+
+		if (i % 2 == 0)
+		{
+			slab_free(i < blocks.size() / 2 ? slab : attached_slab, other);
+		}
+		else
+		{
+			slab_free(i < blocks.size() / 2 ? attached_slab : slab, block);
+		}
+	}
+
+	slab_get_stats(attached_slab, &stats);
+	REQUIRE(stats.allocated_blocks == 0);
+	REQUIRE(stats.pages == 1);
+
+	slab_destroy(attached_slab);
+
+	bmgr_get_stats(bmgr, &bmgr_stats);
+	REQUIRE(bmgr_stats.allocated_bytes == 0);
+
+	munmap(creator_addr, RegionSize);
+	munmap(reserved, RegionSize + 2 * MaxAllocSize);
+	close(fd);
+}
+
+
+TEST_CASE("SlabAllocator Buddy Manager Attach Test", "[allocator]")
+{
+	SECTION("Block headers")
+	{
+		test_slab_bmgr_attach(0);
+	}
+
+	SECTION("Headerless blocks")
+	{
+		test_slab_bmgr_attach(SLAB_HEADERLESS);
+	}
+}
+
+
+TEST_CASE("SlabAllocator Page Map Test", "[allocator]")
+{
+	using namespace std;
+
+	constexpr int	 BlockSize	  = 64;
+	constexpr int	 PageSize	  = 16 * 1024;
+	constexpr int	 PageShift	  = 14;
+	constexpr size_t RegionSize	  = 8 * 1024 * 1024;
+	constexpr size_t MinAllocSize = 1024;
+	constexpr size_t MaxAllocSize = 64 * 1024;
+	constexpr uint8_t Tag		  = 3;
+
+	auto region = static_cast<char *>(mmap(nullptr, RegionSize, PROT_READ | PROT_WRITE,
+										   MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+
+	REQUIRE(region != MAP_FAILED);
+
+	bmgr_t				 *bmgr = bmgr_create(MinAllocSize, MaxAllocSize, region, RegionSize);
+	bmgr_region_layout_t layout;
+
+	REQUIRE(bmgr != nullptr);
+	REQUIRE(bmgr_get_region_layout(bmgr, 0, &layout) == 0);
+
+	size_t map_size = layout.num_chunks * (MaxAllocSize >> PageShift);
+	auto   page_map = static_cast<uint8_t *>(buddy_alloc(bmgr, map_size));
+
+	REQUIRE(page_map != nullptr);
+	memset(page_map, 0, map_size);
+
+	/* Page map needs headerless blocks and a non-zero tag */
+	REQUIRE(slab_create_bmgr_mapped(bmgr, PageSize, BlockSize, 0, page_map, Tag) == nullptr);
+	REQUIRE(slab_create_bmgr_mapped(bmgr, PageSize, BlockSize, SLAB_HEADERLESS, page_map, 0) ==
+			nullptr);
+
+	slab_t *slab = slab_create_bmgr_mapped(bmgr, PageSize, BlockSize, SLAB_HEADERLESS, page_map,
+										   Tag);
+
+	REQUIRE(slab != nullptr);
+
+	vector<void *> blocks(3 * PageSize / BlockSize);
+
+	REQUIRE(slab_alloc_bulk(slab, blocks.size(), blocks.data()) == blocks.size());
+
+	for (auto block : blocks)
+	{
+		REQUIRE(page_map[(static_cast<char *>(block) - layout.chunk_start) >> PageShift] == Tag);
+	}
+
+	slab_free_bulk(slab, blocks.data(), blocks.size());
+	slab_destroy(slab);
+
+	REQUIRE(count(page_map, page_map + map_size, 0) == static_cast<ptrdiff_t>(map_size));
+
+	buddy_free(bmgr, page_map, map_size);
+	munmap(region, RegionSize);
+}